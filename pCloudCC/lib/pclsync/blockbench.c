@@ -0,0 +1,202 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Measures the rolling adler32 scan that looks for server blocks in local files, with the previous modulo based roll and
+ * prime sized table as a reference, for random and for repetitive local data. Run as "blockbench [size in MB] [block size]".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pblockhash.h"
+#include "plibs.h"
+#include "psettings.h"
+
+#define REF_ADLER32_BASE 65521U
+
+typedef struct {
+  const char *name;
+  int repetitive;
+} bench_data_t;
+
+static uint64_t rnd_state=0x626c6f636b686173ULL;
+
+static uint64_t rnd(){
+  rnd_state^=rnd_state<<13;
+  rnd_state^=rnd_state>>7;
+  rnd_state^=rnd_state<<17;
+  return rnd_state;
+}
+
+static void fill_random(unsigned char *buff, size_t len){
+  uint64_t r;
+  size_t i;
+  for (i=0; i<len; i+=sizeof(r)){
+    r=rnd();
+    memcpy(buff+i, &r, len-i<sizeof(r)?len-i:sizeof(r));
+  }
+}
+
+/* text like data, a short record repeated with small changes */
+static void fill_repetitive(unsigned char *buff, size_t len){
+  static const char rec[]="2016-05-12 10:21:07 INFO request completed in 12 ms, status 200\n";
+  size_t i;
+  for (i=0; i<len; i++)
+    buff[i]=rec[i%(sizeof(rec)-1)];
+  for (i=0; i<len; i+=4096)
+    buff[i+rnd()%(len-i<4096?len-i:4096)]^=(unsigned char)rnd();
+}
+
+static int ref_is_prime(uint32_t num){
+  uint32_t i;
+  for (i=5; i*i<=num; i+=2)
+    if (num%i==0)
+      return 0;
+  return 1;
+}
+
+static uint32_t ref_adler32_roll(uint32_t adler, unsigned char byteout, unsigned char bytein, uint32_t len){
+  uint32_t sum;
+  sum=adler>>16;
+  adler&=0xffff;
+  adler+=REF_ADLER32_BASE+bytein-byteout;
+  sum=(REF_ADLER32_BASE*REF_ADLER32_BASE+sum-len*byteout-PSYNC_ADLER32_INITIAL+adler)%REF_ADLER32_BASE;
+  adler%=REF_ADLER32_BASE;
+  return adler|(sum<<16);
+}
+
+static uint32_t *ref_create_hash(const psync_file_checksums *checksums, uint32_t *cnt){
+  uint32_t *elements;
+  uint32_t c, i, o;
+  c=((checksums->blockcnt+1)/2)*6+1;
+  while (!ref_is_prime(c))
+    c+=2;
+  elements=psync_new_cnt(uint32_t, c);
+  memset(elements, 0, sizeof(uint32_t)*c);
+  for (i=0; i<checksums->blockcnt; i++){
+    o=checksums->blocks[i].adler%c;
+    while (elements[o])
+      if (++o>=c)
+        o=0;
+    elements[o]=i+1;
+  }
+  *cnt=c;
+  return elements;
+}
+
+static int ref_has_adler(const uint32_t *elements, uint32_t cnt, const psync_file_checksums *checksums, uint32_t adler){
+  uint32_t o;
+  o=adler%cnt;
+  while (elements[o]){
+    if (checksums->blocks[elements[o]-1].adler==adler)
+      return 1;
+    if (++o>=cnt)
+      o=0;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv){
+  bench_data_t datas[]={{"random", 0}, {"repetitive", 1}};
+  unsigned char *server, *local;
+  psync_file_checksums *checksums;
+  psync_file_checksum_hash *hash;
+  uint32_t *refelements;
+  uint64_t size;
+  uint32_t blocksize, i, refcnt, adler, refadler, hits, refhits;
+  size_t off, d;
+  double reft, newt;
+  clock_t start;
+  if (argc>1)
+    size=strtoull(argv[1], NULL, 10)*1024*1024;
+  else
+    size=128*1024*1024;
+  if (argc>2)
+    blocksize=strtoul(argv[2], NULL, 10);
+  else
+    blocksize=PSYNC_COPY_BUFFER_SIZE/16;
+  if (!blocksize || (blocksize&(blocksize-1)) || size<blocksize*2){
+    fprintf(stderr, "block size should be a power of two and at most half of the size\n");
+    return 1;
+  }
+  server=(unsigned char *)psync_malloc(size);
+  local=(unsigned char *)psync_malloc(size);
+  checksums=(psync_file_checksums *)psync_malloc(offsetof(psync_file_checksums, blocks)+sizeof(psync_block_checksum)*(size/blocksize));
+  checksums->filesize=size;
+  checksums->blocksize=blocksize;
+  checksums->blockcnt=size/blocksize;
+  checksums->next=psync_new_cnt(uint32_t, checksums->blockcnt);
+  printf("file size %lu MB, block size %u, %u blocks\n", (unsigned long)(size/(1024*1024)), (unsigned)blocksize, (unsigned)checksums->blockcnt);
+  printf("%-12s %12s %12s %8s %8s\n", "local data", "ref MB/s", "new MB/s", "speedup", "matches");
+  for (d=0; d<ARRAY_SIZE(datas); d++){
+    fill_random(server, size);
+    for (i=0; i<checksums->blockcnt; i++){
+      checksums->blocks[i].adler=psync_adler32(PSYNC_ADLER32_INITIAL, server+(size_t)i*blocksize, blocksize);
+      memset(checksums->blocks[i].sha1, 0, PSYNC_SHA1_DIGEST_LEN);
+      checksums->next[i]=0;
+    }
+    if (datas[d].repetitive)
+      fill_repetitive(local, size);
+    else
+      fill_random(local, size);
+    /* a few server blocks at unaligned offsets, so there is something to find */
+    for (i=0; i<16; i++)
+      memcpy(local+rnd()%(size-blocksize), server+(rnd()%checksums->blockcnt)*blocksize, blocksize);
+    refelements=ref_create_hash(checksums, &refcnt);
+    hash=psync_block_hash_create(checksums);
+    refhits=0;
+    start=clock();
+    refadler=psync_adler32(PSYNC_ADLER32_INITIAL, local, blocksize);
+    for (off=0; off+blocksize<size; off++){
+      refhits+=ref_has_adler(refelements, refcnt, checksums, refadler);
+      refadler=ref_adler32_roll(refadler, local[off], local[off+blocksize], blocksize);
+    }
+    reft=(double)(clock()-start)/CLOCKS_PER_SEC;
+    hits=0;
+    start=clock();
+    adler=psync_adler32(PSYNC_ADLER32_INITIAL, local, blocksize);
+    for (off=0; off+blocksize<size; off++){
+      hits+=psync_block_hash_has_adler(hash, adler);
+      adler=psync_adler32_roll(hash, adler, local[off], local[off+blocksize]);
+    }
+    newt=(double)(clock()-start)/CLOCKS_PER_SEC;
+    if (adler!=refadler || hits!=refhits || adler!=psync_adler32(PSYNC_ADLER32_INITIAL, local+off, blocksize)){
+      fprintf(stderr, "rolling checksums differ, %08x %08x, %u %u matches\n", (unsigned)adler, (unsigned)refadler, (unsigned)hits, (unsigned)refhits);
+      return 1;
+    }
+    printf("%-12s %12.1f %12.1f %8.2f %8u\n", datas[d].name, reft>0.0?(double)size/(1024*1024)/reft:0.0,
+           newt>0.0?(double)size/(1024*1024)/newt:0.0, newt>0.0?reft/newt:0.0, (unsigned)hits);
+    psync_block_hash_free(hash);
+    psync_free(refelements);
+  }
+  psync_free(checksums->next);
+  psync_free(checksums);
+  psync_free(server);
+  psync_free(local);
+  return 0;
+}
@@ -0,0 +1,196 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Compares how much of a modified file has to be uploaded when it is compared with the previous version by fixed size
+ * blocks at the same offsets and by content defined chunks, for synthetic insert, delete and append edits. Run as
+ * "cdcbench [size in MB] [directory for temporary files]".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pcdc.h"
+#include "plibs.h"
+
+#define BENCH_BLOCK_SIZE PSYNC_CDC_AVG_CHUNK
+#define BENCH_EDIT_SIZE 1000
+
+typedef struct {
+  const char *name;
+  uint64_t off;
+  int64_t diff;
+} bench_edit_t;
+
+static uint64_t rnd_state=0x6364636265636831ULL;
+
+static uint64_t rnd(){
+  rnd_state^=rnd_state<<13;
+  rnd_state^=rnd_state>>7;
+  rnd_state^=rnd_state<<17;
+  return rnd_state;
+}
+
+static void fill_random(unsigned char *buff, size_t len){
+  uint64_t r;
+  size_t i;
+  for (i=0; i<len; i+=sizeof(r)){
+    r=rnd();
+    memcpy(buff+i, &r, len-i<sizeof(r)?len-i:sizeof(r));
+  }
+}
+
+static int write_file(const char *name, const unsigned char *data, size_t len){
+  psync_file_t fd;
+  size_t off;
+  ssize_t wr;
+  fd=psync_file_open(name, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (fd==INVALID_HANDLE_VALUE)
+    return -1;
+  for (off=0; off<len; off+=wr)
+    if ((wr=psync_file_write(fd, data+off, len-off))<=0){
+      psync_file_close(fd);
+      return -1;
+    }
+  psync_file_close(fd);
+  return 0;
+}
+
+static psync_cdc_chunks_t *chunk_file(const char *name, uint64_t len, double *cpu){
+  psync_cdc_chunks_t *chunks;
+  psync_file_t fd;
+  clock_t start;
+  fd=psync_file_open(name, P_O_RDONLY, 0);
+  if (fd==INVALID_HANDLE_VALUE)
+    return NULL;
+  start=clock();
+  chunks=psync_cdc_chunk_file(fd, 0, len, NULL);
+  *cpu+=(double)(clock()-start)/CLOCKS_PER_SEC;
+  psync_file_close(fd);
+  return chunks;
+}
+
+static int chunk_cmp(const void *p1, const void *p2){
+  return memcmp(((const psync_cdc_chunk_t *)p1)->sha1, ((const psync_cdc_chunk_t *)p2)->sha1, PSYNC_SHA1_DIGEST_LEN);
+}
+
+/* what upload_modify would send if only the blocks that changed in place were uploaded */
+static uint64_t fixed_block_upload(const unsigned char *olddata, size_t oldlen, const unsigned char *newdata, size_t newlen){
+  uint64_t upl;
+  size_t off, len;
+  upl=0;
+  for (off=0; off<newlen; off+=len){
+    len=newlen-off<BENCH_BLOCK_SIZE?newlen-off:BENCH_BLOCK_SIZE;
+    if (off+len>oldlen || memcmp(olddata+off, newdata+off, len))
+      upl+=len;
+  }
+  return upl;
+}
+
+static uint64_t cdc_upload(psync_cdc_chunks_t *oldchunks, const psync_cdc_chunks_t *newchunks){
+  uint64_t upl;
+  uint32_t i;
+  qsort(oldchunks->chunks, oldchunks->chunkcnt, sizeof(psync_cdc_chunk_t), chunk_cmp);
+  upl=0;
+  for (i=0; i<newchunks->chunkcnt; i++)
+    if (!bsearch(&newchunks->chunks[i], oldchunks->chunks, oldchunks->chunkcnt, sizeof(psync_cdc_chunk_t), chunk_cmp))
+      upl+=newchunks->chunks[i].len;
+  return upl;
+}
+
+int main(int argc, char **argv){
+  unsigned char *olddata, *newdata;
+  psync_cdc_chunks_t *oldchunks, *newchunks;
+  char *oldname, *newname;
+  const char *dir;
+  uint64_t size, newsize, fixedupl, cdcupl;
+  double cpu;
+  size_t i;
+  if (argc>1)
+    size=strtoull(argv[1], NULL, 10)*1024*1024;
+  else
+    size=256*1024*1024;
+  if (argc>2)
+    dir=argv[2];
+  else
+    dir=".";
+  {
+    bench_edit_t edits[]={
+      {"insert at 1%", size/100, BENCH_EDIT_SIZE},
+      {"insert at 50%", size/2, BENCH_EDIT_SIZE},
+      {"delete at 1%", size/100, -BENCH_EDIT_SIZE},
+      {"delete at 50%", size/2, -BENCH_EDIT_SIZE},
+      {"append", size, 4*1024*1024}
+    };
+    oldname=psync_strcat(dir, PSYNC_DIRECTORY_SEPARATOR, "cdcbench.old", NULL);
+    newname=psync_strcat(dir, PSYNC_DIRECTORY_SEPARATOR, "cdcbench.new", NULL);
+    olddata=(unsigned char *)psync_malloc(size);
+    newdata=(unsigned char *)psync_malloc(size+4*1024*1024);
+    fill_random(olddata, size);
+    if (write_file(oldname, olddata, size)){
+      fprintf(stderr, "can not write %s\n", oldname);
+      return 1;
+    }
+    printf("file size %lu MB, fixed block size %u, cdc chunks %u/%u/%u\n", (unsigned long)(size/(1024*1024)), (unsigned)BENCH_BLOCK_SIZE,
+           (unsigned)PSYNC_CDC_MIN_CHUNK, (unsigned)PSYNC_CDC_AVG_CHUNK, (unsigned)PSYNC_CDC_MAX_CHUNK);
+    printf("%-16s %14s %14s %10s %10s\n", "edit", "fixed bytes", "cdc bytes", "cdc cpu s", "cdc MB/s");
+    for (i=0; i<ARRAY_SIZE(edits); i++){
+      memcpy(newdata, olddata, edits[i].off);
+      if (edits[i].diff>0){
+        fill_random(newdata+edits[i].off, edits[i].diff);
+        memcpy(newdata+edits[i].off+edits[i].diff, olddata+edits[i].off, size-edits[i].off);
+      }
+      else
+        memcpy(newdata+edits[i].off, olddata+edits[i].off-edits[i].diff, size-edits[i].off+edits[i].diff);
+      newsize=size+edits[i].diff;
+      if (write_file(newname, newdata, newsize)){
+        fprintf(stderr, "can not write %s\n", newname);
+        return 1;
+      }
+      cpu=0.0;
+      oldchunks=chunk_file(oldname, size, &cpu);
+      newchunks=chunk_file(newname, newsize, &cpu);
+      if (!oldchunks || !newchunks){
+        fprintf(stderr, "chunking failed\n");
+        return 1;
+      }
+      fixedupl=fixed_block_upload(olddata, size, newdata, newsize);
+      cdcupl=cdc_upload(oldchunks, newchunks);
+      printf("%-16s %14lu %14lu %10.2f %10.1f\n", edits[i].name, (unsigned long)fixedupl, (unsigned long)cdcupl, cpu,
+             cpu>0.0?(double)(size+newsize)/(1024*1024)/cpu:0.0);
+      psync_free(oldchunks);
+      psync_free(newchunks);
+    }
+    psync_file_delete(oldname);
+    psync_file_delete(newname);
+    psync_free(olddata);
+    psync_free(newdata);
+    psync_free(oldname);
+    psync_free(newname);
+  }
+  return 0;
+}
@@ -359,7 +359,7 @@ static binresult *do_parse_result(unsigned char **restrict indata, unsigned char
   return NULL;
 }
 
-static binresult *parse_result(unsigned char *data, size_t datalen){
+binresult *parse_result(unsigned char *data, size_t datalen){
   unsigned char *datac;
   binresult **strings;
   binresult *res;
@@ -107,6 +107,7 @@ psync_socket *psync_api_connect(const char *hostname, int usessl);
 void psync_api_conn_fail_inc();
 void psync_api_conn_fail_reset();
 
+binresult *parse_result(unsigned char *data, size_t datalen) PSYNC_NONNULL(1);
 binresult *get_result(psync_socket *sock) PSYNC_NONNULL(1);
 binresult *get_result_thread(psync_socket *sock) PSYNC_NONNULL(1);
 void async_result_reader_init(async_result_reader *reader) PSYNC_NONNULL(1);
@@ -46,8 +46,19 @@
 #define TASK_TYPE_EXIT        0
 #define TASK_TYPE_FILE_DWL    1
 #define TASK_TYPE_FILE_DWL_NM 2
+#define TASK_TYPE_FILE_DWL_CH 3
+#define TASK_TYPE_API         4
+#define TASK_TYPE_FILE_UPL    5
 
-#define STREAM_FLAG_ACTIVE 1
+#define STREAM_FLAG_ACTIVE      1
+/* a request of a type that older servers do not know, nothing was received for it yet */
+#define STREAM_FLAG_UNCONFIRMED 2
+
+/* kinds of unconfirmed requests, each one falls back to the old way on its own */
+#define STREAM_KIND_CHUNKED 0
+#define STREAM_KIND_API     1
+#define STREAM_KIND_UPLOAD  2
+#define STREAM_KIND_CNT     3
 
 #define STREAM_HEADER_LEN 6 // 4 bytes stream id, 2 bytes length
 
@@ -72,6 +83,13 @@ typedef struct {
   void *cbext;
 } task_file_download_if_not_mod_t;
 
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  psync_async_callback_t cb;
+  void *cbext;
+} task_api_call_t;
+
 typedef struct {
   uint32_t error;
   uint32_t errorflags;
@@ -104,6 +122,7 @@ typedef struct _stream_t {
   psync_tree tree;
   uint32_t streamid;
   uint32_t flags;
+  uint32_t kind;
   psync_async_callback_t cb;
   void (*free)(struct _stream_t *, uint32_t);
   void *cbext;
@@ -120,14 +139,27 @@ typedef struct {
   unsigned char osha1hex[PSYNC_SHA1_DIGEST_HEXLEN];
   psync_sha1_ctx sha1ctx;
   uint64_t remsize;
+  uint64_t chunkrem;
   psync_file_t fd;
+  int chunked;
 } file_download_add_t;
 
+typedef struct {
+  unsigned char *data;
+  uint32_t len;
+  uint32_t off;
+  unsigned char lenbuff[4];
+} api_call_add_t;
+
 TASK_WITH_HEADER(task_hdr_file_download_t, task_file_download_t);
 TASK_WITH_HEADER(task_hdr_file_download_if_not_mod_t, task_file_download_if_not_mod_t);
+TASK_WITH_HEADER(task_hdr_api_call_t, task_api_call_t);
 
 static pthread_mutex_t amutex=PTHREAD_MUTEX_INITIALIZER;
 static int running=0;
+/* consecutive requests of each kind that failed before the server answered */
+static uint32_t unconfirmed_fails[STREAM_KIND_CNT];
+static const char *unconfirmed_names[STREAM_KIND_CNT]={"chunked download", "API call", "upload"};
 static psync_socket_t at_sock=INVALID_SOCKET;
 
 static int send_pending_data(async_thread_params_t *prms){
@@ -209,6 +241,7 @@ static stream_t *create_stream(async_thread_params_t *prms, size_t addsize){
   ret=(stream_t *)psync_malloc(sizeof(stream_t)+addsize);
   ret->streamid=++prms->laststreamid;
   ret->flags=0;
+  ret->kind=0;
   ret->free=NULL;
   parent=psync_tree_get_last(prms->streams);
   if (parent)
@@ -258,8 +291,23 @@ static void file_download_free(stream_t *s, uint32_t error){
   }
 }
 
+/* a failure before the first answer to a request the server may not support asks the caller to use another way */
+static uint32_t stream_unconfirmed_error(stream_t *s, uint32_t error){
+  if (!(s->flags&STREAM_FLAG_UNCONFIRMED))
+    return 0;
+  s->flags&=~STREAM_FLAG_UNCONFIRMED;
+  if (!error){
+    unconfirmed_fails[s->kind]=0;
+    return 0;
+  }
+  unconfirmed_fails[s->kind]++;
+  debug(D_NOTICE, "%s failed before the server answered, %u times in a row", unconfirmed_names[s->kind], (unsigned)unconfirmed_fails[s->kind]);
+  return PSYNC_ASYNC_ERR_FLAG_UNSUPPORTED;
+}
+
 static int file_download_send_error(stream_t *s, async_thread_params_t *prms, file_download_add_t *fda, uint32_t error, uint32_t errorflags){
   psync_async_result_t r;
+  errorflags|=stream_unconfirmed_error(s, error);
   if (error)
     debug(D_NOTICE, "got error %u(%u) for file %s", (unsigned)error, (unsigned)errorflags, fda->localpath);
   else
@@ -286,18 +334,45 @@ static int file_download_checksum(file_download_add_t *fda){
     return 0;
 }
 
+static uint64_t file_download_chunk_size(file_download_add_t *fda){
+  if (fda->remsize>PSYNC_ASYNC_DOWNLOAD_CHUNK)
+    return PSYNC_ASYNC_DOWNLOAD_CHUNK;
+  else
+    return fda->remsize;
+}
+
+static int process_file_download_chunk_headers(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen);
+
+/* Each chunk is requested only when the previous one is completely received, so a larger file never holds more than
+ * PSYNC_ASYNC_DOWNLOAD_CHUNK in front of the other streams. The hash pins the revision that the first chunk came from.
+ */
+static int file_download_request_chunk(stream_t *s, async_thread_params_t *prms, file_download_add_t *fda){
+  char buff[256];
+  int len;
+  len=psync_slprintf(buff, sizeof(buff), "act=dwlrng,strm=%"P_PRI_U64",fileid=%"P_PRI_U64",hash=%"P_PRI_U64",offset=%"P_PRI_U64",count=%"P_PRI_U64"\n",
+                     (uint64_t)s->streamid, (uint64_t)fda->fileid, fda->hash, fda->size-fda->remsize,
+                     fda->size?file_download_chunk_size(fda):(uint64_t)PSYNC_ASYNC_DOWNLOAD_CHUNK);
+  s->process_data=process_file_download_chunk_headers;
+  if (send_data(prms, buff, len)){
+    debug(D_WARNING, "failed to send request for chunk of fileid %lu", (unsigned long)fda->fileid);
+    return -1;
+  }
+  return 0;
+}
+
 static int process_file_download_data(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen){
   file_download_add_t *fda;
   ssize_t wr;
   int err;
   fda=(file_download_add_t *)(s+1);
-  if (datalen>fda->remsize){
+  if (datalen>fda->chunkrem){
     debug(D_ERROR, "got packed of size %u for stream %u file %s when the remaining data is %lu",
-          (unsigned)datalen, (unsigned)s->streamid, fda->localpath, (unsigned long)fda->remsize);
+          (unsigned)datalen, (unsigned)s->streamid, fda->localpath, (unsigned long)fda->chunkrem);
     file_download_send_error(s, prms, fda, PSYNC_ASYNC_ERROR_NET, PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS);
     return -1;
   }
   fda->remsize-=datalen;
+  fda->chunkrem-=datalen;
   psync_account_downloaded_bytes(datalen);
   psync_sha1_update(&fda->sha1ctx, buff, datalen);
   while (datalen){
@@ -316,6 +391,8 @@ static int process_file_download_data(stream_t *s, async_thread_params_t *prms,
     else
       return file_download_send_error(s, prms, fda, 0, 0);
   }
+  else if (fda->chunkrem==0)
+    return file_download_request_chunk(s, prms, fda);
   else
     return 0;
 }
@@ -335,6 +412,7 @@ static int process_file_download_headers(stream_t *s, async_thread_params_t *prm
   memcpy(fda->sha1hex, r.sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
   if (r.error)
     return file_download_send_error(s, prms, fda, r.error+100, r.errorflags);
+  stream_unconfirmed_error(s, 0);
   debug(D_NOTICE, "got headers for file %s size %"P_PRI_U64" hash %"P_PRI_U64" sha1 %.40s", fda->localpath, fda->size, fda->hash, fda->sha1hex);
   psync_sql_start_transaction();
   res=psync_sql_prep_statement("REPLACE INTO hashchecksum (hash, size, checksum) VALUES (?, ?, ?)");
@@ -374,6 +452,10 @@ static int process_file_download_headers(stream_t *s, async_thread_params_t *prm
   fda->remsize=fda->size;
   if (!fda->remsize)
     return file_download_send_error(s, prms, fda, 0, 0);
+  if (fda->chunked)
+    fda->chunkrem=file_download_chunk_size(fda);
+  else
+    fda->chunkrem=fda->remsize;
   s->process_data=process_file_download_data;
   psync_sha1_init(&fda->sha1ctx);
   if (datalen>sizeof(task_file_download_resp_t))
@@ -382,6 +464,31 @@ static int process_file_download_headers(stream_t *s, async_thread_params_t *prm
     return 0;
 }
 
+static int process_file_download_chunk_headers(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen){
+  task_file_download_resp_t r;
+  file_download_add_t *fda;
+  fda=(file_download_add_t *)(s+1);
+  if (fda->fd==INVALID_HANDLE_VALUE)
+    return process_file_download_headers(s, prms, buff, datalen);
+  if (unlikely(datalen<sizeof(task_file_download_resp_t))){
+    debug(D_ERROR, "got packet of size %u while expecting at least %u, disconnecting", (unsigned)datalen, (unsigned)sizeof(task_file_download_resp_t));
+    return -1;
+  }
+  memcpy(&r, buff, sizeof(task_file_download_resp_t));
+  if (r.error)
+    return file_download_send_error(s, prms, fda, r.error+100, r.errorflags);
+  if (unlikely(r.hash!=fda->hash || r.size!=fda->size)){
+    debug(D_NOTICE, "file %s changed while downloading, hash %"P_PRI_U64" now %"P_PRI_U64, fda->localpath, fda->hash, r.hash);
+    return file_download_send_error(s, prms, fda, PSYNC_ASYNC_ERROR_NET, PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS);
+  }
+  fda->chunkrem=file_download_chunk_size(fda);
+  s->process_data=process_file_download_data;
+  if (datalen>sizeof(task_file_download_resp_t))
+    return process_file_download_data(s, prms, buff+sizeof(task_file_download_resp_t), datalen-sizeof(task_file_download_resp_t));
+  else
+    return 0;
+}
+
 static int handle_file_download(async_thread_params_t *prms, task_file_download_t *dwl){
   char buff[256];
   stream_t *s;
@@ -396,6 +503,7 @@ static int handle_file_download(async_thread_params_t *prms, task_file_download_
   s->process_data=process_file_download_headers;
   fda->localpath=dwl->localpath;
   fda->fd=INVALID_HANDLE_VALUE;
+  fda->chunked=0;
   len=psync_slprintf(buff, sizeof(buff), "act=dwl,strm=%"P_PRI_U64",fileid=%"P_PRI_U64"\n", (uint64_t)s->streamid, (uint64_t)dwl->fileid);
   if (send_data(prms, buff, len)){
     debug(D_WARNING, "failed to send request for fileid %lu", (unsigned long)dwl->fileid);
@@ -422,6 +530,7 @@ static int handle_file_download_nm(async_thread_params_t *prms, task_file_downlo
   memcpy(fda->osha1hex, dwl->sha1hex, PSYNC_SHA1_DIGEST_HEXLEN);
   fda->localpath=dwl->localpath;
   fda->fd=INVALID_HANDLE_VALUE;
+  fda->chunked=0;
   len=psync_slprintf(buff, sizeof(buff), "act=dwlnm,strm=%"P_PRI_U64",fileid=%"P_PRI_U64",sha1=%.40s\n", (uint64_t)s->streamid, (uint64_t)dwl->fileid, dwl->sha1hex);
   if (send_data(prms, buff, len)){
     debug(D_WARNING, "failed to send request for fileid %lu", (unsigned long)dwl->fileid);
@@ -432,6 +541,113 @@ static int handle_file_download_nm(async_thread_params_t *prms, task_file_downlo
   return 0;
 }
 
+static int handle_file_download_chunked(async_thread_params_t *prms, task_file_download_t *dwl){
+  stream_t *s;
+  file_download_add_t *fda;
+  s=create_stream(prms, sizeof(file_download_add_t));
+  fda=(file_download_add_t *)(s+1);
+  fda->fileid=dwl->fileid;
+  s->free=file_download_free;
+  s->cb=dwl->cb;
+  s->cbext=dwl->cbext;
+  fda->localpath=dwl->localpath;
+  fda->fd=INVALID_HANDLE_VALUE;
+  fda->chunked=1;
+  fda->osize=0;
+  fda->size=0;
+  fda->hash=0;
+  fda->remsize=0;
+  if (file_download_request_chunk(s, prms, fda))
+    return -1;
+  s->flags|=STREAM_FLAG_ACTIVE|STREAM_FLAG_UNCONFIRMED;
+  s->kind=STREAM_KIND_CHUNKED;
+  debug(D_NOTICE, "requested data of fileid %lu to be saved in %s in chunks", (unsigned long)dwl->fileid, dwl->localpath);
+  return 0;
+}
+
+static void api_call_free(stream_t *s, uint32_t error){
+  api_call_add_t *aca;
+  aca=(api_call_add_t *)(s+1);
+  psync_free(aca->data);
+}
+
+static int api_call_send_result(stream_t *s, async_thread_params_t *prms, binresult *res){
+  psync_async_result_t r;
+  memset(&r, 0, sizeof(r));
+  if (res)
+    r.api=res;
+  else{
+    r.error=PSYNC_ASYNC_ERROR_NET;
+    r.errorflags=PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS;
+  }
+  /* only a result that parses tells that the server knows the request */
+  r.errorflags|=stream_unconfirmed_error(s, r.error);
+  s->cb(s->cbext, &r);
+  psync_free(r.api);
+  close_stream(s, prms, r.error);
+  return 0;
+}
+
+/* the response is a regular binary API result, 4 bytes length followed by the data, split in as many packets as needed */
+static int process_api_call_data(stream_t *s, async_thread_params_t *prms, const char *buff, uint32_t datalen){
+  api_call_add_t *aca;
+  uint32_t cp;
+  aca=(api_call_add_t *)(s+1);
+  if (!aca->data){
+    cp=sizeof(aca->lenbuff)-aca->off;
+    if (cp>datalen)
+      cp=datalen;
+    memcpy(aca->lenbuff+aca->off, buff, cp);
+    aca->off+=cp;
+    buff+=cp;
+    datalen-=cp;
+    if (aca->off<sizeof(aca->lenbuff))
+      return 0;
+    memcpy(&aca->len, aca->lenbuff, sizeof(aca->len));
+    if (unlikely(aca->len>PSYNC_ASYNC_MAX_API_RESULT)){
+      debug(D_ERROR, "got API result of size %u for stream %u, disconnecting", (unsigned)aca->len, (unsigned)s->streamid);
+      return -1;
+    }
+    aca->data=psync_new_cnt(unsigned char, aca->len);
+    aca->off=0;
+  }
+  if (unlikely(datalen>aca->len-aca->off)){
+    debug(D_ERROR, "got packet of size %u for stream %u when the remaining data is %u", (unsigned)datalen, (unsigned)s->streamid,
+          (unsigned)(aca->len-aca->off));
+    return -1;
+  }
+  memcpy(aca->data+aca->off, buff, datalen);
+  aca->off+=datalen;
+  if (aca->off==aca->len)
+    return api_call_send_result(s, prms, parse_result(aca->data, aca->len));
+  else
+    return 0;
+}
+
+static int handle_api_call(async_thread_params_t *prms, task_api_call_t *call, uint32_t kind){
+  char buff[128];
+  stream_t *s;
+  api_call_add_t *aca;
+  int len;
+  s=create_stream(prms, sizeof(api_call_add_t));
+  aca=(api_call_add_t *)(s+1);
+  aca->data=NULL;
+  aca->len=0;
+  aca->off=0;
+  s->free=api_call_free;
+  s->cb=call->cb;
+  s->cbext=call->cbext;
+  s->process_data=process_api_call_data;
+  len=psync_slprintf(buff, sizeof(buff), "act=api,strm=%"P_PRI_U64",len=%"P_PRI_U64"\n", (uint64_t)s->streamid, (uint64_t)call->len);
+  if (send_data(prms, buff, len) || send_data(prms, call->data, call->len)){
+    debug(D_WARNING, "failed to send %s of %lu bytes", unconfirmed_names[kind], (unsigned long)call->len);
+    return -1;
+  }
+  s->flags|=STREAM_FLAG_ACTIVE|STREAM_FLAG_UNCONFIRMED;
+  s->kind=kind;
+  return 0;
+}
+
 #define CHECK_LEN(l)\
   do {\
     if (unlikely(len!=l)){\
@@ -452,6 +668,15 @@ static int handle_command_data(async_thread_params_t *prms, char *data, uint32_t
     case TASK_TYPE_FILE_DWL_NM:
       CHECK_LEN(sizeof(task_file_download_if_not_mod_t));
       return handle_file_download_nm(prms, (task_file_download_if_not_mod_t *)data);
+    case TASK_TYPE_FILE_DWL_CH:
+      CHECK_LEN(sizeof(task_file_download_t));
+      return handle_file_download_chunked(prms, (task_file_download_t *)data);
+    case TASK_TYPE_API:
+      CHECK_LEN(sizeof(task_api_call_t));
+      return handle_api_call(prms, (task_api_call_t *)data, STREAM_KIND_API);
+    case TASK_TYPE_FILE_UPL:
+      CHECK_LEN(sizeof(task_api_call_t));
+      return handle_api_call(prms, (task_api_call_t *)data, STREAM_KIND_UPLOAD);
     default:
       debug(D_BUG, "got packet of unknown type %u", (unsigned)type);
       return 1;
@@ -546,7 +771,7 @@ static void free_stream(stream_t *s){
     psync_async_result_t ar;
     memset(&ar, 0, sizeof(ar));
     ar.error=PSYNC_ASYNC_ERROR_NET;
-    ar.errorflags=PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS;
+    ar.errorflags=PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS|stream_unconfirmed_error(s, ar.error);
     s->cb(s->cbext, &ar);
   }
   if (s->free)
@@ -781,3 +1006,122 @@ int psync_async_download_file_if_changed(psync_fileid_t fileid, const char *loca
   task.task.cbext=cbext;
   return psync_async_send_task(&task, sizeof(task));
 }
+
+int psync_async_chunked_download_supported(){
+  return unconfirmed_fails[STREAM_KIND_CHUNKED]<PSYNC_ASYNC_MAX_UNCONFIRMED_FAILS;
+}
+
+int psync_async_download_file_chunked(psync_fileid_t fileid, const char *localpath, psync_async_callback_t cb, void *cbext){
+  task_hdr_file_download_t task;
+  task.head.type=TASK_TYPE_FILE_DWL_CH;
+  task.head.len=get_len(task_hdr_file_download_t);
+  task.task.fileid=fileid;
+  task.task.localpath=localpath;
+  task.task.cb=cb;
+  task.task.cbext=cbext;
+  return psync_async_send_task(&task, sizeof(task));
+}
+
+int psync_async_api_call_supported(){
+  return unconfirmed_fails[STREAM_KIND_API]<PSYNC_ASYNC_MAX_UNCONFIRMED_FAILS;
+}
+
+int psync_async_upload_supported(){
+  return unconfirmed_fails[STREAM_KIND_UPLOAD]<PSYNC_ASYNC_MAX_UNCONFIRMED_FAILS;
+}
+
+static int psync_async_send_api_call(uint32_t type, const unsigned char *data, size_t len, psync_async_callback_t cb, void *cbext){
+  task_hdr_api_call_t task;
+  task.head.type=type;
+  task.head.len=get_len(task_hdr_api_call_t);
+  task.task.data=data;
+  task.task.len=len;
+  task.task.cb=cb;
+  task.task.cbext=cbext;
+  return psync_async_send_task(&task, sizeof(task));
+}
+
+int psync_async_do_api_call(const char *command, size_t cmdlen, const binparam *params, size_t paramcnt, psync_async_callback_t cb, void *cbext){
+  unsigned char *data;
+  size_t len;
+  int ret;
+  data=do_prepare_command(command, cmdlen, params, paramcnt, -1, 0, &len);
+  if (unlikely_log(!data))
+    return -1;
+  ret=psync_async_send_api_call(TASK_TYPE_API, data, len, cb, cbext);
+  psync_free(data);
+  return ret;
+}
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  binresult *res;
+  int done;
+} api_call_wait_t;
+
+static void api_call_wait_done(void *ptr, psync_async_result_t *r){
+  api_call_wait_t *w;
+  w=(api_call_wait_t *)ptr;
+  pthread_mutex_lock(&w->mutex);
+  if (!r->error){
+    w->res=r->api;
+    r->api=NULL;
+  }
+  w->done=1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+binresult *psync_async_do_run_command(const char *command, size_t cmdlen, const binparam *params, size_t paramcnt){
+  api_call_wait_t w;
+  pthread_mutex_init(&w.mutex, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  w.res=NULL;
+  w.done=0;
+  if (!psync_async_do_api_call(command, cmdlen, params, paramcnt, api_call_wait_done, &w)){
+    pthread_mutex_lock(&w.mutex);
+    while (!w.done)
+      pthread_cond_wait(&w.cond, &w.mutex);
+    pthread_mutex_unlock(&w.mutex);
+  }
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.mutex);
+  return w.res;
+}
+
+int psync_async_upload_file(psync_folderid_t folderid, const char *name, const char *localpath, psync_async_callback_t cb, void *cbext){
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("folderid", folderid), P_STR("filename", name), P_BOOL("nopartial", 1)};
+  psync_stat_t st;
+  unsigned char *data;
+  size_t len;
+  uint64_t fsize;
+  psync_file_t fd;
+  int ret;
+  fd=psync_file_open(localpath, P_O_RDONLY, 0);
+  if (fd==INVALID_HANDLE_VALUE){
+    debug(D_WARNING, "could not open local file %s", localpath);
+    return -1;
+  }
+  if (unlikely_log(psync_fstat(fd, &st)))
+    goto err0;
+  fsize=psync_stat_size(&st);
+  if (fsize>PSYNC_MAX_SIZE_FOR_ASYNC_UPLOAD){
+    debug(D_NOTICE, "file %s is too big for async upload", localpath);
+    goto err0;
+  }
+  data=prepare_command_data_alloc("uploadfile", params, fsize, fsize, &len);
+  if (unlikely_log(!data))
+    goto err0;
+  if (unlikely_log(psync_file_pread(fd, data+len, fsize, 0)!=(ssize_t)fsize)){
+    psync_free(data);
+    goto err0;
+  }
+  psync_file_close(fd);
+  ret=psync_async_send_api_call(TASK_TYPE_FILE_UPL, data, len+fsize, cb, cbext);
+  psync_free(data);
+  return ret;
+err0:
+  psync_file_close(fd);
+  return -1;
+}
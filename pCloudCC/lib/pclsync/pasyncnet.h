@@ -29,10 +29,12 @@
 #define _PSYNC_ASYNCNET_H
 
 #include "psynclib.h"
+#include "papi.h"
 
 #define PSYNC_ASYNC_ERR_FLAG_PERM        0x01 // the error is permanent(ish) and there is no reason to retry
 #define PSYNC_ASYNC_ERR_FLAG_RETRY_AS_IS 0x02 // same request may succeed in the future if retried as is
 #define PSYNC_ASYNC_ERR_FLAG_SUCCESS     0x04 // like no action performed because of no need - file already exists and so on
+#define PSYNC_ASYNC_ERR_FLAG_UNSUPPORTED 0x08 // the server may not support the request, it is to be done in another way
 
 #define PSYNC_ASYNC_ERROR_NET       1
 #define PSYNC_ASYNC_ERROR_FILE      2
@@ -54,16 +56,29 @@ typedef struct {
   uint32_t errorflags;
   union {
     psync_async_file_result_t file;
+    binresult *api; /* freed after the callback returns, unless the callback takes it and sets it to NULL */
   };
 } psync_async_result_t;
 
 typedef void (*psync_async_callback_t)(void *, psync_async_result_t *);
 
 /* Important! The interface typically expect all passed pointers to be alive until the completion callback is called.
+ * API calls and uploads are sent before the functions return, so for them only cbext has to stay alive.
+ * psync_async_do_run_command waits for the result and returns NULL on any failure, the caller is to retry the regular way.
  */
 
 void psync_async_stop();
 int psync_async_download_file(psync_fileid_t fileid, const char *localpath, psync_async_callback_t cb, void *cbext);
 int psync_async_download_file_if_changed(psync_fileid_t fileid, const char *localpath, uint64_t size, const void *sha1hex, psync_async_callback_t cb, void *cbext);
+int psync_async_chunked_download_supported();
+int psync_async_download_file_chunked(psync_fileid_t fileid, const char *localpath, psync_async_callback_t cb, void *cbext);
+int psync_async_api_call_supported();
+int psync_async_do_api_call(const char *command, size_t cmdlen, const binparam *params, size_t paramcnt, psync_async_callback_t cb, void *cbext);
+binresult *psync_async_do_run_command(const char *command, size_t cmdlen, const binparam *params, size_t paramcnt);
+int psync_async_upload_supported();
+int psync_async_upload_file(psync_folderid_t folderid, const char *name, const char *localpath, psync_async_callback_t cb, void *cbext);
+
+#define psync_async_api_call(cmd, params, cb, cbext) psync_async_do_api_call(cmd, strlen(cmd), params, ARRAY_SIZE(params), cb, cbext)
+#define psync_async_run_command(cmd, params) psync_async_do_run_command(cmd, strlen(cmd), params, ARRAY_SIZE(params))
 
 #endif
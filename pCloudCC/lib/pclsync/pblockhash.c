@@ -0,0 +1,180 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "pblockhash.h"
+#include "plibs.h"
+
+#define MAX_ADLER_COLL 64
+
+#define ADLER32_1(o) adler+=buff[o]; sum+=adler
+#define ADLER32_2(o) ADLER32_1(o); ADLER32_1(o+1)
+#define ADLER32_4(o) ADLER32_2(o); ADLER32_2(o+2)
+#define ADLER32_8(o) ADLER32_4(o); ADLER32_4(o+4)
+#define ADLER32_16() do{ ADLER32_8(0); ADLER32_8(8); } while (0)
+
+#define ADLER32_NMAX 5552U
+
+static uint32_t log2_ceil(uint64_t num){
+  uint32_t ret;
+  ret=0;
+  while (((uint64_t)1<<ret)<num)
+    ret++;
+  return ret;
+}
+
+/* Since it is fairly easy to generate adler32 collisions, a file can be crafted to contain many colliding blocks.
+ * Our hash will drop entries if more than MAX_ADLER_COLL collisions are detected (actually we just don't travel more
+ * than MAX_ADLER_COLL from our "perfect" position in the hash).
+ */
+
+psync_file_checksum_hash *psync_block_hash_create(psync_file_checksums *checksums){
+  psync_file_checksum_hash *h;
+  uint64_t bits;
+  uint32_t i, o, bt, col, tbits, bbits;
+  /* load factor of at most 1/2 and at least 16 bits of filter per block */
+  tbits=log2_ceil((uint64_t)checksums->blockcnt*2);
+  if (tbits<4)
+    tbits=4;
+  bbits=log2_ceil((uint64_t)checksums->blockcnt*16/64);
+  if (bbits<6)
+    bbits=6;
+  h=(psync_file_checksum_hash *)psync_malloc(offsetof(psync_file_checksum_hash, elements)+sizeof(psync_file_checksum_hash_entry)*((size_t)1<<tbits));
+  h->shift=32-tbits;
+  h->mask=((uint32_t)1<<tbits)-1;
+  h->bloomshift=32-bbits;
+  h->bloom=psync_new_cnt(uint64_t, (size_t)1<<bbits);
+  memset(h->bloom, 0, sizeof(uint64_t)<<bbits);
+  memset(h->elements, 0, sizeof(psync_file_checksum_hash_entry)<<tbits);
+  for (i=0; i<256; i++)
+    h->rollout[i]=((uint64_t)checksums->blocksize*i+PSYNC_ADLER32_INITIAL)%PSYNC_ADLER32_BASE;
+  for (i=0; i<checksums->blockcnt; i++){
+    o=psync_block_hash_slot(h, checksums->blocks[i].adler);
+    col=0;
+    while (h->elements[o].idx){
+      bt=h->elements[o].idx-1;
+      if (h->elements[o].adler==checksums->blocks[i].adler && !memcmp(checksums->blocks[i].sha1, checksums->blocks[bt].sha1, PSYNC_SHA1_DIGEST_LEN)){
+        checksums->next[i]=h->elements[o].idx;
+        break;
+      }
+      o=(o+1)&h->mask;
+      if (++col>MAX_ADLER_COLL)
+        break;
+    }
+    if (col>MAX_ADLER_COLL){
+      debug(D_WARNING, "too many collisions, ignoring a checksum %u", (unsigned)checksums->blocks[i].adler);
+      continue;
+    }
+    h->elements[o].adler=checksums->blocks[i].adler;
+    h->elements[o].idx=i+1;
+    o=checksums->blocks[i].adler*0x85ebca77U;
+    bits=((uint64_t)1<<(o&63))|((uint64_t)1<<((o>>6)&63));
+    h->bloom[o>>h->bloomshift]|=bits;
+  }
+  return h;
+}
+
+void psync_block_hash_free(psync_file_checksum_hash *hash){
+  psync_free(hash->bloom);
+  psync_free(hash);
+}
+
+/* the filter can not forget a block, a removed block only costs a probe of the table */
+void psync_block_hash_remove(psync_file_checksum_hash *hash, uint32_t adler, const unsigned char *sha1, const psync_file_checksums *checksums){
+  uint32_t idx, zeroidx, o, bp;
+  o=psync_block_hash_slot(hash, adler);
+  while (1){
+    idx=hash->elements[o].idx;
+    if (unlikely_log(!idx))
+      return;
+    else if (hash->elements[o].adler==adler && !memcmp(checksums->blocks[idx-1].sha1, sha1, PSYNC_SHA1_DIGEST_LEN))
+      break;
+    o=(o+1)&hash->mask;
+  }
+  hash->elements[o].idx=0;
+  zeroidx=o;
+  while (1){
+    o=(o+1)&hash->mask;
+    if (!hash->elements[o].idx)
+      return;
+    bp=psync_block_hash_slot(hash, hash->elements[o].adler);
+    if (bp!=o){
+      while (1){
+        if (bp==zeroidx){
+          hash->elements[bp]=hash->elements[o];
+          hash->elements[o].idx=0;
+          zeroidx=o;
+          break;
+        }
+        else if (bp==o)
+          break;
+        bp=(bp+1)&hash->mask;
+      }
+    }
+  }
+}
+
+uint32_t psync_block_hash_find(const psync_file_checksum_hash *hash, const psync_file_checksums *checksums, uint32_t adler,
+                               const unsigned char *sha1){
+  uint32_t idx, o;
+  o=psync_block_hash_slot(hash, adler);
+  while (1){
+    idx=hash->elements[o].idx;
+    if (!idx)
+      return 0;
+    else if (hash->elements[o].adler==adler && !memcmp(checksums->blocks[idx-1].sha1, sha1, PSYNC_SHA1_DIGEST_LEN))
+      return idx;
+    o=(o+1)&hash->mask;
+  }
+}
+
+uint32_t psync_adler32(uint32_t adler, const unsigned char *buff, size_t len){
+  uint32_t sum, i;
+  sum=adler>>16;
+  adler&=0xffff;
+  while (len>=ADLER32_NMAX) {
+    len-=ADLER32_NMAX;
+    for (i=0; i<ADLER32_NMAX/16; i++){
+      ADLER32_16();
+      buff+=16;
+    }
+    adler%=PSYNC_ADLER32_BASE;
+    sum%=PSYNC_ADLER32_BASE;
+  }
+  while (len>=16){
+    len-=16;
+    ADLER32_16();
+    buff+=16;
+  }
+  while (len--){
+    adler+=*buff++;
+    sum+=adler;
+  }
+  adler%=PSYNC_ADLER32_BASE;
+  sum%=PSYNC_ADLER32_BASE;
+  return adler|(sum<<16);
+}
@@ -0,0 +1,115 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PSYNC_BLOCKHASH_H
+#define _PSYNC_BLOCKHASH_H
+
+#include "pcompiler.h"
+#include "pssl.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/* Lookup of server block checksums by rolling adler32 of local data. A small blocked Bloom filter, one 64 bit word per
+ * lookup, rejects most positions before the open addressing table is touched. The table keeps the adler32 next to the
+ * block index, so a probe does not have to look at the checksums themselves.
+ */
+
+#define PSYNC_ADLER32_BASE    65521U
+#define PSYNC_ADLER32_INITIAL 1U
+
+typedef struct {
+  unsigned char sha1[PSYNC_SHA1_DIGEST_LEN];
+  uint32_t adler;
+} psync_block_checksum;
+
+typedef struct {
+  uint64_t filesize;
+  uint32_t blocksize;
+  uint32_t blockcnt;
+  uint32_t *next;
+  psync_block_checksum blocks[];
+} psync_file_checksums;
+
+typedef struct {
+  uint32_t adler;
+  uint32_t idx; /* 1-based index in blocks, 0 for free slots */
+} psync_file_checksum_hash_entry;
+
+typedef struct {
+  uint64_t *bloom;
+  uint32_t bloomshift;
+  uint32_t shift;
+  uint32_t mask;
+  /* (blocksize*byte+PSYNC_ADLER32_INITIAL)%PSYNC_ADLER32_BASE, removes a byte from the sum without a division */
+  uint32_t rollout[256];
+  psync_file_checksum_hash_entry elements[];
+} psync_file_checksum_hash;
+
+psync_file_checksum_hash *psync_block_hash_create(psync_file_checksums *checksums);
+void psync_block_hash_free(psync_file_checksum_hash *hash);
+void psync_block_hash_remove(psync_file_checksum_hash *hash, uint32_t adler, const unsigned char *sha1, const psync_file_checksums *checksums);
+uint32_t psync_block_hash_find(const psync_file_checksum_hash *hash, const psync_file_checksums *checksums, uint32_t adler,
+                               const unsigned char *sha1);
+
+uint32_t psync_adler32(uint32_t adler, const unsigned char *buff, size_t len);
+
+static inline uint32_t psync_block_hash_slot(const psync_file_checksum_hash *hash, uint32_t adler){
+  return (adler*0x9e3779b1U)>>hash->shift;
+}
+
+static inline int psync_block_hash_has_adler(const psync_file_checksum_hash *hash, uint32_t adler){
+  uint64_t bits;
+  uint32_t h, o;
+  h=adler*0x85ebca77U;
+  bits=((uint64_t)1<<(h&63))|((uint64_t)1<<((h>>6)&63));
+  if (likely((hash->bloom[h>>hash->bloomshift]&bits)!=bits))
+    return 0;
+  o=psync_block_hash_slot(hash, adler);
+  while (hash->elements[o].idx){
+    if (hash->elements[o].adler==adler)
+      return 1;
+    o=(o+1)&hash->mask;
+  }
+  return 0;
+}
+
+static inline uint32_t psync_adler32_roll(const psync_file_checksum_hash *hash, uint32_t adler, unsigned char byteout, unsigned char bytein){
+  int32_t a, s;
+  a=(int32_t)(adler&0xffff)+bytein-byteout;
+  if (a<0)
+    a+=PSYNC_ADLER32_BASE;
+  else if (a>=(int32_t)PSYNC_ADLER32_BASE)
+    a-=PSYNC_ADLER32_BASE;
+  s=(int32_t)(adler>>16)+a-(int32_t)hash->rollout[byteout];
+  if (s<0)
+    s+=PSYNC_ADLER32_BASE;
+  else if (s>=(int32_t)PSYNC_ADLER32_BASE)
+    s-=PSYNC_ADLER32_BASE;
+  return (uint32_t)a|((uint32_t)s<<16);
+}
+
+#endif
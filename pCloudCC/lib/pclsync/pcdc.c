@@ -0,0 +1,177 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include "pcdc.h"
+#include "plibs.h"
+
+/* normalized chunking, chunks shorter than the average size need two more zero bits, longer ones need two less */
+#define CDC_MASK_S ((((uint64_t)1<<18)-1)<<46)
+#define CDC_MASK_L ((((uint64_t)1<<14)-1)<<50)
+
+#define CDC_BUFFER_SIZE (PSYNC_CDC_MAX_CHUNK*4)
+
+/* The table is generated from a fixed seed. Changing either the seed or the generator moves all the chunk boundaries and
+ * makes the stored signatures useless.
+ */
+static uint64_t gear[256];
+static pthread_once_t gear_once=PTHREAD_ONCE_INIT;
+
+static void gear_init(){
+  uint64_t x, z;
+  psync_uint_t i;
+  x=0x7063646367656172ULL;
+  for (i=0; i<ARRAY_SIZE(gear); i++){
+    x+=0x9e3779b97f4a7c15ULL;
+    z=x;
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    gear[i]=z^(z>>31);
+  }
+}
+
+/* data points to the start of a chunk, len should be at least PSYNC_CDC_MAX_CHUNK unless at the end of the data */
+size_t psync_cdc_find_cut(const unsigned char *data, size_t len){
+  uint64_t h;
+  size_t i, avg;
+  if (len<=PSYNC_CDC_MIN_CHUNK)
+    return len;
+  if (len>PSYNC_CDC_MAX_CHUNK)
+    len=PSYNC_CDC_MAX_CHUNK;
+  if (len>PSYNC_CDC_AVG_CHUNK)
+    avg=PSYNC_CDC_AVG_CHUNK;
+  else
+    avg=len;
+  pthread_once(&gear_once, gear_init);
+  h=0;
+  for (i=PSYNC_CDC_MIN_CHUNK; i<avg; i++){
+    h=(h<<1)+gear[data[i]];
+    if (unlikely(!(h&CDC_MASK_S)))
+      return i+1;
+  }
+  for (; i<len; i++){
+    h=(h<<1)+gear[data[i]];
+    if (unlikely(!(h&CDC_MASK_L)))
+      return i+1;
+  }
+  return len;
+}
+
+/* hctx, if not NULL, is updated with all the data that is read */
+psync_cdc_chunks_t *psync_cdc_chunk_file(psync_file_t fd, uint64_t off, uint64_t len, psync_hash_ctx *hctx){
+  psync_cdc_chunks_t *cs;
+  psync_cdc_chunk_t *c;
+  unsigned char *buff;
+  uint64_t rem, coff;
+  size_t blen, boff, rd, cl;
+  uint32_t alloced;
+  alloced=len/PSYNC_CDC_AVG_CHUNK+16;
+  cs=(psync_cdc_chunks_t *)psync_malloc(offsetof(psync_cdc_chunks_t, chunks)+sizeof(psync_cdc_chunk_t)*alloced);
+  cs->chunkcnt=0;
+  buff=(unsigned char *)psync_malloc(CDC_BUFFER_SIZE);
+  blen=0;
+  boff=0;
+  rem=len;
+  coff=off;
+  while (1){
+    if (blen-boff<PSYNC_CDC_MAX_CHUNK && rem){
+      memmove(buff, buff+boff, blen-boff);
+      blen-=boff;
+      boff=0;
+      if (rem>CDC_BUFFER_SIZE-blen)
+        rd=CDC_BUFFER_SIZE-blen;
+      else
+        rd=rem;
+      if (unlikely_log(psync_file_pread(fd, buff+blen, rd, off+len-rem)!=rd))
+        goto err;
+      if (hctx)
+        psync_hash_update(hctx, buff+blen, rd);
+      blen+=rd;
+      rem-=rd;
+    }
+    if (boff==blen)
+      break;
+    cl=psync_cdc_find_cut(buff+boff, blen-boff);
+    if (unlikely(cs->chunkcnt==alloced)){
+      alloced*=2;
+      cs=(psync_cdc_chunks_t *)psync_realloc(cs, offsetof(psync_cdc_chunks_t, chunks)+sizeof(psync_cdc_chunk_t)*alloced);
+    }
+    c=&cs->chunks[cs->chunkcnt++];
+    c->off=coff;
+    c->len=cl;
+    psync_sha1(buff+boff, cl, c->sha1);
+    boff+=cl;
+    coff+=cl;
+  }
+  psync_free(buff);
+  return cs;
+err:
+  psync_free(buff);
+  psync_free(cs);
+  return NULL;
+}
+
+psync_cdc_chunks_t *psync_cdc_load_chunks(uint64_t hash){
+  psync_sql_res *res;
+  psync_variant_row row;
+  psync_cdc_chunks_t *cs;
+  const char *data;
+  size_t len;
+  cs=NULL;
+  res=psync_sql_query_rdlock("SELECT chunks FROM hashchunks WHERE hash=?");
+  psync_sql_bind_uint(res, 1, hash);
+  if ((row=psync_sql_fetch_row(res))){
+    data=psync_get_lstring(row[0], &len);
+    if (likely_log(len && len%sizeof(psync_cdc_chunk_t)==0)){
+      cs=(psync_cdc_chunks_t *)psync_malloc(offsetof(psync_cdc_chunks_t, chunks)+len);
+      cs->chunkcnt=len/sizeof(psync_cdc_chunk_t);
+      memcpy(cs->chunks, data, len);
+    }
+  }
+  psync_sql_free_result(res);
+  return cs;
+}
+
+/* only the signatures of the last PSYNC_CDC_MAX_SIGNATURES revisions are kept */
+void psync_cdc_save_chunks(uint64_t hash, const psync_cdc_chunks_t *chunks){
+  psync_sql_res *res;
+  uint64_t id;
+  psync_sql_lock();
+  res=psync_sql_prep_statement("REPLACE INTO hashchunks (hash, chunks) VALUES (?, ?)");
+  psync_sql_bind_uint(res, 1, hash);
+  psync_sql_bind_blob(res, 2, (const char *)chunks->chunks, sizeof(psync_cdc_chunk_t)*chunks->chunkcnt);
+  psync_sql_run_free(res);
+  id=psync_sql_insertid();
+  if (id>PSYNC_CDC_MAX_SIGNATURES){
+    res=psync_sql_prep_statement("DELETE FROM hashchunks WHERE id<=?");
+    psync_sql_bind_uint(res, 1, id-PSYNC_CDC_MAX_SIGNATURES);
+    psync_sql_run_free(res);
+  }
+  psync_sql_unlock();
+  debug(D_NOTICE, "saved %u chunk signatures for hash %lu", (unsigned)chunks->chunkcnt, (unsigned long)hash);
+}
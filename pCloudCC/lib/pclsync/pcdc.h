@@ -0,0 +1,58 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PSYNC_CDC_H
+#define _PSYNC_CDC_H
+
+#include "pcompat.h"
+#include "pssl.h"
+#include "psettings.h"
+
+/* Content defined chunking. Chunk boundaries are chosen by a gear rolling hash over the content itself, so an insertion
+ * or a deletion only changes the chunks around it, while fixed size blocks would all shift by the edit.
+ * Chunk signatures of uploaded revisions are kept in the hashchunks table and are used to find which parts of a modified
+ * file can be copied from the previous revision on the server.
+ */
+
+typedef struct {
+  uint64_t off;
+  uint32_t len;
+  unsigned char sha1[PSYNC_SHA1_DIGEST_LEN];
+} psync_cdc_chunk_t;
+
+typedef struct {
+  uint32_t chunkcnt;
+  psync_cdc_chunk_t chunks[];
+} psync_cdc_chunks_t;
+
+size_t psync_cdc_find_cut(const unsigned char *data, size_t len);
+psync_cdc_chunks_t *psync_cdc_chunk_file(psync_file_t fd, uint64_t off, uint64_t len, psync_hash_ctx *hctx);
+
+psync_cdc_chunks_t *psync_cdc_load_chunks(uint64_t hash);
+void psync_cdc_save_chunks(uint64_t hash, const psync_cdc_chunks_t *chunks);
+
+#endif
@@ -681,7 +681,7 @@ static void save_folder_key_to_db(psync_folderid_t folderid, psync_encrypted_sym
   t=psync_new(insert_folder_key_task);
   t->key=psync_ssl_copy_encrypted_symmetric_key(enckey);
   t->id=folderid;
-  psync_run_thread1("save folder key to db task", save_folder_key_task, t);
+  psync_run_pool1(PSYNC_POOL_CPU, "save folder key to db task", save_folder_key_task, t);
 }
 
 typedef struct {
@@ -709,7 +709,7 @@ static void save_file_key_to_db(psync_fileid_t fileid, uint64_t hash, psync_encr
   t->key=psync_ssl_copy_encrypted_symmetric_key(enckey);
   t->id=fileid;
   t->hash=hash;
-  psync_run_thread1("save file key to db task", save_file_key_task, t);
+  psync_run_pool1(PSYNC_POOL_CPU, "save file key to db task", save_file_key_task, t);
 }
 
 static psync_encrypted_symmetric_key_t psync_crypto_download_folder_enc_key(psync_folderid_t folderid){
@@ -39,6 +39,10 @@
 
 #if defined(P_OS_LINUX)
 #include <sys/sysinfo.h>
+#include <sys/syscall.h>
+#if !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 #endif
 
 #if defined(P_OS_MACOSX)
@@ -106,6 +110,30 @@ typedef struct {
   const char *name;
 } psync_run_data1;
 
+typedef struct {
+  psync_list list;
+  psync_thread_start0 run0;
+  psync_thread_start1 run1;
+  void *ptr;
+  const char *name;
+  uint64_t queuedat;
+} psync_pool_job_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  psync_list jobs;
+  const char *name;
+  uint32_t maxthreads;
+  psync_pool_stats_t stats;
+} psync_pool_t;
+
+static psync_pool_t psync_pools[]={
+  {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PSYNC_LIST_STATIC_INIT(psync_pools[PSYNC_POOL_CPU].jobs), "cpu pool", PSYNC_POOL_CPU_THREADS},
+  {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PSYNC_LIST_STATIC_INIT(psync_pools[PSYNC_POOL_IO].jobs), "io pool", PSYNC_POOL_IO_THREADS},
+  {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PSYNC_LIST_STATIC_INIT(psync_pools[PSYNC_POOL_READ].jobs), "read pool", PSYNC_POOL_READ_THREADS}
+};
+
 #if defined(P_OS_POSIX)
 static uid_t psync_uid;
 static gid_t psync_gid;
@@ -574,6 +602,91 @@ void psync_run_thread1(const char *name, psync_thread_start1 run, void *ptr){
   pthread_attr_destroy(&attr);
 }
 
+/* Short jobs go to one of the pools of worker threads instead of getting a thread each. Workers are started on demand
+ * up to the size of the pool and exit after staying idle for PSYNC_POOL_IDLE_SEC. Jobs must not wait for other jobs
+ * of the same pool. PSYNC_POOL_READ is reserved for reads someone is waiting for, so that they never queue behind
+ * readahead and other background I/O. */
+
+static void psync_pool_worker(void *ptr){
+  psync_pool_t *pool;
+  psync_pool_job_t *job;
+  struct timespec tm;
+  uint64_t waitms;
+  pool=(psync_pool_t *)ptr;
+  while (1){
+    pthread_mutex_lock(&pool->mutex);
+    while (psync_list_isempty(&pool->jobs)){
+      tm.tv_sec=psync_current_time+PSYNC_POOL_IDLE_SEC;
+      tm.tv_nsec=0;
+      pool->stats.idle++;
+      if (pthread_cond_timedwait(&pool->cond, &pool->mutex, &tm) && psync_list_isempty(&pool->jobs)){
+        pool->stats.idle--;
+        pool->stats.threads--;
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+      }
+      pool->stats.idle--;
+    }
+    job=psync_list_remove_head_element(&pool->jobs, psync_pool_job_t, list);
+    pool->stats.queued--;
+    waitms=psync_millitime()-job->queuedat;
+    pool->stats.waitms+=waitms;
+    if (waitms>pool->stats.maxwaitms)
+      pool->stats.maxwaitms=waitms;
+    pthread_mutex_unlock(&pool->mutex);
+    psync_thread_name=job->name;
+    if (job->run1)
+      job->run1(job->ptr);
+    else
+      job->run0();
+    psync_free(job);
+  }
+}
+
+static void psync_pool_submit(uint32_t pid, const char *name, psync_thread_start0 run0, psync_thread_start1 run1, void *ptr){
+  psync_pool_t *pool;
+  psync_pool_job_t *job;
+  int spawn;
+  assert(pid<ARRAY_SIZE(psync_pools));
+  pool=&psync_pools[pid];
+  job=psync_new(psync_pool_job_t);
+  job->run0=run0;
+  job->run1=run1;
+  job->ptr=ptr;
+  job->name=name;
+  job->queuedat=psync_millitime();
+  pthread_mutex_lock(&pool->mutex);
+  psync_list_add_tail(&pool->jobs, &job->list);
+  pool->stats.jobs++;
+  if (++pool->stats.queued>pool->stats.maxqueued)
+    pool->stats.maxqueued=pool->stats.queued;
+  if (pool->stats.queued>pool->stats.idle && pool->stats.threads<pool->maxthreads){
+    pool->stats.threads++;
+    spawn=1;
+  }
+  else
+    spawn=0;
+  if (pool->stats.idle)
+    pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  if (spawn)
+    psync_run_thread1(pool->name, psync_pool_worker, pool);
+}
+
+void psync_run_pool(uint32_t pool, const char *name, psync_thread_start0 run){
+  psync_pool_submit(pool, name, run, NULL, NULL);
+}
+
+void psync_run_pool1(uint32_t pool, const char *name, psync_thread_start1 run, void *ptr){
+  psync_pool_submit(pool, name, NULL, run, ptr);
+}
+
+void psync_pool_get_stats(uint32_t pool, psync_pool_stats_t *stats){
+  pthread_mutex_lock(&psync_pools[pool].mutex);
+  memcpy(stats, &psync_pools[pool].stats, sizeof(psync_pool_stats_t));
+  pthread_mutex_unlock(&psync_pools[pool].mutex);
+}
+
 static void psync_check_no_sql_lock(uint64_t millisec){
 #if IS_DEBUG
   if (psync_sql_islocked()){
@@ -2792,6 +2905,54 @@ int psync_file_close(psync_file_t fd){
 #endif
 }
 
+int psync_file_trylock(psync_file_t fd){
+#if defined(P_OS_POSIX)
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type=F_WRLCK;
+  fl.l_whence=SEEK_SET;
+  return fcntl(fd, F_SETLK, &fl);
+#elif defined(P_OS_WINDOWS)
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  return psync_bool_to_zero(LockFileEx(fd, LOCKFILE_EXCLUSIVE_LOCK|LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &ov));
+#else
+#error "Function not implemented for your operating system"
+#endif
+}
+
+/* Fills dst (expected to be empty) with the first size bytes of src without passing the data through userspace, by
+ * sharing the extents (reflink) where the filesystem supports it or with copy_file_range otherwise. Returns -1 if
+ * neither works, the caller should copy the data itself then. File offsets are not changed.
+ */
+int psync_file_clone(psync_file_t src, psync_file_t dst, uint64_t size){
+#if defined(P_OS_LINUX) && defined(__NR_copy_file_range)
+  int64_t soff, doff;
+  ssize_t cp;
+  if (!ioctl(dst, FICLONE, src) && psync_file_size(dst)==size)
+    return 0;
+  soff=0;
+  doff=0;
+  while ((uint64_t)doff<size){
+    cp=syscall(__NR_copy_file_range, src, &soff, dst, &doff, size-doff, 0);
+    if (cp<=0){
+      if (cp==-1 && errno==EINTR)
+        continue;
+      if (doff)
+        debug(D_WARNING, "copy_file_range failed after %lu bytes, errno=%d", (unsigned long)doff, (int)errno);
+      return -1;
+    }
+  }
+  return 0;
+#elif defined(P_OS_LINUX)
+  if (!ioctl(dst, FICLONE, src) && psync_file_size(dst)==size)
+    return 0;
+  return -1;
+#else
+  return -1;
+#endif
+}
+
 int psync_file_sync(psync_file_t fd){
 #if defined(F_FULLFSYNC) && defined(P_OS_POSIX)
   if (unlikely(fcntl(fd, F_FULLFSYNC))){
@@ -3706,6 +3867,36 @@ void *psync_mmap_anon_safe(size_t size){
     return psync_mmap_anon_emergency(size);
 }
 
+/* tries to back the allocation by huge pages, explicitly reserved ones first, then transparent ones, size should be multiple of
+ * PSYNC_HUGE_PAGE_SIZE for that to be possible. hugetlb is set if reserved huge pages are used, psync_anon_reset() can then only
+ * give back whole huge pages
+ */
+void *psync_mmap_anon_huge(size_t size, int *hugetlb){
+#if defined(PSYNC_MAP_ANONYMOUS)
+  void *ret;
+  *hugetlb=0;
+#if defined(MAP_HUGETLB)
+  if (size%PSYNC_HUGE_PAGE_SIZE==0){
+    ret=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|PSYNC_MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (ret!=MAP_FAILED){
+      debug(D_NOTICE, "allocated %lu bytes in huge pages", (unsigned long)size);
+      *hugetlb=1;
+      return ret;
+    }
+  }
+#endif
+  ret=psync_mmap_anon_safe(size);
+#if defined(MADV_HUGEPAGE)
+  if (size%PSYNC_HUGE_PAGE_SIZE==0)
+    madvise(ret, size, MADV_HUGEPAGE);
+#endif
+  return ret;
+#else
+  *hugetlb=0;
+  return psync_mmap_anon_safe(size);
+#endif
+}
+
 int psync_munmap_anon(void *ptr, size_t size){
 #if defined(PSYNC_MAP_ANONYMOUS)
   return munmap(ptr, size);
@@ -3748,3 +3939,97 @@ int psync_munlock(void *ptr, size_t size){
 int psync_get_page_size(){
   return psync_page_size;
 }
+
+uint64_t psync_get_physical_memory(){
+#if defined(P_OS_LINUX)
+  struct sysinfo si;
+  if (likely_log(!sysinfo(&si)))
+    return (uint64_t)si.totalram*si.mem_unit;
+  else
+    return 0;
+#elif defined(P_OS_MACOSX)
+  uint64_t mem;
+  size_t len;
+  int mib[2];
+  mib[0]=CTL_HW;
+  mib[1]=HW_MEMSIZE;
+  len=sizeof(mem);
+  if (likely_log(!sysctl(mib, 2, &mem, &len, NULL, 0)))
+    return mem;
+  else
+    return 0;
+#elif defined(P_OS_WINDOWS)
+  MEMORYSTATUSEX ms;
+  ms.dwLength=sizeof(ms);
+  if (likely_log(GlobalMemoryStatusEx(&ms)))
+    return ms.ullTotalPhys;
+  else
+    return 0;
+#elif defined(_SC_PHYS_PAGES)
+  long pages;
+  pages=sysconf(_SC_PHYS_PAGES);
+  if (likely_log(pages>0))
+    return (uint64_t)pages*psync_page_size;
+  else
+    return 0;
+#else
+  return 0;
+#endif
+}
+
+#if defined(P_OS_LINUX)
+static ssize_t psync_read_proc_file(const char *path, char *buff, size_t size){
+  ssize_t rd;
+  int fd;
+  fd=open(path, O_RDONLY);
+  if (fd==-1)
+    return -1;
+  rd=read(fd, buff, size-1);
+  close(fd);
+  if (rd<0)
+    return -1;
+  buff[rd]=0;
+  return rd;
+}
+#endif
+
+/* Gets the cumulative time in which the system was stalled on disk I/O and the time it is measured against, in the same
+ * (otherwise arbitrary) units. The share of stalled time between two calls is the I/O pressure in between. PSI is used
+ * when the kernel has it (microseconds against monotonic time), otherwise iowait against all cpu time from /proc/stat
+ * (clock ticks). Returns -1 if neither is available.
+ */
+int psync_get_io_stall(uint64_t *stalled, uint64_t *total){
+#if defined(P_OS_LINUX)
+  char buff[512];
+  uint64_t val;
+  char *ptr, *end;
+  int i;
+  if (psync_read_proc_file("/proc/pressure/io", buff, sizeof(buff))>0 && !memcmp(buff, "some ", 5) &&
+      (ptr=strstr(buff, "total=")) && (end=strchr(buff, '\n')) && ptr<end){
+    val=strtoull(ptr+6, &end, 10);
+    if (end!=ptr+6){
+      *stalled=val;
+      *total=psync_millitime()*1000;
+      return 0;
+    }
+  }
+  if (psync_read_proc_file("/proc/stat", buff, sizeof(buff))<=0 || memcmp(buff, "cpu ", 4))
+    return -1;
+  ptr=buff+4;
+  *total=0;
+  *stalled=0;
+  /* user nice system idle iowait irq softirq steal */
+  for (i=0; i<8; i++){
+    val=strtoull(ptr, &end, 10);
+    if (end==ptr)
+      break;
+    *total+=val;
+    if (i==4)
+      *stalled=val;
+    ptr=end;
+  }
+  return i<5?-1:0;
+#else
+  return -1;
+#endif
+}
@@ -407,6 +407,20 @@ typedef void (*psync_list_dir_callback_fast)(void *, psync_pstat_fast *);
 typedef void (*psync_thread_start0)();
 typedef void (*psync_thread_start1)(void *);
 
+#define PSYNC_POOL_CPU 0
+#define PSYNC_POOL_IO  1
+#define PSYNC_POOL_READ 2
+
+typedef struct {
+  uint64_t jobs;
+  uint64_t waitms;
+  uint64_t maxwaitms;
+  uint32_t threads;
+  uint32_t idle;
+  uint32_t queued;
+  uint32_t maxqueued;
+} psync_pool_stats_t;
+
 extern PSYNC_THREAD const char *psync_thread_name;
 
 extern const unsigned char psync_invalid_filename_chars[];
@@ -421,6 +435,9 @@ char *psync_get_default_database_path();
 char *psync_get_home_dir();
 void psync_run_thread(const char *name, psync_thread_start0 run);
 void psync_run_thread1(const char *name, psync_thread_start1 run, void *ptr);
+void psync_run_pool(uint32_t pool, const char *name, psync_thread_start0 run);
+void psync_run_pool1(uint32_t pool, const char *name, psync_thread_start1 run, void *ptr);
+void psync_pool_get_stats(uint32_t pool, psync_pool_stats_t *stats);
 void psync_milisleep_nosqlcheck(uint64_t millisec);
 void psync_milisleep(uint64_t millisec);
 time_t psync_time();
@@ -486,6 +503,8 @@ int psync_file_delete(const char *path);
 
 psync_file_t psync_file_open(const char *path, int access, int flags);
 int psync_file_close(psync_file_t fd);
+int psync_file_trylock(psync_file_t fd);
+int psync_file_clone(psync_file_t src, psync_file_t dst, uint64_t size);
 int psync_file_sync(psync_file_t fd);
 int psync_file_schedulesync(psync_file_t fd);
 int psync_folder_sync(const char *path);
@@ -514,8 +533,11 @@ int psync_run_update_file(const char *path);
 int psync_invalidate_os_cache_needed();
 int psync_invalidate_os_cache(const char *path);
 
+#define PSYNC_HUGE_PAGE_SIZE (2*1024*1024)
+
 void *psync_mmap_anon(size_t size);
 void *psync_mmap_anon_safe(size_t size);
+void *psync_mmap_anon_huge(size_t size, int *hugetlb);
 int psync_munmap_anon(void *ptr, size_t size);
 void psync_anon_reset(void *ptr, size_t size);
 
@@ -523,6 +545,8 @@ int psync_mlock(void *ptr, size_t size);
 int psync_munlock(void *ptr, size_t size);
 
 int psync_get_page_size();
+uint64_t psync_get_physical_memory();
+int psync_get_io_stall(uint64_t *stalled, uint64_t *total);
 
 void psync_rebuild_icons();
 
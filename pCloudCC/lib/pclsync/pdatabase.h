@@ -43,14 +43,14 @@
 #define PSYNC_TEXT_COL "COLLATE NOCASE"
 #endif
 
-#define PSYNC_DATABASE_VERSION 17
+#define PSYNC_DATABASE_VERSION 21
 
 #define PSYNC_DATABASE_CONFIG \
 "\
 PRAGMA page_size=4096;\
 PRAGMA journal_mode=WAL;\
 PRAGMA synchronous=1;\
-PRAGMA locking_mode=EXCLUSIVE;\
+PRAGMA locking_mode=NORMAL;\
 PRAGMA cache_size=8000;\
 PRAGMA foreign_keys=ON;\
 "
@@ -71,6 +71,7 @@ CREATE TABLE IF NOT EXISTS file (id INTEGER PRIMARY KEY, parentfolderid INTEGER,
 CREATE INDEX IF NOT EXISTS kfilefolderid ON file(parentfolderid);\
 CREATE INDEX IF NOT EXISTS kfilecategory ON file(category);\
 CREATE INDEX IF NOT EXISTS kfileartist ON file(artist, album);\
+CREATE INDEX IF NOT EXISTS kfilesize ON file(size);\
 CREATE TABLE IF NOT EXISTS filerevision (fileid INTEGER REFERENCES file(id) ON DELETE CASCADE, hash INTEGER, ctime INTEGER, size INTEGER,\
   PRIMARY KEY (fileid, hash)) " P_SQL_WOWROWID ";\
 CREATE TABLE IF NOT EXISTS syncfolderdelayed (id INTEGER PRIMARY KEY, localpath VARCHAR(4096), remotepath VARCHAR(4096), synctype INTEGER); \
@@ -101,14 +102,14 @@ CREATE TABLE IF NOT EXISTS task (id INTEGER PRIMARY KEY, type INTEGER, syncid IN
 CREATE INDEX IF NOT EXISTS ktaskitemid ON task(itemid);\
 CREATE INDEX IF NOT EXISTS ktasklocalitemid ON task(localitemid);\
 CREATE TABLE IF NOT EXISTS hashchecksum (hash INTEGER, size INTEGER, checksum TEXT, PRIMARY KEY (hash, size)) " P_SQL_WOWROWID ";\
+CREATE INDEX IF NOT EXISTS khashchecksumchecksum ON hashchecksum(checksum);\
+CREATE TABLE IF NOT EXISTS hashchunks (id INTEGER PRIMARY KEY, hash INTEGER NOT NULL UNIQUE, chunks BLOB NOT NULL);\
 CREATE TABLE IF NOT EXISTS sharerequest (id INTEGER PRIMARY KEY, isincoming INTEGER, folderid INTEGER, ctime INTEGER, etime INTEGER, permissions INTEGER,\
   userid INTEGER, mail TEXT, name VARCHAR(1024), message TEXT, isba INTEGER);\
 CREATE TABLE IF NOT EXISTS sharedfolder (id INTEGER PRIMARY KEY, isincoming INTEGER, folderid INTEGER, ctime INTEGER, permissions INTEGER,\
   userid INTEGER, mail TEXT, name VARCHAR(1024), bsharedfolderid INTEGER);\
-CREATE TABLE IF NOT EXISTS pagecache (id INTEGER PRIMARY KEY, hash INTEGER, pageid INTEGER, type INTEGER, flags INTEGER,\
-  lastuse INTEGER, usecnt INTEGER, size INTEGER, crc INTEGER);\
-CREATE UNIQUE INDEX IF NOT EXISTS kpagecachehashpageid ON pagecache(hash, pageid);\
-CREATE INDEX IF NOT EXISTS kpagecachetype ON pagecache(type);\
+CREATE TABLE IF NOT EXISTS pagecacheextent (id INTEGER PRIMARY KEY, hash INTEGER, pageid INTEGER, pagecnt INTEGER, cacheid INTEGER,\
+  lastsize INTEGER, lastuse INTEGER, usecnt INTEGER, crcs BLOB);\
 CREATE TABLE IF NOT EXISTS fstask (id INTEGER PRIMARY KEY, type INTEGER, status INTEGER, folderid INTEGER, sfolderid INTEGER, fileid INTEGER,\
   text1 TEXT, text2 TEXT, int1 INTEGER, int2 INTEGER);\
 CREATE INDEX IF NOT EXISTS kfstaskfolderid ON fstask(folderid);\
@@ -265,6 +266,24 @@ COMMIT;",
 "BEGIN;\
 UPDATE setting SET value=17 WHERE id='dbversion'; \
 UPDATE setting SET value=0 WHERE id='diffid'; \
+COMMIT;",
+"BEGIN;\
+DROP TABLE IF EXISTS pagecache;\
+CREATE TABLE IF NOT EXISTS pagecacheextent (id INTEGER PRIMARY KEY, hash INTEGER, pageid INTEGER, pagecnt INTEGER, cacheid INTEGER,\
+  lastsize INTEGER, lastuse INTEGER, usecnt INTEGER, crcs BLOB);\
+UPDATE setting SET value=18 WHERE id='dbversion'; \
+COMMIT;",
+"BEGIN;\
+CREATE INDEX IF NOT EXISTS kfilesize ON file(size);\
+UPDATE setting SET value=19 WHERE id='dbversion'; \
+COMMIT;",
+"BEGIN;\
+CREATE INDEX IF NOT EXISTS khashchecksumchecksum ON hashchecksum(checksum);\
+UPDATE setting SET value=20 WHERE id='dbversion'; \
+COMMIT;",
+"BEGIN;\
+CREATE TABLE IF NOT EXISTS hashchunks (id INTEGER PRIMARY KEY, hash INTEGER NOT NULL UNIQUE, chunks BLOB NOT NULL);\
+UPDATE setting SET value=21 WHERE id='dbversion'; \
 COMMIT;"
 };
 
@@ -489,6 +489,7 @@ static void process_createfolder(const binresult *entry){
     psync_sql_bind_uint(res, 7, flags);
     psync_sql_bind_uint(res, 8, folderid);
     psync_sql_run_free(res);
+    psync_fsfolder_cache_folder_changed(folderid);
   }
   psync_sql_bind_uint(st2, 1, mtime);
   psync_sql_bind_uint(st2, 2, parentfolderid);
@@ -627,6 +628,7 @@ static void process_modifyfolder(const binresult *entry){
   psync_sql_bind_uint(st, 7, flags);
   psync_sql_bind_uint(st, 8, folderid);
   psync_sql_run(st);
+  psync_fsfolder_cache_folder_changed(folderid);
   if (oldparentfolderid!=parentfolderid){
     res=psync_sql_prep_statement("UPDATE folder SET subdircnt=subdircnt-1, mtime=? WHERE id=?");
     psync_sql_bind_uint(res, 1, mtime);
@@ -776,6 +778,7 @@ static void process_deletefolder(const binresult *entry){
     psync_sql_bind_uint(st2, 2, psync_find_result(meta, "parentfolderid", PARAM_NUM)->num);
     psync_sql_run(st2);
     psync_fs_folder_deleted(folderid);
+    psync_fsfolder_cache_folder_changed(folderid);
   }
 }
 
@@ -1580,6 +1583,8 @@ static void process_acceptedsharein(const binresult *entry){
       br=psync_check_result(share, "sharename", PARAM_STR);
   psync_sql_bind_lstring(q, 7, br->str, br->length);
   psync_sql_run_free(q);
+  /* the dentry cache keeps the shareid of folders owned by others */
+  psync_fsfolder_cache_clean();
 }
 
 static void process_establishbsharein(const binresult *entry){
@@ -1676,6 +1681,7 @@ static void process_acceptedshareout(const binresult *entry){
     psync_sql_bind_lstring(q, 7, br->str, br->length);
     psync_sql_bind_uint(q, 8, isincomming);
     psync_sql_run_free(q);
+    psync_fsfolder_cache_clean();
   }
 }
 
@@ -1795,6 +1801,7 @@ static void delete_shared_folder(const binresult *share){
   //debug(D_NOTICE, "DELETE NORMAL SHARE id: %lld", (long long) shareid );
   psync_sql_bind_uint(q, 1, shareid);
   psync_sql_run_free(q);
+  psync_fsfolder_cache_clean();
 }
 
 static void delete_bsshared_folder(const binresult *share){
@@ -1851,6 +1858,7 @@ static void modify_shared_folder(const binresult *perms, uint64_t shareid){
   psync_sql_bind_uint(q, 1, psync_get_permissions(perms));
   psync_sql_bind_uint(q, 2, shareid);
   psync_sql_run_free(q);
+  psync_fsfolder_cache_clean();
 }
 
 static void modify_bshared_folder(const binresult *perms, uint64_t shareid){
@@ -2191,7 +2199,7 @@ static void psync_diff_refresh_fs(const binresult *entries){
     ptr=psync_new(refresh_folders_ptr_t);
     ptr->refresh_folders=refresh_folders;
     ptr->refresh_last=refresh_last;
-    psync_run_thread1("fs folder refresh", psync_diff_refresh_thread, ptr);
+    psync_run_pool1(PSYNC_POOL_CPU, "fs folder refresh", psync_diff_refresh_thread, ptr);
     refresh_folders=NULL;
     refresh_allocated=0;
     refresh_last=0;
@@ -2200,7 +2208,7 @@ static void psync_diff_refresh_fs(const binresult *entries){
 
 static void psync_run_analyze_if_needed(){
   if (psync_timer_time()>psync_sql_cellint("SELECT value FROM setting WHERE id='lastanalyze'", 0)+24*3600){
-    static const char *skiptables[]={"pagecache", "sqlite_stat1"};
+    static const char *skiptables[]={"pagecacheextent", "sqlite_stat1"};
     psync_sql_res *res;
     psync_uint_row row;
     psync_str_row srow;
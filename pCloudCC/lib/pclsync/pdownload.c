@@ -44,6 +44,7 @@
 #include "pupload.h"
 #include "pasyncnet.h"
 #include "ppathstatus.h"
+#include "ppagecache.h"
 
 typedef struct {
   psync_list list;
@@ -506,6 +507,276 @@ static int rename_and_create_local(download_task_t *dt, unsigned char *checksum,
   return 0;
 }
 
+/* Local content is looked up by checksum and size, first in the synced folders and then in the read cache, which also
+ * holds files recently uploaded through the filesystem. Synced files are verified lazily: a stat has to match what the
+ * local scan recorded and the checksum is verified while copying. On success the content is in dt->tmpname.
+ */
+static int copy_from_local_content(download_task_t *dt, const unsigned char *checksum, uint64_t size){
+  psync_sql_res *sql;
+  psync_full_result_int *fr;
+  psync_stat_t st;
+  char *path;
+  uint32_t i;
+  int ret;
+  ret=-1;
+  sql=psync_sql_query_rdlock("SELECT id, mtimenative, inode FROM localfile WHERE size=? AND checksum=? LIMIT "
+                             NTO_STR(PSYNC_MAX_LOCAL_COPY_CANDIDATES));
+  psync_sql_bind_uint(sql, 1, size);
+  psync_sql_bind_lstring(sql, 2, (const char *)checksum, PSYNC_HASH_DIGEST_HEXLEN);
+  fr=psync_sql_fetchall_int(sql);
+  for (i=0; i<fr->rows && ret; i++){
+    path=psync_local_path_for_local_file(psync_get_result_cell(fr, i, 0), NULL);
+    if (unlikely_log(!path))
+      continue;
+    if (psync_stat(path, &st) || psync_stat_size(&st)!=size || psync_stat_mtime_native(&st)!=psync_get_result_cell(fr, i, 1) ||
+        psync_stat_inode(&st)!=psync_get_result_cell(fr, i, 2))
+      debug(D_NOTICE, "%s changed since it was scanned, not copying it", path);
+    else if (psync_copy_local_file_if_checksum_matches(path, dt->tmpname, checksum, size)==PSYNC_NET_OK){
+      debug(D_NOTICE, "file %s copied from %s", dt->localname, path);
+      ret=0;
+    }
+    else
+      debug(D_WARNING, "failed to copy %s from %s", dt->localname, path);
+    psync_free(path);
+  }
+  psync_free(fr);
+  if (!ret)
+    return 0;
+  sql=psync_sql_query_rdlock("SELECT hash FROM hashchecksum WHERE checksum=? AND size=? LIMIT "NTO_STR(PSYNC_MAX_LOCAL_COPY_CANDIDATES));
+  psync_sql_bind_lstring(sql, 1, (const char *)checksum, PSYNC_HASH_DIGEST_HEXLEN);
+  psync_sql_bind_uint(sql, 2, size);
+  fr=psync_sql_fetchall_int(sql);
+  for (i=0; i<fr->rows && ret; i++)
+    if (!psync_pagecache_copy_to_local_file(psync_get_result_cell(fr, i, 0), size, dt->tmpname, checksum)){
+      debug(D_NOTICE, "file %s restored from the read cache", dt->localname);
+      ret=0;
+    }
+  psync_free(fr);
+  return ret;
+}
+
+/* another synced copy of the same fileid, possibly of an older revision, can provide blocks for the ranged download */
+static char *other_local_copy_of_file(download_task_t *dt){
+  psync_sql_res *sql;
+  psync_uint_row row;
+  psync_fileid_t localfileid;
+  sql=psync_sql_query_rdlock("SELECT id FROM localfile WHERE fileid=? AND size>=? AND NOT (syncid=? AND localparentfolderid=? AND name=?) LIMIT 1");
+  psync_sql_bind_uint(sql, 1, dt->dwllist.fileid);
+  psync_sql_bind_uint(sql, 2, PSYNC_MIN_SIZE_FOR_CHECKSUMS);
+  psync_sql_bind_uint(sql, 3, dt->dwllist.syncid);
+  psync_sql_bind_uint(sql, 4, dt->localfolderid);
+  psync_sql_bind_string(sql, 5, dt->filename);
+  if ((row=psync_sql_fetch_rowint(sql)))
+    localfileid=row[0];
+  else
+    localfileid=0;
+  psync_sql_free_result(sql);
+  if (localfileid)
+    return psync_local_path_for_local_file(localfileid, NULL);
+  else
+    return NULL;
+}
+
+static void account_downloaded_bytes(download_task_t *dt, uint64_t bytes){
+  pthread_mutex_lock(&current_downloads_mutex);
+  psync_status.bytesdownloaded+=bytes;
+  dt->downloadedsize+=bytes;
+  if (current_downloads_waiters && psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded<=PSYNC_START_NEW_DOWNLOADS_TRESHOLD)
+    pthread_cond_signal(&current_downloads_cond);
+  pthread_mutex_unlock(&current_downloads_mutex);
+  psync_send_status_update();
+}
+
+#define PARALLEL_SEGMENT_IDLE (~(uint64_t)0)
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  download_task_t *dt;
+  const binresult *hosts;
+  const char *requestpath;
+  psync_file_t fd;
+  uint64_t nextoff;
+  uint64_t endoff;
+  uint64_t bytes;
+  /* offset up to which the segment each connection works on is written, PARALLEL_SEGMENT_IDLE if none */
+  uint64_t active[PSYNC_PARALLEL_DOWNLOAD_MAX_CONNS];
+  uint32_t started;
+  uint32_t running;
+  int error;
+} parallel_download_t;
+
+static void parallel_download_thread(void *ptr){
+  parallel_download_t *pd;
+  psync_http_socket *http;
+  void *buff;
+  uint64_t off, len;
+  uint32_t idx, i;
+  int rd;
+  pd=(parallel_download_t *)ptr;
+  buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
+  pthread_mutex_lock(&pd->mutex);
+  idx=pd->started++;
+  while (!pd->error && !pd->dt->dwllist.stop && pd->nextoff<pd->endoff){
+    off=pd->nextoff;
+    len=pd->endoff-off;
+    if (len>PSYNC_PARALLEL_DOWNLOAD_SEGMENT)
+      len=PSYNC_PARALLEL_DOWNLOAD_SEGMENT;
+    pd->nextoff+=len;
+    pd->active[idx]=off;
+    pthread_mutex_unlock(&pd->mutex);
+    http=NULL;
+    for (i=0; i<pd->hosts->length; i++)
+      if ((http=psync_http_connect(pd->hosts->array[i]->str, pd->requestpath, off, off+len-1)))
+        break;
+    if (unlikely_log(!http))
+      goto err0;
+    while (len && !pd->dt->dwllist.stop){
+      rd=psync_http_readall(http, buff, len>PSYNC_COPY_BUFFER_SIZE?PSYNC_COPY_BUFFER_SIZE:len);
+      if (unlikely_log(rd<=0) ||
+          unlikely_log(psync_file_pwriteall_checkoverquota(pd->fd, buff, rd, off)))
+        goto err1;
+      off+=rd;
+      len-=rd;
+      account_downloaded_bytes(pd->dt, rd);
+      pthread_mutex_lock(&pd->mutex);
+      pd->bytes+=rd;
+      pd->active[idx]=off;
+      pthread_mutex_unlock(&pd->mutex);
+      if (unlikely(!psync_statuses_ok_array(requiredstatuses, ARRAY_SIZE(requiredstatuses))))
+        goto err1;
+    }
+    psync_http_close(http);
+    pthread_mutex_lock(&pd->mutex);
+    /* let the hashing catch up with the completed segment */
+    pthread_cond_signal(&pd->cond);
+  }
+  goto ex;
+err1:
+  psync_http_close(http);
+err0:
+  pthread_mutex_lock(&pd->mutex);
+  pd->error=1;
+ex:
+  pd->active[idx]=PARALLEL_SEGMENT_IDLE;
+  pd->running--;
+  pthread_cond_signal(&pd->cond);
+  pthread_mutex_unlock(&pd->mutex);
+  psync_free(buff);
+}
+
+static int parallel_download_hash(psync_file_t fd, psync_hash_ctx *hashctx, void *buff, uint64_t *hashedoff, uint64_t upto){
+  uint64_t len;
+  ssize_t rd;
+  while (*hashedoff<upto){
+    len=upto-*hashedoff;
+    if (len>PSYNC_COPY_BUFFER_SIZE)
+      len=PSYNC_COPY_BUFFER_SIZE;
+    rd=psync_file_pread(fd, buff, len, *hashedoff);
+    if (unlikely_log(rd<=0))
+      return -1;
+    psync_hash_update(hashctx, buff, rd);
+    *hashedoff+=rd;
+  }
+  return 0;
+}
+
+/* Downloads a large range over several connections, each of them fetching PSYNC_PARALLEL_DOWNLOAD_SEGMENT sized pieces
+ * in increasing offset order and writing them in place. One more connection is added (opened in advance through the
+ * connection cache) every PSYNC_PARALLEL_DOWNLOAD_PROBE_SEC for as long as the throughput per connection does not drop
+ * below 3/4 of what it was with one connection less, that is while the link is not yet full. Meanwhile the part of the
+ * range that is completely written is read back and hashed, so the checksum still covers the whole file in order.
+ */
+static int parallel_download_range(download_task_t *dt, const binresult *hosts, const char *requestpath, psync_file_t fd,
+                                   uint64_t off, uint64_t len, psync_hash_ctx *hashctx, void *buff){
+  parallel_download_t pd;
+  struct timespec tm;
+  uint64_t hashedoff, upto, lastbytes, lastms, now, rate, prevrate;
+  psync_file_t rfd;
+  uint32_t conns, i;
+  int grow, warm, timedout, ret;
+  debug(D_NOTICE, "downloading %lu bytes from offset %lu of fileid %lu in parallel", (unsigned long)len, (unsigned long)off,
+        (unsigned long)dt->dwllist.fileid);
+  rfd=psync_file_open(dt->tmpname, P_O_RDONLY, 0);
+  if (unlikely_log(rfd==INVALID_HANDLE_VALUE))
+    return -1;
+  pthread_mutex_init(&pd.mutex, NULL);
+  pthread_cond_init(&pd.cond, NULL);
+  pd.dt=dt;
+  pd.hosts=hosts;
+  pd.requestpath=requestpath;
+  pd.fd=fd;
+  pd.nextoff=off;
+  pd.endoff=off+len;
+  pd.bytes=0;
+  for (i=0; i<PSYNC_PARALLEL_DOWNLOAD_MAX_CONNS; i++)
+    pd.active[i]=PARALLEL_SEGMENT_IDLE;
+  pd.started=0;
+  pd.running=1;
+  pd.error=0;
+  hashedoff=off;
+  conns=1;
+  grow=1;
+  warm=0;
+  prevrate=0;
+  lastbytes=0;
+  lastms=psync_millitime();
+  psync_run_thread1("parallel download", parallel_download_thread, &pd);
+  /* psync_current_time is only updated once a second and might be behind the clock the condition waits on */
+  psync_nanotime(&tm);
+  tm.tv_sec+=PSYNC_PARALLEL_DOWNLOAD_PROBE_SEC;
+  pthread_mutex_lock(&pd.mutex);
+  while (pd.running){
+    timedout=pthread_cond_timedwait(&pd.cond, &pd.mutex, &tm)==ETIMEDOUT;
+    if (timedout){
+      psync_nanotime(&tm);
+      tm.tv_sec+=PSYNC_PARALLEL_DOWNLOAD_PROBE_SEC;
+    }
+    upto=pd.nextoff;
+    for (i=0; i<PSYNC_PARALLEL_DOWNLOAD_MAX_CONNS; i++)
+      if (pd.active[i]<upto)
+        upto=pd.active[i];
+    if (timedout && !pd.error && grow && pd.nextoff<pd.endoff && !dt->dwllist.stop && (now=psync_millitime())>lastms){
+      if (warm){
+        pd.running++;
+        conns++;
+        warm=0;
+        psync_run_thread1("parallel download", parallel_download_thread, &pd);
+      }
+      else{
+        rate=(pd.bytes-lastbytes)*1000/(now-lastms)/conns;
+        if (rate*4>=prevrate*3 && conns<PSYNC_PARALLEL_DOWNLOAD_MAX_CONNS){
+          debug(D_NOTICE, "%lu bytes/sec per connection with %u connections, adding one", (unsigned long)rate, (unsigned)conns);
+          psync_http_connect_and_cache_host(hosts->array[0]->str);
+          prevrate=rate;
+          warm=1;
+        }
+        else{
+          debug(D_NOTICE, "%lu bytes/sec per connection with %u connections, not adding more", (unsigned long)rate, (unsigned)conns);
+          grow=0;
+        }
+      }
+      lastbytes=pd.bytes;
+      lastms=now;
+    }
+    pthread_mutex_unlock(&pd.mutex);
+    if (!pd.error && parallel_download_hash(rfd, hashctx, buff, &hashedoff, upto)){
+      pthread_mutex_lock(&pd.mutex);
+      pd.error=1;
+      continue;
+    }
+    pthread_mutex_lock(&pd.mutex);
+  }
+  ret=pd.error || dt->dwllist.stop?-1:0;
+  pthread_mutex_unlock(&pd.mutex);
+  if (!ret)
+    ret=parallel_download_hash(rfd, hashctx, buff, &hashedoff, off+len);
+  psync_file_close(rfd);
+  pthread_cond_destroy(&pd.cond);
+  pthread_mutex_destroy(&pd.mutex);
+  return ret;
+}
+
 static int task_download_file(download_task_t *dt){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", dt->dwllist.fileid)};
   psync_stat_t st;
@@ -514,8 +785,8 @@ static int task_download_file(download_task_t *dt){
   binresult *res;
   psync_sql_res *sql;
   const binresult *hosts;
-  char *tmpold;
-  char *oldfiles[2];
+  char *tmpold, *tmpother;
+  char *oldfiles[3];
   uint32_t oldcnt;
   const char *requestpath;
   void *buff;
@@ -532,6 +803,7 @@ static int task_download_file(download_task_t *dt){
 
   psync_list_init(&ranges);
   tmpold=NULL;
+  tmpother=NULL;
 
   rt=psync_get_remote_file_checksum(dt->dwllist.fileid, serverhashhex, &serversize, &hash);
   if (unlikely_log(rt!=PSYNC_NET_OK)){
@@ -583,33 +855,8 @@ static int task_download_file(download_task_t *dt){
     }
   }
 
-  sql=psync_sql_query_rdlock("SELECT id FROM localfile WHERE size=? AND checksum=?");
-  psync_sql_bind_uint(sql, 1, serversize);
-  psync_sql_bind_lstring(sql, 2, (char *)serverhashhex, PSYNC_HASH_DIGEST_HEXLEN);
-  while ((row=psync_sql_fetch_rowint(sql))){
-    tmpold=psync_local_path_for_local_file(row[0], NULL);
-    if (unlikely_log(!tmpold))
-      continue;
-    psync_sql_free_result(sql);
-    sql=NULL;
-    rt=psync_copy_local_file_if_checksum_matches(tmpold, dt->tmpname, serverhashhex, serversize);
-    if (likely(rt==PSYNC_NET_OK)){
-      if (rename_and_create_local(dt, serverhashhex, serversize, hash))
-        rt=PSYNC_NET_TEMPFAIL;
-      else
-        debug(D_NOTICE, "file %s copied from %s", dt->localname, tmpold);
-    }
-    else
-      debug(D_WARNING, "failed to copy %s from %s", dt->localname, tmpold);
-    psync_free(tmpold);
-    tmpold=NULL;
-    if (likely_log(rt==PSYNC_NET_OK))
-      return 0;
-    else
-      break;
-  }
-  if (sql)
-    psync_sql_free_result(sql);
+  if (!copy_from_local_content(dt, serverhashhex, serversize) && likely_log(!rename_and_create_local(dt, serverhashhex, serversize, hash)))
+    return 0;
 
   if (dt->dwllist.stop)
     return 0;
@@ -658,6 +905,8 @@ static int task_download_file(download_task_t *dt){
     }
     if (dt->localexists && dt->localsize>=PSYNC_MIN_SIZE_FOR_CHECKSUMS)
       oldfiles[oldcnt++]=dt->localname;
+    if ((tmpother=other_local_copy_of_file(dt)))
+      oldfiles[oldcnt++]=tmpother;
   }
 
   fd=psync_file_open(dt->tmpname, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
@@ -676,7 +925,12 @@ static int task_download_file(download_task_t *dt){
   psync_list_for_each_element(range, &ranges, psync_range_list_t, list){
     if (!range->len)
       continue;
-    if (range->type==PSYNC_RANGE_TRANSFER){
+    if (range->type==PSYNC_RANGE_TRANSFER && range->len>=PSYNC_MIN_SIZE_FOR_PARALLEL_DOWNLOAD){
+      if (parallel_download_range(dt, hosts, requestpath, fd, range->off, range->len, &hashctx, buff) ||
+          unlikely_log(psync_file_seek(fd, range->off+range->len, P_SEEK_SET)==-1))
+        goto err2;
+    }
+    else if (range->type==PSYNC_RANGE_TRANSFER){
       debug(D_NOTICE, "downloading %lu bytes from offset %lu of fileid %lu", (unsigned long)range->len, (unsigned long)range->off, (unsigned long)dt->dwllist.fileid);
       for (i=0; i<hosts->length; i++)
         if ((http=psync_http_connect(hosts->array[i]->str, requestpath, range->off, (range->len==serversize&&range->off==0)?0:(range->len+range->off-1))))
@@ -692,13 +946,7 @@ static int task_download_file(download_task_t *dt){
             unlikely_log(psync_file_writeall_checkoverquota(fd, buff, rd)))
           goto err2;
         psync_hash_update(&hashctx, buff, rd);
-        pthread_mutex_lock(&current_downloads_mutex);
-        psync_status.bytesdownloaded+=rd;
-        if (current_downloads_waiters && psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded<=PSYNC_START_NEW_DOWNLOADS_TRESHOLD)
-          pthread_cond_signal(&current_downloads_cond);
-        pthread_mutex_unlock(&current_downloads_mutex);
-        psync_send_status_update();
-        dt->downloadedsize+=rd;
+        account_downloaded_bytes(dt, rd);
         if (unlikely(!psync_statuses_ok_array(requiredstatuses, ARRAY_SIZE(requiredstatuses))))
           goto err2;
       }
@@ -728,13 +976,7 @@ static int task_download_file(download_task_t *dt){
         }
         result-=rd;
         psync_hash_update(&hashctx, buff, rd);
-        pthread_mutex_lock(&current_downloads_mutex);
-        psync_status.bytesdownloaded+=rd;
-        if (current_downloads_waiters && psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded<=PSYNC_START_NEW_DOWNLOADS_TRESHOLD)
-          pthread_cond_signal(&current_downloads_cond);
-        pthread_mutex_unlock(&current_downloads_mutex);
-        psync_send_status_update();
-        dt->downloadedsize+=rd;
+        account_downloaded_bytes(dt, rd);
       }
       psync_file_close(ifd);
     }
@@ -777,6 +1019,7 @@ static int task_download_file(download_task_t *dt){
     psync_file_delete(tmpold);
     psync_free(tmpold);
   }
+  psync_free(tmpother);
   psync_free(res);
   return 0;
 err2:
@@ -793,6 +1036,7 @@ err0:
     psync_file_delete(tmpold);
     psync_free(tmpold);
   }
+  psync_free(tmpother);
   psync_free(res);
   return -1;
 }
@@ -951,8 +1195,7 @@ static void free_task_timer_thread(void *ptr){
 }
 
 static void free_task_timer(psync_timer_t timer, void *ptr){
-  psync_timer_stop(timer);
-  psync_run_thread1("free task", free_task_timer_thread, ptr);
+  psync_run_pool1(PSYNC_POOL_CPU, "free task", free_task_timer_thread, ptr);
 }
 
 static void handle_async_error(download_task_t *dt, psync_async_result_t *res){
@@ -975,7 +1218,7 @@ static void handle_async_error(download_task_t *dt, psync_async_result_t *res){
     psync_status_recalc_to_download_async();
   }
   else
-    psync_timer_register(free_task_timer, 1, dt);
+    psync_timer_oneshot_ms(free_task_timer, 1000, dt);
 }
 
 #if defined(P_OS_WINDOWS)
@@ -1005,15 +1248,21 @@ static void rename_create_thread(void *ptr){
 }
 
 static void rename_create_timer(psync_timer_t timer, void *ptr){
-  psync_timer_stop(timer);
-  psync_run_thread1("small file dwl db ins", rename_create_thread, ptr);
+  psync_run_pool1(PSYNC_POOL_CPU, "small file dwl db ins", rename_create_thread, ptr);
 }
 
 #endif
 
+static void task_run_download_file_thread(void *ptr);
+
 static void finish_async_download(void *ptr, psync_async_result_t *res){
   download_task_t *dt=(download_task_t *)ptr;
-  if (res->error)
+  if (res->errorflags&PSYNC_ASYNC_ERR_FLAG_UNSUPPORTED){
+    /* chunked downloads may be unknown to the server, the regular download works everywhere */
+    debug(D_NOTICE, "chunked download of %s failed, downloading it the regular way", dt->localname);
+    psync_run_thread1("download file", task_run_download_file_thread, dt);
+  }
+  else if (res->error)
     handle_async_error(dt, res);
   else{
     if (dt->dwllist.stop==2){
@@ -1026,10 +1275,10 @@ static void finish_async_download(void *ptr, psync_async_result_t *res){
     ard=psync_new(async_res_dt_t);
     memcpy(&ard->res, res, sizeof(psync_async_result_t));
     ard->dt=dt;
-    psync_timer_register(rename_create_timer, 2, ard);
+    psync_timer_oneshot_ms(rename_create_timer, 2000, ard);
 #else
     if (rename_and_create_local(dt, res->file.sha1hex, res->file.size, res->file.hash))
-      psync_timer_register(free_task_timer, 1, dt);
+      psync_timer_oneshot_ms(free_task_timer, 1000, dt);
     else{
       delete_task(dt->taskid);
       psync_path_status_sync_folder_task_completed(dt->dwllist.syncid, dt->localfolderid);
@@ -1045,7 +1294,7 @@ static void finish_async_download_existing_not_mod(download_task_t *dt, psync_as
   if (stat_and_create_local(dt->dwllist.syncid, dt->dwllist.fileid, dt->localfolderid, dt->filename, dt->localname,
                             res->file.sha1hex, res->file.size, res->file.hash)){
     debug(D_WARNING, "stat_and_create_local failed for %s", dt->localname);
-    psync_timer_register(free_task_timer, 1, dt);
+    psync_timer_oneshot_ms(free_task_timer, 1000, dt);
   }
   else{
     delete_task(dt->taskid);
@@ -1213,11 +1462,15 @@ static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_
   }
   dt->lock=lock;
   set_task_inprogress(taskid, 1);
-  if (size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD){
+  /* files that exist locally and are not small are better served by the checksum based download of changed blocks */
+  if (size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD ||
+      (size<=PSYNC_MAX_SIZE_FOR_ASYNC_CHUNKED_DOWNLOAD && !dt->localexists && psync_async_chunked_download_supported())){
     if (dt->localexists)
       ret=psync_async_download_file_if_changed(fileid, dt->tmpname, csize, dt->checksum, finish_async_download_existing, dt);
-    else
+    else if (size<=PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD)
       ret=psync_async_download_file(fileid, dt->tmpname, finish_async_download, dt);
+    else
+      ret=psync_async_download_file_chunked(fileid, dt->tmpname, finish_async_download, dt);
     if (ret){
       debug(D_WARNING, "async download start failed for %s", dt->localname);
       free_download_task(dt);
@@ -1354,43 +1607,44 @@ static int download_task(uint64_t taskid, uint32_t type, psync_syncid_t syncid,
   return res;
 }
 
+static void download_task_completed(psync_task_t *task){
+  if (task->type==PSYNC_DOWNLOAD_FILE){
+    psync_status_recalc_to_download_async();
+    psync_path_status_sync_folder_task_completed(task->syncid, task->localitemid);
+  }
+}
+
 static void download_thread(){
-  psync_variant *row;
-  uint64_t taskid;
-  uint32_t type;
+  psync_task_t *task;
   while (psync_do_run){
+    /* finished tasks are deleted in batches, they must not stay in the task table (and counted as pending) while we block */
+    if (!psync_statuses_ok_array(requiredstatuses, ARRAY_SIZE(requiredstatuses)))
+      psync_task_queue_flush(PSYNC_TASK_DOWNLOAD);
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
 
-    row=psync_sql_row("SELECT id, type, syncid, itemid, localitemid, newitemid, name, newsyncid FROM task WHERE "
-                      "inprogress=0 AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_DOWNLOAD)" ORDER BY id LIMIT 1");
-    if (row){
-      taskid=psync_get_number(row[0]);
-      type=psync_get_number(row[1]);
-      if (!download_task(taskid, type,
-                         psync_get_number_or_null(row[2]),
-                         psync_get_number(row[3]),
-                         psync_get_number(row[4]),
-                         psync_get_number_or_null(row[5]),
-                         psync_get_string_or_null(row[6]),
-                         psync_get_number_or_null(row[7]))){
-        delete_task(taskid);
-        if (type==PSYNC_DOWNLOAD_FILE){
-          psync_status_recalc_to_download_async();
-          psync_path_status_sync_folder_task_completed(psync_get_number(row[2]), psync_get_number(row[4]));
-        }
+    task=psync_task_queue_get(PSYNC_TASK_DOWNLOAD);
+    if (task){
+      if (!download_task(task->id, task->type, task->syncid, task->itemid, task->localitemid, task->newitemid, task->name, task->newsyncid)){
+        psync_task_queue_done(PSYNC_TASK_DOWNLOAD, task);
+        continue;
       }
-      else if (type!=PSYNC_DOWNLOAD_FILE)
+      else if (task->type!=PSYNC_DOWNLOAD_FILE){
         psync_milisleep(PSYNC_SLEEP_ON_FAILED_DOWNLOAD);
-      psync_free(row);
+        psync_task_queue_retry(PSYNC_TASK_DOWNLOAD);
+      }
+      psync_free(task);
       continue;
     }
 
+    psync_task_queue_flush(PSYNC_TASK_DOWNLOAD);
     pthread_mutex_lock(&download_mutex);
     if (!download_wakes)
       pthread_cond_wait(&download_cond, &download_mutex);
     download_wakes=0;
     pthread_mutex_unlock(&download_mutex);
   }
+  /* otherwise the tasks done since the last flush are run again on the next start */
+  psync_task_queue_flush(PSYNC_TASK_DOWNLOAD);
 }
 
 void psync_wake_download(){
@@ -1401,6 +1655,7 @@ void psync_wake_download(){
 }
 
 void psync_download_init(){
+  psync_task_queue_init(PSYNC_TASK_DOWNLOAD, download_task_completed);
   psync_timer_exception_handler(psync_wake_download);
   psync_run_thread("download main", download_thread);
 }
@@ -1420,8 +1675,10 @@ void psync_delete_download_tasks_for_file(psync_fileid_t fileid, psync_syncid_t
   psync_sql_run(res);
   aff=psync_sql_affected_rows();
   psync_sql_free_result(res);
-  if (aff)
+  if (aff){
+    psync_task_queue_invalidate(PSYNC_TASK_DOWNLOAD);
     psync_status_recalc_to_download_async();
+  }
   if (deltemp)
     deltemp=2;
   else
@@ -1448,6 +1705,7 @@ void psync_stop_sync_download(psync_syncid_t syncid){
   res=psync_sql_prep_statement("DELETE FROM task WHERE syncid=? AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_DOWNLOAD));
   psync_sql_bind_uint(res, 1, syncid);
   psync_sql_run_free(res);
+  psync_task_queue_invalidate(PSYNC_TASK_DOWNLOAD);
   psync_status_recalc_to_download_async();
   pthread_mutex_lock(&current_downloads_mutex);
   psync_list_for_each_element(dwl, &downloads, download_list_t, list)
@@ -0,0 +1,368 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "pfileio.h"
+#include "plibs.h"
+#include "psettings.h"
+
+#if defined(P_OS_LINUX)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define P_HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#endif
+
+#if defined(P_HAS_IO_URING)
+
+/* every ring keeps a copy of the registered files, it is only touched with the mutex of the ring held, which is also held for the
+ * whole duration of a batch, so the kernel never sees the table change under running operations. Buffers are not registered, as
+ * that pins and faults in all of their memory for as long as they stay registered. */
+typedef struct {
+  pthread_mutex_t mutex;
+  int fd;
+  unsigned entries;
+  unsigned *sqhead;
+  unsigned *sqtail;
+  unsigned *sqmask;
+  unsigned *sqarray;
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqring;
+  void *cqring;
+  size_t sqringsize;
+  size_t cqringsize;
+  size_t sqessize;
+  uint32_t filecnt;
+  psync_file_t files[PSYNC_FILEIO_MAX_FILES];
+} fileio_ring_t;
+
+static pthread_mutex_t fileio_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_file_t reg_files[PSYNC_FILEIO_MAX_FILES];
+static uint32_t reg_files_cnt=0;
+
+static fileio_ring_t rings[PSYNC_FILEIO_RINGS];
+static uint32_t ring_cnt=0;
+static uint32_t ring_next=0;
+
+static void fileio_ring_close(fileio_ring_t *r){
+  if (r->sqes)
+    munmap(r->sqes, r->sqessize);
+  if (r->cqring && r->cqring!=r->sqring)
+    munmap(r->cqring, r->cqringsize);
+  if (r->sqring)
+    munmap(r->sqring, r->sqringsize);
+  close(r->fd);
+  r->sqes=NULL;
+  r->sqring=r->cqring=NULL;
+  r->fd=-1;
+  r->filecnt=0;
+}
+
+static int fileio_ring_open(fileio_ring_t *r){
+  struct io_uring_params p;
+  char *sq, *cq;
+  memset(&p, 0, sizeof(p));
+  r->fd=syscall(__NR_io_uring_setup, PSYNC_FILEIO_RING_ENTRIES, &p);
+  if (r->fd<0){
+    debug(D_NOTICE, "io_uring_setup failed with errno %d", (int)errno);
+    r->fd=-1;
+    return -1;
+  }
+  r->sqes=NULL;
+  r->sqring=r->cqring=NULL;
+  r->sqringsize=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  r->cqringsize=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  r->sqessize=p.sq_entries*sizeof(struct io_uring_sqe);
+#if defined(IORING_FEAT_SINGLE_MMAP)
+  if (p.features&IORING_FEAT_SINGLE_MMAP){
+    if (r->cqringsize>r->sqringsize)
+      r->sqringsize=r->cqringsize;
+    r->cqringsize=r->sqringsize;
+  }
+#endif
+  sq=(char *)mmap(NULL, r->sqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (unlikely_log(sq==MAP_FAILED))
+    goto err0;
+  r->sqring=sq;
+#if defined(IORING_FEAT_SINGLE_MMAP)
+  if (p.features&IORING_FEAT_SINGLE_MMAP)
+    cq=sq;
+  else
+#endif
+  {
+    cq=(char *)mmap(NULL, r->cqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (unlikely_log(cq==MAP_FAILED))
+      goto err0;
+  }
+  r->cqring=cq;
+  r->sqes=(struct io_uring_sqe *)mmap(NULL, r->sqessize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (unlikely_log(r->sqes==MAP_FAILED)){
+    r->sqes=NULL;
+    goto err0;
+  }
+  r->sqhead=(unsigned *)(sq+p.sq_off.head);
+  r->sqtail=(unsigned *)(sq+p.sq_off.tail);
+  r->sqmask=(unsigned *)(sq+p.sq_off.ring_mask);
+  r->sqarray=(unsigned *)(sq+p.sq_off.array);
+  r->cqhead=(unsigned *)(cq+p.cq_off.head);
+  r->cqtail=(unsigned *)(cq+p.cq_off.tail);
+  r->cqmask=(unsigned *)(cq+p.cq_off.ring_mask);
+  r->cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+  r->entries=p.sq_entries;
+  r->filecnt=0;
+  return 0;
+err0:
+  fileio_ring_close(r);
+  return -1;
+}
+
+static void fileio_ring_set_files(fileio_ring_t *r){
+  if (r->filecnt)
+    syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_FILES, NULL, 0);
+  r->filecnt=0;
+  if (!reg_files_cnt)
+    return;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, reg_files, reg_files_cnt)){
+    debug(D_NOTICE, "registering %u files failed with errno %d", (unsigned)reg_files_cnt, (int)errno);
+    return;
+  }
+  memcpy(r->files, reg_files, sizeof(psync_file_t)*reg_files_cnt);
+  r->filecnt=reg_files_cnt;
+}
+
+static void fileio_update_rings(){
+  uint32_t i;
+  for (i=0; i<ring_cnt; i++){
+    pthread_mutex_lock(&rings[i].mutex);
+    if (rings[i].fd!=-1)
+      fileio_ring_set_files(&rings[i]);
+    pthread_mutex_unlock(&rings[i].mutex);
+  }
+}
+
+static fileio_ring_t *fileio_get_ring(){
+  fileio_ring_t *r;
+  uint32_t i, start;
+  start=ring_next++;
+  for (i=0; i<ring_cnt; i++){
+    r=&rings[(start+i)%ring_cnt];
+    if (!pthread_mutex_trylock(&r->mutex)){
+      if (likely(r->fd!=-1))
+        return r;
+      pthread_mutex_unlock(&r->mutex);
+    }
+  }
+  return NULL;
+}
+
+/* submits cnt<=r->entries operations with one io_uring_enter() and waits for all of them, returns -1 if the ring failed and was
+ * closed, operations that did not complete are then left with ret of -1 */
+static int fileio_ring_submit(fileio_ring_t *r, int write, psync_file_io_t *ios, unsigned cnt){
+  struct iovec iov[PSYNC_FILEIO_RING_ENTRIES];
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  psync_file_t fd;
+  unsigned i, j, tail, head, idx, submitted, done;
+  int fidx, ret;
+  fd=INVALID_HANDLE_VALUE;
+  fidx=-1;
+  tail=*r->sqtail;
+  for (i=0; i<cnt; i++){
+    if (ios[i].fd!=fd){
+      fd=ios[i].fd;
+      fidx=-1;
+      for (j=0; j<r->filecnt; j++)
+        if (r->files[j]==fd){
+          fidx=j;
+          break;
+        }
+    }
+    idx=tail&*r->sqmask;
+    sqe=&r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    iov[i].iov_base=ios[i].buf;
+    iov[i].iov_len=ios[i].count;
+    sqe->opcode=write?IORING_OP_WRITEV:IORING_OP_READV;
+    sqe->addr=(uintptr_t)&iov[i];
+    sqe->len=1;
+    if (fidx!=-1){
+      sqe->fd=fidx;
+      sqe->flags=IOSQE_FIXED_FILE;
+    }
+    else
+      sqe->fd=fd;
+    sqe->off=ios[i].offset;
+    sqe->user_data=i;
+    r->sqarray[idx]=idx;
+    tail++;
+  }
+  __atomic_store_n(r->sqtail, tail, __ATOMIC_RELEASE);
+  submitted=done=0;
+  while (done<cnt){
+    ret=syscall(__NR_io_uring_enter, r->fd, cnt-submitted, cnt-done, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (unlikely(ret<0)){
+      if (errno==EINTR)
+        continue;
+      debug(D_ERROR, "io_uring_enter failed with errno %d, closing ring", (int)errno);
+      fileio_ring_close(r);
+      return -1;
+    }
+    submitted+=ret;
+    head=*r->cqhead;
+    while (head!=__atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)){
+      cqe=&r->cqes[head&*r->cqmask];
+      if (likely(cqe->user_data<cnt))
+        ios[cqe->user_data].ret=cqe->res;
+      done++;
+      head++;
+    }
+    __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+#endif
+
+/* finishes what the ring did not do, short transfers are continued and failed operations retried, so the result and errno are
+ * the same as from the blocking calls */
+static int fileio_complete(int write, psync_file_io_t *io){
+  size_t done;
+  ssize_t ret;
+  if (likely(io->ret==(ssize_t)io->count))
+    return 0;
+  done=io->ret>0?io->ret:0;
+  ret=0;
+  while (done<io->count){
+    if (write)
+      ret=psync_file_pwrite(io->fd, (char *)io->buf+done, io->count-done, io->offset+done);
+    else
+      ret=psync_file_pread(io->fd, (char *)io->buf+done, io->count-done, io->offset+done);
+    if (ret<=0)
+      break;
+    done+=ret;
+  }
+  if (done==io->count){
+    io->ret=done;
+    return 0;
+  }
+  io->ret=(done || ret==0)?(ssize_t)done:-1;
+  return -1;
+}
+
+static int fileio_batch(int write, psync_file_io_t *ios, size_t cnt){
+#if defined(P_HAS_IO_URING)
+  fileio_ring_t *r;
+#endif
+  size_t i;
+  int ret;
+  for (i=0; i<cnt; i++)
+    ios[i].ret=-1;
+#if defined(P_HAS_IO_URING)
+  /* a single operation is not worth the ring */
+  if (cnt>1 && (r=fileio_get_ring())){
+    for (i=0; i<cnt; i+=r->entries)
+      if (fileio_ring_submit(r, write, ios+i, cnt-i>r->entries?r->entries:cnt-i))
+        break;
+    pthread_mutex_unlock(&r->mutex);
+  }
+#endif
+  ret=0;
+  for (i=0; i<cnt; i++)
+    if (fileio_complete(write, &ios[i]))
+      ret=-1;
+  return ret;
+}
+
+void psync_fileio_init(){
+#if defined(P_HAS_IO_URING)
+  uint32_t i;
+  pthread_mutex_lock(&fileio_mutex);
+  if (!ring_cnt && psync_setting_get_bool(_PS(fsiouring))){
+    for (i=0; i<PSYNC_FILEIO_RINGS; i++){
+      if (fileio_ring_open(&rings[i]))
+        break;
+      pthread_mutex_init(&rings[i].mutex, NULL);
+    }
+    ring_cnt=i;
+    debug(D_NOTICE, "using %u io_uring instances for file I/O", (unsigned)ring_cnt);
+  }
+  pthread_mutex_unlock(&fileio_mutex);
+#endif
+}
+
+int psync_fileio_register_file(psync_file_t fd){
+#if defined(P_HAS_IO_URING)
+  uint32_t i;
+  pthread_mutex_lock(&fileio_mutex);
+  for (i=0; i<reg_files_cnt; i++)
+    if (reg_files[i]==fd){
+      pthread_mutex_unlock(&fileio_mutex);
+      return 0;
+    }
+  if (!ring_cnt || reg_files_cnt==PSYNC_FILEIO_MAX_FILES){
+    pthread_mutex_unlock(&fileio_mutex);
+    return -1;
+  }
+  reg_files[reg_files_cnt++]=fd;
+  fileio_update_rings();
+  pthread_mutex_unlock(&fileio_mutex);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+void psync_fileio_unregister_file(psync_file_t fd){
+#if defined(P_HAS_IO_URING)
+  uint32_t i;
+  pthread_mutex_lock(&fileio_mutex);
+  for (i=0; i<reg_files_cnt; i++)
+    if (reg_files[i]==fd){
+      memmove(&reg_files[i], &reg_files[i+1], sizeof(psync_file_t)*(reg_files_cnt-i-1));
+      reg_files_cnt--;
+      fileio_update_rings();
+      break;
+    }
+  pthread_mutex_unlock(&fileio_mutex);
+#endif
+}
+
+int psync_file_pread_batch(psync_file_io_t *ios, size_t cnt){
+  return fileio_batch(0, ios, cnt);
+}
+
+int psync_file_pwrite_batch(psync_file_io_t *ios, size_t cnt){
+  return fileio_batch(1, ios, cnt);
+}
@@ -0,0 +1,57 @@
+/* Copyright (c) 2016 Anton Titov.
+ * Copyright (c) 2016 pCloud Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PSYNC_FILEIO_H
+#define _PSYNC_FILEIO_H
+
+#include "pcompat.h"
+
+/* Batched positional reads and writes. On Linux the batch is submitted to an io_uring with a single system call, elsewhere,
+ * when io_uring is not available or disabled with the fsiouring setting, every operation goes through psync_file_pread() or
+ * psync_file_pwrite(). Files that are used often (the cache files) can be registered with the rings, which saves the kernel the
+ * file lookup of every operation.
+ */
+
+/* operations of a batch can go to different files, which on io_uring also runs them on different devices in parallel */
+typedef struct {
+  void *buf;
+  size_t count;
+  uint64_t offset;
+  ssize_t ret; /* set by the batch functions to what psync_file_pread()/psync_file_pwrite() would return */
+  psync_file_t fd;
+} psync_file_io_t;
+
+void psync_fileio_init();
+
+int psync_fileio_register_file(psync_file_t fd);
+void psync_fileio_unregister_file(psync_file_t fd);
+
+/* both return 0 if all operations transferred count bytes and -1 otherwise */
+int psync_file_pread_batch(psync_file_io_t *ios, size_t cnt);
+int psync_file_pwrite_batch(psync_file_io_t *ios, size_t cnt);
+
+#endif
@@ -698,7 +698,7 @@ pfolder_list_t *psync_list_remote_folder(psync_folderid_t folderid, psync_listty
   uint64_t perms;
   list=folder_list_init();
   if (listtype&PLIST_FOLDERS){
-    res=psync_sql_query_rdlock("SELECT id, permissions, name, userid, flags FROM folder WHERE parentfolderid=? ORDER BY name");
+    res=psync_sql_query_readonly("SELECT id, permissions, name, userid, flags FROM folder WHERE parentfolderid=? ORDER BY name");
     psync_sql_bind_uint(res, 1, folderid);
     while ((row=psync_sql_fetch_row(res))){
       entry.folder.folderid=psync_get_number(row[0]);
@@ -715,7 +715,7 @@ pfolder_list_t *psync_list_remote_folder(psync_folderid_t folderid, psync_listty
     psync_sql_free_result(res);
   }
   if (listtype&PLIST_FILES){
-    res=psync_sql_query_rdlock("SELECT id, size, name FROM file WHERE parentfolderid=? ORDER BY name");
+    res=psync_sql_query_readonly("SELECT id, size, name FROM file WHERE parentfolderid=? ORDER BY name");
     psync_sql_bind_uint(res, 1, folderid);
     while ((row=psync_sql_fetch_row(res))){
       entry.file.fileid=psync_get_number(row[0]);
@@ -28,8 +28,15 @@
 #define FUSE_USE_VERSION 26
 #define _FILE_OFFSET_BITS 64
 
+#if defined(P_OS_LINUX)
+#define PSYNC_FS_LOWLEVEL 1
+#endif
+
 #include <pthread.h>
 #include <fuse.h>
+#if defined(PSYNC_FS_LOWLEVEL)
+#include <fuse_lowlevel.h>
+#endif
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
@@ -61,6 +68,10 @@
 typedef off_t fuse_off_t;
 #endif
 
+#if !defined(PSYNC_FS_LOWLEVEL)
+struct fuse_bufvec;
+#endif
+
 #if defined(P_OS_POSIX)
 #include <signal.h>
 #endif
@@ -81,6 +92,7 @@ typedef off_t fuse_off_t;
 
 #define FS_BLOCK_SIZE 4096
 #define FS_MAX_WRITE  16*1024*1024
+#define FS_MAX_READ   FS_MAX_WRITE
 
 #if defined(P_OS_MACOSX)
 #define FS_MAX_ACCEPTABLE_FILENAME_LEN 255
@@ -104,7 +116,11 @@ typedef off_t fuse_off_t;
 #endif
 
 static struct fuse_chan *psync_fuse_channel=NULL;
+#if defined(PSYNC_FS_LOWLEVEL)
+static struct fuse_session *psync_fuse_session=NULL;
+#else
 static struct fuse *psync_fuse=NULL;
+#endif
 static char *psync_current_mountpoint=NULL;
 static psync_generic_callback_t psync_start_callback=NULL;
 char *psync_fake_prefix=NULL;
@@ -122,7 +138,12 @@ static gid_t mygid=0;
 
 static psync_tree *openfiles=PSYNC_TREE_EMPTY;
 
+static pthread_mutex_t wbuf_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint64_t wbuf_total=0;
+
 static int psync_fs_ftruncate_of_locked(psync_openfile_t *of, fuse_off_t size);
+static int psync_fs_wbuf_flush_locked(psync_openfile_t *of);
+static int psync_fs_wbuf_release_locked(psync_openfile_t *of);
 
 static void delete_log_files(psync_openfile_t *of){
   char fileidhex[sizeof(psync_fsfileid_t)*2+2];
@@ -303,6 +324,46 @@ int psync_fs_rename_openfile_locked(psync_fsfileid_t fileid, psync_fsfolderid_t
   return 0;
 }
 
+uint32_t psync_fs_get_readahead_stats(psync_fsfileid_t fileid, psync_fs_readahead_stats_t *stats, uint32_t cnt){
+  psync_openfile_t *fl;
+  psync_file_stream_t *st;
+  psync_tree *tr;
+  int64_t d;
+  time_t ctime;
+  uint32_t i, ret;
+  ret=0;
+  ctime=psync_timer_time();
+  psync_sql_rdlock();
+  tr=openfiles;
+  while (tr){
+    d=fileid-psync_tree_element(tr, psync_openfile_t, tree)->fileid;
+    if (d<0)
+      tr=tr->left;
+    else if (d>0)
+      tr=tr->right;
+    else{
+      fl=psync_tree_element(tr, psync_openfile_t, tree);
+      psync_fs_lock_file(fl);
+      for (i=0; i<PSYNC_FS_FILESTREAMS_CNT && ret<cnt; i++){
+        st=&fl->streams[i];
+        if (!st->lastuse || st->lastuse<ctime-30)
+          continue;
+        stats[ret].offset=(st->topage+1)*PSYNC_FS_PAGE_SIZE;
+        stats[ret].readrate=st->readrate;
+        stats[ret].netrate=st->netrate;
+        stats[ret].window=st->window;
+        stats[ret].rttms=st->rttms;
+        stats[ret].requests=st->requests;
+        ret++;
+      }
+      pthread_mutex_unlock(&fl->mutex);
+      break;
+    }
+  }
+  psync_sql_rdunlock();
+  return ret;
+}
+
 static int psync_fs_relock_fileid(psync_fsfileid_t fileid){
   psync_openfile_t *fl;
   psync_tree *tr;
@@ -656,7 +717,7 @@ static int psync_creat_static_to_file_stat(psync_fstask_creat_t *cr, struct FUSE
   psync_fstask_local_creat_t *lc;
   lc=psync_fstask_creat_get_local(cr);
   memset(stbuf, 0, sizeof(struct FUSE_STAT));
-  stbuf->st_ino=cr->taskid;
+  stbuf->st_ino=taskid_to_inode(cr->taskid);
 #ifdef FUSE_STAT_HAS_BIRTHTIME
   stbuf->st_birthtime=lc->ctime;
 #endif
@@ -702,7 +763,7 @@ int psync_fs_crypto_err_to_errno(int cryptoerr){
 static int psync_fs_getrootattr(struct FUSE_STAT *stbuf){
   psync_sql_res *res;
   psync_variant_row row;
-  res=psync_sql_query_rdlock("SELECT 0, 0, IFNULL(s.value, 1414766136)*1, f.mtime, f.subdircnt FROM folder f LEFT JOIN setting s ON s.id='registered' WHERE f.id=0");
+  res=psync_sql_query_readonly("SELECT 0, 0, IFNULL(s.value, 1414766136)*1, f.mtime, f.subdircnt FROM folder f LEFT JOIN setting s ON s.id='registered' WHERE f.id=0");
   if ((row=psync_sql_fetch_row(res)))
     psync_row_to_folder_stat(row, stbuf);
   psync_sql_free_result(res);
@@ -769,7 +830,7 @@ static int psync_fs_getattr(const char *path, struct FUSE_STAT *stbuf){
     }
   }
   if (!folder || !psync_fstask_find_rmdir(folder, fpath->name, 0)){
-    res=psync_sql_query_nolock("SELECT id, permissions, ctime, mtime, subdircnt FROM folder WHERE parentfolderid=? AND name=?");
+    res=psync_sql_query_readonly("SELECT id, permissions, ctime, mtime, subdircnt FROM folder WHERE parentfolderid=? AND name=?");
     psync_sql_bind_uint(res, 1, fpath->folderid);
     psync_sql_bind_string(res, 2, fpath->name);
     if ((row=psync_sql_fetch_row(res)))
@@ -781,7 +842,7 @@ static int psync_fs_getattr(const char *path, struct FUSE_STAT *stbuf){
       return 0;
     }
   }
-  res=psync_sql_query_nolock("SELECT name, size, ctime, mtime, id FROM file WHERE parentfolderid=? AND name=?");
+  res=psync_sql_query_readonly("SELECT name, size, ctime, mtime, id FROM file WHERE parentfolderid=? AND name=?");
   psync_sql_bind_uint(res, 1, fpath->folderid);
   psync_sql_bind_string(res, 2, fpath->name);
   if ((row=psync_sql_fetch_row(res)))
@@ -857,7 +918,7 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, "..", NULL, 0);
   folder=psync_fstask_get_folder_tasks_rdlocked(folderid);
   if (folderid>=0){
-    res=psync_sql_query_nolock("SELECT id, permissions, ctime, mtime, subdircnt, name FROM folder WHERE parentfolderid=?");
+    res=psync_sql_query_readonly("SELECT id, permissions, ctime, mtime, subdircnt, name FROM folder WHERE parentfolderid=?");
     psync_sql_bind_uint(res, 1, folderid);
     while ((row=psync_sql_fetch_row(res))){
       name=psync_get_lstring(row[5], &namelen);
@@ -873,7 +934,7 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       filler_decoded(dec, filler, buf, name, &st, 0);
     }
     psync_sql_free_result(res);
-    res=psync_sql_query_nolock("SELECT name, size, ctime, mtime, id FROM file WHERE parentfolderid=?");
+    res=psync_sql_query_readonly("SELECT name, size, ctime, mtime, id FROM file WHERE parentfolderid=?");
     psync_sql_bind_uint(res, 1, folderid);
     while ((row=psync_sql_fetch_row(res))){
       name=psync_get_lstring(row[0], &namelen);
@@ -1586,6 +1647,9 @@ static void psync_fs_free_openfile(psync_openfile_t *of){
   debug(D_NOTICE, "releasing file %s", of->currentname);
   if (unlikely(of->writetimer!=PSYNC_INVALID_TIMER))
     debug(D_BUG, "file %s with active timer is set to free, this is not supposed to happen", of->currentname);
+  if (unlikely(of->wbuflen))
+    debug(D_BUG, "file %s with buffered writes is set to free, this is not supposed to happen", of->currentname);
+  psync_fs_wbuf_release_locked(of);
   if (of->deleted && of->fileid<0){
     psync_sql_res *res;
     debug(D_NOTICE, "file %s marked for deletion, releasing cancel tasks", of->currentname);
@@ -1707,7 +1771,6 @@ static void psync_fs_write_timer(psync_timer_t timer, void *ptr){
   psync_openfile_t *of;
   of=(psync_openfile_t *)ptr;
   psync_fs_lock_file(of);
-  psync_timer_stop(timer);
   of->writetimer=PSYNC_INVALID_TIMER;
   debug(D_NOTICE, "got write timer for file %s", of->currentname);
   if (of->releasedforupload)
@@ -1722,6 +1785,8 @@ static void psync_fs_write_timer(psync_timer_t timer, void *ptr){
       debug(D_WARNING, "we are in timer and we failed to flush crypto file, life sux");
       goto unlock_ex;
     }
+    if (unlikely_log(psync_fs_wbuf_release_locked(of)))
+      goto unlock_ex;
     of->releasedforupload=1;
     ofw=psync_new(psync_openfile_writeid_t);
     ofw->of=of;
@@ -1761,6 +1826,13 @@ static int psync_fs_flush(const char *path, struct fuse_file_info *fi){
         return ret;
       }
     }
+    else{
+      ret=psync_fs_wbuf_release_locked(of);
+      if (unlikely_log(ret)){
+        pthread_mutex_unlock(&of->mutex);
+        return ret;
+      }
+    }
     of->releasedforupload=1;
     if (of->writetimer && !psync_timer_stop(of->writetimer)){
       if (--of->refcnt==0){
@@ -1819,6 +1891,13 @@ static int psync_fs_fsync(const char *path, int datasync, struct fuse_file_info
       return ret;
     }
   }
+  else{
+    ret=psync_fs_wbuf_release_locked(of);
+    if (unlikely_log(ret)){
+      pthread_mutex_unlock(&of->mutex);
+      return ret;
+    }
+  }
   if (unlikely_log(psync_file_sync(of->datafile)) || unlikely_log(!of->newfile && psync_file_sync(of->indexfile))){
     pthread_mutex_unlock(&of->mutex);
     return -EIO;
@@ -1863,13 +1942,9 @@ static int psync_read_staticfile(psync_openfile_t *of, char *buf, uint64_t size,
   return ret;
 }
 
-static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
-  psync_openfile_t *of;
+static void psync_fs_account_read_locked(psync_openfile_t *of, size_t size){
   time_t currenttime;
-  psync_fs_set_thread_name();
-  of=fh_to_openfile(fi->fh);
   currenttime=psync_timer_time();
-  psync_fs_lock_file(of);
   if (of->currentsec==currenttime){
     of->bytesthissec+=size;
     if (of->currentspeed<of->bytesthissec)
@@ -1885,6 +1960,18 @@ static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t of
     of->currentsec=currenttime;
     of->bytesthissec=size;
   }
+}
+
+static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+  psync_openfile_t *of;
+  psync_fs_set_thread_name();
+  of=fh_to_openfile(fi->fh);
+  psync_fs_lock_file(of);
+  if (unlikely(of->wbuflen) && unlikely_log(psync_fs_wbuf_flush_locked(of))){
+    pthread_mutex_unlock(&of->mutex);
+    return -EIO;
+  }
+  psync_fs_account_read_locked(of, size);
   if (of->encrypted){
     if (of->newfile)
       return psync_fs_crypto_read_newfile_locked(of, buf, size, offset);
@@ -1907,6 +1994,47 @@ static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t of
   }
 }
 
+#if defined(PSYNC_FS_LOWLEVEL)
+/*
+ * Replies to reads of unencrypted new files and of locally written ranges of modified files with the data file itself,
+ * so the kernel can splice the data without it passing through our memory. Returns 0 if the regular path is to be used.
+ */
+static int psync_fs_read_zero_copy(fuse_req_t req, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+  struct fuse_bufvec bufv=FUSE_BUFVEC_INIT(size);
+  psync_openfile_t *of;
+  psync_interval_tree_t *itr;
+  of=fh_to_openfile(fi->fh);
+  if (of->encrypted)
+    return 0;
+  psync_fs_lock_file(of);
+  if (!of->modified || of->staticfile || (of->wbuflen && psync_fs_wbuf_flush_locked(of))){
+    pthread_mutex_unlock(&of->mutex);
+    return 0;
+  }
+  if (of->newfile){
+    if (offset>=of->currentsize)
+      size=0;
+    else if (offset+size>of->currentsize)
+      size=of->currentsize-offset;
+  }
+  else{
+    itr=psync_interval_tree_first_interval_containing_or_after(of->writeintervals, offset);
+    if (!itr || itr->from>offset || itr->to<offset+size){
+      pthread_mutex_unlock(&of->mutex);
+      return 0;
+    }
+  }
+  psync_fs_account_read_locked(of, size);
+  bufv.buf[0].size=size;
+  bufv.buf[0].flags=(enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+  bufv.buf[0].fd=of->datafile;
+  bufv.buf[0].pos=offset;
+  fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+  pthread_mutex_unlock(&of->mutex);
+  return 1;
+}
+#endif
+
 static void psync_fs_inc_writeid_locked(psync_openfile_t *of){
   if (unlikely(of->releasedforupload)){
     if (unlikely(psync_sql_trylock())){
@@ -1926,7 +2054,7 @@ static void psync_fs_inc_writeid_locked(psync_openfile_t *of){
   if (of->writetimer==PSYNC_INVALID_TIMER || !psync_timer_stop(of->writetimer)){
     if (of->writetimer==PSYNC_INVALID_TIMER)
       psync_fs_inc_of_refcnt_locked(of);
-    of->writetimer=psync_timer_register(psync_fs_write_timer, PSYNC_UPLOAD_NOWRITE_TIMER, of);
+    of->writetimer=psync_timer_oneshot_ms(psync_fs_write_timer, (uint64_t)PSYNC_UPLOAD_NOWRITE_TIMER*1000, of);
   }
 }
 
@@ -2241,14 +2369,32 @@ static int psync_fs_check_write_space(psync_openfile_t *of, size_t size, fuse_of
   return psync_fs_do_check_write_space(of, size);
 }
 
-static int psync_fs_write_modified(psync_openfile_t *of, const char *buf, size_t size, fuse_off_t offset){
+/* writes either buf or, when it is not NULL, bufv to the data file, the latter is spliced if it comes from a pipe */
+static ssize_t psync_fs_pwrite_data(psync_openfile_t *of, const char *buf, struct fuse_bufvec *bufv, size_t size, fuse_off_t offset){
+#if defined(PSYNC_FS_LOWLEVEL)
+  if (bufv){
+    struct fuse_bufvec dst=FUSE_BUFVEC_INIT(size);
+    ssize_t bw;
+    dst.buf[0].flags=(enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+    dst.buf[0].fd=of->datafile;
+    dst.buf[0].pos=offset;
+    bw=fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags)0);
+    if (unlikely_log(bw<0))
+      return -1;
+    return bw;
+  }
+#endif
+  return psync_file_pwrite(of->datafile, buf, size, offset);
+}
+
+static int psync_fs_write_modified(psync_openfile_t *of, const char *buf, struct fuse_bufvec *bufv, size_t size, fuse_off_t offset){
   psync_fs_index_record rec;
   uint64_t ioff;
   ssize_t bw;
   if (unlikely_log(psync_fs_modfile_check_size_ok(of, offset)))
     return -EIO;
   ioff=of->indexoff++;
-  bw=psync_file_pwrite(of->datafile, buf, size, offset);
+  bw=psync_fs_pwrite_data(of, buf, bufv, size, offset);
   if (unlikely_log(bw==-1))
     return -EIO;
   rec.offset=offset;
@@ -2261,19 +2407,102 @@ static int psync_fs_write_modified(psync_openfile_t *of, const char *buf, size_t
   return bw;
 }
 
-static int psync_fs_write_newfile(psync_openfile_t *of, const char *buf, size_t size, fuse_off_t offset){
+static int psync_fs_write_newfile(psync_openfile_t *of, const char *buf, struct fuse_bufvec *bufv, size_t size, fuse_off_t offset){
   ssize_t bw;
-  bw=psync_file_pwrite(of->datafile, buf, size, offset);
+  bw=psync_fs_pwrite_data(of, buf, bufv, size, offset);
   if (of->currentsize<offset+size && bw!=-1)
     of->currentsize=offset+size;
   return bw;
 }
 
-static int psync_fs_write(const char *path, const char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+/* Has to be called before anything reads the data file of a file with buffered writes, changes its size or its times and
+ * before it is released for upload.
+ */
+static int psync_fs_wbuf_flush_locked(psync_openfile_t *of){
+  uint32_t len;
+  int ret;
+  if (!of->wbuflen)
+    return 0;
+  len=of->wbuflen;
+  of->wbuflen=0;
+  if (of->newfile)
+    ret=psync_fs_write_newfile(of, of->wbuf, NULL, len, of->wbufoff);
+  else
+    ret=psync_fs_write_modified(of, of->wbuf, NULL, len, of->wbufoff);
+  if (unlikely_log(ret!=(int)len))
+    return -EIO;
+  else
+    return 0;
+}
+
+static int psync_fs_wbuf_release_locked(psync_openfile_t *of){
+  int ret;
+  ret=psync_fs_wbuf_flush_locked(of);
+  if (of->wbuf){
+    pthread_mutex_lock(&wbuf_mutex);
+    wbuf_total-=of->wbufalloc;
+    pthread_mutex_unlock(&wbuf_mutex);
+    psync_free(of->wbuf);
+    of->wbuf=NULL;
+    of->wbufalloc=0;
+  }
+  return ret;
+}
+
+/* Returns 1 if the write is buffered, 0 if it is to be written directly (buffered data is written out before that) or a
+ * negative error. Large writes and writes coming from a pipe are not buffered.
+ */
+static int psync_fs_wbuf_write_locked(psync_openfile_t *of, const char *buf, struct fuse_bufvec *bufv, size_t size, fuse_off_t offset){
+  uint64_t bufsize;
+  int ret;
+  if (of->wbuflen){
+    if (!bufv && offset>=of->wbufoff && offset<=of->wbufoff+of->wbuflen && offset+size-of->wbufoff<=of->wbufalloc &&
+        psync_millitime()-of->wbufstarted<PSYNC_FS_WRITE_BUFFER_MAX_MS){
+      memcpy(of->wbuf+(offset-of->wbufoff), buf, size);
+      if (offset+size>of->wbufoff+of->wbuflen)
+        of->wbuflen=offset+size-of->wbufoff;
+      if (of->currentsize<offset+size)
+        of->currentsize=offset+size;
+      return 1;
+    }
+    if ((ret=psync_fs_wbuf_flush_locked(of)))
+      return ret;
+  }
+  if (bufv)
+    return 0;
+  if (!of->wbuf){
+    bufsize=psync_setting_get_uint(_PS(fswritebuffersize));
+    if (size*2>bufsize)
+      return 0;
+    pthread_mutex_lock(&wbuf_mutex);
+    if (wbuf_total+bufsize>psync_setting_get_uint(_PS(fswritebuffertotal))){
+      pthread_mutex_unlock(&wbuf_mutex);
+      return 0;
+    }
+    wbuf_total+=bufsize;
+    pthread_mutex_unlock(&wbuf_mutex);
+    of->wbuf=psync_new_cnt(char, bufsize);
+    of->wbufalloc=bufsize;
+  }
+  else if (size*2>of->wbufalloc)
+    return 0;
+  /* a gap between the old end of a modified file and the write has to be recorded now, as currentsize moves past it */
+  if (!of->newfile && unlikely_log(psync_fs_modfile_check_size_ok(of, offset)))
+    return -EIO;
+  memcpy(of->wbuf, buf, size);
+  of->wbufoff=offset;
+  of->wbuflen=size;
+  of->wbufstarted=psync_millitime();
+  if (of->currentsize<offset+size)
+    of->currentsize=offset+size;
+  return 1;
+}
+
+/* exactly one of buf and bufv is set, bufv is only passed for unencrypted files */
+static int psync_fs_do_write(const char *buf, struct fuse_bufvec *bufv, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
   psync_openfile_t *of;
   int ret;
   psync_fs_set_thread_name();
-//  debug(D_NOTICE, "write to %s of %lu at %lu", path, (unsigned long)size, (unsigned long)offset);
   of=fh_to_openfile(fi->fh);
   psync_fs_lock_file(of);
   ret=psync_fs_check_write_space(of, size, offset);
@@ -2284,13 +2513,13 @@ retry:
   if (of->newfile){
     if (of->encrypted)
       return psync_fs_crypto_write_newfile_locked(of, buf, size, offset);
-    else
-      ret=psync_fs_write_newfile(of, buf, size, offset);
+    ret=psync_fs_wbuf_write_locked(of, buf, bufv, size, offset);
+    if (ret==1)
+      ret=size;
+    else if (!ret && unlikely_log((ret=psync_fs_write_newfile(of, buf, bufv, size, offset))==-1))
+      ret=-EIO;
     pthread_mutex_unlock(&of->mutex);
-    if (unlikely_log(ret==-1))
-      return -EIO;
-    else
-      return ret;
+    return ret;
   }
   else{
     if (unlikely(!of->modified)){
@@ -2315,14 +2544,48 @@ retry:
           return ret;
         }
       }
-      else
-        ret=psync_fs_write_modified(of, buf, size, offset);
+      ret=psync_fs_wbuf_write_locked(of, buf, bufv, size, offset);
+      if (ret==1)
+        ret=size;
+      else if (!ret)
+        ret=psync_fs_write_modified(of, buf, bufv, size, offset);
     }
     pthread_mutex_unlock(&of->mutex);
     return ret;
   }
 }
 
+#if !defined(PSYNC_FS_LOWLEVEL)
+static int psync_fs_write(const char *path, const char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+//  debug(D_NOTICE, "write to %s of %lu at %lu", path, (unsigned long)size, (unsigned long)offset);
+  return psync_fs_do_write(buf, NULL, size, offset, fi);
+}
+#else
+static int psync_fs_write_buf(struct fuse_bufvec *bufv, fuse_off_t offset, struct fuse_file_info *fi){
+  struct fuse_bufvec dst;
+  char *buf;
+  size_t size;
+  ssize_t br;
+  int ret;
+  size=fuse_buf_size(bufv);
+  if (bufv->count==1 && !(bufv->buf[0].flags&FUSE_BUF_IS_FD))
+    return psync_fs_do_write((const char *)bufv->buf[0].mem, NULL, size, offset, fi);
+  if (!fh_to_openfile(fi->fh)->encrypted)
+    return psync_fs_do_write(NULL, bufv, size, offset, fi);
+  /* encrypted data has to pass through memory anyway */
+  buf=psync_new_cnt(char, size);
+  dst=FUSE_BUFVEC_INIT(size);
+  dst.buf[0].mem=buf;
+  br=fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags)0);
+  if (unlikely_log(br<0))
+    ret=br;
+  else
+    ret=psync_fs_do_write(buf, NULL, br, offset, fi);
+  psync_free(buf);
+  return ret;
+}
+#endif
+
 static int psync_fs_mkdir(const char *path, mode_t mode){
   psync_fspath_t *fpath;
   int ret;
@@ -2783,6 +3046,10 @@ static int psync_fs_set_filetime_locked(psync_fsfileid_t fileid, const struct ti
     filename=psync_strcat(cachepath, PSYNC_DIRECTORY_SEPARATOR, fileidhex, NULL);
     if (fl && fl->datafile!=INVALID_HANDLE_VALUE){
       debug(D_NOTICE, "found open file for file id %ld", (long)fl->fileid);
+      /* a later write of buffered data would change the time again */
+      psync_fs_lock_file(fl);
+      psync_fs_wbuf_flush_locked(fl);
+      pthread_mutex_unlock(&fl->mutex);
       if (crtime)
         ret=psync_set_crtime_mtime_by_fd(fl->datafile, filename, tv->tv_sec, 0);
       else
@@ -2910,6 +3177,8 @@ static int psync_fs_ftruncate_of_locked(psync_openfile_t *of, fuse_off_t size){
     debug(D_NOTICE, "not truncating as size is already %lu", (long unsigned)size);
     return 0;
   }
+  if (unlikely_log(psync_fs_wbuf_flush_locked(of)))
+    return -EIO;
   psync_fs_inc_writeid_locked(of);
 retry:
   if (unlikely(!of->newfile && !of->modified)){
@@ -2978,6 +3247,12 @@ static void *psync_fs_init(struct fuse_conn_info *conn){
 #endif
 #if defined(FUSE_CAP_BIG_WRITES)
   conn->want|=FUSE_CAP_BIG_WRITES;
+#endif
+#if defined(PSYNC_FS_LOWLEVEL)
+  if (conn->capable&FUSE_CAP_SPLICE_READ)
+    conn->want|=FUSE_CAP_SPLICE_READ;
+  if (conn->capable&FUSE_CAP_SPLICE_WRITE)
+    conn->want|=FUSE_CAP_SPLICE_WRITE;
 #endif
   conn->max_readahead=1024*1024;
   conn->max_write=FS_MAX_WRITE;
@@ -2986,6 +3261,904 @@ static void *psync_fs_init(struct fuse_conn_info *conn){
   return 0;
 }
 
+#if defined(PSYNC_FS_LOWLEVEL)
+
+/*
+ * Low-level frontend. Node ids handed to the kernel are the inode numbers reported in st_ino (folderid*3,
+ * fileid*3+1 and taskid*3+2), only the root folder is FUSE_ROOT_ID. For every node the kernel holds a lookup
+ * reference to we remember parent and name, so requests can still be served by the path based handlers above.
+ */
+
+#define NODE_HASH_SIZE PSYNC_FS_NODE_HASH_SIZE
+#define NODE_FAKE_INO_START ((uint64_t)1<<62)
+
+typedef struct _psync_fs_node_t {
+  /* inonext is the next node in the bucket by inode, namenext - in the bucket by parent and name */
+  struct _psync_fs_node_t *inonext;
+  struct _psync_fs_node_t *namenext;
+  struct _psync_fs_node_t *parent;
+  /* siblings is element of parent->children */
+  psync_list siblings;
+  psync_list children;
+  uint64_t ino;
+  uint64_t nlookup;
+  uint32_t namehash;
+  char *name;
+} psync_fs_node_t;
+
+typedef struct {
+  uint32_t nameoff;
+  uint32_t namelen;
+  struct FUSE_STAT st;
+} psync_fs_dirent_t;
+
+/* complete listing of a folder, kept for PSYNC_FS_DIRLIST_HINT_SEC after readdir to answer lookups of its entries */
+typedef struct {
+  psync_list list;
+  fuse_req_t req;
+  fuse_ino_t ino;
+  time_t ctime;
+  uint32_t refcnt;
+  uint32_t entcnt;
+  uint32_t entalloc;
+  uint32_t hashmask;
+  uint32_t *hash;
+  psync_fs_dirent_t *ents;
+  char *names;
+  size_t namesoff;
+  size_t namesalloc;
+  char *dirbuf;
+  size_t dirbufsize;
+  size_t dirbufalloc;
+} psync_fs_dirlist_t;
+
+typedef struct {
+  fuse_ino_t parent;
+  fuse_ino_t ino;
+  size_t namelen;
+  char name[];
+} psync_fs_inval_t;
+
+typedef struct {
+  psync_fs_inval_t **invals;
+  size_t cnt;
+  size_t alloc;
+} psync_fs_inval_list_t;
+
+static pthread_mutex_t node_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_fs_node_t *node_ino_hash[NODE_HASH_SIZE];
+static psync_fs_node_t *node_name_hash[NODE_HASH_SIZE];
+static psync_fs_node_t node_root;
+static uint64_t node_fake_ino=NODE_FAKE_INO_START;
+
+static pthread_mutex_t dirlist_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_list dirlists=PSYNC_LIST_STATIC_INIT(dirlists);
+
+static uint32_t node_name_hash_func(uint64_t parent, const char *name, size_t len){
+  uint32_t hash;
+  hash=(uint32_t)parent*0xc2b2ae35U;
+  while (len--)
+    hash=(unsigned char)*name++ +(hash<<5)+hash;
+  hash+=hash<<3;
+  hash^=hash>>11;
+  return hash;
+}
+
+static psync_fs_node_t *node_get_locked(uint64_t ino){
+  psync_fs_node_t *node;
+  if (ino==FUSE_ROOT_ID)
+    return &node_root;
+  for (node=node_ino_hash[ino%NODE_HASH_SIZE]; node; node=node->inonext)
+    if (node->ino==ino)
+      return node;
+  return NULL;
+}
+
+static psync_fs_node_t *node_find_child_locked(psync_fs_node_t *parent, const char *name){
+  psync_fs_node_t *node;
+  uint32_t hash;
+  hash=node_name_hash_func(parent->ino, name, strlen(name));
+  for (node=node_name_hash[hash%NODE_HASH_SIZE]; node; node=node->namenext)
+    if (node->namehash==hash && node->parent==parent && !strcmp(node->name, name))
+      return node;
+  return NULL;
+}
+
+static void node_attach_locked(psync_fs_node_t *node, psync_fs_node_t *parent, const char *name){
+  size_t len;
+  len=strlen(name);
+  node->parent=parent;
+  node->name=psync_strndup(name, len);
+  node->namehash=node_name_hash_func(parent->ino, name, len);
+  node->namenext=node_name_hash[node->namehash%NODE_HASH_SIZE];
+  node_name_hash[node->namehash%NODE_HASH_SIZE]=node;
+  psync_list_add_tail(&parent->children, &node->siblings);
+}
+
+static psync_fs_node_t *node_detach_locked(psync_fs_node_t *node){
+  psync_fs_node_t **pnode, *parent;
+  parent=node->parent;
+  if (!parent)
+    return NULL;
+  for (pnode=&node_name_hash[node->namehash%NODE_HASH_SIZE]; *pnode!=node; pnode=&(*pnode)->namenext)
+    ;
+  *pnode=node->namenext;
+  psync_list_del(&node->siblings);
+  psync_free(node->name);
+  node->name=NULL;
+  node->parent=NULL;
+  return parent;
+}
+
+static void node_free_unused_locked(psync_fs_node_t *node){
+  psync_fs_node_t **pnode, *parent;
+  while (node && node!=&node_root && !node->nlookup && psync_list_isempty(&node->children)){
+    parent=node_detach_locked(node);
+    for (pnode=&node_ino_hash[node->ino%NODE_HASH_SIZE]; *pnode!=node; pnode=&(*pnode)->inonext)
+      ;
+    *pnode=node->inonext;
+    psync_free(node);
+    node=parent;
+  }
+}
+
+static int node_add(fuse_ino_t parentino, const char *name, uint64_t ino){
+  psync_fs_node_t *parent, *node, *other, *oldparent;
+  pthread_mutex_lock(&node_mutex);
+  parent=node_get_locked(parentino);
+  if (unlikely_log(!parent)){
+    pthread_mutex_unlock(&node_mutex);
+    return -ENOENT;
+  }
+  node=node_get_locked(ino);
+  if (!node){
+    node=psync_new(psync_fs_node_t);
+    node->ino=ino;
+    node->nlookup=0;
+    node->parent=NULL;
+    node->name=NULL;
+    psync_list_init(&node->children);
+    node->inonext=node_ino_hash[ino%NODE_HASH_SIZE];
+    node_ino_hash[ino%NODE_HASH_SIZE]=node;
+  }
+  node->nlookup++;
+  if (node->parent!=parent || strcmp(node->name, name)){
+    other=node_find_child_locked(parent, name);
+    if (other){
+      node_detach_locked(other);
+      node_free_unused_locked(other);
+    }
+    oldparent=node_detach_locked(node);
+    node_attach_locked(node, parent, name);
+    node_free_unused_locked(oldparent);
+  }
+  pthread_mutex_unlock(&node_mutex);
+  return 0;
+}
+
+static void node_forget(uint64_t ino, uint64_t nlookup){
+  psync_fs_node_t *node;
+  pthread_mutex_lock(&node_mutex);
+  node=node_get_locked(ino);
+  if (likely_log(node && node!=&node_root)){
+    if (unlikely_log(node->nlookup<nlookup))
+      node->nlookup=0;
+    else
+      node->nlookup-=nlookup;
+    node_free_unused_locked(node);
+  }
+  pthread_mutex_unlock(&node_mutex);
+}
+
+static void node_removed(fuse_ino_t parentino, const char *name){
+  psync_fs_node_t *parent, *node;
+  pthread_mutex_lock(&node_mutex);
+  parent=node_get_locked(parentino);
+  if (parent && (node=node_find_child_locked(parent, name))){
+    node_detach_locked(node);
+    node_free_unused_locked(node);
+    node_free_unused_locked(parent);
+  }
+  pthread_mutex_unlock(&node_mutex);
+}
+
+static void node_renamed(fuse_ino_t parentino, const char *name, fuse_ino_t newparentino, const char *newname){
+  psync_fs_node_t *parent, *newparent, *node, *other;
+  pthread_mutex_lock(&node_mutex);
+  parent=node_get_locked(parentino);
+  newparent=node_get_locked(newparentino);
+  if (parent && newparent && (node=node_find_child_locked(parent, name))){
+    other=node_find_child_locked(newparent, newname);
+    if (other){
+      node_detach_locked(other);
+      node_free_unused_locked(other);
+    }
+    node_detach_locked(node);
+    node_attach_locked(node, newparent, newname);
+    node_free_unused_locked(parent);
+  }
+  pthread_mutex_unlock(&node_mutex);
+}
+
+static char *node_path_locked(psync_fs_node_t *node, const char *name){
+  psync_fs_node_t *n;
+  char *path, *p;
+  size_t len, l;
+  len=name?strlen(name)+1:0;
+  for (n=node; n!=&node_root; n=n->parent)
+    if (unlikely(!n->parent))
+      return NULL;
+    else
+      len+=strlen(n->name)+1;
+  if (!len)
+    return psync_strdup("/");
+  path=psync_new_cnt(char, len+1);
+  p=path+len;
+  *p=0;
+  if (name){
+    l=strlen(name);
+    p-=l;
+    memcpy(p, name, l);
+    *--p='/';
+  }
+  for (n=node; n!=&node_root; n=n->parent){
+    l=strlen(n->name);
+    p-=l;
+    memcpy(p, n->name, l);
+    *--p='/';
+  }
+  return path;
+}
+
+static char *psync_fs_ll_path(fuse_ino_t ino, const char *name){
+  psync_fs_node_t *node;
+  char *path;
+  pthread_mutex_lock(&node_mutex);
+  node=node_get_locked(ino);
+  if (likely(node))
+    path=node_path_locked(node, name);
+  else
+    path=NULL;
+  pthread_mutex_unlock(&node_mutex);
+  return path;
+}
+
+static fuse_ino_t psync_fs_ll_parent(fuse_ino_t ino){
+  psync_fs_node_t *node;
+  fuse_ino_t ret;
+  pthread_mutex_lock(&node_mutex);
+  node=node_get_locked(ino);
+  if (node && node->parent)
+    ret=node->parent->ino;
+  else
+    ret=0;
+  pthread_mutex_unlock(&node_mutex);
+  return ret;
+}
+
+static void dirlist_unref_locked(psync_fs_dirlist_t *dl){
+  if (--dl->refcnt)
+    return;
+  psync_free(dl->hash);
+  psync_free(dl->ents);
+  psync_free(dl->names);
+  psync_free(dl->dirbuf);
+  psync_free(dl);
+}
+
+static void dirlist_expire_locked(time_t now){
+  psync_fs_dirlist_t *dl;
+  while (!psync_list_isempty(&dirlists)){
+    dl=psync_list_element(dirlists.prev, psync_fs_dirlist_t, list);
+    if (dl->ctime+PSYNC_FS_DIRLIST_HINT_SEC>=now)
+      break;
+    psync_list_del(&dl->list);
+    dirlist_unref_locked(dl);
+  }
+}
+
+static void dirlist_drop_locked(fuse_ino_t ino){
+  psync_fs_dirlist_t *dl;
+  psync_list_for_each_element(dl, &dirlists, psync_fs_dirlist_t, list)
+    if (dl->ino==ino){
+      psync_list_del(&dl->list);
+      dirlist_unref_locked(dl);
+      break;
+    }
+}
+
+static void psync_fs_ll_dirlist_drop(fuse_ino_t ino){
+  pthread_mutex_lock(&dirlist_mutex);
+  if (!psync_list_isempty(&dirlists))
+    dirlist_drop_locked(ino);
+  pthread_mutex_unlock(&dirlist_mutex);
+}
+
+/* size and mtime of a file change with writes to it, so its entry in the listing of its parent can no longer answer lookups */
+static void psync_fs_ll_dirlist_drop_parent_of(fuse_ino_t ino){
+  int empty;
+  pthread_mutex_lock(&dirlist_mutex);
+  empty=psync_list_isempty(&dirlists);
+  pthread_mutex_unlock(&dirlist_mutex);
+  if (!empty)
+    psync_fs_ll_dirlist_drop(psync_fs_ll_parent(ino));
+}
+
+static void psync_fs_ll_dirlist_clean(){
+  pthread_mutex_lock(&dirlist_mutex);
+  while (!psync_list_isempty(&dirlists))
+    dirlist_unref_locked(psync_list_remove_head_element(&dirlists, psync_fs_dirlist_t, list));
+  pthread_mutex_unlock(&dirlist_mutex);
+}
+
+static void psync_fs_ll_dirlist_release(psync_fs_dirlist_t *dl){
+  pthread_mutex_lock(&dirlist_mutex);
+  dirlist_unref_locked(dl);
+  pthread_mutex_unlock(&dirlist_mutex);
+}
+
+static int dirlist_filler(void *buf, const char *name, const struct FUSE_STAT *st, fuse_off_t off){
+  psync_fs_dirlist_t *dl;
+  struct FUSE_STAT dotst;
+  size_t len, entsize;
+  dl=(psync_fs_dirlist_t *)buf;
+  if (!st){
+    memset(&dotst, 0, sizeof(dotst));
+    dotst.st_mode=S_IFDIR;
+    st=&dotst;
+  }
+  entsize=fuse_add_direntry(dl->req, NULL, 0, name, NULL, 0);
+  if (dl->dirbufsize+entsize>dl->dirbufalloc){
+    dl->dirbufalloc=(dl->dirbufsize+entsize)*2;
+    dl->dirbuf=(char *)psync_realloc(dl->dirbuf, dl->dirbufalloc);
+  }
+  fuse_add_direntry(dl->req, dl->dirbuf+dl->dirbufsize, entsize, name, st, dl->dirbufsize+entsize);
+  dl->dirbufsize+=entsize;
+  if (st==&dotst)
+    return 0;
+  len=strlen(name);
+  if (dl->namesoff+len>dl->namesalloc){
+    dl->namesalloc=(dl->namesoff+len)*2;
+    dl->names=(char *)psync_realloc(dl->names, dl->namesalloc);
+  }
+  if (dl->entcnt==dl->entalloc){
+    dl->entalloc=dl->entalloc?dl->entalloc*2:64;
+    dl->ents=(psync_fs_dirent_t *)psync_realloc(dl->ents, sizeof(psync_fs_dirent_t)*dl->entalloc);
+  }
+  memcpy(dl->names+dl->namesoff, name, len);
+  dl->ents[dl->entcnt].nameoff=dl->namesoff;
+  dl->ents[dl->entcnt].namelen=len;
+  dl->ents[dl->entcnt].st=*st;
+  dl->entcnt++;
+  dl->namesoff+=len;
+  return 0;
+}
+
+static void dirlist_build_hash(psync_fs_dirlist_t *dl){
+  uint32_t i, h, sz;
+  for (sz=64; sz<dl->entcnt*2; sz*=2)
+    ;
+  dl->hashmask=sz-1;
+  dl->hash=psync_new_cnt(uint32_t, sz);
+  memset(dl->hash, 0, sizeof(uint32_t)*sz);
+  for (i=0; i<dl->entcnt; i++){
+    h=node_name_hash_func(0, dl->names+dl->ents[i].nameoff, dl->ents[i].namelen)&dl->hashmask;
+    while (dl->hash[h])
+      h=(h+1)&dl->hashmask;
+    dl->hash[h]=i+1;
+  }
+}
+
+static int psync_fs_ll_dirlist_stat(fuse_ino_t parent, const char *name, struct FUSE_STAT *st){
+  psync_fs_dirlist_t *dl;
+  psync_fs_dirent_t *de;
+  size_t len;
+  uint32_t h;
+  len=strlen(name);
+  pthread_mutex_lock(&dirlist_mutex);
+  dirlist_expire_locked(psync_timer_time());
+  psync_list_for_each_element(dl, &dirlists, psync_fs_dirlist_t, list)
+    if (dl->ino==parent){
+      h=node_name_hash_func(0, name, len)&dl->hashmask;
+      while (dl->hash[h]){
+        de=&dl->ents[dl->hash[h]-1];
+        if (de->namelen==len && !memcmp(dl->names+de->nameoff, name, len)){
+          *st=de->st;
+          pthread_mutex_unlock(&dirlist_mutex);
+          return 0;
+        }
+        h=(h+1)&dl->hashmask;
+      }
+      break;
+    }
+  pthread_mutex_unlock(&dirlist_mutex);
+  return -1;
+}
+
+static void psync_fs_ll_clean(){
+  psync_fs_node_t *node, *next;
+  uint32_t i;
+  psync_fs_ll_dirlist_clean();
+  pthread_mutex_lock(&node_mutex);
+  for (i=0; i<NODE_HASH_SIZE; i++){
+    for (node=node_ino_hash[i]; node; node=next){
+      next=node->inonext;
+      psync_free(node->name);
+      psync_free(node);
+    }
+    node_ino_hash[i]=NULL;
+    node_name_hash[i]=NULL;
+  }
+  node_root.ino=FUSE_ROOT_ID;
+  node_root.nlookup=1;
+  psync_list_init(&node_root.children);
+  pthread_mutex_unlock(&node_mutex);
+}
+
+static int psync_fs_ll_fill_entry(fuse_ino_t parent, const char *name, struct FUSE_STAT *st, struct fuse_entry_param *e){
+  int ret;
+  if (unlikely(!st->st_ino)){
+    pthread_mutex_lock(&node_mutex);
+    st->st_ino=node_fake_ino++;
+    pthread_mutex_unlock(&node_mutex);
+  }
+  ret=node_add(parent, name, st->st_ino);
+  if (ret)
+    return ret;
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino=st->st_ino;
+  e->attr=*st;
+  e->attr_timeout=PSYNC_FS_ATTR_TIMEOUT;
+  e->entry_timeout=PSYNC_FS_ENTRY_TIMEOUT;
+  return 0;
+}
+
+static void psync_fs_ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name, const char *path){
+  struct fuse_entry_param e;
+  struct FUSE_STAT st;
+  int ret;
+  ret=psync_fs_getattr(path, &st);
+  if (!ret)
+    ret=psync_fs_ll_fill_entry(parent, name, &st, &e);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else if (fuse_reply_entry(req, &e))
+    node_forget(e.ino, 1);
+}
+
+static void psync_fs_ll_reply_attr(fuse_req_t req, fuse_ino_t ino, const char *path){
+  struct FUSE_STAT st;
+  int ret;
+  ret=psync_fs_getattr(path, &st);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else{
+    if (ino==FUSE_ROOT_ID)
+      st.st_ino=FUSE_ROOT_ID;
+    fuse_reply_attr(req, &st, PSYNC_FS_ATTR_TIMEOUT);
+  }
+}
+
+#define LL_GET_PATH(path, ino, name) do {\
+  path=psync_fs_ll_path(ino, name);\
+  if (unlikely(!path)){\
+    fuse_reply_err(req, ENOENT);\
+    return;\
+  }\
+} while (0)
+
+static void psync_fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+  struct fuse_entry_param e;
+  struct FUSE_STAT st;
+  char *path;
+  if (!psync_fs_ll_dirlist_stat(parent, name, &st)){
+    if (psync_fs_ll_fill_entry(parent, name, &st, &e))
+      fuse_reply_err(req, ENOENT);
+    else if (fuse_reply_entry(req, &e))
+      node_forget(e.ino, 1);
+    return;
+  }
+  LL_GET_PATH(path, parent, name);
+  psync_fs_ll_reply_entry(req, parent, name, path);
+  psync_free(path);
+}
+
+static void psync_fs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup){
+  node_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void psync_fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  char *path;
+  LL_GET_PATH(path, ino, NULL);
+  psync_fs_ll_reply_attr(req, ino, path);
+  psync_free(path);
+}
+
+static void psync_fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct FUSE_STAT *attr, int to_set, struct fuse_file_info *fi){
+  struct timespec tv[2];
+  char *path;
+  int ret;
+  LL_GET_PATH(path, ino, NULL);
+  ret=0;
+  if (to_set&FUSE_SET_ATTR_MODE)
+    ret=psync_fs_chmod(path, attr->st_mode);
+  if (!ret && (to_set&FUSE_SET_ATTR_SIZE)){
+    if (fi)
+      ret=psync_fs_ftruncate(path, attr->st_size, fi);
+    else
+      ret=psync_fs_truncate(path, attr->st_size);
+  }
+#if defined(FUSE_SET_ATTR_MTIME_NOW)
+  if (!ret && (to_set&(FUSE_SET_ATTR_MTIME|FUSE_SET_ATTR_MTIME_NOW))){
+#else
+  if (!ret && (to_set&FUSE_SET_ATTR_MTIME)){
+#endif
+    memset(tv, 0, sizeof(tv));
+    if (to_set&FUSE_SET_ATTR_MTIME)
+      tv[1]=attr->st_mtim;
+    else
+      tv[1].tv_sec=psync_timer_time();
+    tv[0]=tv[1];
+    ret=psync_fs_utimens(path, tv);
+  }
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else{
+    psync_fs_ll_dirlist_drop_parent_of(ino);
+    psync_fs_ll_reply_attr(req, ino, path);
+  }
+  psync_free(path);
+}
+
+static void psync_fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  fi->fh=0;
+  fuse_reply_open(req, fi);
+}
+
+static void psync_fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, struct fuse_file_info *fi){
+  psync_fs_dirlist_t *dl;
+  char *path;
+  int ret;
+  dl=(psync_fs_dirlist_t *)(uintptr_t)fi->fh;
+  if (!dl || !off){
+    LL_GET_PATH(path, ino, NULL);
+    if (dl){
+      psync_fs_ll_dirlist_release(dl);
+      fi->fh=0;
+    }
+    dl=psync_new(psync_fs_dirlist_t);
+    memset(dl, 0, sizeof(psync_fs_dirlist_t));
+    dl->req=req;
+    dl->ino=ino;
+    ret=psync_fs_readdir(path, dl, dirlist_filler, 0, fi);
+    psync_free(path);
+    if (ret){
+      dl->refcnt=1;
+      psync_fs_ll_dirlist_release(dl);
+      fuse_reply_err(req, -ret);
+      return;
+    }
+    dirlist_build_hash(dl);
+    dl->req=NULL;
+    dl->ctime=psync_timer_time();
+    /* one reference for the open directory, one for the list of recent listings */
+    dl->refcnt=2;
+    pthread_mutex_lock(&dirlist_mutex);
+    dirlist_drop_locked(ino);
+    psync_list_add_head(&dirlists, &dl->list);
+    dirlist_expire_locked(dl->ctime);
+    pthread_mutex_unlock(&dirlist_mutex);
+    fi->fh=(uintptr_t)dl;
+  }
+  if (off<dl->dirbufsize)
+    fuse_reply_buf(req, dl->dirbuf+off, size<dl->dirbufsize-off?size:dl->dirbufsize-off);
+  else
+    fuse_reply_buf(req, NULL, 0);
+}
+
+static void psync_fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  if (fi->fh)
+    psync_fs_ll_dirlist_release((psync_fs_dirlist_t *)(uintptr_t)fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+static void psync_fs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi){
+  char *path;
+  LL_GET_PATH(path, ino, NULL);
+  fuse_reply_err(req, -psync_fs_fsyncdir(path, datasync, fi));
+  psync_free(path);
+}
+
+static void psync_fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  char *path;
+  int ret;
+  LL_GET_PATH(path, ino, NULL);
+  ret=psync_fs_open(path, fi);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else{
+    if (fi->flags&O_TRUNC)
+      psync_fs_ll_dirlist_drop_parent_of(ino);
+    if (fuse_reply_open(req, fi))
+      psync_fs_release(path, fi);
+  }
+  psync_free(path);
+}
+
+static void psync_fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi){
+  struct fuse_entry_param e;
+  struct FUSE_STAT st;
+  char *path;
+  int ret;
+  LL_GET_PATH(path, parent, name);
+  ret=psync_fs_creat(path, mode, fi);
+  if (ret){
+    fuse_reply_err(req, -ret);
+    psync_free(path);
+    return;
+  }
+  psync_fs_ll_dirlist_drop(parent);
+  ret=psync_fs_getattr(path, &st);
+  if (!ret)
+    ret=psync_fs_ll_fill_entry(parent, name, &st, &e);
+  if (ret){
+    psync_fs_release(path, fi);
+    fuse_reply_err(req, -ret);
+  }
+  else if (fuse_reply_create(req, &e, fi)){
+    psync_fs_release(path, fi);
+    node_forget(e.ino, 1);
+  }
+  psync_free(path);
+}
+
+static void psync_fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, struct fuse_file_info *fi){
+  char *buf;
+  int ret;
+  if (psync_fs_read_zero_copy(req, size, off, fi))
+    return;
+  buf=psync_new_cnt(char, size);
+  ret=psync_fs_read(NULL, buf, size, off, fi);
+  if (ret<0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_buf(req, buf, ret);
+  psync_free(buf);
+}
+
+static void psync_fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, fuse_off_t off, struct fuse_file_info *fi){
+  int ret;
+  ret=psync_fs_write_buf(bufv, off, fi);
+  if (ret<0)
+    fuse_reply_err(req, -ret);
+  else{
+    psync_fs_ll_dirlist_drop_parent_of(ino);
+    fuse_reply_write(req, ret);
+  }
+}
+
+static void psync_fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  char *path;
+  path=psync_fs_ll_path(ino, NULL);
+  psync_fs_ll_dirlist_drop_parent_of(ino);
+  fuse_reply_err(req, -psync_fs_flush(path?path:"", fi));
+  psync_free(path);
+}
+
+static void psync_fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  char *path;
+  path=psync_fs_ll_path(ino, NULL);
+  psync_fs_release(path?path:"", fi);
+  psync_free(path);
+  psync_fs_ll_dirlist_drop_parent_of(ino);
+  fuse_reply_err(req, 0);
+}
+
+static void psync_fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi){
+  char *path;
+  path=psync_fs_ll_path(ino, NULL);
+  fuse_reply_err(req, -psync_fs_fsync(path?path:"", datasync, fi));
+  psync_free(path);
+}
+
+static void psync_fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+  char *path;
+  int ret;
+  LL_GET_PATH(path, parent, name);
+  ret=psync_fs_mkdir(path, mode);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else{
+    psync_fs_ll_dirlist_drop(parent);
+    psync_fs_ll_reply_entry(req, parent, name, path);
+  }
+  psync_free(path);
+}
+
+static void psync_fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+  char *path;
+  int ret;
+  LL_GET_PATH(path, parent, name);
+  ret=psync_fs_rmdir(path);
+  psync_free(path);
+  if (!ret){
+    psync_fs_ll_dirlist_drop(parent);
+    node_removed(parent, name);
+  }
+  fuse_reply_err(req, -ret);
+}
+
+static void psync_fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+  char *path;
+  int ret;
+  LL_GET_PATH(path, parent, name);
+  ret=psync_fs_unlink(path);
+  psync_free(path);
+  if (!ret){
+    psync_fs_ll_dirlist_drop(parent);
+    node_removed(parent, name);
+  }
+  fuse_reply_err(req, -ret);
+}
+
+static void psync_fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname){
+  char *path, *newpath;
+  int ret;
+  LL_GET_PATH(path, parent, name);
+  newpath=psync_fs_ll_path(newparent, newname);
+  if (unlikely(!newpath)){
+    psync_free(path);
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  ret=psync_fs_rename(path, newpath);
+  psync_free(path);
+  psync_free(newpath);
+  if (!ret){
+    psync_fs_ll_dirlist_drop(parent);
+    psync_fs_ll_dirlist_drop(newparent);
+    node_renamed(parent, name, newparent, newname);
+  }
+  fuse_reply_err(req, -ret);
+}
+
+static void psync_fs_ll_statfs(fuse_req_t req, fuse_ino_t ino){
+  struct statvfs st;
+  int ret;
+  ret=psync_fs_statfs("/", &st);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_statfs(req, &st);
+}
+
+static void psync_fs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags){
+  char *path;
+  LL_GET_PATH(path, ino, NULL);
+  fuse_reply_err(req, -psync_fs_setxattr(path, name, value, size, flags));
+  psync_free(path);
+}
+
+static void psync_fs_ll_reply_xattr(fuse_req_t req, int ret, const char *buf, size_t size){
+  if (ret<0)
+    fuse_reply_err(req, -ret);
+  else if (size)
+    fuse_reply_buf(req, buf, ret);
+  else
+    fuse_reply_xattr(req, ret);
+}
+
+static void psync_fs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size){
+  char *path, *buf;
+  LL_GET_PATH(path, ino, NULL);
+  buf=size?psync_new_cnt(char, size):NULL;
+  psync_fs_ll_reply_xattr(req, psync_fs_getxattr(path, name, buf, size), buf, size);
+  psync_free(buf);
+  psync_free(path);
+}
+
+static void psync_fs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size){
+  char *path, *buf;
+  LL_GET_PATH(path, ino, NULL);
+  buf=size?psync_new_cnt(char, size):NULL;
+  psync_fs_ll_reply_xattr(req, psync_fs_listxattr(path, buf, size), buf, size);
+  psync_free(buf);
+  psync_free(path);
+}
+
+static void psync_fs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name){
+  char *path;
+  LL_GET_PATH(path, ino, NULL);
+  fuse_reply_err(req, -psync_fs_removexattr(path, name));
+  psync_free(path);
+}
+
+static void psync_fs_ll_init(void *userdata, struct fuse_conn_info *conn){
+  psync_fs_init(conn);
+}
+
+static void psync_fs_ll_add_inval(psync_fs_inval_list_t *il, fuse_ino_t parent, fuse_ino_t ino, const char *name){
+  psync_fs_inval_t *inv;
+  size_t len;
+  len=name?strlen(name):0;
+  if (il->cnt==il->alloc){
+    il->alloc=il->alloc?il->alloc*2:32;
+    il->invals=(psync_fs_inval_t **)psync_realloc(il->invals, sizeof(psync_fs_inval_t *)*il->alloc);
+  }
+  inv=(psync_fs_inval_t *)psync_malloc(offsetof(psync_fs_inval_t, name)+len+1);
+  inv->parent=parent;
+  inv->ino=ino;
+  inv->namelen=len;
+  memcpy(inv->name, name?name:"", len+1);
+  il->invals[il->cnt++]=inv;
+}
+
+static void psync_fs_ll_add_folder_invals_locked(psync_fs_inval_list_t *il, psync_fs_node_t *folder){
+  psync_fs_node_t *node;
+  psync_fs_ll_add_inval(il, 0, folder->ino, NULL);
+  psync_list_for_each_element(node, &folder->children, psync_fs_node_t, siblings)
+    psync_fs_ll_add_inval(il, folder->ino, node->ino, node->name);
+}
+
+static void psync_fs_ll_invalidate_thread(void *ptr){
+  psync_fs_inval_list_t *il;
+  size_t i;
+  il=(psync_fs_inval_list_t *)ptr;
+  /* holding start_mutex keeps the channel alive, none of the request handlers take it */
+  pthread_mutex_lock(&start_mutex);
+  if (started==1)
+    for (i=0; i<il->cnt; i++){
+      if (il->invals[i]->parent)
+        fuse_lowlevel_notify_inval_entry(psync_fuse_channel, il->invals[i]->parent, il->invals[i]->name, il->invals[i]->namelen);
+      fuse_lowlevel_notify_inval_inode(psync_fuse_channel, il->invals[i]->ino, 0, 0);
+    }
+  pthread_mutex_unlock(&start_mutex);
+  for (i=0; i<il->cnt; i++)
+    psync_free(il->invals[i]);
+  psync_free(il->invals);
+  psync_free(il);
+}
+
+/*
+ * Called on remote changes in folderid, 0 means that anything could have changed. We drop the cached listing, the
+ * folder's attributes and page cache and the dentries of its children known to the kernel. Notifications are sent
+ * from a separate thread as the kernel may wait on in-flight requests that in turn wait for locks held by our caller.
+ */
+static void psync_fs_ll_refresh_folder(psync_folderid_t folderid){
+  psync_fs_inval_list_t *il;
+  psync_fs_node_t *node;
+  fuse_ino_t ino;
+  uint32_t i;
+  ino=folderid?folderid_to_inode(folderid):FUSE_ROOT_ID;
+  if (folderid)
+    psync_fs_ll_dirlist_drop(ino);
+  else
+    psync_fs_ll_dirlist_clean();
+  il=psync_new(psync_fs_inval_list_t);
+  memset(il, 0, sizeof(psync_fs_inval_list_t));
+  pthread_mutex_lock(&node_mutex);
+  if (folderid){
+    node=node_get_locked(ino);
+    if (node)
+      psync_fs_ll_add_folder_invals_locked(il, node);
+  }
+  else{
+    psync_fs_ll_add_folder_invals_locked(il, &node_root);
+    for (i=0; i<NODE_HASH_SIZE; i++)
+      for (node=node_ino_hash[i]; node; node=node->inonext)
+        if (!psync_list_isempty(&node->children))
+          psync_fs_ll_add_folder_invals_locked(il, node);
+  }
+  pthread_mutex_unlock(&node_mutex);
+  if (il->cnt)
+    psync_run_pool1(PSYNC_POOL_IO, "fs invalidate", psync_fs_ll_invalidate_thread, il);
+  else
+    psync_free(il);
+}
+
+#endif
+
 static pthread_mutex_t fsrefreshmutex=PTHREAD_MUTEX_INITIALIZER;
 static time_t lastfsrefresh=0;
 static int fsrefreshtimerscheduled=0;
@@ -3013,7 +4186,7 @@ static void psync_fs_refresh_timer(psync_timer_t timer, void *ptr){
   fsrefreshtimerscheduled=0;
   lastfsrefresh=ct;
   pthread_mutex_unlock(&fsrefreshmutex);
-  psync_run_thread("os cache invalidate timer", psync_invalidate_os_cache_noret);
+  psync_run_pool(PSYNC_POOL_IO, "os cache invalidate timer", psync_invalidate_os_cache_noret);
 }
 
 void psync_fs_refresh(){
@@ -3035,7 +4208,7 @@ void psync_fs_refresh(){
   pthread_mutex_unlock(&fsrefreshmutex);
   if (todo==0){
     debug(D_NOTICE, "running cache invalidate direct");
-    psync_run_thread("os cache invalidate", psync_invalidate_os_cache_noret);
+    psync_run_pool(PSYNC_POOL_IO, "os cache invalidate", psync_invalidate_os_cache_noret);
   }
   else if (todo==1){
     debug(D_NOTICE, "setting timer to invalidate cache");
@@ -3052,6 +4225,9 @@ int psync_fs_need_per_folder_refresh_f(){
 }
 
 void psync_fs_refresh_folder(psync_folderid_t folderid){
+#if defined(PSYNC_FS_LOWLEVEL)
+  psync_fs_ll_refresh_folder(folderid);
+#else
   char *path, *fpath;
   unsigned char rndbuff[20];
   char rndhex[42];
@@ -3085,6 +4261,7 @@ void psync_fs_refresh_folder(psync_folderid_t folderid){
       psync_file_close(fd);
   }
   psync_free(fpath);
+#endif
 }
 
 #if defined(P_OS_WINDOWS)
@@ -3175,12 +4352,31 @@ char *psync_fs_get_path_by_folderid(psync_folderid_t folderid){
 
 #if IS_DEBUG
 
+static void psync_fs_dump_pool(uint32_t pool, const char *name){
+  psync_pool_stats_t st;
+  psync_pool_get_stats(pool, &st);
+  debug(D_NOTICE, "%s pool: threads %u idle %u queued %u max queued %u jobs %lu wait %lums max wait %lums", name,
+        (unsigned)st.threads, (unsigned)st.idle, (unsigned)st.queued, (unsigned)st.maxqueued,
+        (unsigned long)st.jobs, (unsigned long)st.waitms, (unsigned long)st.maxwaitms);
+}
+
 static void psync_fs_dump_internals() {
   psync_openfile_t *of;
   debug(D_NOTICE, "dumping internal state");
+  psync_fs_dump_pool(PSYNC_POOL_CPU, "cpu");
+  psync_fs_dump_pool(PSYNC_POOL_IO, "io");
+  psync_fs_dump_pool(PSYNC_POOL_READ, "read");
   psync_sql_rdlock();
-  psync_tree_for_each_element(of, openfiles, psync_openfile_t, tree)
+  psync_tree_for_each_element(of, openfiles, psync_openfile_t, tree){
+    psync_fs_readahead_stats_t stats[PSYNC_FS_FILESTREAMS_CNT];
+    uint32_t i, cnt;
     debug(D_NOTICE, "open file %s fileid %ld folderid %ld", of->currentname, (long)of->fileid, (long)of->currentfolder->folderid);
+    cnt=psync_fs_get_readahead_stats(of->fileid, stats, ARRAY_SIZE(stats));
+    for (i=0; i<cnt; i++)
+      debug(D_NOTICE, "  stream at %lu read %lu B/s net %lu B/s rtt %u ms window %lu, %u requests", (unsigned long)stats[i].offset,
+            (unsigned long)stats[i].readrate, (unsigned long)stats[i].netrate, (unsigned)stats[i].rttms, (unsigned long)stats[i].window,
+            (unsigned)stats[i].requests);
+  }
   psync_fstask_dump_state();
   psync_sql_rdunlock();
 }
@@ -3197,8 +4393,13 @@ static void psync_fs_do_stop(void){
     unmount(psync_current_mountpoint, MNT_FORCE);
     debug(D_NOTICE, "unmount exited");
 #endif
+#if defined(PSYNC_FS_LOWLEVEL)
+    debug(D_NOTICE, "running fuse_session_exit");
+    fuse_session_exit(psync_fuse_session);
+#else
     debug(D_NOTICE, "running fuse_exit");
     fuse_exit(psync_fuse);
+#endif
     started=2;
     debug(D_NOTICE, "fuse_exit exited, flushing cache");
     psync_pagecache_flush();
@@ -3289,12 +4490,21 @@ static void psync_fuse_thread(){
     initonce=1;
   }
   pthread_mutex_unlock(&start_mutex);
+#if defined(PSYNC_FS_LOWLEVEL)
+  debug(D_NOTICE, "running fuse_session_loop_mt");
+  fr=fuse_session_loop_mt(psync_fuse_session);
+  debug(D_NOTICE, "fuse_session_loop_mt exited with code %d, running fuse_session_destroy", fr);
+  pthread_mutex_lock(&start_mutex);
+  fuse_session_destroy(psync_fuse_session);
+  debug(D_NOTICE, "fuse_session_destroy exited");
+#else
   debug(D_NOTICE, "running fuse_loop_mt");
   fr=fuse_loop_mt(psync_fuse);
   debug(D_NOTICE, "fuse_loop_mt exited with code %d, running fuse_destroy", fr);
   pthread_mutex_lock(&start_mutex);
   fuse_destroy(psync_fuse);
   debug(D_NOTICE, "fuse_destroy exited");
+#endif
 /*#if defined(P_OS_MACOSX)
   debug(D_NOTICE, "calling unmount");
   unmount(psync_current_mountpoint, MNT_FORCE);
@@ -3308,7 +4518,12 @@ static void psync_fuse_thread(){
 
 static int psync_fs_do_start(){
   char *mp;
+#if defined(PSYNC_FS_LOWLEVEL)
+  struct fuse_lowlevel_ops psync_ll_oper;
+  char maxreadopt[32];
+#else
   struct fuse_operations psync_oper;
+#endif
   struct fuse_args args=FUSE_ARGS_INIT(0, NULL);
 
 // it seems that fuse option parser ignores the first argument
@@ -3317,10 +4532,12 @@ static int psync_fs_do_start(){
 #if defined(P_OS_LINUX)
   fuse_opt_add_arg(&args, "argv");
   fuse_opt_add_arg(&args, "-oauto_unmount");
-//  fuse_opt_add_arg(&args, "-ouse_ino");
   fuse_opt_add_arg(&args, "-ofsname="DEFAULT_FUSE_MOUNT_POINT".fs");
   fuse_opt_add_arg(&args, "-ononempty");
-  fuse_opt_add_arg(&args, "-ohard_remove");
+#if defined(PSYNC_FS_LOWLEVEL)
+  psync_slprintf(maxreadopt, sizeof(maxreadopt), "-omax_read=%u", (unsigned)(FS_MAX_READ));
+  fuse_opt_add_arg(&args, maxreadopt);
+#endif
 //  fuse_opt_add_arg(&args, "-d");
 #endif
 #if defined(P_OS_MACOSX)
@@ -3334,6 +4551,36 @@ static int psync_fs_do_start(){
   fuse_opt_add_arg(&args, "-ohard_remove");
 #endif
 
+#if defined(PSYNC_FS_LOWLEVEL)
+  memset(&psync_ll_oper, 0, sizeof(psync_ll_oper));
+
+  psync_ll_oper.init       = psync_fs_ll_init;
+  psync_ll_oper.lookup     = psync_fs_ll_lookup;
+  psync_ll_oper.forget     = psync_fs_ll_forget;
+  psync_ll_oper.getattr    = psync_fs_ll_getattr;
+  psync_ll_oper.setattr    = psync_fs_ll_setattr;
+  psync_ll_oper.opendir    = psync_fs_ll_opendir;
+  psync_ll_oper.readdir    = psync_fs_ll_readdir;
+  psync_ll_oper.releasedir = psync_fs_ll_releasedir;
+  psync_ll_oper.fsyncdir   = psync_fs_ll_fsyncdir;
+  psync_ll_oper.open       = psync_fs_ll_open;
+  psync_ll_oper.create     = psync_fs_ll_create;
+  psync_ll_oper.read       = psync_fs_ll_read;
+  psync_ll_oper.write_buf  = psync_fs_ll_write_buf;
+  psync_ll_oper.flush      = psync_fs_ll_flush;
+  psync_ll_oper.release    = psync_fs_ll_release;
+  psync_ll_oper.fsync      = psync_fs_ll_fsync;
+  psync_ll_oper.mkdir      = psync_fs_ll_mkdir;
+  psync_ll_oper.rmdir      = psync_fs_ll_rmdir;
+  psync_ll_oper.unlink     = psync_fs_ll_unlink;
+  psync_ll_oper.rename     = psync_fs_ll_rename;
+  psync_ll_oper.statfs     = psync_fs_ll_statfs;
+
+  psync_ll_oper.setxattr   = psync_fs_ll_setxattr;
+  psync_ll_oper.getxattr   = psync_fs_ll_getxattr;
+  psync_ll_oper.listxattr  = psync_fs_ll_listxattr;
+  psync_ll_oper.removexattr= psync_fs_ll_removexattr;
+#else
   memset(&psync_oper, 0, sizeof(psync_oper));
 
   psync_oper.init     = psync_fs_init;
@@ -3371,6 +4618,7 @@ static int psync_fs_do_start(){
 #if defined(FUSE_HAS_SETCRTIME)
   psync_oper.setcrtime=psync_fs_setcrtime;
 #endif
+#endif
 
 #if defined(P_OS_POSIX)
   myuid=getuid();
@@ -3385,12 +4633,22 @@ static int psync_fs_do_start(){
   unmount(mp, MNT_FORCE);
 #endif
 
+#if defined(PSYNC_FS_LOWLEVEL)
+  psync_fs_ll_clean();
+#endif
   psync_fuse_channel=fuse_mount(mp, &args);
   if (unlikely_log(!psync_fuse_channel))
     goto err0;
+#if defined(PSYNC_FS_LOWLEVEL)
+  psync_fuse_session=fuse_lowlevel_new(&args, &psync_ll_oper, sizeof(psync_ll_oper), NULL);
+  if (unlikely_log(!psync_fuse_session))
+    goto err1;
+  fuse_session_add_chan(psync_fuse_session, psync_fuse_channel);
+#else
   psync_fuse=fuse_new(psync_fuse_channel, &args, &psync_oper, sizeof(psync_oper), NULL);
   if (unlikely_log(!psync_fuse))
     goto err1;
+#endif
   psync_current_mountpoint=mp;
   started=1;
   pthread_mutex_unlock(&start_mutex);
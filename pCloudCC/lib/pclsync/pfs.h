@@ -61,8 +61,27 @@ typedef struct {
   uint64_t requestedto;
   uint64_t id;
   time_t lastuse;
+  /* readahead controller: the reader's consumption rate and the throughput and round trip time of completed range
+   * requests, all in bytes per second and milliseconds */
+  uint64_t readrate;
+  uint64_t netrate;
+  uint64_t readbytes;
+  uint64_t ratesince;
+  uint64_t window;
+  uint32_t rttms;
+  uint32_t requests;
+  uint32_t gen;
 } psync_file_stream_t;
 
+typedef struct {
+  uint64_t offset;
+  uint64_t readrate;
+  uint64_t netrate;
+  uint64_t window;
+  uint32_t rttms;
+  uint32_t requests;
+} psync_fs_readahead_stats_t;
+
 typedef struct {
   pthread_cond_t cond;
   uint64_t extendto;
@@ -103,6 +122,9 @@ typedef struct {
   uint32_t runningreads;
   uint32_t currentspeed;
   uint32_t bytesthissec;
+  /* last estimates of any stream, new streams start from them */
+  uint64_t netrate;
+  uint32_t rttms;
   unsigned char modified;
   unsigned char newfile;
   unsigned char releasedforupload;
@@ -110,6 +132,12 @@ typedef struct {
   unsigned char encrypted;
   unsigned char throttle;
   unsigned char staticfile;
+  /* buffered writes, wbuflen bytes at wbufoff that are not yet written to datafile */
+  char *wbuf;
+  uint64_t wbufoff;
+  uint64_t wbufstarted;
+  uint32_t wbuflen;
+  uint32_t wbufalloc;
 #if IS_DEBUG
   const char *lockfile;
   const char *lockthread;
@@ -173,6 +201,7 @@ void psync_fs_inc_of_refcnt(psync_openfile_t *of);
 void psync_fs_dec_of_refcnt(psync_openfile_t *of);
 void psync_fs_inc_of_refcnt_and_readers(psync_openfile_t *of);
 void psync_fs_dec_of_refcnt_and_readers(psync_openfile_t *of);
+uint32_t psync_fs_get_readahead_stats(psync_fsfileid_t fileid, psync_fs_readahead_stats_t *stats, uint32_t cnt);
 
 void psync_fs_refresh();
 int psync_fs_need_per_folder_refresh_f();
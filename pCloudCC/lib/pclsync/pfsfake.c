@@ -26,6 +26,7 @@
  */
 
 #include "psynclib.h"
+#include "pfsfolder.h"
 
 int psync_fs_remount(){
   return 0;
@@ -72,6 +73,16 @@ void psync_fs_refresh_folder(psync_folderid_t folderid){
 void psync_pagecache_resize_cache(){
 }
 
+void psync_fsfolder_cache_folder_changed(psync_fsfolderid_t folderid){
+}
+
+void psync_pagecache_resize_memory_cache(){
+}
+
+int psync_pagecache_copy_to_local_file(uint64_t hash, uint64_t size, const char *filename, const unsigned char *hexsum){
+  return -1;
+}
+
 int psync_cloud_crypto_setup(const char *password){
   return PSYNC_CRYPTO_SETUP_NOT_SUPPORTED;
 }
@@ -34,8 +34,185 @@
 #include "pfs.h"
 #include <string.h>
 
+#define DENTRY_HASH_SIZE 16384
+
+#define dentry_id_bucket(folderid) ((uint64_t)(folderid)%DENTRY_HASH_SIZE)
+
+typedef struct {
+  psync_fsfolderid_t folderid;
+  uint64_t userid;
+  uint32_t permissions;
+  uint32_t flags;
+  /* shareid of the folder itself if it is not ours, otherwise 0 */
+  uint32_t shareid;
+} psync_fsfolder_dentry_data_t;
+
+/* subfolders of non-encrypted folders as found in the database, keyed by parent folderid and name. Negative lookups are not cached,
+ * so entries only need to be dropped when a folder is modified or deleted. Pending mkdir/rmdir tasks are not cached either, they are
+ * always checked on top of the result.
+ */
+typedef struct _psync_fsfolder_dentry_t {
+  /* next is the next entry in the bucket by parent folderid and name, idnext - in the bucket by folderid */
+  struct _psync_fsfolder_dentry_t *next;
+  struct _psync_fsfolder_dentry_t *idnext;
+  /* lru is element of dentry_lru, most recently used first */
+  psync_list lru;
+  psync_fsfolder_dentry_data_t data;
+  psync_fsfolderid_t parentfolderid;
+  uint32_t hash;
+  uint32_t namelen;
+  char name[];
+} psync_fsfolder_dentry_t;
+
 static PSYNC_THREAD int cryptoerr=0;
 
+static psync_fsfolder_dentry_t *dentry_hash[DENTRY_HASH_SIZE];
+static psync_fsfolder_dentry_t *dentry_id_hash[DENTRY_HASH_SIZE];
+static psync_list dentry_lru=PSYNC_LIST_STATIC_INIT(dentry_lru);
+static uint32_t dentry_cnt=0;
+static pthread_mutex_t dentry_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+#if PSYNC_FILENAMES_CASESENSITIVE
+#define dentry_fold(c) (c)
+#else
+/* names are compared COLLATE NOCASE by the database, which only folds ASCII letters, so the cache has to match the same way */
+#define dentry_fold(c) ((c)>='A' && (c)<='Z'?(c)+'a'-'A':(c))
+#endif
+
+static uint32_t dentry_hash_func(psync_fsfolderid_t parentfolderid, const char *name, size_t len){
+  uint32_t hash;
+  unsigned char c;
+  hash=(uint32_t)parentfolderid*0xc2b2ae35U;
+  while (len--){
+    c=*name++;
+    hash=dentry_fold(c)+(hash<<5)+hash;
+  }
+  hash+=hash<<3;
+  hash^=hash>>11;
+  return hash;
+}
+
+static int dentry_name_eq(const char *name1, const char *name2, size_t len){
+#if PSYNC_FILENAMES_CASESENSITIVE
+  return !memcmp(name1, name2, len);
+#else
+  unsigned char c1, c2;
+  while (len--){
+    c1=*name1++;
+    c2=*name2++;
+    if (dentry_fold(c1)!=dentry_fold(c2))
+      return 0;
+  }
+  return 1;
+#endif
+}
+
+static psync_fsfolder_dentry_t *dentry_find_locked(uint32_t hash, psync_fsfolderid_t parentfolderid, const char *name, size_t len){
+  psync_fsfolder_dentry_t *de;
+  for (de=dentry_hash[hash%DENTRY_HASH_SIZE]; de; de=de->next)
+    if (de->hash==hash && de->parentfolderid==parentfolderid && de->namelen==len && dentry_name_eq(de->name, name, len))
+      return de;
+  return NULL;
+}
+
+static void dentry_unlink_locked(psync_fsfolder_dentry_t *de){
+  psync_fsfolder_dentry_t **pde;
+  for (pde=&dentry_hash[de->hash%DENTRY_HASH_SIZE]; *pde!=de; pde=&(*pde)->next)
+    ;
+  *pde=de->next;
+  for (pde=&dentry_id_hash[dentry_id_bucket(de->data.folderid)]; *pde!=de; pde=&(*pde)->idnext)
+    ;
+  *pde=de->idnext;
+  psync_list_del(&de->lru);
+  dentry_cnt--;
+}
+
+static int dentry_cache_get(psync_fsfolderid_t parentfolderid, const char *name, size_t len, psync_fsfolder_dentry_data_t *data){
+  psync_fsfolder_dentry_t *de;
+  uint32_t hash;
+  hash=dentry_hash_func(parentfolderid, name, len);
+  pthread_mutex_lock(&dentry_mutex);
+  de=dentry_find_locked(hash, parentfolderid, name, len);
+  if (de){
+    if (!psync_list_is_head(&dentry_lru, &de->lru)){
+      psync_list_del(&de->lru);
+      psync_list_add_head(&dentry_lru, &de->lru);
+    }
+    *data=de->data;
+  }
+  pthread_mutex_unlock(&dentry_mutex);
+  return de!=NULL;
+}
+
+static void dentry_cache_add(psync_fsfolderid_t parentfolderid, const char *name, size_t len, const psync_fsfolder_dentry_data_t *data){
+  psync_fsfolder_dentry_t *de, *old;
+  uint32_t hash;
+  hash=dentry_hash_func(parentfolderid, name, len);
+  de=(psync_fsfolder_dentry_t *)psync_malloc(offsetof(psync_fsfolder_dentry_t, name)+len);
+  de->data=*data;
+  de->parentfolderid=parentfolderid;
+  de->hash=hash;
+  de->namelen=len;
+  memcpy(de->name, name, len);
+  old=NULL;
+  pthread_mutex_lock(&dentry_mutex);
+  if (dentry_find_locked(hash, parentfolderid, name, len)){
+    pthread_mutex_unlock(&dentry_mutex);
+    psync_free(de);
+    return;
+  }
+  if (dentry_cnt>=PSYNC_FS_DENTRY_CACHE_CNT){
+    old=psync_list_element(dentry_lru.prev, psync_fsfolder_dentry_t, lru);
+    dentry_unlink_locked(old);
+  }
+  de->next=dentry_hash[hash%DENTRY_HASH_SIZE];
+  dentry_hash[hash%DENTRY_HASH_SIZE]=de;
+  de->idnext=dentry_id_hash[dentry_id_bucket(data->folderid)];
+  dentry_id_hash[dentry_id_bucket(data->folderid)]=de;
+  psync_list_add_head(&dentry_lru, &de->lru);
+  dentry_cnt++;
+  pthread_mutex_unlock(&dentry_mutex);
+  psync_free(old);
+}
+
+void psync_fsfolder_cache_folder_changed(psync_fsfolderid_t folderid){
+  psync_fsfolder_dentry_t *de, *next;
+  pthread_mutex_lock(&dentry_mutex);
+  de=dentry_id_hash[dentry_id_bucket(folderid)];
+  while (de){
+    next=de->idnext;
+    if (de->data.folderid==folderid){
+      dentry_unlink_locked(de);
+      psync_free(de);
+    }
+    de=next;
+  }
+  pthread_mutex_unlock(&dentry_mutex);
+}
+
+void psync_fsfolder_cache_name_changed(psync_fsfolderid_t parentfolderid, const char *name){
+  psync_fsfolder_dentry_t *de;
+  size_t len;
+  len=strlen(name);
+  pthread_mutex_lock(&dentry_mutex);
+  de=dentry_find_locked(dentry_hash_func(parentfolderid, name, len), parentfolderid, name, len);
+  if (de)
+    dentry_unlink_locked(de);
+  pthread_mutex_unlock(&dentry_mutex);
+  psync_free(de);
+}
+
+void psync_fsfolder_cache_clean(){
+  psync_fsfolder_dentry_t *de;
+  pthread_mutex_lock(&dentry_mutex);
+  while (!psync_list_isempty(&dentry_lru)){
+    de=psync_list_element(dentry_lru.next, psync_fsfolder_dentry_t, lru);
+    dentry_unlink_locked(de);
+    psync_free(de);
+  }
+  pthread_mutex_unlock(&dentry_mutex);
+}
+
 static char *get_encname_for_folder(psync_fsfolderid_t folderid, const char *path, size_t len){
   char *name, *encname;
   psync_crypto_aes256_text_encoder_t enc;
@@ -88,7 +265,7 @@ static psync_fspath_t *ret_folder_data(psync_fsfolderid_t folderid, const char *
 PSYNC_NOINLINE void do_check_userid(uint64_t userid, uint64_t folderid, uint32_t *shareid){
   psync_sql_res *res;
   psync_uint_row row;
-  res=psync_sql_query_rdlock("SELECT id FROM sharedfolder WHERE userid=? AND folderid=?");
+  res=psync_sql_query_readonly("SELECT id FROM sharedfolder WHERE userid=? AND folderid=?");
   psync_sql_bind_uint(res, 1, userid);
   psync_sql_bind_uint(res, 2, folderid);
   if ((row=psync_sql_fetch_rowint(res)))
@@ -98,11 +275,50 @@ PSYNC_NOINLINE void do_check_userid(uint64_t userid, uint64_t folderid, uint32_t
   psync_sql_free_result(res);
 }
 
-static void check_userid(uint64_t userid, uint64_t folderid, uint32_t *shareid){
-  if (userid==psync_my_userid || *shareid)
-    return;
+/* looks up subfolder name (of length len) of folderid, for non-encrypted folders the dentry cache is tried before the database,
+ * returns 1 if found, 0 if not found and -1 on crypto error. *ename is set to the name as stored in the database, it has to be
+ * freed if it is not name.
+ */
+static int get_subfolder(psync_sql_res **res, psync_fsfolderid_t folderid, uint32_t flags, const char *name, size_t len,
+                         char **ename, psync_fsfolder_dentry_data_t *data){
+  psync_uint_row row;
+  if (flags&PSYNC_FOLDER_FLAG_ENCRYPTED){
+    *ename=get_encname_for_folder(folderid, name, len);
+    if (!*ename)
+      return -1;
+  }
+  else{
+    *ename=(char *)name;
+    if (dentry_cache_get(folderid, name, len, data))
+      return 1;
+  }
+  if (!*res)
+    *res=psync_sql_query_readonly("SELECT id, permissions, flags, userid FROM folder WHERE parentfolderid=? AND name=?");
+  else
+    psync_sql_reset(*res);
+  psync_sql_bind_int(*res, 1, folderid);
+  if (*ename==name)
+    psync_sql_bind_lstring(*res, 2, name, len);
   else
-    do_check_userid(userid, folderid, shareid);
+    psync_sql_bind_string(*res, 2, *ename);
+  row=psync_sql_fetch_rowint(*res);
+  if (!row)
+    return 0;
+  data->folderid=row[0];
+  data->permissions=row[1];
+  data->flags=row[2];
+  data->userid=row[3];
+  data->shareid=0;
+  if (data->userid!=psync_my_userid)
+    do_check_userid(data->userid, data->folderid, &data->shareid);
+  if (*ename==name)
+    dentry_cache_add(folderid, name, len, data);
+  return 1;
+}
+
+static void check_userid(const psync_fsfolder_dentry_data_t *data, uint32_t *shareid){
+  if (data->userid!=psync_my_userid && !*shareid)
+    *shareid=data->shareid;
 }
 
 psync_fspath_t *psync_fsfolder_resolve_path(const char *path){
@@ -111,11 +327,11 @@ psync_fspath_t *psync_fsfolder_resolve_path(const char *path){
   psync_fstask_folder_t *folder;
   psync_fstask_mkdir_t *mk;
   psync_sql_res *res;
-  psync_uint_row row;
+  psync_fsfolder_dentry_data_t de;
   char *ename;
   size_t len, elen;
   uint32_t permissions, flags, shareid;
-  int hasit;
+  int hasit, found;
   cryptoerr=0;
   res=NULL;
   if (*path!='/')
@@ -140,53 +356,41 @@ psync_fspath_t *psync_fsfolder_resolve_path(const char *path){
         psync_sql_free_result(res);
       return ret_folder_data(cfolderid, path, permissions, flags, shareid);
     }
-    if (!res)
-      res=psync_sql_query_rdlock("SELECT id, permissions, flags, userid FROM folder WHERE parentfolderid=? AND name=?");
-    else
-      psync_sql_reset(res);
-    psync_sql_bind_int(res, 1, cfolderid);
-    if (flags&PSYNC_FOLDER_FLAG_ENCRYPTED){
-      ename=get_encname_for_folder(cfolderid, path, len);
-      if (!ename)
-        break;
-      elen=strlen(ename);
-      psync_sql_bind_lstring(res, 2, ename, elen);
-    }
-    else{
-      psync_sql_bind_lstring(res, 2, path, len);
-      ename=(char *)path;
-      elen=len;
-    }
-    row=psync_sql_fetch_rowint(res);
+    found=get_subfolder(&res, cfolderid, flags, path, len, &ename, &de);
+    if (found==-1)
+      break;
     folder=psync_fstask_get_folder_tasks_rdlocked(cfolderid);
     if (folder){
-      char *name=psync_strndup(ename, elen);
+      elen=ename==path?len:strlen(ename);
+      psync_def_var_arr(name, char, elen+1);
+      memcpy(name, ename, elen);
+      name[elen]=0;
       if ((mk=psync_fstask_find_mkdir(folder, name, 0))){
         if (mk->flags&PSYNC_FOLDER_FLAG_INVISIBLE){
-          psync_free(name);
+          if (ename!=path)
+            psync_free(ename);
           break;
         }
         cfolderid=mk->folderid;
         flags=mk->flags;
         hasit=1;
       }
-      else if (row && !psync_fstask_find_rmdir(folder, name, 0)){
-        cfolderid=row[0];
-        permissions&=row[1];
-        flags=row[2];
+      else if (found && !psync_fstask_find_rmdir(folder, name, 0)){
+        cfolderid=de.folderid;
+        permissions&=de.permissions;
+        flags=de.flags;
         hasit=1;
-        check_userid(row[3], row[0], &shareid);
+        check_userid(&de, &shareid);
       }
       else
         hasit=0;
-      psync_free(name);
     }
     else{
-      if (row){
-        cfolderid=row[0];
-        permissions=row[1];
-        flags=row[2];
-        check_userid(row[3], row[0], &shareid);
+      if (found){
+        cfolderid=de.folderid;
+        permissions=de.permissions;
+        flags=de.flags;
+        check_userid(&de, &shareid);
         hasit=1;
       }
       else
@@ -209,11 +413,11 @@ psync_fsfolderid_t psync_fsfolderid_by_path(const char *path, uint32_t *pflags){
   psync_fstask_folder_t *folder;
   psync_fstask_mkdir_t *mk;
   psync_sql_res *res;
-  psync_uint_row row;
+  psync_fsfolder_dentry_data_t de;
   char *ename;
   size_t len, elen;
   uint32_t flags;
-  int hasit;
+  int hasit, found;
   res=NULL;
   cryptoerr=0;
   if (*path!='/')
@@ -235,45 +439,32 @@ psync_fsfolderid_t psync_fsfolderid_by_path(const char *path, uint32_t *pflags){
       len=sl-path;
     else
       len=strlen(path);
-    if (!res)
-      res=psync_sql_query_rdlock("SELECT id, flags FROM folder WHERE parentfolderid=? AND name=?");
-    else
-      psync_sql_reset(res);
-    psync_sql_bind_int(res, 1, cfolderid);
-    if (flags&PSYNC_FOLDER_FLAG_ENCRYPTED){
-      ename=get_encname_for_folder(cfolderid, path, len);
-      if (!ename)
-        break;
-      elen=strlen(ename);
-      psync_sql_bind_lstring(res, 2, ename, elen);
-    }
-    else{
-      psync_sql_bind_lstring(res, 2, path, len);
-      ename=(char *)path;
-      elen=len;
-    }
-    row=psync_sql_fetch_rowint(res);
+    found=get_subfolder(&res, cfolderid, flags, path, len, &ename, &de);
+    if (found==-1)
+      break;
     folder=psync_fstask_get_folder_tasks_rdlocked(cfolderid);
     if (folder){
-      char *name=psync_strndup(ename, elen);
+      elen=ename==path?len:strlen(ename);
+      psync_def_var_arr(name, char, elen+1);
+      memcpy(name, ename, elen);
+      name[elen]=0;
       if ((mk=psync_fstask_find_mkdir(folder, name, 0))){
         cfolderid=mk->folderid;
         flags=mk->flags;
         hasit=1;
       }
-      else if (row && !psync_fstask_find_rmdir(folder, name, 0)){
-        cfolderid=row[0];
-        flags=row[1];
+      else if (found && !psync_fstask_find_rmdir(folder, name, 0)){
+        cfolderid=de.folderid;
+        flags=de.flags;
         hasit=1;
       }
       else
         hasit=0;
-      psync_free(name);
     }
     else{
-      if (row){
-        cfolderid=row[0];
-        flags=row[1];
+      if (found){
+        cfolderid=de.folderid;
+        flags=de.flags;
         hasit=1;
       }
       else
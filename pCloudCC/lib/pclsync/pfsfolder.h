@@ -48,5 +48,9 @@ psync_fspath_t *psync_fsfolder_resolve_path(const char *path);
 psync_fsfolderid_t psync_fsfolderid_by_path(const char *path, uint32_t *pflags);
 int psync_fsfolder_crypto_error();
 
+void psync_fsfolder_cache_folder_changed(psync_fsfolderid_t folderid);
+void psync_fsfolder_cache_name_changed(psync_fsfolderid_t parentfolderid, const char *name);
+void psync_fsfolder_cache_clean();
+
 
 #endif
\ No newline at end of file
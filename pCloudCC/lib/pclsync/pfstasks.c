@@ -379,6 +379,7 @@ int psync_fstask_mkdir(psync_fsfolderid_t folderid, const char *name, uint32_t f
   psync_fstask_insert_into_tree(&folder->mkdirs, offsetof(psync_fstask_mkdir_t, name), &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
+  psync_fsfolder_cache_name_changed(folderid, name);
   if (!depend)
     psync_fsupload_wake();
   if (folderid>=0)
@@ -567,6 +568,7 @@ int psync_fstask_rmdir(psync_fsfolderid_t folderid, uint32_t parentflags, const
   psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
+  psync_fsfolder_cache_name_changed(folderid, name);
   if (depend==0)
     psync_fsupload_wake();
   return 0;
@@ -1225,6 +1227,8 @@ int psync_fstask_rename_folder(psync_fsfolderid_t folderid, psync_fsfolderid_t p
   psync_fstask_insert_into_tree(&folder->mkdirs, offsetof(psync_fstask_mkdir_t, name), &mk->tree);
   folder->taskscnt+=2;
   psync_fstask_release_folder_tasks_locked(folder);
+  psync_fsfolder_cache_name_changed(parentfolderid, name);
+  psync_fsfolder_cache_name_changed(to_folderid, new_name);
   psync_fsupload_wake();
   if (to_folderid>=0)
     psync_path_status_drive_folder_changed(to_folderid);
@@ -1307,6 +1311,7 @@ void psync_fstask_folder_deleted(psync_folderid_t parentfolderid, uint64_t taski
     }
     psync_fstask_release_folder_tasks_locked(folder);
   }
+  psync_fsfolder_cache_name_changed(parentfolderid, name);
 }
 
 static void psync_fstask_look_for_creat_in_db(psync_folderid_t parentfolderid, uint64_t taskid, const char *name, psync_fileid_t fileid){
@@ -1482,6 +1487,7 @@ void psync_fstask_folder_renamed(psync_folderid_t parentfolderid, uint64_t taski
     if (mk)
       psync_path_status_drive_folder_changed(parentfolderid);
   }
+  psync_fsfolder_cache_name_changed(parentfolderid, name);
   res=psync_sql_query("SELECT id, folderid, text1 FROM fstask WHERE id=?");
   psync_sql_bind_uint(res, 1, frtaskid);
   if (likely_log(row=psync_sql_fetch_row(res))){
@@ -1495,6 +1501,7 @@ void psync_fstask_folder_renamed(psync_folderid_t parentfolderid, uint64_t taski
       }
       psync_fstask_release_folder_tasks_locked(folder);
     }
+    psync_fsfolder_cache_name_changed(psync_get_snumber(row[1]), psync_get_string(row[2]));
   }
   psync_sql_free_result(res);
   res=psync_sql_prep_statement("DELETE FROM fstaskdepend WHERE dependfstaskid=?");
@@ -1830,6 +1837,7 @@ void psync_fstask_clean(){
       folder->taskscnt=0;
     }
   }
+  psync_fsfolder_cache_clean();
   psync_sql_unlock();
 }
 
@@ -42,6 +42,7 @@
 #include "pcache.h"
 #include "ppathstatus.h"
 #include "pdiff.h"
+#include "pcdc.h"
 #include <string.h>
 #include <ctype.h>
 
@@ -62,12 +63,18 @@ typedef struct {
   unsigned char status;
 } fsupload_task_t;
 
+typedef struct {
+  psync_list list;
+  uint64_t taskid;
+  int stop;
+} large_upload_t;
+
 static pthread_mutex_t upload_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t upload_cond=PTHREAD_COND_INITIALIZER;
-static uint64_t current_upload_taskid=0;
 static uint32_t upload_wakes=0;
-static int large_upload_running=0;
-static int stop_current_upload=0;
+/* both protected by the sql lock */
+static psync_list large_uploads=PSYNC_LIST_STATIC_INIT(large_uploads);
+static uint32_t large_upload_threads=0;
 static psync_list *current_upload_batch=NULL;
 
 static const uint32_t requiredstatuses[]={
@@ -436,8 +443,28 @@ static int save_meta(const binresult *meta, psync_folderid_t folderid, const cha
   return 0;
 }
 
+/* Chunk signatures are computed before save_meta, which fails if the file was written in the meantime, so they always
+ * match the saved revision. Modified files are often only partially present locally, then no signatures are computed.
+ */
+static psync_cdc_chunks_t *large_upload_chunk_file(const char *filepath, uint64_t size){
+  psync_cdc_chunks_t *chunks;
+  psync_file_t fd;
+  fd=psync_file_open(filepath, P_O_RDONLY, 0);
+  if (unlikely_log(fd==INVALID_HANDLE_VALUE))
+    return NULL;
+  chunks=psync_cdc_chunk_file(fd, 0, size, NULL);
+  psync_file_close(fd);
+  return chunks;
+}
+
+/* checksum, if known, is remembered for the new revision, so the content can be found in the read cache by checksum,
+ * fullcontent is set if filepath has all the content of the file */
 static int large_upload_save(psync_socket *api, uint64_t uploadid, psync_folderid_t folderid, const char *name,
-                             uint64_t taskid, uint64_t writeid, int newfile, uint64_t oldhash, const char *key, const char *filepath){
+                             uint64_t taskid, uint64_t writeid, int newfile, uint64_t oldhash, const char *key, const char *filepath,
+                             const unsigned char *checksum, int fullcontent){
+  const binresult *meta;
+  psync_cdc_chunks_t *chunks;
+  psync_sql_res *sql;
   binresult *res;
   psync_stat_t st;
   uint64_t result;
@@ -480,7 +507,22 @@ static int large_upload_save(psync_socket *api, uint64_t uploadid, psync_folderi
     handle_upload_api_error_taskid(result, taskid);
     return -1;
   }
-  ret=save_meta(psync_find_result(res, "metadata", PARAM_HASH), folderid, name, taskid, writeid, newfile, oldhash, key);
+  meta=psync_find_result(res, "metadata", PARAM_HASH);
+  if (fullcontent && !key && psync_find_result(meta, "size", PARAM_NUM)->num>=PSYNC_CDC_MIN_FILE_SIZE)
+    chunks=large_upload_chunk_file(filepath, psync_find_result(meta, "size", PARAM_NUM)->num);
+  else
+    chunks=NULL;
+  ret=save_meta(meta, folderid, name, taskid, writeid, newfile, oldhash, key);
+  if (!ret && chunks)
+    psync_cdc_save_chunks(psync_find_result(meta, "hash", PARAM_NUM)->num, chunks);
+  psync_free(chunks);
+  if (!ret && checksum){
+    sql=psync_sql_prep_statement("REPLACE INTO hashchecksum (hash, size, checksum) VALUES (?, ?, ?)");
+    psync_sql_bind_uint(sql, 1, psync_find_result(meta, "hash", PARAM_NUM)->num);
+    psync_sql_bind_uint(sql, 2, psync_find_result(meta, "size", PARAM_NUM)->num);
+    psync_sql_bind_lstring(sql, 3, (const char *)checksum, PSYNC_HASH_DIGEST_HEXLEN);
+    psync_sql_run_free(sql);
+  }
   psync_free(res);
   psync_diff_wake();
   return ret;
@@ -566,7 +608,29 @@ static int copy_file_if_exists(psync_socket *api, const unsigned char *hashhex,
   return ret;
 }
 
-static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename,
+/* Returns 1 if the file should be hashed while it is being sent, 0 if it is worth hashing it upfront in order to try
+ * getfilesbychecksum and -1 on error. Encrypted files are never deduplicated and for the rest a file of the same size
+ * has to be known in the account for a checksum match to be possible at all.
+ */
+static int large_upload_should_stream(const char *filename, const char *key, uint64_t *fsize){
+  psync_stat_t st;
+  psync_sql_res *res;
+  int ret;
+  if (unlikely_log(psync_stat(filename, &st)))
+    return -1;
+  *fsize=psync_stat_size(&st);
+  if (key)
+    return 1;
+  if (*fsize<PSYNC_FSUPLOAD_STREAM_MIN_SIZE)
+    return 0;
+  res=psync_sql_query_rdlock("SELECT 1 FROM file WHERE size=? LIMIT 1");
+  psync_sql_bind_uint(res, 1, *fsize);
+  ret=psync_sql_fetch_rowint(res)?0:1;
+  psync_sql_free_result(res);
+  return ret;
+}
+
+static int large_upload_creat(large_upload_t *lu, uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename,
                               psync_uploadid_t uploadid, uint64_t writeid, const char *key){
   psync_sql_res *sql;
   psync_socket *api;
@@ -576,10 +640,13 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   size_t rd;
   ssize_t rrd;
   psync_file_t fd;
-  int ret;
+  psync_hash_ctx hctx;
+  int ret, stream;
   unsigned char uploadhash[PSYNC_HASH_DIGEST_HEXLEN], filehash[PSYNC_HASH_DIGEST_HEXLEN], fileparthash[PSYNC_HASH_DIGEST_HEXLEN];
+  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN];
   debug(D_NOTICE, "uploading %s as %lu/%s (uploadid=%lu)", filename, (unsigned long)folderid, name, (unsigned long)uploadid);
   asize=0;
+  stream=0;
   if (uploadid){
     ret=psync_get_upload_checksum(uploadid, uploadhash, &usize);
     if (ret!=PSYNC_NET_OK){
@@ -591,8 +658,16 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   }
   if (uploadid)
     ret=psync_get_local_file_checksum_part(filename, filehash, &fsize, fileparthash, usize);
-  else
-    ret=psync_get_local_file_checksum(filename, filehash, &fsize);
+  else{
+    ret=large_upload_should_stream(filename, key, &fsize);
+    if (ret==1){
+      debug(D_NOTICE, "no candidate for checksum match for %s, hashing while uploading", filename);
+      stream=1;
+      ret=0;
+    }
+    else if (ret==0)
+      ret=psync_get_local_file_checksum(filename, filehash, &fsize);
+  }
   if (ret){
     perm_fail_upload_task(taskid);
     debug(D_WARNING, "could not open local file %s, skipping task", filename);
@@ -603,7 +678,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   api=psync_apipool_get();
   if (unlikely(!api))
     return -1;
-  if (!key){
+  if (!key && !stream){
     ret=copy_file_if_exists(api, filehash, fsize, folderid, name, taskid, writeid);
     if (ret!=0){
       if (ret==1){
@@ -651,12 +726,14 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   if (large_upload_creat_send_write(api, uploadid, usize, fsize-usize))
     goto err1;
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
+  if (stream)
+    psync_hash_init(&hctx);
   if (usize){
     asize=usize;
     psync_upload_add_bytes_uploaded(asize);
   }
   while (usize<fsize){
-    if (unlikely(stop_current_upload)){
+    if (unlikely(lu->stop)){
       debug(D_NOTICE, "got stop for file %s", name);
       goto err2;
     }
@@ -669,6 +746,8 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
     if (unlikely_log(rrd<=0))
       goto err2;
     usize+=rrd;
+    if (stream)
+      psync_hash_update(&hctx, buff, rrd);
     if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
       goto err2;
     asize+=rrd;
@@ -676,6 +755,10 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   }
   psync_free(buff);
   psync_file_close(fd);
+  if (stream){
+    psync_hash_final(hashbin, &hctx);
+    psync_binhex(filehash, hashbin, PSYNC_HASH_DIGEST_LEN);
+  }
   res=get_result(api);
   if (unlikely_log(!res))
     goto err0;
@@ -691,7 +774,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
     psync_process_api_error(result);
     goto errs;
   }
-  if (unlikely(stop_current_upload)){
+  if (unlikely(lu->stop)){
     debug(D_NOTICE, "got stop for file %s", name);
     psync_apipool_release(api);
     goto errs;
@@ -699,7 +782,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
   // large_upload_check_checksum releases api on failure
   if (large_upload_check_checksum(api, uploadid, filehash))
     goto errs;
-  if (unlikely(stop_current_upload)){
+  if (unlikely(lu->stop)){
     debug(D_NOTICE, "got stop for file %s", name);
     psync_apipool_release(api);
     goto errs;
@@ -713,7 +796,7 @@ static int large_upload_creat(uint64_t taskid, psync_folderid_t folderid, const
     psync_upload_sub_bytes_uploaded(asize);
     asize=0;
   }
-  return large_upload_save(api, uploadid, folderid, name, taskid, writeid, 1, 0, key, filename);
+  return large_upload_save(api, uploadid, folderid, name, taskid, writeid, 1, 0, key, filename, filehash, 1);
 ret01:
   psync_file_close(fd);
 ret0:
@@ -738,11 +821,12 @@ static int64_t i64min(int64_t a, int64_t b){
   return a<b?a:b;
 }
 
-static int upload_modify_send_copy_from(psync_socket *api, psync_uploadid_t uploadid, uint64_t offset, uint64_t length,
+static int upload_modify_send_copy_from(psync_socket *api, psync_uploadid_t uploadid, uint64_t uploadoffset, uint64_t offset, uint64_t length,
                                         psync_fileid_t fileid, uint64_t hash, uint64_t *upl){
-  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadoffset", offset), P_NUM("uploadid", uploadid),
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadoffset", uploadoffset), P_NUM("uploadid", uploadid),
                      P_NUM("fileid", fileid), P_NUM("hash", hash), P_NUM("offset", offset), P_NUM("count", length)};
-  debug(D_NOTICE, "copying %lu bytes from fileid %lu hash %lu at offset %lu", (unsigned long)length, (unsigned long)fileid, (unsigned long) hash, (unsigned long)offset);
+  debug(D_NOTICE, "copying %lu bytes to offset %lu from fileid %lu hash %lu at offset %lu", (unsigned long)length, (unsigned long)uploadoffset,
+        (unsigned long)fileid, (unsigned long) hash, (unsigned long)offset);
   if (unlikely_log(!send_command_no_res(api, "upload_writefromfile", params)))
     return PSYNC_NET_TEMPFAIL;
   else{
@@ -752,7 +836,7 @@ static int upload_modify_send_copy_from(psync_socket *api, psync_uploadid_t uplo
   }
 }
 
-static int upload_modify_send_local(psync_socket *api, psync_uploadid_t uploadid, uint64_t offset, uint64_t length, psync_file_t fd, uint64_t *upl){
+static int upload_modify_send_local(large_upload_t *lu, psync_socket *api, psync_uploadid_t uploadid, uint64_t offset, uint64_t length, psync_file_t fd, uint64_t *upl){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadoffset", offset), P_NUM("uploadid", uploadid)};
   void *buff;
   uint64_t bw;
@@ -766,7 +850,7 @@ static int upload_modify_send_local(psync_socket *api, psync_uploadid_t uploadid
 
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
   while (bw<length){
-    if (unlikely(stop_current_upload)){
+    if (unlikely(lu->stop)){
       debug(D_NOTICE, "got stop");
       goto err0;
     }
@@ -816,20 +900,22 @@ static int upload_modify_read_req(psync_socket *api){
     return PSYNC_NET_OK;
 }
 
-int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename, const char *indexname, psync_fileid_t fileid,
+static int upload_modify(large_upload_t *lu, uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename, const char *indexname, psync_fileid_t fileid,
               uint64_t hash, uint64_t writeid, const char *key){
   binparam aparams[]={P_STR("auth", psync_my_auth)};
   psync_interval_tree_t *tree, *cinterval;
+  psync_upload_range_list_t *le;
   psync_socket *api;
   binresult *res;
   psync_sql_res *sql;
-  int64_t fsize, coff, len;
+  psync_list rlist;
+  int64_t fsize, coff;
   uint64_t result, asize;
   psync_uploadid_t uploadid;
   psync_uint_t reqs;
   psync_file_t fd;
   psync_fs_err_t err;
-  int ret;
+  int ret, fullcontent;
   debug(D_NOTICE, "uploading modified file %s writeid %lu as %lu/%s", filename, (unsigned long)writeid, (unsigned long)folderid, name);
   asize=0;
   fd=psync_file_open(indexname, P_O_RDONLY, 0);
@@ -893,52 +979,69 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
   if (unlikely_log(fsize==-1))
     goto err3;
   debug(D_NOTICE, "file size=%lu", (unsigned long)fsize);
+  /* written intervals are uploaded, the rest is copied from the same offset of the old revision */
+  psync_list_init(&rlist);
   coff=0;
-  reqs=0;
+  fullcontent=1;
   cinterval=psync_interval_tree_get_first(tree);
   while (coff<fsize){
+    le=psync_new(psync_upload_range_list_t);
+    le->uploadoffset=coff;
+    le->off=coff;
+    if (!cinterval){
+      le->len=fsize-coff;
+      le->type=PSYNC_URANGE_COPY_FILE;
+      fullcontent=0;
+    }
+    else if (cinterval->from>coff){
+      le->len=i64min(cinterval->from, fsize)-coff;
+      le->type=PSYNC_URANGE_COPY_FILE;
+      fullcontent=0;
+    }
+    else if (cinterval->to>coff){
+      le->len=i64min(cinterval->to, fsize)-coff;
+      le->type=PSYNC_URANGE_UPLOAD;
+      cinterval=psync_interval_tree_get_next(cinterval);
+    }
+    else{
+      debug(D_BUG, "broken interval tree");
+      psync_free(le);
+      fullcontent=0;
+      break;
+    }
+    psync_list_add_tail(&rlist, &le->list);
+    coff+=le->len;
+  }
+  /* data that only moved within the file is found by its chunks and copied from its old offset */
+  if (!key && unlikely_log(psync_net_scan_file_for_chunks(&rlist, fileid, hash, fd)==PSYNC_NET_TEMPFAIL))
+    goto err4;
+  reqs=0;
+  psync_list_for_each_element(le, &rlist, psync_upload_range_list_t, list){
     if (reqs && (psync_socket_pendingdata(api) || psync_select_in(&api->sock, 1, 0)!=SOCKET_ERROR)){
       if ((ret=upload_modify_read_req(api))){
         if (unlikely_log(ret==PSYNC_NET_PERMFAIL))
           perm_fail_upload_task(taskid);
-        goto err3;
+        goto err4;
       }
       else
         reqs--;
     }
-    if (cinterval){
-      if (cinterval->from>coff){
-        len=i64min(cinterval->from, fsize)-coff;
-        ret=upload_modify_send_copy_from(api, uploadid, coff, len, fileid, hash, &asize);
-        reqs++;
-        coff+=len;
-      }
-      else if (cinterval->from<=coff && cinterval->to>coff){
-        ret=upload_modify_send_local(api, uploadid, coff, i64min(cinterval->to, fsize)-coff, fd, &asize);
-        reqs++;
-        coff=cinterval->to;
-        cinterval=psync_interval_tree_get_next(cinterval);
-      }
-      else{
-        debug(D_BUG, "broken interval tree");
-        break;
-      }
-    }
-    else{
-      ret=upload_modify_send_copy_from(api, uploadid, coff, fsize-coff, fileid, hash, &asize);
-      reqs++;
-      coff=fsize;
-    }
+    if (le->type==PSYNC_URANGE_UPLOAD)
+      ret=upload_modify_send_local(lu, api, uploadid, le->off, le->len, fd, &asize);
+    else
+      ret=upload_modify_send_copy_from(api, uploadid, le->uploadoffset, le->off, le->len, fileid, hash, &asize);
+    reqs++;
     if (ret){
       if (unlikely_log(ret==PSYNC_NET_PERMFAIL))
         perm_fail_upload_task(taskid);
-      goto err3;
+      goto err4;
     }
-    if (unlikely(stop_current_upload)){
+    if (unlikely(lu->stop)){
       debug(D_NOTICE, "got stop for file %s", name);
-      goto err3;
+      goto err4;
     }
   }
+  psync_list_for_each_element_call(&rlist, psync_upload_range_list_t, list, psync_free);
   psync_file_close(fd);
   while (reqs--)
     if ((ret=upload_modify_read_req(api))){
@@ -953,7 +1056,9 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
     psync_apipool_release(api);
     return -1;
   }
-  return large_upload_save(api, uploadid, folderid, name, taskid, writeid, 0, hash, key, filename);
+  return large_upload_save(api, uploadid, folderid, name, taskid, writeid, 0, hash, key, filename, NULL, fullcontent);
+err4:
+  psync_list_for_each_element_call(&rlist, psync_upload_range_list_t, list, psync_free);
 err3:
   psync_file_close(fd);
 err2:
@@ -964,7 +1069,16 @@ err1:
   return -1;
 }
 
+static large_upload_t *large_upload_find_locked(uint64_t taskid){
+  large_upload_t *lu;
+  psync_list_for_each_element(lu, &large_uploads, large_upload_t, list)
+    if (lu->taskid==taskid)
+      return lu;
+  return NULL;
+}
+
 static void large_upload(){
+  large_upload_t lu;
   uint64_t taskid, type, writeid;
   psync_uploadid_t uploadid;
   psync_folderid_t folderid;
@@ -979,15 +1093,25 @@ static void large_upload(){
   int ret;
   char fileidhex[sizeof(psync_fsfileid_t)*2+2];
   debug(D_NOTICE, "started");
+  lu.taskid=0;
   while (1){
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
+    /* tasks with status=2 have no dependencies left, so any of them can go in parallel with the ones other threads
+     * are uploading; the write lock makes picking a task and claiming it atomic */
+    psync_sql_lock();
+    if (lu.taskid){
+      psync_list_del(&lu.list);
+      lu.taskid=0;
+    }
     res=psync_sql_query("SELECT id, type, folderid, text1, text2, int1, fileid, int2 FROM fstask WHERE status=2 AND "
-                        "type IN ("NTO_STR(PSYNC_FS_TASK_CREAT)", "NTO_STR(PSYNC_FS_TASK_MODIFY)") ORDER BY id LIMIT 1");
-    row=psync_sql_fetch_row(res);
+                        "type IN ("NTO_STR(PSYNC_FS_TASK_CREAT)", "NTO_STR(PSYNC_FS_TASK_MODIFY)") ORDER BY id");
+    while ((row=psync_sql_fetch_row(res)))
+      if (!large_upload_find_locked(psync_get_number(row[0])))
+        break;
     if (!row){
-      large_upload_running=0;
-      current_upload_taskid=0;
+      large_upload_threads--;
       psync_sql_free_result(res);
+      psync_sql_unlock();
       break;
     }
     taskid=psync_get_number(row[0]);
@@ -1008,9 +1132,11 @@ static void large_upload(){
     len++;
     name=psync_new_cnt(char, len);
     memcpy(name, cname, len);
-    current_upload_taskid=taskid;
-    stop_current_upload=0;
+    lu.taskid=taskid;
+    lu.stop=0;
+    psync_list_add_tail(&large_uploads, &lu.list);
     psync_sql_free_result(res);
+    psync_sql_unlock();
     psync_binhex(fileidhex, &taskid, sizeof(psync_fsfileid_t));
     fileidhex[sizeof(psync_fsfileid_t)]='d';
     fileidhex[sizeof(psync_fsfileid_t)+1]=0;
@@ -1027,9 +1153,9 @@ static void large_upload(){
     psync_sql_free_result(res);
     psync_upload_inc_uploads();
     if (type==PSYNC_FS_TASK_CREAT)
-      ret=large_upload_creat(taskid, folderid, name, filename, uploadid, writeid, key);
+      ret=large_upload_creat(&lu, taskid, folderid, name, filename, uploadid, writeid, key);
     else if (type==PSYNC_FS_TASK_MODIFY)
-      ret=upload_modify(taskid, folderid, name, filename, indexname, fileid, hash, writeid, key);
+      ret=upload_modify(&lu, taskid, folderid, name, filename, indexname, fileid, hash, writeid, key);
     else{
       ret=0;
       debug(D_BUG, "wrong type %lu for task %lu", (unsigned long)type, (unsigned long)taskid);
@@ -1046,11 +1172,14 @@ static void large_upload(){
         uploadid=urow[0];
       else
         uploadid=2;
-      if (uploadid!=2)
-        current_upload_taskid=0;
       psync_sql_free_result(res);
-      if (uploadid!=2)
+      if (uploadid!=2){
+        psync_sql_lock();
+        psync_list_del(&lu.list);
+        lu.taskid=0;
+        psync_sql_unlock();
         psync_fsupload_wake();
+      }
       psync_milisleep(PSYNC_SLEEP_ON_FAILED_UPLOAD);
     }
     psync_free(indexname);
@@ -1063,21 +1192,25 @@ static void large_upload(){
 
 static int psync_sent_task_creat_upload_large(fsupload_task_t *task){
   psync_sql_res *res;
+  uint64_t maxthreads;
   res=psync_sql_prep_statement("UPDATE fstask SET status=2 WHERE id=? AND status=0");
   psync_sql_bind_uint(res, 1, task->id);
   //psync_fs_uploading_openfile(task->id);
-  if (!large_upload_running){
-    large_upload_running=1;
+  psync_sql_run_free(res);
+  maxthreads=psync_setting_get_uint(_PS(fsuploadthreads));
+  if (large_upload_threads<maxthreads || !large_upload_threads){
+    large_upload_threads++;
     psync_run_thread("large file fs upload", large_upload);
   }
-  psync_sql_run_free(res);
   return 0;
 }
 
 void psync_fsupload_stop_upload_locked(uint64_t taskid){
+  large_upload_t *lu;
   psync_sql_res *res;
-  if (current_upload_taskid==taskid)
-    stop_current_upload=1;
+  lu=large_upload_find_locked(taskid);
+  if (lu)
+    lu->stop=1;
   res=psync_sql_prep_statement("UPDATE fstask SET status=1 WHERE id=?");
   psync_sql_bind_uint(res, 1, taskid);
   psync_sql_run_free(res);
@@ -1803,7 +1936,7 @@ static void psync_fsupload_check_tasks(){
                         ", "NTO_STR(PSYNC_FS_TASK_MODIFY)") ORDER BY id LIMIT "NTO_STR(PSYNC_FSUPLOAD_NUM_TASKS_PER_RUN));
   while ((row=psync_sql_fetch_row(res))){
     cnt++;
-    if (psync_get_number(row[0])==current_upload_taskid)
+    if (large_upload_find_locked(psync_get_number(row[0])))
       continue;
     size=sizeof(fsupload_task_t);
     if (row[4].type==PSYNC_TSTRING)
@@ -43,6 +43,7 @@
 #define SQL_NO_LOCK    0
 #define SQL_READ_LOCK  1
 #define SQL_WRITE_LOCK 2
+#define SQL_READ_CONN  3
 
 struct run_after_ptr {
   struct run_after_ptr *next;
@@ -121,6 +122,31 @@ PSYNC_THREAD uint32_t psync_error=0;
 
 static pthread_mutex_t psync_db_checkpoint_mutex;
 
+typedef struct _psync_sql_read_conn_t {
+  struct _psync_sql_read_conn_t *next;
+  sqlite3 *db;
+  uint32_t gen;
+  uint32_t stmtnext;
+  psync_sql_res *stmts[PSYNC_DB_READ_STMT_CNT];
+} psync_sql_read_conn_t;
+
+typedef struct {
+  psync_list list;
+  pthread_mutex_t mutex;
+  psync_sql_res *slots[PSYNC_QUERY_THREAD_SLOTS];
+} psync_sql_stmt_slots_t;
+
+static pthread_key_t stmt_slots_key;
+static pthread_mutex_t stmt_slots_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_list stmt_slots_list=PSYNC_LIST_STATIC_INIT(stmt_slots_list);
+
+static pthread_mutex_t read_conn_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_sql_read_conn_t *read_conn_free=NULL;
+static uint32_t read_conn_cnt=0;
+static uint32_t read_conn_gen=0;
+static char *psync_db_path=NULL;
+static psync_file_t psync_db_lock_fd=INVALID_HANDLE_VALUE;
+
 static int in_transaction=0;
 static int transaction_failed=0;
 static psync_list tran_callbacks;
@@ -388,10 +414,202 @@ static void psync_sql_wal_checkpoint(){
 
 static int psync_sql_wal_hook(void *ptr, sqlite3 *db, const char *name, int numpages){
   if (numpages>=PSYNC_DB_CHECKPOINT_AT_PAGES)
-    psync_run_thread("checkpoint charlie", psync_sql_wal_checkpoint);
+    psync_run_pool(PSYNC_POOL_IO, "checkpoint charlie", psync_sql_wal_checkpoint);
   return SQLITE_OK;
 }
 
+/* Statements are cached per thread in a direct-mapped table indexed by the address of the query string, callers always
+ * pass string literals. A hit costs one array lookup under an uncontended mutex, misses and evicted statements go
+ * through the shared psync_cache keyed by the query text, so short lived threads still reuse prepared statements. */
+
+static void psync_sql_free_cache(void *ptr);
+
+/* the address is only a hint, a buffer that is reused for another query must not get the statement of the old one */
+static int psync_sql_res_matches(const psync_sql_res *res, const char *sql){
+  return res->sql==sql && !strcmp(sqlite3_sql(res->stmt), sql);
+}
+
+static uint32_t psync_sql_stmt_slot(const char *sql){
+  return (((uintptr_t)sql)>>3)%PSYNC_QUERY_THREAD_SLOTS;
+}
+
+static psync_sql_res *psync_sql_stmt_get(const char *sql){
+  psync_sql_stmt_slots_t *ss;
+  psync_sql_res *res;
+  uint32_t i;
+  ss=(psync_sql_stmt_slots_t *)pthread_getspecific(stmt_slots_key);
+  if (likely(ss)){
+    i=psync_sql_stmt_slot(sql);
+    pthread_mutex_lock(&ss->mutex);
+    res=ss->slots[i];
+    if (likely(res && psync_sql_res_matches(res, sql)))
+      ss->slots[i]=NULL;
+    else
+      res=NULL;
+    pthread_mutex_unlock(&ss->mutex);
+    if (likely(res))
+      return res;
+  }
+  res=(psync_sql_res *)psync_cache_get(sql);
+  if (res)
+    res->sql=sql;
+  return res;
+}
+
+static void psync_sql_stmt_put(psync_sql_res *res){
+  psync_sql_stmt_slots_t *ss;
+  psync_sql_res *old;
+  uint32_t i;
+  ss=(psync_sql_stmt_slots_t *)pthread_getspecific(stmt_slots_key);
+  if (unlikely(!ss)){
+    ss=psync_new(psync_sql_stmt_slots_t);
+    memset(ss->slots, 0, sizeof(ss->slots));
+    pthread_mutex_init(&ss->mutex, NULL);
+    pthread_mutex_lock(&stmt_slots_mutex);
+    psync_list_add_tail(&stmt_slots_list, &ss->list);
+    pthread_mutex_unlock(&stmt_slots_mutex);
+    pthread_setspecific(stmt_slots_key, ss);
+  }
+  i=psync_sql_stmt_slot(res->sql);
+  pthread_mutex_lock(&ss->mutex);
+  old=ss->slots[i];
+  ss->slots[i]=res;
+  pthread_mutex_unlock(&ss->mutex);
+  if (old)
+    psync_cache_add(sqlite3_sql(old->stmt), old, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+}
+
+static void psync_sql_stmt_slots_flush(psync_sql_stmt_slots_t *ss){
+  psync_sql_res *res;
+  uint32_t i;
+  pthread_mutex_lock(&ss->mutex);
+  for (i=0; i<PSYNC_QUERY_THREAD_SLOTS; i++)
+    if ((res=ss->slots[i])){
+      ss->slots[i]=NULL;
+      psync_sql_free_cache(res);
+    }
+  pthread_mutex_unlock(&ss->mutex);
+}
+
+static void psync_sql_stmt_slots_free(void *ptr){
+  psync_sql_stmt_slots_t *ss=(psync_sql_stmt_slots_t *)ptr;
+  psync_sql_res *res;
+  uint32_t i;
+  pthread_mutex_lock(&stmt_slots_mutex);
+  psync_list_del(&ss->list);
+  pthread_mutex_unlock(&stmt_slots_mutex);
+  for (i=0; i<PSYNC_QUERY_THREAD_SLOTS; i++)
+    if ((res=ss->slots[i]))
+      psync_cache_add(sqlite3_sql(res->stmt), res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+  pthread_mutex_destroy(&ss->mutex);
+  psync_free(ss);
+}
+
+static void psync_sql_stmt_slots_clean_all(){
+  psync_sql_stmt_slots_t *ss;
+  pthread_mutex_lock(&stmt_slots_mutex);
+  psync_list_for_each_element(ss, &stmt_slots_list, psync_sql_stmt_slots_t, list)
+    psync_sql_stmt_slots_flush(ss);
+  pthread_mutex_unlock(&stmt_slots_mutex);
+}
+
+static void psync_sql_read_conn_close(psync_sql_read_conn_t *conn){
+  uint32_t i;
+  for (i=0; i<PSYNC_DB_READ_STMT_CNT; i++)
+    if (conn->stmts[i]){
+      sqlite3_finalize(conn->stmts[i]->stmt);
+      psync_free(conn->stmts[i]);
+    }
+  sqlite3_close(conn->db);
+  psync_free(conn);
+}
+
+static psync_sql_read_conn_t *psync_sql_read_conn_get(){
+  psync_sql_read_conn_t *conn;
+  char *path;
+  uint32_t gen;
+  int code;
+  pthread_mutex_lock(&read_conn_mutex);
+  conn=read_conn_free;
+  if (conn){
+    read_conn_free=conn->next;
+    pthread_mutex_unlock(&read_conn_mutex);
+    return conn;
+  }
+  if (read_conn_cnt>=PSYNC_DB_READ_CONNECTIONS || !psync_db_path){
+    pthread_mutex_unlock(&read_conn_mutex);
+    return NULL;
+  }
+  read_conn_cnt++;
+  path=psync_strdup(psync_db_path);
+  gen=read_conn_gen;
+  pthread_mutex_unlock(&read_conn_mutex);
+  conn=psync_new(psync_sql_read_conn_t);
+  memset(conn, 0, sizeof(psync_sql_read_conn_t));
+  conn->gen=gen;
+  code=sqlite3_open_v2(path, &conn->db, SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX, NULL);
+  psync_free(path);
+  if (unlikely(code!=SQLITE_OK)){
+    debug(D_WARNING, "could not open read connection to the database: %d", code);
+    sqlite3_close(conn->db);
+    psync_free(conn);
+    pthread_mutex_lock(&read_conn_mutex);
+    if (gen==read_conn_gen)
+      read_conn_cnt--;
+    pthread_mutex_unlock(&read_conn_mutex);
+    return NULL;
+  }
+  sqlite3_busy_timeout(conn->db, PSYNC_DB_READ_BUSY_TIMEOUT);
+  debug(D_NOTICE, "opened read connection %u to the database", (unsigned)read_conn_cnt);
+  return conn;
+}
+
+static void psync_sql_read_conn_put(psync_sql_read_conn_t *conn){
+  pthread_mutex_lock(&read_conn_mutex);
+  if (likely(conn->gen==read_conn_gen)){
+    conn->next=read_conn_free;
+    read_conn_free=conn;
+    conn=NULL;
+  }
+  pthread_mutex_unlock(&read_conn_mutex);
+  if (unlikely(conn))
+    psync_sql_read_conn_close(conn);
+}
+
+static void psync_sql_read_conns_close(){
+  psync_sql_read_conn_t *conn, *next;
+  pthread_mutex_lock(&read_conn_mutex);
+  conn=read_conn_free;
+  read_conn_free=NULL;
+  read_conn_cnt=0;
+  read_conn_gen++;
+  psync_free(psync_db_path);
+  psync_db_path=NULL;
+  pthread_mutex_unlock(&read_conn_mutex);
+  while (conn){
+    next=conn->next;
+    psync_sql_read_conn_close(conn);
+    conn=next;
+  }
+}
+
+static int psync_sql_lock_db_file(const char *db){
+  char *path;
+  path=psync_strcat(db, "-lock", NULL);
+  psync_db_lock_fd=psync_file_open(path, P_O_RDWR, P_O_CREAT);
+  psync_free(path);
+  if (unlikely(psync_db_lock_fd==INVALID_HANDLE_VALUE)){
+    debug(D_WARNING, "could not open lock file of database %s", db);
+    return 0;
+  }
+  if (psync_file_trylock(psync_db_lock_fd)){
+    psync_file_close(psync_db_lock_fd);
+    psync_db_lock_fd=INVALID_HANDLE_VALUE;
+    return -1;
+  }
+  return 0;
+}
+
 int psync_sql_connect(const char *db){
   static int initmutex=1;
   pthread_mutexattr_t mattr;
@@ -410,6 +628,10 @@ int psync_sql_connect(const char *db){
   }
   if (psync_stat(db, &st)!=0)
     initdbneeded=1;
+  if (psync_sql_lock_db_file(db)){
+    debug(D_ERROR, "database is locked");
+    return -1;
+  }
 
   code=sqlite3_open(db, &psync_db);
   if (likely(code==SQLITE_OK)){
@@ -419,17 +641,21 @@ int psync_sql_connect(const char *db){
       pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
       pthread_mutex_init(&psync_db_checkpoint_mutex, &mattr);
       pthread_mutexattr_destroy(&mattr);
+      pthread_key_create(&stmt_slots_key, psync_sql_stmt_slots_free);
       initmutex=0;
     }
     if (IS_DEBUG)
       sqlite3_config(SQLITE_CONFIG_LOG, psync_sql_err_callback, NULL);
     sqlite3_wal_hook(psync_db, psync_sql_wal_hook, NULL);
     psync_sql_statement(PSYNC_DATABASE_CONFIG);
+    pthread_mutex_lock(&read_conn_mutex);
+    psync_db_path=psync_strdup(db);
+    pthread_mutex_unlock(&read_conn_mutex);
     if (initdbneeded==1)
       return psync_sql_statement(PSYNC_DATABASE_STRUCTURE);
     else if (psync_sql_statement("DELETE FROM setting WHERE id='justcheckingiflocked'")){
       debug(D_ERROR, "database is locked");
-      sqlite3_close(psync_db);
+      psync_sql_close();
       psync_rwlock_destroy(&psync_db_lock);
       return -1;
     }
@@ -450,16 +676,23 @@ int psync_sql_connect(const char *db){
   }
   else{
     debug(D_CRITICAL, "could not open sqlite database %s: %d", db, code);
+    if (psync_db_lock_fd!=INVALID_HANDLE_VALUE){
+      psync_file_close(psync_db_lock_fd);
+      psync_db_lock_fd=INVALID_HANDLE_VALUE;
+    }
     return -1;
   }
 }
 
 int psync_sql_close(){
   int code, tries;
+  psync_sql_read_conns_close();
+  psync_sql_stmt_slots_clean_all();
   tries=0;
   while (1){
     code=sqlite3_close(psync_db);
     if (code==SQLITE_BUSY){
+      psync_sql_stmt_slots_clean_all();
       psync_cache_clean_all();
       tries++;
       if (tries>100){
@@ -474,6 +707,10 @@ int psync_sql_close(){
       break;
   }
   psync_db=NULL;
+  if (psync_db_lock_fd!=INVALID_HANDLE_VALUE){
+    psync_file_close(psync_db_lock_fd);
+    psync_db_lock_fd=INVALID_HANDLE_VALUE;
+  }
   if (unlikely(code!=SQLITE_OK)){
     debug(D_CRITICAL, "error when closing database: %d", code);
     code=sqlite3_close_v2(psync_db);
@@ -1188,7 +1425,7 @@ psync_sql_res *psync_sql_do_query(const char *sql, const char *file, unsigned li
 psync_sql_res *psync_sql_query(const char *sql){
 #endif
   psync_sql_res *ret;
-  ret=(psync_sql_res *)psync_cache_get(sql);
+  ret=psync_sql_stmt_get(sql);
   if (ret){
 //    debug(D_NOTICE, "got query %s from cache", sql);
     ret->locked=SQL_WRITE_LOCK;
@@ -1248,7 +1485,7 @@ psync_sql_res *psync_sql_do_query_rdlock(const char *sql, const char *file, unsi
 psync_sql_res *psync_sql_query_rdlock(const char *sql){
 #endif
   psync_sql_res *ret;
-  ret=(psync_sql_res *)psync_cache_get(sql);
+  ret=psync_sql_stmt_get(sql);
   if (ret){
 //    debug(D_NOTICE, "got query %s from cache", sql);
     ret->locked=SQL_READ_LOCK;
@@ -1267,6 +1504,80 @@ psync_sql_res *psync_sql_query_rdlock(const char *sql){
 #endif
 }
 
+/* Runs the query on one of the read-only connections, so it does not take psync_db_lock and sees the last committed
+ * state of the database. Writers commit only under the write lock, so a thread holding the read lock sees exactly the
+ * state that in-memory data protected by the lock matches, while its queries still do not serialize on the main
+ * connection. Threads holding the write lock (possibly inside a transaction) and callers that can't get a connection
+ * fall back to psync_sql_query_rdlock. */
+#if IS_DEBUG
+psync_sql_res *psync_sql_do_query_readonly(const char *sql, const char *file, unsigned line){
+#else
+psync_sql_res *psync_sql_query_readonly(const char *sql){
+#endif
+  psync_sql_read_conn_t *conn;
+  sqlite3_stmt *stmt;
+  psync_sql_res *res;
+  uint32_t i;
+  int code, cnt;
+  if (psync_rwlock_holding_wrlock(&psync_db_lock) || !(conn=psync_sql_read_conn_get()))
+    goto fallback;
+  for (i=0; i<PSYNC_DB_READ_STMT_CNT; i++)
+    if (conn->stmts[i] && psync_sql_res_matches(conn->stmts[i], sql)){
+      res=conn->stmts[i];
+      res->locked=SQL_READ_CONN;
+      return res;
+    }
+  code=sqlite3_prepare_v2(conn->db, sql, -1, &stmt, NULL);
+  if (unlikely(code!=SQLITE_OK)){
+    debug(D_NOTICE, "could not prepare %s on read connection: %s", sql, sqlite3_errmsg(conn->db));
+    psync_sql_read_conn_put(conn);
+    goto fallback;
+  }
+  cnt=sqlite3_column_count(stmt);
+  res=(psync_sql_res *)psync_malloc(sizeof(psync_sql_res)+cnt*sizeof(psync_variant));
+  res->stmt=stmt;
+  res->sql=sql;
+  res->rconn=conn;
+  res->column_count=cnt;
+  res->locked=SQL_READ_CONN;
+  return res;
+fallback:
+#if IS_DEBUG
+  return psync_sql_do_query_rdlock(sql, file, line);
+#else
+  return psync_sql_query_rdlock(sql);
+#endif
+}
+
+static void psync_sql_read_conn_free_result(psync_sql_res *res, int cache){
+  psync_sql_read_conn_t *conn;
+  uint32_t i;
+  conn=res->rconn;
+  for (i=0; i<PSYNC_DB_READ_STMT_CNT; i++)
+    if (conn->stmts[i]==res)
+      break;
+  if (cache && sqlite3_reset(res->stmt)==SQLITE_OK){
+#if IS_DEBUG
+    memset(res->row, 0xff, res->column_count*sizeof(psync_variant));
+#endif
+    if (i==PSYNC_DB_READ_STMT_CNT){
+      i=conn->stmtnext++%PSYNC_DB_READ_STMT_CNT;
+      if (conn->stmts[i]){
+        sqlite3_finalize(conn->stmts[i]->stmt);
+        psync_free(conn->stmts[i]);
+      }
+      conn->stmts[i]=res;
+    }
+  }
+  else{
+    if (i<PSYNC_DB_READ_STMT_CNT)
+      conn->stmts[i]=NULL;
+    sqlite3_finalize(res->stmt);
+    psync_free(res);
+  }
+  psync_sql_read_conn_put(conn);
+}
+
 #if IS_DEBUG
 psync_sql_res *psync_sql_do_query_nolock_nocache(const char *sql, const char *file, unsigned line){
 #else
@@ -1311,7 +1622,7 @@ psync_sql_res *psync_sql_query_nolock(const char *sql){
     abort();
   }
 #endif
-  ret=(psync_sql_res *)psync_cache_get(sql);
+  ret=psync_sql_stmt_get(sql);
   if (ret){
 //    debug(D_NOTICE, "got query %s from cache", sql);
     ret->locked=SQL_NO_LOCK;
@@ -1353,18 +1664,27 @@ static void psync_sql_res_unlock(psync_sql_res *res){
 }
 
 void psync_sql_free_result(psync_sql_res *res){
-  int code=sqlite3_reset(res->stmt);
+  int code;
+  if (res->locked==SQL_READ_CONN){
+    psync_sql_read_conn_free_result(res, 1);
+    return;
+  }
+  code=sqlite3_reset(res->stmt);
   psync_sql_res_unlock(res);
 #if IS_DEBUG
   memset(res->row, 0xff, res->column_count*sizeof(psync_variant));
 #endif
   if (code==SQLITE_OK)
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+    psync_sql_stmt_put(res);
   else
     psync_sql_free_cache(res);
 }
 
 void psync_sql_free_result_nocache(psync_sql_res *res){
+  if (res->locked==SQL_READ_CONN){
+    psync_sql_read_conn_free_result(res, 0);
+    return;
+  }
   sqlite3_finalize(res->stmt);
   psync_sql_res_unlock(res);
 #if IS_DEBUG
@@ -1415,7 +1735,7 @@ psync_sql_res *psync_sql_do_prep_statement(const char *sql, const char *file, un
 psync_sql_res *psync_sql_prep_statement(const char *sql){
 #endif
   psync_sql_res *ret;
-  ret=psync_cache_get(sql);
+  ret=psync_sql_stmt_get(sql);
   if (ret){
 //    debug(D_NOTICE, "got statement %s from cache", sql);
     ret->locked=SQL_WRITE_LOCK;
@@ -1493,7 +1813,7 @@ int psync_sql_run_free(psync_sql_res *res){
   }
   else{
     psync_sql_res_unlock(res);
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+    psync_sql_stmt_put(res);
     return 0;
   }
 }
@@ -1686,7 +2006,6 @@ void psync_libs_init(){
 
 static void run_after_sec(psync_timer_t timer, void *ptr){
   struct run_after_ptr *fp=(struct run_after_ptr *)ptr;
-  psync_timer_stop(timer);
   fp->run(fp->ptr);
   psync_free(fp);
 }
@@ -1696,16 +2015,15 @@ void psync_run_after_sec(psync_run_after_t run, void *ptr, uint32_t seconds){
   fp=psync_new(struct run_after_ptr);
   fp->run=run;
   fp->ptr=ptr;
-  psync_timer_register(run_after_sec, seconds, fp);
+  psync_timer_oneshot_ms(run_after_sec, (uint64_t)seconds*1000, fp);
 }
 
 static void free_after_sec(psync_timer_t timer, void *ptr){
-  psync_timer_stop(timer);
   psync_free(ptr);
 }
 
 void psync_free_after_sec(void *ptr, uint32_t seconds){
-  psync_timer_register(free_after_sec, seconds, ptr);
+  psync_timer_oneshot_ms(free_after_sec, (uint64_t)seconds*1000, ptr);
 }
 
 int psync_match_pattern(const char *name, const char *pattern, size_t plen){
@@ -2406,6 +2724,7 @@ void psync_qpartition(void *base, size_t cnt, size_t sort_first, size_t size, in
 
 void psync_try_free_memory(){
   sqlite3_db_release_memory(psync_db);
+  psync_sql_stmt_slots_clean_all();
   psync_cache_clean_all();
 }
 
@@ -150,9 +150,12 @@ typedef struct {
   };
 } psync_variant;
 
+struct _psync_sql_read_conn_t;
+
 typedef struct {
   sqlite3_stmt *stmt;
   const char *sql;
+  struct _psync_sql_read_conn_t *rconn;
   int column_count;
   int locked;
   psync_variant row[];
@@ -214,6 +217,10 @@ int psync_sql_reopen(const char *path);
 void psync_sql_checkpoint_lock();
 void psync_sql_checkpoint_unlock();
 
+/* The cached query functions (all but the _nocache ones) look prepared statements up by the address of sql and only then
+ * compare the text. Pass string literals, a query built at run time in a reused buffer is still correct, but misses the
+ * per thread cache most of the time. */
+
 #if IS_DEBUG
 
 #define psync_sql_trylock() psync_sql_do_trylock(__FILE__, __LINE__)
@@ -226,6 +233,7 @@ void psync_sql_checkpoint_unlock();
 #define psync_sql_query(sql) psync_sql_do_query(sql, __FILE__, __LINE__)
 #define psync_sql_query_rdlock_nocache(sql) psync_sql_do_query_rdlock_nocache(sql, __FILE__, __LINE__)
 #define psync_sql_query_rdlock(sql) psync_sql_do_query_rdlock(sql, __FILE__, __LINE__)
+#define psync_sql_query_readonly(sql) psync_sql_do_query_readonly(sql, __FILE__, __LINE__)
 #define psync_sql_query_nolock_nocache(sql) psync_sql_do_query_nolock_nocache(sql, __FILE__, __LINE__)
 #define psync_sql_query_nolock(sql) psync_sql_do_query_nolock(sql, __FILE__, __LINE__)
 #define psync_sql_prep_statement_nocache(sql) psync_sql_do_prep_statement_nocache(sql, __FILE__, __LINE__)
@@ -241,6 +249,7 @@ psync_sql_res *psync_sql_do_query_nocache(const char *sql, const char *file, uns
 psync_sql_res *psync_sql_do_query(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_do_query_rdlock_nocache(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_do_query_rdlock(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
+psync_sql_res *psync_sql_do_query_readonly(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_do_query_nolock_nocache(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_do_query_nolock(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_do_prep_statement_nocache(const char *sql, const char *file, unsigned line) PSYNC_NONNULL(1);
@@ -260,6 +269,7 @@ psync_sql_res *psync_sql_query_nocache(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_query(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_query_rdlock_nocache(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_query_rdlock(const char *sql) PSYNC_NONNULL(1);
+psync_sql_res *psync_sql_query_readonly(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_query_nolock(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_query_nolock_nocache(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_prep_statement(const char *sql) PSYNC_NONNULL(1);
@@ -192,29 +192,47 @@ static void process_pipe(){
     debug(D_ERROR, "invalid message type %u", (unsigned int)msg.type);
 }
 
+static localnotify_watch *find_watch(localnotify_dir *dir, int wd){
+  localnotify_watch *wch;
+  wch=dir->watches[wd%WATCH_HASH];
+  while (wch && wch->watchid!=wd)
+    wch=wch->next;
+  return wch;
+}
+
+/* Every event marks the folder it happened in as changed, so the scanner only has to look at these folders. Folders
+ * moved into the tree are also marked recursively, as their contents may differ from what the database has. */
 static void process_notification(localnotify_dir *dir){
   ssize_t rd, off;
   struct inotify_event ev;
   localnotify_watch *wch, **pwch;
   struct stat st;
+  int overflow;
   char buff[8*1024];
   rd=read(dir->inotifyfd, buff, sizeof(buff));
   off=0;
+  overflow=0;
   while (off<rd){
     memcpy(&ev, buff+off, offsetof(struct inotify_event, name));
-    if (ev.mask&(IN_CREATE|IN_MOVED_TO)){
-      wch=dir->watches[ev.wd%WATCH_HASH];
-      while (wch){
-        if (wch->watchid==ev.wd){
+    if (unlikely(ev.mask&IN_Q_OVERFLOW)){
+      debug(D_NOTICE, "inotify queue overflow for %s", dir->path);
+      overflow=1;
+    }
+    else if (ev.mask&(IN_CREATE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_CLOSE_WRITE)){
+      wch=find_watch(dir, ev.wd);
+      if (wch){
+        if (!overflow)
+          psync_localscan_folder_changed(dir->syncid, wch->path, 0);
+        if (ev.mask&(IN_CREATE|IN_MOVED_TO)){
           wch->path[wch->pathlen]='/';
           psync_strlcpy(wch->path+wch->pathlen+1, buff+off+offsetof(struct inotify_event, name), wch->namelen+1);
-          if (!lstat(wch->path, &st) && S_ISDIR(st.st_mode))
+          if (!lstat(wch->path, &st) && S_ISDIR(st.st_mode)){
+            if ((ev.mask&IN_MOVED_TO) && !overflow)
+              psync_localscan_folder_changed(dir->syncid, wch->path, 1);
             add_dir_scan(dir, wch->path);
+          }
           wch->path[wch->pathlen]=0;
-          break;
         }
-        else
-          wch=wch->next;
       }
     }
     else if (ev.mask&IN_DELETE_SELF){
@@ -235,7 +253,7 @@ static void process_notification(localnotify_dir *dir){
     }
     off+=offsetof(struct inotify_event, name)+ev.len;
   }
-  if (rd>0)
+  if (overflow)
     psync_wake_localscan();
 }
 
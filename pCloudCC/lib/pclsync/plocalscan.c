@@ -64,11 +64,27 @@ typedef struct {
   char name[1];
 } sync_folderlist;
 
+typedef struct _dirty_folder {
+  psync_list list;
+  struct _dirty_folder *next;
+  psync_syncid_t syncid;
+  uint32_t hash;
+  int recursive;
+  char path[];
+} dirty_folder;
+
+#define DIRTY_HASH_SIZE 1024
+
 static pthread_mutex_t scan_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t scan_cond=PTHREAD_COND_INITIALIZER;
 static uint32_t scan_wakes=0;
 static uint32_t restart_scan=0;
 static uint32_t scan_stoppers=0;
+static uint32_t full_scan=1;
+static uint32_t dirty_cnt=0;
+static psync_list dirty_folders=PSYNC_LIST_STATIC_INIT(dirty_folders);
+/* the same folders in a hash by syncid and path, so that repeated notifications do not walk the whole queue */
+static dirty_folder *dirty_hash[DIRTY_HASH_SIZE];
 
 static const uint32_t requiredstatuses[]={
   PSTATUS_COMBINE(PSTATUS_TYPE_AUTH, PSTATUS_AUTH_PROVIDED),
@@ -287,7 +303,7 @@ static void add_modified_file(const sync_folderlist *e, const sync_folderlist *d
 }
 
 static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid, psync_folderid_t localfolderid,
-                                psync_syncid_t syncid, psync_synctype_t synctype, psync_deviceid_t deviceid){
+                                psync_syncid_t syncid, psync_synctype_t synctype, psync_deviceid_t deviceid, int recursive){
   psync_list disklist, dblist, *ldisk, *ldb;
   sync_folderlist *l, *fdisk, *fdb;
   char *subpath;
@@ -357,12 +373,13 @@ static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid
     if (psync_current_time-starttime>=PSYNC_LOCALSCAN_SLEEPSEC_PER_SCAN*3/2)
       localsleepperfolder=0;
   }
-  psync_list_for_each_element(l, &disklist, sync_folderlist, list)
-    if (l->isfolder && l->localid){
-      subpath=psync_strcat(localpath, PSYNC_DIRECTORY_SEPARATOR, l->name, NULL);
-      scanner_scan_folder(subpath, l->remoteid, l->localid, syncid, synctype, l->deviceid);
-      psync_free(subpath);
-    }
+  if (recursive)
+    psync_list_for_each_element(l, &disklist, sync_folderlist, list)
+      if (l->isfolder && l->localid){
+        subpath=psync_strcat(localpath, PSYNC_DIRECTORY_SEPARATOR, l->name, NULL);
+        scanner_scan_folder(subpath, l->remoteid, l->localid, syncid, synctype, l->deviceid, 1);
+        psync_free(subpath);
+      }
   psync_list_for_each_element_call(&disklist, sync_folderlist, list, psync_free);
 }
 
@@ -584,7 +601,7 @@ static void scan_created_folder(sync_folderlist *fl){
   localpath=psync_local_path_for_local_folder(fl->localid, fl->syncid, NULL);
   if (likely_log(localpath)){
     debug(D_NOTICE, "scanning just created folder %s localid %lu name %s", localpath, (unsigned long)fl->localid, fl->name);
-    scanner_scan_folder(localpath, 0, fl->localid, fl->syncid, fl->synctype, fl->deviceid);
+    scanner_scan_folder(localpath, 0, fl->localid, fl->syncid, fl->synctype, fl->deviceid, 1);
     psync_free(localpath);
   }
 }
@@ -703,6 +720,7 @@ retry:
       psync_sql_bind_uint(res, 1, fl->syncid);
       psync_sql_bind_uint(res, 2, fl->localid);
       psync_sql_run_free(res);
+      psync_task_queue_invalidate(PSYNC_TASK_UPLOAD);
     }
     else{
       psync_sql_commit_transaction();
@@ -728,13 +746,88 @@ retry:
     }\
   } while (0)
 
-static void scanner_scan(int first){
+/* Finds the deepest folder on the path of df that is already in localfolder and scans it. Folders that are not yet
+ * known are found as new by that scan and scanned recursively by scan_created_folder. */
+static void scanner_scan_dirty_folder(const sync_list *l, const dirty_folder *df){
+  psync_sql_res *res;
+  psync_uint_row row;
+  const char *rel, *end;
+  char *name, *path;
+  psync_folderid_t folderid, localfolderid;
+  psync_deviceid_t deviceid;
+  size_t rootlen, len;
+  int recursive, found;
+  rootlen=strlen(l->localpath);
+  while (rootlen && l->localpath[rootlen-1]==PSYNC_DIRECTORY_SEPARATORC)
+    rootlen--;
+  if (psync_filename_cmpn(l->localpath, df->path, rootlen) || (df->path[rootlen] && df->path[rootlen]!=PSYNC_DIRECTORY_SEPARATORC)){
+    debug(D_WARNING, "changed folder %s is not under sync root %s", df->path, l->localpath);
+    return;
+  }
+  folderid=l->folderid;
+  localfolderid=0;
+  deviceid=l->deviceid;
+  recursive=df->recursive;
+  rel=df->path+rootlen;
+  while (1){
+    while (*rel==PSYNC_DIRECTORY_SEPARATORC)
+      rel++;
+    if (!*rel)
+      break;
+    end=strchr(rel, PSYNC_DIRECTORY_SEPARATORC);
+    len=end?end-rel:strlen(rel);
+    name=psync_strndup(rel, len);
+    res=psync_sql_query_rdlock("SELECT id, folderid, deviceid FROM localfolder WHERE localparentfolderid=? AND syncid=? AND name=?");
+    psync_sql_bind_uint(res, 1, localfolderid);
+    psync_sql_bind_uint(res, 2, l->syncid);
+    psync_sql_bind_string(res, 3, name);
+    if ((row=psync_sql_fetch_rowint(res))){
+      localfolderid=row[0];
+      folderid=row[1];
+      deviceid=row[2];
+      found=1;
+    }
+    else
+      found=0;
+    psync_sql_free_result(res);
+    psync_free(name);
+    if (!found){
+      recursive=0;
+      break;
+    }
+    rel+=len;
+  }
+  path=psync_strndup(df->path, rel-df->path);
+  len=strlen(path);
+  while (len>rootlen && path[len-1]==PSYNC_DIRECTORY_SEPARATORC)
+    path[--len]=0;
+  debug(D_NOTICE, "scanning changed folder %s%s", path, recursive?" recursively":"");
+  scanner_scan_folder(path, folderid, localfolderid, l->syncid, l->synctype, deviceid, recursive);
+  psync_free(path);
+}
+
+static void scanner_scan_dirty(psync_list *dirty){
+  psync_list slist;
+  dirty_folder *df;
+  sync_list *l;
+  scanner_set_syncs_to_list(&slist);
+  psync_list_for_each_element(df, dirty, dirty_folder, list)
+    psync_list_for_each_element(l, &slist, sync_list, list)
+      if (l->syncid==df->syncid){
+        scanner_scan_dirty_folder(l, df);
+        break;
+      }
+  psync_list_for_each_element_call(&slist, sync_list, list, psync_free);
+}
+
+/* scans all syncs when dirty is NULL, otherwise only the folders in dirty */
+static void scanner_scan(int first, psync_list *dirty){
   psync_list slist, newtmp, *l1, *l2;
   sync_folderlist *fl;
   sync_list *l;
   psync_uint_t i, w, trn, restartsleep;
   int movedfolders;
-  if (first)
+  if (first || dirty)
     localsleepperfolder=0;
   else{
     i=psync_sql_cellint("SELECT COUNT(*) FROM localfolder", 100);
@@ -758,12 +851,16 @@ restart:
     return;
   for (i=0; i<SCAN_LIST_CNT; i++)
     psync_list_init(&scan_lists[i]);
-  scanner_set_syncs_to_list(&slist);
   changes=0;
   movedfolders=0;
-  psync_list_for_each_element(l, &slist, sync_list, list)
-    scanner_scan_folder(l->localpath, l->folderid, 0, l->syncid, l->synctype, l->deviceid);
-  psync_list_for_each_element_call(&slist, sync_list, list, psync_free);
+  if (dirty)
+    scanner_scan_dirty(dirty);
+  else{
+    scanner_set_syncs_to_list(&slist);
+    psync_list_for_each_element(l, &slist, sync_list, list)
+      scanner_scan_folder(l->localpath, l->folderid, 0, l->syncid, l->synctype, l->deviceid, 1);
+    psync_list_for_each_element_call(&slist, sync_list, list, psync_free);
+  }
   w=0;
   do {
     pthread_mutex_lock(&scan_mutex);
@@ -898,16 +995,40 @@ static int scanner_wait(){
   return ret;
 }
 
+/* Takes the folders queued by psync_localscan_folder_changed. Returns 1 if a full scan is due instead, that is when
+ * the scanner was woken up by psync_wake_localscan, the queue overflowed or the wait timed out. */
+static int scanner_take_dirty(psync_list *dirty, int woken){
+  psync_list *l1, *l2;
+  int full;
+  psync_list_init(dirty);
+  pthread_mutex_lock(&scan_mutex);
+  full=full_scan || !woken || psync_list_isempty(&dirty_folders);
+  if (!full)
+    psync_list_for_each_safe(l1, l2, &dirty_folders){
+      psync_list_del(l1);
+      psync_list_add_tail(dirty, l1);
+    }
+  else
+    psync_list_for_each_element_call(&dirty_folders, dirty_folder, list, psync_free);
+  psync_list_init(&dirty_folders);
+  memset(dirty_hash, 0, sizeof(dirty_hash));
+  dirty_cnt=0;
+  full_scan=0;
+  pthread_mutex_unlock(&scan_mutex);
+  return full;
+}
+
 static void scanner_thread(){
+  psync_list dirty;
   time_t lastscan;
   int w;
   psync_milisleep(1500);
   psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
   psync_wait_status(PSTATUS_TYPE_RUN, PSTATUS_RUN_RUN|PSTATUS_RUN_PAUSE);
-  scanner_scan(1);
+  scanner_take_dirty(&dirty, 0);
+  scanner_scan(1, NULL);
   psync_set_status(PSTATUS_TYPE_LOCALSCAN, PSTATUS_LOCALSCAN_READY);
-  scanner_wait();
-  w=0;
+  w=scanner_wait();
   lastscan=0;
   while (psync_do_run){
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
@@ -918,7 +1039,12 @@ static void scanner_thread(){
       pthread_mutex_unlock(&scan_mutex);
     }
     lastscan=psync_current_time;
-    scanner_scan(w);
+    if (scanner_take_dirty(&dirty, w))
+      scanner_scan(w, NULL);
+    else{
+      scanner_scan(w, &dirty);
+      psync_list_for_each_element_call(&dirty, dirty_folder, list, psync_free);
+    }
     w=scanner_wait();
   }
 }
@@ -926,12 +1052,57 @@ static void scanner_thread(){
 void psync_wake_localscan(){
   localsleepperfolder=0;
   pthread_mutex_lock(&scan_mutex);
+  full_scan=1;
   if (!scan_wakes++)
     pthread_cond_signal(&scan_cond);
   pthread_mutex_unlock(&scan_mutex);
   localsleepperfolder=0;
 }
 
+static uint32_t dirty_hash_func(psync_syncid_t syncid, const char *path, size_t *len){
+  const char *p;
+  uint32_t hash;
+  hash=(uint32_t)syncid*0xc2b2ae35U;
+  for (p=path; *p; p++)
+    hash=(unsigned char)*p+(hash<<5)+hash;
+  hash+=hash<<3;
+  hash^=hash>>11;
+  *len=p-path;
+  return hash;
+}
+
+void psync_localscan_folder_changed(psync_syncid_t syncid, const char *path, int recursive){
+  dirty_folder *df;
+  size_t len;
+  uint32_t hash;
+  hash=dirty_hash_func(syncid, path, &len);
+  pthread_mutex_lock(&scan_mutex);
+  if (full_scan)
+    goto wake;
+  for (df=dirty_hash[hash%DIRTY_HASH_SIZE]; df; df=df->next)
+    if (df->hash==hash && df->syncid==syncid && !memcmp(df->path, path, len+1)){
+      df->recursive|=recursive;
+      goto wake;
+    }
+  if (unlikely(++dirty_cnt>PSYNC_LOCALSCAN_MAX_DIRTY_FOLDERS)){
+    debug(D_NOTICE, "too many changed folders, doing a full scan");
+    full_scan=1;
+    goto wake;
+  }
+  df=(dirty_folder *)psync_malloc(offsetof(dirty_folder, path)+len+1);
+  df->syncid=syncid;
+  df->hash=hash;
+  df->recursive=recursive;
+  memcpy(df->path, path, len+1);
+  psync_list_add_tail(&dirty_folders, &df->list);
+  df->next=dirty_hash[hash%DIRTY_HASH_SIZE];
+  dirty_hash[hash%DIRTY_HASH_SIZE]=df;
+wake:
+  if (!scan_wakes++)
+    pthread_cond_signal(&scan_cond);
+  pthread_mutex_unlock(&scan_mutex);
+}
+
 void psync_restart_localscan(){
   pthread_mutex_lock(&scan_mutex);
   restart_scan=1;
@@ -28,8 +28,11 @@
 #ifndef _PSYNC_LOCALSCAN_H
 #define _PSYNC_LOCALSCAN_H
 
+#include "psynclib.h"
+
 void psync_localscan_init();
 void psync_wake_localscan();
+void psync_localscan_folder_changed(psync_syncid_t syncid, const char *path, int recursive);
 void psync_restart_localscan();
 void psync_stop_localscan();
 void psync_resume_localscan();
@@ -39,7 +39,10 @@
 #include "papi.h"
 #include "pcache.h"
 #include "ptree.h"
+#include "pcdc.h"
+#include "pblockhash.h"
 #include "gitcommit.h"
+#include "pasyncnet.h"
 
 struct time_bytes {
   time_t tm;
@@ -51,24 +54,6 @@ struct _psync_file_lock_t {
   char filename[];
 };
 
-typedef struct {
-  unsigned char sha1[PSYNC_SHA1_DIGEST_LEN];
-  uint32_t adler;
-} psync_block_checksum;
-
-typedef struct {
-  uint64_t filesize;
-  uint32_t blocksize;
-  uint32_t blockcnt;
-  uint32_t *next;
-  psync_block_checksum blocks[];
-} psync_file_checksums;
-
-typedef struct {
-  psync_uint_t elementcnt;
-  uint32_t elements[];
-} psync_file_checksum_hash;
-
 typedef struct {
   uint64_t filesize;
   uint32_t blocksize;
@@ -415,7 +400,12 @@ int psync_get_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum,
     return PSYNC_NET_OK;
   }
   psync_sql_free_result(sres);
-  res=psync_api_run_command("checksumfile", params);
+  /* checksums of different files do not depend on each other, so the calls of all threads can share the pipelined connection */
+  res=NULL;
+  if (psync_async_api_call_supported())
+    res=psync_async_run_command("checksumfile", params);
+  if (!res)
+    res=psync_api_run_command("checksumfile", params);
   if (!res)
     return PSYNC_NET_TEMPFAIL;
   result=psync_find_result(res, "result", PARAM_NUM)->num;
@@ -442,6 +432,98 @@ int psync_get_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum,
   return PSYNC_NET_OK;
 }
 
+typedef struct {
+  uint64_t lastms;
+  uint64_t lastprobe;
+  uint64_t bytes;
+  uint64_t bestrate;
+  uint32_t sleepms;
+  int pressure;
+} io_budget_t;
+
+static void io_budget_init(io_budget_t *b){
+  uint64_t stalled, total;
+  b->lastms=psync_millitime();
+  b->lastprobe=0;
+  b->bytes=0;
+  b->bestrate=0;
+  b->sleepms=0;
+  b->pressure=psync_get_io_stall(&stalled, &total)?-1:0;
+}
+
+/* Sleeps for ms and, if the system reports I/O stalls, updates b->pressure with the pressure measured while we were not
+ * reading. Our own reads would otherwise make us throttle ourselves on an otherwise idle disk.
+ */
+static void io_budget_pause(io_budget_t *b, uint32_t ms){
+  uint64_t stalled1, total1, stalled2, total2;
+  if (b->pressure==-1 || psync_get_io_stall(&stalled1, &total1)){
+    psync_milisleep(ms);
+    return;
+  }
+  psync_milisleep(ms);
+  if (psync_get_io_stall(&stalled2, &total2) || total2<=total1)
+    return;
+  if (stalled2<=stalled1)
+    b->pressure=0;
+  else if (stalled2-stalled1>=total2-total1)
+    b->pressure=100;
+  else
+    b->pressure=(stalled2-stalled1)*100/(total2-total1);
+}
+
+/* Called after each read of a checksumming loop. Unless checksums are set to run at full speed, every
+ * PSYNC_IO_BUDGET_CHECK_BYTES it backs off exponentially while other I/O keeps the system under pressure and speeds back
+ * up when it is gone. The pressure is only sampled during our own pauses, a short probe pause is made every
+ * PSYNC_IO_BUDGET_PROBE_INTERVAL ms for that. Where pressure is not reported a drop of our own read rate is taken as the
+ * sign of contention and a minimal sleep is always kept.
+ */
+static void io_budget_account(io_budget_t *b, size_t bytes){
+  uint64_t now, rate;
+  int contended;
+  b->bytes+=bytes;
+  if (b->bytes<PSYNC_IO_BUDGET_CHECK_BYTES)
+    return;
+  now=psync_millitime();
+  if (psync_setting_get_bool(_PS(fullspeedchecksums))){
+    b->bytes=0;
+    b->lastms=now;
+    return;
+  }
+  rate=b->bytes*1000/(now>b->lastms?now-b->lastms:1);
+  if (rate>b->bestrate)
+    b->bestrate=rate;
+  b->bytes=0;
+  if (b->pressure==-1)
+    contended=rate*PSYNC_IO_BUDGET_SLOWDOWN<b->bestrate;
+  else{
+    if (now-b->lastprobe>=PSYNC_IO_BUDGET_PROBE_INTERVAL){
+      io_budget_pause(b, PSYNC_IO_BUDGET_PROBE_SLEEP);
+      now=psync_millitime();
+      b->lastprobe=now;
+    }
+    contended=b->pressure>=PSYNC_IO_BUDGET_PRESSURE_HIGH;
+  }
+  if (contended){
+    if (b->sleepms<PSYNC_IO_BUDGET_MIN_SLEEP)
+      b->sleepms=PSYNC_IO_BUDGET_MIN_SLEEP;
+    else if (b->sleepms*2<=PSYNC_IO_BUDGET_MAX_SLEEP)
+      b->sleepms*=2;
+    else
+      b->sleepms=PSYNC_IO_BUDGET_MAX_SLEEP;
+  }
+  else if (b->pressure==-1 || b->pressure<=PSYNC_IO_BUDGET_PRESSURE_LOW)
+    b->sleepms/=2;
+  if (b->pressure==-1 && b->sleepms<PSYNC_IO_BUDGET_MIN_SLEEP)
+    b->sleepms=PSYNC_IO_BUDGET_MIN_SLEEP;
+  if (b->sleepms){
+    if (b->sleepms>=PSYNC_IO_BUDGET_MIN_SLEEP*4)
+      debug(D_NOTICE, "throttling checksum reads, pressure=%d, rate=%lu, sleeping %ums", b->pressure, (unsigned long)rate, (unsigned)b->sleepms);
+    io_budget_pause(b, b->sleepms);
+    now=psync_millitime();
+  }
+  b->lastms=now;
+}
+
 static int file_changed(psync_stat_t *st1, psync_stat_t *st2){
   return psync_stat_size(st1)!=psync_stat_size(st2) || psync_stat_mtime_native(st1)!=psync_stat_mtime_native(st2);
 }
@@ -453,19 +535,19 @@ int psync_get_local_file_checksum(const char *restrict filename, unsigned char *
   void *buff;
   size_t rs;
   ssize_t rrs;
-  psync_uint_t cnt;
+  io_budget_t iob;
   psync_file_t fd;
   unsigned char hashbin[PSYNC_HASH_DIGEST_LEN];
   fd=psync_file_open(filename, P_O_RDONLY, 0);
   if (fd==INVALID_HANDLE_VALUE)
     return PSYNC_NET_PERMFAIL;
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
+  io_budget_init(&iob);
 retry:
   if (unlikely_log(psync_fstat(fd, &st)))
     goto err1;
   psync_hash_init(&hctx);
   rsz=psync_stat_size(&st);
-  cnt=0;
   while (rsz){
     if (rsz>PSYNC_COPY_BUFFER_SIZE)
       rs=PSYNC_COPY_BUFFER_SIZE;
@@ -484,8 +566,7 @@ retry:
     }
     psync_hash_update(&hctx, buff, rrs);
     rsz-=rrs;
-    if (++cnt%16==0)
-      psync_milisleep(5);
+    io_budget_account(&iob, rrs);
   }
   if (unlikely_log(psync_fstat(fd, &st2)))
     goto err1;
@@ -517,7 +598,7 @@ int psync_get_local_file_checksum_part(const char *restrict filename, unsigned c
   void *buff;
   size_t rs;
   ssize_t rrs;
-  psync_uint_t cnt;
+  io_budget_t iob;
   psync_file_t fd;
   unsigned char hashbin[PSYNC_HASH_DIGEST_LEN];
   fd=psync_file_open(filename, P_O_RDONLY, 0);
@@ -526,10 +607,10 @@ int psync_get_local_file_checksum_part(const char *restrict filename, unsigned c
   if (unlikely_log(psync_fstat(fd, &st)))
     goto err1;
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
+  io_budget_init(&iob);
   psync_hash_init(&hctx);
   psync_hash_init(&hctxp);
   rsz=psync_stat_size(&st);
-  cnt=0;
   while (rsz){
     if (rsz>PSYNC_COPY_BUFFER_SIZE)
       rs=PSYNC_COPY_BUFFER_SIZE;
@@ -550,8 +631,7 @@ int psync_get_local_file_checksum_part(const char *restrict filename, unsigned c
       }
     }
     rsz-=rrs;
-    if (++cnt%16==0)
-      psync_milisleep(5);
+    io_budget_account(&iob, rrs);
   }
   psync_free(buff);
   psync_file_close(fd);
@@ -590,12 +670,36 @@ int psync_file_writeall_checkoverquota(psync_file_t fd, const void *buf, size_t
   return 0;
 }
 
+int psync_file_pwriteall_checkoverquota(psync_file_t fd, const void *buf, size_t count, uint64_t offset){
+  ssize_t wr;
+  while (count){
+    wr=psync_file_pwrite(fd, buf, count, offset);
+    if (wr==count){
+      psync_set_local_full(0);
+      return 0;
+    }
+    else if (wr==-1){
+      if (psync_fs_err()==P_NOSPC || psync_fs_err()==P_DQUOT){
+        psync_set_local_full(1);
+        psync_milisleep(PSYNC_SLEEP_ON_DISK_FULL);
+      }
+      return -1;
+    }
+    buf=(unsigned char*)buf+wr;
+    offset+=wr;
+    count-=wr;
+  }
+  return 0;
+}
+
 int psync_copy_local_file_if_checksum_matches(const char *source, const char *destination, const unsigned char *hexsum, uint64_t fsize){
   psync_file_t sfd, dfd;
   psync_hash_ctx hctx;
   void *buff;
   size_t rrd;
   ssize_t rd;
+  io_budget_t iob;
+  int cloned;
   unsigned char hashbin[PSYNC_HASH_DIGEST_LEN];
   char hashhex[PSYNC_HASH_DIGEST_HEXLEN];
   sfd=psync_file_open(source, P_O_RDONLY, 0);
@@ -606,8 +710,13 @@ int psync_copy_local_file_if_checksum_matches(const char *source, const char *de
   dfd=psync_file_open(destination, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
   if (unlikely_log(dfd==INVALID_HANDLE_VALUE))
     goto err1;
+  /* when the data can be cloned it still has to be read once to verify the checksum, but nothing is written */
+  cloned=!psync_file_clone(sfd, dfd, fsize);
+  if (cloned)
+    debug(D_NOTICE, "cloned %s to %s", source, destination);
   psync_hash_init(&hctx);
   buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
+  io_budget_init(&iob);
   while (fsize){
     if (fsize>PSYNC_COPY_BUFFER_SIZE)
       rrd=PSYNC_COPY_BUFFER_SIZE;
@@ -616,11 +725,12 @@ int psync_copy_local_file_if_checksum_matches(const char *source, const char *de
     rd=psync_file_read(sfd, buff, rrd);
     if (unlikely_log(rd<=0))
       goto err2;
-    if (unlikely_log(psync_file_writeall_checkoverquota(dfd, buff, rd)))
+    if (!cloned && unlikely_log(psync_file_writeall_checkoverquota(dfd, buff, rd)))
       goto err2;
     psync_yield_cpu();
     psync_hash_update(&hctx, buff, rd);
     fsize-=rd;
+    io_budget_account(&iob, rd);
   }
   psync_hash_final(hashbin, &hctx);
   psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
@@ -799,6 +909,21 @@ static psync_uint_t get_upload_bytes_this_sec(){
     return 0;
 }
 
+/* with several files uploading in parallel limit each write to an equal part of the per-second budget, so the
+ * first thread to wake up after a second boundary does not eat the whole of it */
+static psync_int_t upload_fair_share(psync_int_t wwr, psync_int_t speed){
+  psync_int_t cnt;
+  cnt=psync_status.filesuploading;
+  if (cnt>1){
+    speed/=cnt;
+    if (speed<PSYNC_UPL_AUTO_SHAPER_MIN/4)
+      speed=PSYNC_UPL_AUTO_SHAPER_MIN/4;
+    if (wwr>speed)
+      wwr=speed;
+  }
+  return wwr;
+}
+
 //static void set_send_buf(psync_socket *sock){
 //  psync_socket_set_sendbuf(sock, dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_BUF_PER/100);
 //}
@@ -825,6 +950,7 @@ int psync_socket_writeall_upload(psync_socket *sock, const void *buff, int num){
         wwr=dyn_upload_speed-thissec;
       else
         wwr=num;
+      wwr=upload_fair_share(wwr, dyn_upload_speed);
       if (!psync_socket_writable(sock)){
         dyn_upload_speed=(dyn_upload_speed*PSYNC_UPL_AUTO_SHAPER_DEC_PER)/100;
         if (dyn_upload_speed<PSYNC_UPL_AUTO_SHAPER_MIN)
@@ -851,6 +977,7 @@ int psync_socket_writeall_upload(psync_socket *sock, const void *buff, int num){
         wwr=uplspeed-thissec;
       else
         wwr=num;
+      wwr=upload_fair_share(wwr, uplspeed);
       wr=psync_socket_write(sock, buff, wwr);
       if (wr==-1)
         return writebytes?writebytes:wr;
@@ -1164,7 +1291,7 @@ void psync_http_connect_and_cache_host(const char *host){
   }
   pthread_mutex_unlock(&connect_cache_mutex);
   if (node)
-    psync_run_thread1("connect http cache", connect_cache_thread, node);
+    psync_run_pool1(PSYNC_POOL_IO, "connect http cache", connect_cache_thread, node);
   else
     debug(D_NOTICE, "connection for %s is already in progress", host);
 }
@@ -1629,100 +1756,6 @@ static psync_block_checksum **psync_net_get_sorted_checksums(psync_file_checksum
   return ret;
 }*/
 
-static int psync_is_prime(psync_uint_t num){
-  psync_uint_t i;
-  for (i=5; i*i<=num; i+=2)
-    if (num%i==0)
-      return 0;
-  return 1;
-}
-
-#define MAX_ADLER_COLL 64
-
-/* Since it is fairly easy to generate adler32 collisions, a file can be crafted to contain many colliding blocks.
- * Our hash will drop entries if more than MAX_ADLER_COLL collisions are detected (actually we just don't travel more
- * than MAX_ADLER_COLL from our "perfect" position in the hash).
- */
-
-static psync_file_checksum_hash *psync_net_create_hash(const psync_file_checksums *checksums){
-  psync_file_checksum_hash *h;
-  psync_uint_t cnt, col;
-  uint32_t i, o;
-  cnt=((checksums->blockcnt+1)/2)*6+1;
-  while (1){
-    if (psync_is_prime(cnt))
-      break;
-    cnt+=4;
-    if (psync_is_prime(cnt))
-      break;
-    cnt+=2;
-  }
-  h=(psync_file_checksum_hash *)psync_malloc(offsetof(psync_file_checksum_hash, elements)+sizeof(uint32_t)*cnt);
-  h->elementcnt=cnt;
-  memset(h->elements, 0, sizeof(uint32_t)*cnt);
-  for (i=0; i<checksums->blockcnt; i++){
-    o=checksums->blocks[i].adler%cnt;
-    if (h->elements[o]){
-      col=0;
-      do {
-        if (!memcmp(checksums->blocks[i].sha1, checksums->blocks[h->elements[o]-1].sha1, PSYNC_SHA1_DIGEST_LEN)){
-          checksums->next[i]=h->elements[o];
-          break;
-        }
-        if (++o>=cnt)
-          o=0;
-        if (++col>MAX_ADLER_COLL)
-          break;
-      } while (h->elements[o]);
-      if (col>MAX_ADLER_COLL){
-        debug(D_WARNING, "too many collisions, ignoring a checksum %u", (unsigned)checksums->blocks[i].adler);
-        continue;
-      }
-    }
-    h->elements[o]=i+1;
-  }
-  return h;
-}
-
-static void psync_net_hash_remove(psync_file_checksum_hash *restrict hash, psync_file_checksums *restrict checksums,
-                                  uint32_t adler, const unsigned char *sha1){
-  uint32_t idx, zeroidx, o, bp;
-  o=adler%hash->elementcnt;
-  while (1){
-    idx=hash->elements[o];
-    if (unlikely_log(!idx))
-      return;
-    else if (checksums->blocks[idx-1].adler==adler && !memcmp(checksums->blocks[idx-1].sha1, sha1, PSYNC_SHA1_DIGEST_LEN))
-      break;
-    else if (++o>=hash->elementcnt)
-      o=0;
-  }
-  hash->elements[o]=0;
-  zeroidx=o;
-  while (1){
-    if (++o>=hash->elementcnt)
-      o=0;
-    idx=hash->elements[o];
-    if (!idx)
-      return;
-    bp=checksums->blocks[idx-1].adler%hash->elementcnt;
-    if (bp!=o){
-      while (1){
-        if (bp==zeroidx){
-          hash->elements[bp]=idx;
-          hash->elements[o]=0;
-          zeroidx=o;
-          break;
-        }
-        else if (bp==o)
-          break;
-        else if (++bp>=hash->elementcnt)
-          bp=0;
-      }
-    }
-  }
-}
-
 static void psync_net_block_match_found(psync_file_checksum_hash *restrict hash, psync_file_checksums *restrict checksums,
                                         psync_block_action *restrict blockactions, uint32_t idx, uint32_t fileidx, uint64_t fileoffset){
   uint32_t cidx;
@@ -1740,84 +1773,7 @@ static void psync_net_block_match_found(psync_file_checksum_hash *restrict hash,
     else
       break;
   }
-  psync_net_hash_remove(hash, checksums, checksums->blocks[idx].adler, checksums->blocks[idx].sha1);
-}
-
-static int psync_net_hash_has_adler(const psync_file_checksum_hash *hash, const psync_file_checksums *checksums, uint32_t adler){
-  uint32_t idx, o;
-  o=adler%hash->elementcnt;
-  while (1){
-    idx=hash->elements[o];
-    if (!idx)
-      return 0;
-    else if (checksums->blocks[idx-1].adler==adler)
-      return 1;
-    else if (++o>=hash->elementcnt)
-      o=0;
-  }
-}
-
-static uint32_t psync_net_hash_has_adler_and_sha1(const psync_file_checksum_hash *hash, const psync_file_checksums *checksums, uint32_t adler,
-                                                  const unsigned char *sha1){
-  uint32_t idx, o;
-  o=adler%hash->elementcnt;
-  while (1){
-    idx=hash->elements[o];
-    if (!idx)
-      return 0;
-    else if (checksums->blocks[idx-1].adler==adler && !memcmp(checksums->blocks[idx-1].sha1, sha1, PSYNC_SHA1_DIGEST_LEN))
-      return idx;
-    else if (++o>=hash->elementcnt)
-      o=0;
-  }
-}
-
-#define ADLER32_1(o) adler+=buff[o]; sum+=adler
-#define ADLER32_2(o) ADLER32_1(o); ADLER32_1(o+1)
-#define ADLER32_4(o) ADLER32_2(o); ADLER32_2(o+2)
-#define ADLER32_8(o) ADLER32_4(o); ADLER32_4(o+4)
-#define ADLER32_16() do{ ADLER32_8(0); ADLER32_8(8); } while (0)
-
-#define ADLER32_BASE    65521U
-#define ADLER32_NMAX    5552U
-#define ADLER32_INITIAL 1U
-
-static uint32_t adler32(uint32_t adler, const unsigned char *buff, size_t len){
-  uint32_t sum, i;
-  sum=adler>>16;
-  adler&=0xffff;
-  while (len>=ADLER32_NMAX) {
-    len-=ADLER32_NMAX;
-    for (i=0; i<ADLER32_NMAX/16; i++){
-      ADLER32_16();
-      buff+=16;
-    }
-    adler%=ADLER32_BASE;
-    sum%=ADLER32_BASE;
-  }
-  while (len>=16){
-    len-=16;
-    ADLER32_16();
-    buff+=16;
-  }
-  while (len--){
-    adler+=*buff++;
-    sum+=adler;
-  }
-  adler%=ADLER32_BASE;
-  sum%=ADLER32_BASE;
-  return adler|(sum<<16);
-}
-
-static uint32_t adler32_roll(uint32_t adler, unsigned char byteout, unsigned char bytein, uint32_t len){
-  uint32_t sum;
-  sum=adler>>16;
-  adler&=0xffff;
-  adler+=ADLER32_BASE+bytein-byteout;
-  sum=(ADLER32_BASE*ADLER32_BASE+sum-len*byteout-ADLER32_INITIAL+adler)%ADLER32_BASE;
-  /* dividing after sum calculation gives processor a chance to run the divisions in parallel */
-  adler%=ADLER32_BASE;
-  return adler|(sum<<16);
+  psync_block_hash_remove(hash, checksums->blocks[idx].adler, checksums->blocks[idx].sha1, checksums);
 }
 
 static void psync_net_check_file_for_blocks(const char *name, psync_file_checksums *restrict checksums,
@@ -1853,13 +1809,13 @@ static void psync_net_check_file_for_blocks(const char *name, psync_file_checksu
   }
   else
     bufferlen=buffersize;
-  adler=adler32(ADLER32_INITIAL, buff, checksums->blocksize);
+  adler=psync_adler32(PSYNC_ADLER32_INITIAL, buff, checksums->blocksize);
   outbyteoff=0;
   buffoff=0;
   inbyteoff=checksums->blocksize;
   blockmask=checksums->blocksize-1;
   while (1){
-    if (psync_net_hash_has_adler(hash, checksums, adler)){
+    if (psync_block_hash_has_adler(hash, adler)){
       if (outbyteoff<inbyteoff)
         psync_sha1(buff+outbyteoff, checksums->blocksize, sha1bin);
       else{
@@ -1868,7 +1824,7 @@ static void psync_net_check_file_for_blocks(const char *name, psync_file_checksu
         psync_sha1_update(&ctx, buff, inbyteoff);
         psync_sha1_final(sha1bin, &ctx);
       }
-      off=psync_net_hash_has_adler_and_sha1(hash, checksums, adler, sha1bin);
+      off=psync_block_hash_find(hash, checksums, adler, sha1bin);
       if (off)
         psync_net_block_match_found(hash, checksums, blockactions, off, fileidx, buffoff+outbyteoff);
     }
@@ -1904,7 +1860,7 @@ static void psync_net_check_file_for_blocks(const char *name, psync_file_checksu
         }
       }
     }
-    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], checksums->blocksize);
+    adler=psync_adler32_roll(hash, adler, buff[outbyteoff++], buff[inbyteoff++]);
   }
   psync_free(buff);
   psync_file_close(fd);
@@ -1928,12 +1884,12 @@ int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_
     psync_free(checksums);
     return PSYNC_NET_TEMPFAIL;
   }
-  hash=psync_net_create_hash(checksums);
+  hash=psync_block_hash_create(checksums);
   blockactions=psync_new_cnt(psync_block_action, checksums->blockcnt);
   memset(blockactions, 0, sizeof(psync_block_action)*checksums->blockcnt);
   for (i=0; i<filecnt; i++)
     psync_net_check_file_for_blocks(files[i], checksums, hash, blockactions, i);
-  psync_free(hash);
+  psync_block_hash_free(hash);
   range=psync_new(psync_range_list_t);
   range->len=checksums->blocksize;
   range->type=blockactions[0].type;
@@ -2007,7 +1963,7 @@ static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_ch
   }
   else
     bufferlen=buffersize;
-  adler=adler32(ADLER32_INITIAL, buff, checksums->blocksize);
+  adler=psync_adler32(PSYNC_ADLER32_INITIAL, buff, checksums->blocksize);
   outbyteoff=0;
   buffoff=0;
   inbyteoff=checksums->blocksize;
@@ -2015,7 +1971,7 @@ static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_ch
   ur=NULL;
   skipbytes=-1;
   while (buffoff+outbyteoff<len){
-    if (psync_net_hash_has_adler(hash, checksums, adler)){
+    if (psync_block_hash_has_adler(hash, adler)){
       if (outbyteoff<inbyteoff)
         psync_sha1(buff+outbyteoff, checksums->blocksize, sha1bin);
       else{
@@ -2024,7 +1980,7 @@ static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_ch
         psync_sha1_update(&ctx, buff, inbyteoff);
         psync_sha1_final(sha1bin, &ctx);
       }
-      blockidx=psync_net_hash_has_adler_and_sha1(hash, checksums, adler, sha1bin);
+      blockidx=psync_block_hash_find(hash, checksums, adler, sha1bin);
       if (blockidx){
 //        debug(D_NOTICE, "got block, buffoff+outbyteoff=%lu, off=%lu, blockidx=%u", buffoff+outbyteoff, off, (unsigned)(blockidx-1));
         if (buffoff+outbyteoff+checksums->blocksize<=len)
@@ -2086,15 +2042,15 @@ static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_ch
         outbyteoff+=skipbytes;
         skipbytes=-1;
         if (outbyteoff<inbyteoff)
-          adler=adler32(ADLER32_INITIAL, buff+outbyteoff, checksums->blocksize);
+          adler=psync_adler32(PSYNC_ADLER32_INITIAL, buff+outbyteoff, checksums->blocksize);
         else{
-          adler=adler32(ADLER32_INITIAL, buff+outbyteoff, buffersize-outbyteoff);
-          adler=adler32(adler, buff, inbyteoff);
+          adler=psync_adler32(PSYNC_ADLER32_INITIAL, buff+outbyteoff, buffersize-outbyteoff);
+          adler=psync_adler32(adler, buff, inbyteoff);
         }
         continue;
       }
     }
-    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], checksums->blocksize);
+    adler=psync_adler32_roll(hash, adler, buff[outbyteoff++], buff[inbyteoff++]);
   }
   psync_free(buff);
   return PSYNC_NET_OK;
@@ -2156,14 +2112,14 @@ int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_f
     return PSYNC_NET_OK;
   else if (unlikely_log(rt==PSYNC_NET_TEMPFAIL))
     return PSYNC_NET_TEMPFAIL;
-  hash=psync_net_create_hash(checksums);
+  hash=psync_block_hash_create(checksums);
   psync_list_for_each_safe(l, lb, rlist){
     ur=psync_list_element(l, psync_upload_range_list_t, list);
     if (ur->len<checksums->blocksize || ur->type!=PSYNC_URANGE_UPLOAD)
       continue;
     psync_list_init(&nr);
     if (check_range_for_blocks(checksums, hash, ur->off, ur->len, fd, &nr)==PSYNC_NET_TEMPFAIL){
-      psync_free(hash);
+      psync_block_hash_free(hash);
       psync_free(checksums);
       return PSYNC_NET_TEMPFAIL;
     }
@@ -2176,7 +2132,7 @@ int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_f
       merge_list_to_element(ur, &nr);
     }
   }
-  psync_free(hash);
+  psync_block_hash_free(hash);
   psync_free(checksums);
   return PSYNC_NET_OK;
 }
@@ -2194,14 +2150,14 @@ int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync
     return PSYNC_NET_OK;
   else if (unlikely_log(rt==PSYNC_NET_TEMPFAIL))
     return PSYNC_NET_TEMPFAIL;
-  hash=psync_net_create_hash(checksums);
+  hash=psync_block_hash_create(checksums);
   psync_list_for_each_safe(l, lb, rlist){
     ur=psync_list_element(l, psync_upload_range_list_t, list);
     if (ur->len<checksums->blocksize || ur->type!=PSYNC_URANGE_UPLOAD)
       continue;
     psync_list_init(&nr);
     if (check_range_for_blocks(checksums, hash, ur->off, ur->len, fd, &nr)==PSYNC_NET_TEMPFAIL){
-      psync_free(hash);
+      psync_block_hash_free(hash);
       psync_free(checksums);
       return PSYNC_NET_TEMPFAIL;
     }
@@ -2213,11 +2169,75 @@ int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync
       merge_list_to_element(ur, &nr);
     }
   }
-  psync_free(hash);
+  psync_block_hash_free(hash);
   psync_free(checksums);
   return PSYNC_NET_OK;
 }
 
+static int cdc_chunk_cmp(const void *p1, const void *p2){
+  const psync_cdc_chunk_t *c1=*(const psync_cdc_chunk_t **)p1;
+  const psync_cdc_chunk_t *c2=*(const psync_cdc_chunk_t **)p2;
+  return memcmp(c1->sha1, c2->sha1, PSYNC_SHA1_DIGEST_LEN);
+}
+
+/* Unlike psync_net_scan_file_for_blocks this does not need anything from the server, but works only if we have the chunk
+ * signatures of the revision (that is, if it was uploaded from here). Matching chunks are found at any offset, so data
+ * that only moved because of an insertion or a deletion is copied instead of uploaded.
+ */
+int psync_net_scan_file_for_chunks(psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, psync_file_t fd){
+  psync_cdc_chunks_t *oldchunks, *newchunks;
+  psync_cdc_chunk_t **sorted, *nc, **found;
+  psync_list *l, *lb;
+  psync_upload_range_list_t *ur, *le;
+  psync_list nr;
+  uint32_t i;
+  oldchunks=psync_cdc_load_chunks(filehash);
+  if (!oldchunks)
+    return PSYNC_NET_OK;
+  debug(D_NOTICE, "scanning fileid %lu hash %lu for chunks", (unsigned long)fileid, (unsigned long)filehash);
+  sorted=psync_new_cnt(psync_cdc_chunk_t *, oldchunks->chunkcnt);
+  for (i=0; i<oldchunks->chunkcnt; i++)
+    sorted[i]=&oldchunks->chunks[i];
+  qsort(sorted, oldchunks->chunkcnt, sizeof(psync_cdc_chunk_t *), cdc_chunk_cmp);
+  psync_list_for_each_safe(l, lb, rlist){
+    ur=psync_list_element(l, psync_upload_range_list_t, list);
+    if (ur->len<PSYNC_CDC_MIN_CHUNK*2 || ur->type!=PSYNC_URANGE_UPLOAD)
+      continue;
+    newchunks=psync_cdc_chunk_file(fd, ur->off, ur->len, NULL);
+    if (unlikely_log(!newchunks)){
+      psync_free(sorted);
+      psync_free(oldchunks);
+      return PSYNC_NET_TEMPFAIL;
+    }
+    psync_list_init(&nr);
+    le=NULL;
+    for (i=0; i<newchunks->chunkcnt; i++){
+      nc=&newchunks->chunks[i];
+      found=(psync_cdc_chunk_t **)bsearch(&nc, sorted, oldchunks->chunkcnt, sizeof(psync_cdc_chunk_t *), cdc_chunk_cmp);
+      if (!found || (*found)->len!=nc->len)
+        continue;
+      if (le && le->off+le->len==(*found)->off && le->uploadoffset+le->len==nc->off)
+        le->len+=nc->len;
+      else{
+        le=psync_new(psync_upload_range_list_t);
+        le->uploadoffset=nc->off;
+        le->off=(*found)->off;
+        le->len=nc->len;
+        le->type=PSYNC_URANGE_COPY_FILE;
+        le->file.fileid=fileid;
+        le->file.hash=filehash;
+        psync_list_add_tail(&nr, &le->list);
+      }
+    }
+    psync_free(newchunks);
+    if (!psync_list_isempty(&nr))
+      merge_list_to_element(ur, &nr);
+  }
+  psync_free(sorted);
+  psync_free(oldchunks);
+  return PSYNC_NET_OK;
+}
+
 static int is_revision_local(const unsigned char *localhashhex, uint64_t filesize, psync_fileid_t fileid){
   psync_sql_res *res;
   psync_uint_row row;
@@ -117,6 +117,7 @@ int psync_get_local_file_checksum_part(const char *restrict filename, unsigned c
                                        unsigned char *restrict phexsum, uint64_t pfsize);
 int psync_copy_local_file_if_checksum_matches(const char *source, const char *destination, const unsigned char *hexsum, uint64_t fsize);
 int psync_file_writeall_checkoverquota(psync_file_t fd, const void *buf, size_t count);
+int psync_file_pwriteall_checkoverquota(psync_file_t fd, const void *buf, size_t count, uint64_t offset);
 
 int psync_set_default_sendbuf(psync_socket *sock);
 void psync_account_downloaded_bytes(int unsigned bytes);
@@ -140,6 +141,7 @@ char *psync_url_decode(const char *s);
 int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_t filehash, uint64_t filesize, char *const *files, uint32_t filecnt);
 int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, psync_file_t fd);
 int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync_uploadid_t uploadid, psync_file_t fd);
+int psync_net_scan_file_for_chunks(psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, psync_file_t fd);
 
 int psync_is_revision_of_file(const unsigned char *localhashhex, uint64_t filesize, psync_fileid_t fileid, int *isrev);
 
@@ -35,16 +35,57 @@
 #include "pfsupload.h"
 #include "pfscrypto.h"
 #include "pcrc32c.h"
+#include "pfileio.h"
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 
-#define CACHE_PAGES (PSYNC_FS_MEMORY_CACHE/PSYNC_FS_PAGE_SIZE)
-#define CACHE_HASH (CACHE_PAGES/2)
-
-#define PAGE_WAITER_HASH 1024
+/* cache_hash buckets are protected by CACHE_LOCK_STRIPES independent locks, bucket h by cache_stripes[h%CACHE_LOCK_STRIPES]. The
+ * number of buckets is always a multiple of CACHE_LOCK_STRIPES, so the stripe of a page does not depend on the size of the hash and
+ * the hash can be resized while holding all stripe locks. The bucket should therefore be computed only after the stripe is locked.
+ */
+#define CACHE_LOCK_STRIPES 64
+
+/* waiters of all pages of a file are protected by the same lock, so buckets are partitioned between the locks by hash */
+#define PAGE_WAITER_HASH 4096
+#define PAGE_WAITER_STRIPES 16
+
+/* maximum number of consecutive pages that are stored as one extent (one row in pagecacheextent), 4Mb with 4k pages */
+#define CACHE_EXTENT_MAX_PAGES 1024
+
+/* the disk cache is stored in one file per tier, the cacheid of a page is its slot in the file of its tier with the tier in the
+ * bits above CACHE_TIER_SHIFT, so ids stored before there were tiers belong to the first one */
+#define CACHE_TIER_SHIFT 30
+#define cacheid_tier(id) ((uint32_t)((id)>>CACHE_TIER_SHIFT))
+#define cacheid_slot(id) ((id)&((1U<<CACHE_TIER_SHIFT)-1))
+#define cacheid_fd(id) (cache_tiers[cacheid_tier(id)].fd)
+#define cacheid_offset(id) ((uint64_t)cacheid_slot(id)*PSYNC_FS_PAGE_SIZE)
+#define tier_cacheid(tier, slot) (((uint32_t)(tier)<<CACHE_TIER_SHIFT)+(uint32_t)(slot))
+/* every entry of fscachetiers keeps its position as its tier number, entries that can not be used become dead tiers without a file */
+#define tier_is_dead(t) ((t)->fd==INVALID_HANDLE_VALUE)
+
+/* extents of every cache tier are kept in a segmented LRU, the segments are in order of eviction preference (the last one is evicted
+ * first). First pages of files and extents that were used at least 16/8/4/2 times go into protected segments, each of which can
+ * hold up to the given percent of the cache, the least recently used extents of a segment that goes above its share are demoted
+ * to the next segment. Everything else goes to the probation segment, which is evicted from first.
+ */
+#define CACHE_SEG_FIRST     0
+#define CACHE_SEG_XFIRST    1
+#define CACHE_SEG_USE16     2
+#define CACHE_SEG_USE8      3
+#define CACHE_SEG_USE4      4
+#define CACHE_SEG_USE2      5
+#define CACHE_SEG_PROBATION 6
+#define CACHE_SEG_CNT       7
 
-#define DB_CACHE_UPDATE_HASH (32*1024)
+#define PSYNC_FS_CACHE_LRU2_PERCENT 20
+#define PSYNC_FS_CACHE_LRU4_PERCENT 15
+#define PSYNC_FS_CACHE_LRU8_PERCENT 10
+#define PSYNC_FS_CACHE_LRU16_PERCENT 5
+#define PSYNC_FS_CACHE_LRU_FIRST_PAGES_PERCENT 15
+#define PSYNC_FS_CACHE_LRU_XFIRST_PAGES_PERCENT 5
+#define PSYNC_FS_FIRST_PAGES_UNDER_ID (PSYNC_FS_MIN_READAHEAD_START/PSYNC_FS_PAGE_SIZE)
+#define PSYNC_FS_XFIRST_PAGES_UNDER_ID (1024*1024/PSYNC_FS_PAGE_SIZE)
 
 #define PAGE_TYPE_FREE  0
 #define PAGE_TYPE_READ  1
@@ -53,10 +94,16 @@
 #define PAGE_TASK_TYPE_CREAT  0
 #define PAGE_TASK_TYPE_MODIFY 1
 
-#define pagehash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%CACHE_HASH)
-#define waiterhash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%PAGE_WAITER_HASH)
-#define lock_wait(hash) pthread_mutex_lock(&wait_page_mutex)
-#define unlock_wait(hash) pthread_mutex_unlock(&wait_page_mutex)
+#define pagehash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%cache_hash_size)
+#define stripe_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%CACHE_LOCK_STRIPES)
+#define waiterhash_by_hash_and_pageid(hash, pageid) \
+  (((hash)%PAGE_WAITER_STRIPES)*(PAGE_WAITER_HASH/PAGE_WAITER_STRIPES)+((hash)/PAGE_WAITER_STRIPES+(pageid))%(PAGE_WAITER_HASH/PAGE_WAITER_STRIPES))
+#define wait_mutex(hash) (&wait_page_mutex[(hash)%PAGE_WAITER_STRIPES])
+#define lock_wait(hash) pthread_mutex_lock(wait_mutex(hash))
+#define unlock_wait(hash) pthread_mutex_unlock(wait_mutex(hash))
+#define lock_stripe(h) pthread_mutex_lock(&cache_stripes[(h)%CACHE_LOCK_STRIPES].mutex)
+#define unlock_stripe(h) pthread_mutex_unlock(&cache_stripes[(h)%CACHE_LOCK_STRIPES].mutex)
+#define stripe_pages(h) cache_stripes[(h)%CACHE_LOCK_STRIPES].pages
 
 typedef struct {
   psync_list list;
@@ -72,11 +119,83 @@ typedef struct {
   uint8_t type;
 } psync_cache_page_t;
 
+/* lock order is wait_page_mutex, cache stripe, free_pages_mutex */
+typedef struct {
+  pthread_mutex_t mutex;
+  /* number of pages in the buckets of the stripe */
+  uint32_t pages;
+  /* keep locks of different stripes on separate cache lines */
+  char pad[64-sizeof(uint32_t)];
+} psync_cache_stripe_t;
+
+/* memory of the page cache is allocated in arenas, one at init and one more every time the cache is grown above what was ever
+ * allocated. Arenas are never unmapped, when the cache is shrunk pages are moved to retired_pages instead of free_pages and their
+ * memory is given back to the OS by the flush timer.
+ */
+typedef struct _psync_cache_arena_t {
+  struct _psync_cache_arena_t *next;
+  char *base;
+  uint32_t pagecnt;
+  /* reserved huge pages, memory of single pages can not be given back */
+  int hugetlb;
+} psync_cache_arena_t;
+
 typedef struct {
-  uint64_t pagecacheid;
+  /* tree is a node of cache_extents, ordered by hash and first pageid */
+  psync_tree tree;
+  /* dirtylist is an element of dirty_extents if lastuse or usecnt are to be written to the database, otherwise it is initialized as empty */
+  psync_list dirtylist;
+  /* seglist is an element of segs[seg] of the tier of the extent, most recently used first */
+  psync_list seglist;
+  uint64_t hash;
+  uint64_t pageid;
+  uint64_t dbid;
   time_t lastuse;
+  uint32_t cacheid;
+  uint32_t pagecnt;
+  uint32_t lastsize;
   uint32_t usecnt;
-} psync_cachepage_to_update;
+  uint8_t seg;
+  uint32_t crcs[];
+} psync_cache_extent_t;
+
+/* a run of free slots in free_runs of a tier, ordered by length and then by position */
+typedef struct {
+  psync_tree tree;
+  uint64_t from;
+  uint64_t to;
+} psync_cache_free_run_t;
+
+/* free_slots, max_page and in_pages are in slots of the file of the tier, max_page is how many are in use and in_pages the
+ * configured size. free_runs indexes the intervals of free_slots by length, both are only to be changed by slots_add_locked(),
+ * slots_remove_locked() and slots_cut_end_locked() */
+typedef struct {
+  psync_interval_tree_t *free_slots;
+  psync_tree *free_runs;
+  char *dir;
+  psync_list segs[CACHE_SEG_CNT];
+  uint64_t seg_pages[CACHE_SEG_CNT];
+  uint64_t in_pages;
+  uint64_t max_page;
+  uint32_t free_pages;
+  psync_file_t fd;
+  int full;
+} psync_cache_tier_t;
+
+/* extent to be moved to another tier by balance_cache_tiers() */
+typedef struct {
+  psync_cache_extent_t *ext;
+  char *buff;
+  uint32_t *crcs;
+  uint64_t hash;
+  uint64_t pageid;
+  uint64_t dbid;
+  uint32_t from;
+  uint32_t to;
+  uint32_t pagecnt;
+  uint32_t lastsize;
+  int ok;
+} psync_cache_move_t;
 
 typedef struct {
   /* list is an element of hash table for pages */
@@ -115,6 +234,11 @@ typedef struct {
   psync_openfile_t *of;
   psync_fileid_t fileid;
   uint64_t hash;
+  uint64_t sentms;
+  uint64_t firstms;
+  uint64_t bytes;
+  int32_t streamidx;
+  uint32_t streamgen;
   int needkey;
 } psync_request_t;
 
@@ -145,43 +269,57 @@ typedef struct {
   uint8_t freebuff;
 } psync_crypto_data_page;
 
-static psync_list cache_hash[CACHE_HASH];
-static uint32_t cache_pages_in_hash=0;
+static psync_list *cache_hash=NULL;
+static psync_uint_t cache_hash_size=0;
+static psync_cache_stripe_t cache_stripes[CACHE_LOCK_STRIPES];
+static uint32_t cache_pages=0;
 static uint32_t cache_pages_free;
+static uint32_t cache_pages_to_retire=0;
 static int cache_pages_reset=1;
 static psync_list free_pages;
+static psync_list retired_pages;
+/* number of pages at the head of retired_pages that still have their memory */
+static uint32_t retired_pages_unreset=0;
+static psync_cache_arena_t *cache_arenas=NULL;
 static psync_list wait_page_hash[PAGE_WAITER_HASH];
-static char *pages_base;
 static uint32_t free_page_waiters=0;
 static int flush_page_running=0;
 
-static psync_cachepage_to_update cachepages_to_update[DB_CACHE_UPDATE_HASH];
-static uint32_t cachepages_to_update_cnt=0;
-static uint32_t free_db_pages;
-
-static pthread_mutex_t clean_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t clean_cache_cond=PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_tree *cache_extents=PSYNC_TREE_EMPTY;
+static psync_list dirty_extents=PSYNC_LIST_STATIC_INIT(dirty_extents);
+static uint32_t cache_extents_cnt=0;
+static uint32_t dirty_extents_cnt=0;
+/* free slots in all tiers */
+static uint32_t free_db_pages=0;
+static psync_cache_tier_t cache_tiers[PSYNC_FS_CACHE_MAX_TIERS];
+static uint32_t cache_tier_cnt=0;
+static const uint8_t cache_seg_percent[CACHE_SEG_CNT]={
+  PSYNC_FS_CACHE_LRU_FIRST_PAGES_PERCENT,
+  PSYNC_FS_CACHE_LRU_XFIRST_PAGES_PERCENT,
+  PSYNC_FS_CACHE_LRU16_PERCENT,
+  PSYNC_FS_CACHE_LRU8_PERCENT,
+  PSYNC_FS_CACHE_LRU4_PERCENT,
+  PSYNC_FS_CACHE_LRU2_PERCENT,
+  100
+};
+
+static pthread_mutex_t evict_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t free_pages_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t extent_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t flush_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t resize_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t free_page_cond=PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t url_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t url_cache_cond=PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t wait_page_mutex;
+static pthread_mutex_t wait_page_mutex[PAGE_WAITER_STRIPES];
 static pthread_cond_t enc_key_cond=PTHREAD_COND_INITIALIZER;
 
-static uint32_t clean_cache_stoppers=0;
-static uint32_t clean_cache_waiters=0;
-static uint32_t clean_cache_in_progress=0;
+static uint32_t evict_stoppers=0;
 
 static int flushedbetweentimers=0;
 static int flushcacherun=0;
 static int upload_to_cache_thread_run=0;
 
-static uint64_t db_cache_in_pages;
-static uint64_t db_cache_max_page;
-
-static psync_file_t readcache=INVALID_HANDLE_VALUE;
-
 static psync_tree *url_cache_tree=PSYNC_TREE_EMPTY;
 
 static int flush_pages(int nosleep);
@@ -190,37 +328,18 @@ static void flush_pages_noret(){
   flush_pages(0);
 }
 
-static psync_cache_page_t *psync_pagecache_get_free_page_if_available(){
-  psync_cache_page_t *page;
-  int runthread;
-  runthread=0;
-  pthread_mutex_lock(&cache_mutex);
-  if (unlikely(cache_pages_free<=CACHE_PAGES*25/100 && !flushcacherun)){
-    flushcacherun=1;
-    runthread=1;
-  }
-  if (likely(!psync_list_isempty(&free_pages)))
-    page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
-  else
-    page=NULL;
-  pthread_mutex_unlock(&cache_mutex);
-  if (runthread)
-    psync_run_thread("flush pages get free page ifav", flush_pages_noret);
-  return page;
-}
-
 static psync_cache_page_t *psync_pagecache_get_free_page(int runflushcacheinside){
   psync_cache_page_t *page;
   int runthread;
   runthread=0;
-  pthread_mutex_lock(&cache_mutex);
-  if (unlikely(cache_pages_free<=CACHE_PAGES*25/100 && !flushcacherun)){
+  pthread_mutex_lock(&free_pages_mutex);
+  if (unlikely(cache_pages_free<=cache_pages*25/100 && !flushcacherun)){
     flushcacherun=1;
     if (runflushcacheinside){
-      pthread_mutex_unlock(&cache_mutex);
+      pthread_mutex_unlock(&free_pages_mutex);
       debug(D_NOTICE, "running flush cache on this thread");
       flush_pages(2);
-      pthread_mutex_lock(&cache_mutex);
+      pthread_mutex_lock(&free_pages_mutex);
     }
     else
       runthread=1;
@@ -232,21 +351,21 @@ static psync_cache_page_t *psync_pagecache_get_free_page(int runflushcacheinside
       debug(D_NOTICE, "no free pages, but somebody is flushing cache, waiting for a page");
       do {
         free_page_waiters++;
-        pthread_cond_wait(&free_page_cond, &cache_mutex);
+        pthread_cond_wait(&free_page_cond, &free_pages_mutex);
         free_page_waiters--;
       } while (flush_page_running && psync_list_isempty(&free_pages));
     }
     if (psync_list_isempty(&free_pages)){
       debug(D_NOTICE, "no free pages, flushing cache");
-      pthread_mutex_unlock(&cache_mutex);
+      pthread_mutex_unlock(&free_pages_mutex);
       flush_pages(1);
-      pthread_mutex_lock(&cache_mutex);
+      pthread_mutex_lock(&free_pages_mutex);
       while (unlikely(psync_list_isempty(&free_pages))){
-        pthread_mutex_unlock(&cache_mutex);
+        pthread_mutex_unlock(&free_pages_mutex);
         debug(D_NOTICE, "no free pages after flush, sleeping");
         psync_milisleep(200);
         flush_pages(1);
-        pthread_mutex_lock(&cache_mutex);
+        pthread_mutex_lock(&free_pages_mutex);
       }
     }
     else
@@ -254,7 +373,7 @@ static psync_cache_page_t *psync_pagecache_get_free_page(int runflushcacheinside
     page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
   }
   cache_pages_free--;
-  pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_unlock(&free_pages_mutex);
   if (runthread)
     psync_run_thread("flush pages get free page", flush_pages_noret);
   return page;
@@ -294,14 +413,69 @@ static void psync_pagecache_send_page_wait_page(psync_page_wait_t *pw, psync_cac
 }
 
 static void psync_pagecache_return_free_page_locked(psync_cache_page_t *page){
-  psync_list_add_head(&free_pages, &page->list);
-  cache_pages_free++;
+  if (unlikely(cache_pages_to_retire)){
+    psync_list_add_head(&retired_pages, &page->list);
+    retired_pages_unreset++;
+    cache_pages_to_retire--;
+    cache_pages--;
+  }
+  else{
+    psync_list_add_head(&free_pages, &page->list);
+    cache_pages_free++;
+  }
 }
 
 static void psync_pagecache_return_free_page(psync_cache_page_t *page){
-  pthread_mutex_lock(&cache_mutex);
+  pthread_mutex_lock(&free_pages_mutex);
   psync_pagecache_return_free_page_locked(page);
-  pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_unlock(&free_pages_mutex);
+}
+
+/* returns pages linked in the list by page->list to the free list */
+static void psync_pagecache_return_free_pages(psync_list *pages){
+  if (psync_list_isempty(pages))
+    return;
+  pthread_mutex_lock(&free_pages_mutex);
+  while (!psync_list_isempty(pages))
+    psync_pagecache_return_free_page_locked(psync_list_remove_head_element(pages, psync_cache_page_t, list));
+  if (free_page_waiters)
+    pthread_cond_broadcast(&free_page_cond);
+  pthread_mutex_unlock(&free_pages_mutex);
+}
+
+static void add_page_to_hash(psync_cache_page_t *page){
+  psync_uint_t h;
+  lock_stripe(stripe_by_hash_and_pageid(page->hash, page->pageid));
+  h=pagehash_by_hash_and_pageid(page->hash, page->pageid);
+  psync_list_add_tail(&cache_hash[h], &page->list);
+  stripe_pages(h)++;
+  unlock_stripe(h);
+}
+
+/* locks the stripe of the bucket the page is currently in, the hash of the page can only be changed by somebody holding it */
+static psync_uint_t lock_page_stripe(psync_cache_page_t *page){
+  psync_uint_t s;
+  while (1){
+    s=stripe_by_hash_and_pageid(page->hash, page->pageid);
+    lock_stripe(s);
+    if (likely(s==stripe_by_hash_and_pageid(page->hash, page->pageid)))
+      return pagehash_by_hash_and_pageid(page->hash, page->pageid);
+    unlock_stripe(s);
+  }
+}
+
+/* locks the stripe of hash and pageid and returns their bucket */
+static psync_uint_t lock_bucket(uint64_t hash, uint64_t pageid){
+  lock_stripe(stripe_by_hash_and_pageid(hash, pageid));
+  return pagehash_by_hash_and_pageid(hash, pageid);
+}
+
+static uint32_t get_cache_pages_in_hash(){
+  uint32_t i, cnt;
+  cnt=0;
+  for (i=0; i<CACHE_LOCK_STRIPES; i++)
+    cnt+=cache_stripes[i].pages;
+  return cnt;
 }
 
 static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_request_range_t *range, psync_socket *api){
@@ -316,6 +490,8 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
   res=get_result_thread(api);
   if (unlikely_log(!res))
     return -2;
+  if (!request->firstms)
+    request->firstms=psync_millitime();
   dlen=psync_find_result(res, "result", PARAM_NUM)->num;
   if (unlikely(dlen)){
     psync_free(res);
@@ -334,6 +510,7 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
       return i==0?-2:-1;
     }
     dlen-=rb;
+    request->bytes+=rb;
     page->hash=request->hash;
     page->pageid=first_page_id+i;
     page->lastuse=psync_timer_time();
@@ -349,10 +526,7 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
         break;
       }
     unlock_wait(page->hash);
-    pthread_mutex_lock(&cache_mutex);
-    psync_list_add_tail(&cache_hash[pagehash_by_hash_and_pageid(page->hash, page->pageid)], &page->list);
-    cache_pages_in_hash++;
-    pthread_mutex_unlock(&cache_mutex);
+    add_page_to_hash(page);
   }
   return 0;
 }
@@ -709,70 +883,444 @@ static uint64_t size_round_up_to_page(uint64_t size){
 static int has_page_in_cache_by_hash(uint64_t hash, uint64_t pageid){
   psync_cache_page_t *page;
   psync_uint_t h;
-  h=pagehash_by_hash_and_pageid(hash, pageid);
-  pthread_mutex_lock(&cache_mutex);
+  h=lock_bucket(hash, pageid);
   psync_list_for_each_element(page, &cache_hash[h], psync_cache_page_t, list)
     if (page->hash==hash && page->pageid==pageid){
-      pthread_mutex_unlock(&cache_mutex);
+      unlock_stripe(h);
       return 1;
     }
-  pthread_mutex_unlock(&cache_mutex);
+  unlock_stripe(h);
   return 0;
 }
 
-static unsigned char *has_pages_in_db(uint64_t hash, uint64_t pageid, uint32_t pagecnt, int readahead){
+static int extent_cmp(const psync_tree *t1, const psync_tree *t2){
+  const psync_cache_extent_t *e1, *e2;
+  e1=psync_tree_element(t1, const psync_cache_extent_t, tree);
+  e2=psync_tree_element(t2, const psync_cache_extent_t, tree);
+  if (e1->hash<e2->hash)
+    return -1;
+  else if (e1->hash>e2->hash)
+    return 1;
+  else if (e1->pageid<e2->pageid)
+    return -1;
+  else if (e1->pageid>e2->pageid)
+    return 1;
+  else
+    return 0;
+}
+
+/* returns the extent of hash that contains pageid or if there is no such, the first extent of hash after pageid,
+ * extent_mutex should be held
+ */
+static psync_cache_extent_t *get_extent_containing_or_after(uint64_t hash, uint64_t pageid){
+  psync_cache_extent_t *ext, *ret;
+  psync_tree *tr;
+  ret=NULL;
+  tr=cache_extents;
+  while (tr){
+    ext=psync_tree_element(tr, psync_cache_extent_t, tree);
+    if (hash<ext->hash || (hash==ext->hash && pageid<ext->pageid+ext->pagecnt)){
+      ret=ext;
+      tr=tr->left;
+    }
+    else
+      tr=tr->right;
+  }
+  if (ret && ret->hash==hash)
+    return ret;
+  else
+    return NULL;
+}
+
+static psync_cache_extent_t *get_extent(uint64_t hash, uint64_t pageid){
+  psync_cache_extent_t *ext;
+  ext=get_extent_containing_or_after(hash, pageid);
+  if (ext && ext->pageid<=pageid)
+    return ext;
+  else
+    return NULL;
+}
+
+static psync_cache_extent_t *get_next_extent(psync_cache_extent_t *ext){
+  psync_tree *tr;
+  tr=psync_tree_get_next(&ext->tree);
+  if (tr && psync_tree_element(tr, psync_cache_extent_t, tree)->hash==ext->hash)
+    return psync_tree_element(tr, psync_cache_extent_t, tree);
+  else
+    return NULL;
+}
+
+static uint32_t extent_page_size(const psync_cache_extent_t *ext, uint64_t pageid){
+  if (pageid==ext->pageid+ext->pagecnt-1)
+    return ext->lastsize;
+  else
+    return PSYNC_FS_PAGE_SIZE;
+}
+
+static psync_cache_extent_t *new_extent(uint64_t hash, uint64_t pageid, uint32_t cacheid, uint32_t pagecnt){
+  psync_cache_extent_t *ext;
+  ext=(psync_cache_extent_t *)psync_malloc(offsetof(psync_cache_extent_t, crcs)+sizeof(uint32_t)*pagecnt);
+  psync_list_init(&ext->dirtylist);
+  ext->hash=hash;
+  ext->pageid=pageid;
+  ext->dbid=0;
+  ext->lastuse=0;
+  ext->cacheid=cacheid;
+  ext->pagecnt=pagecnt;
+  ext->lastsize=PSYNC_FS_PAGE_SIZE;
+  ext->usecnt=0;
+  return ext;
+}
+
+static uint8_t extent_usecnt_seg(const psync_cache_extent_t *ext){
+  if (ext->usecnt>=16)
+    return CACHE_SEG_USE16;
+  else if (ext->usecnt>=8)
+    return CACHE_SEG_USE8;
+  else if (ext->usecnt>=4)
+    return CACHE_SEG_USE4;
+  else if (ext->usecnt>=2)
+    return CACHE_SEG_USE2;
+  else
+    return CACHE_SEG_PROBATION;
+}
+
+static uint8_t extent_seg(const psync_cache_extent_t *ext){
+  if (ext->pageid<PSYNC_FS_FIRST_PAGES_UNDER_ID)
+    return CACHE_SEG_FIRST;
+  else if (ext->pageid<PSYNC_FS_XFIRST_PAGES_UNDER_ID)
+    return CACHE_SEG_XFIRST;
+  else
+    return extent_usecnt_seg(ext);
+}
+
+static void seg_add_locked(psync_cache_extent_t *ext, uint8_t seg){
+  psync_cache_tier_t *t;
+  t=&cache_tiers[cacheid_tier(ext->cacheid)];
+  ext->seg=seg;
+  psync_list_add_head(&t->segs[seg], &ext->seglist);
+  t->seg_pages[seg]+=ext->pagecnt;
+}
+
+static void seg_del_locked(psync_cache_extent_t *ext){
+  psync_list_del(&ext->seglist);
+  cache_tiers[cacheid_tier(ext->cacheid)].seg_pages[ext->seg]-=ext->pagecnt;
+}
+
+/* demotes the least recently used extents of protected segments that are over their share, as every segment is only demoted to
+ * a segment after it, one pass is enough
+ */
+static void seg_balance_locked(psync_cache_tier_t *t){
+  psync_cache_extent_t *ext;
+  uint64_t max;
+  uint8_t seg, nseg;
+  for (seg=0; seg<CACHE_SEG_PROBATION; seg++){
+    max=t->in_pages*cache_seg_percent[seg]/100;
+    while (t->seg_pages[seg]>max && !psync_list_isempty(&t->segs[seg])){
+      ext=psync_list_element(t->segs[seg].prev, psync_cache_extent_t, seglist);
+      seg_del_locked(ext);
+      if (seg<=CACHE_SEG_XFIRST)
+        nseg=extent_usecnt_seg(ext);
+      else
+        nseg=seg+1;
+      seg_add_locked(ext, nseg);
+    }
+  }
+}
+
+/* returns the extent of the tier that should be evicted next, probation first and then the least protected segment */
+static psync_cache_extent_t *seg_get_victim_locked(psync_cache_tier_t *t){
+  int seg;
+  for (seg=CACHE_SEG_PROBATION; seg>=0; seg--)
+    if (!psync_list_isempty(&t->segs[seg]))
+      return psync_list_element(t->segs[seg].prev, psync_cache_extent_t, seglist);
+  return NULL;
+}
+
+/* new data goes to the fastest tier with free slots, so when all of them are full the slowest one makes room */
+static psync_cache_extent_t *get_victim_locked(){
+  psync_cache_extent_t *ext;
+  uint32_t i;
+  for (i=cache_tier_cnt; i>0; i--)
+    if ((ext=seg_get_victim_locked(&cache_tiers[i-1])))
+      return ext;
+  return NULL;
+}
+
+static int add_extent_locked(psync_cache_extent_t *ext){
+  psync_cache_extent_t *cext;
+  cext=get_extent_containing_or_after(ext->hash, ext->pageid);
+  if (unlikely(cext && cext->pageid<ext->pageid+ext->pagecnt))
+    return -1;
+  psync_tree_add(&cache_extents, &ext->tree, extent_cmp);
+  seg_add_locked(ext, extent_seg(ext));
+  seg_balance_locked(&cache_tiers[cacheid_tier(ext->cacheid)]);
+  cache_extents_cnt++;
+  return 0;
+}
+
+static void del_extent_locked(psync_cache_extent_t *ext){
+  psync_tree_del(&cache_extents, &ext->tree);
+  seg_del_locked(ext);
+  if (!psync_list_isempty(&ext->dirtylist)){
+    psync_list_del(&ext->dirtylist);
+    psync_list_init(&ext->dirtylist);
+    dirty_extents_cnt--;
+  }
+  cache_extents_cnt--;
+}
+
+static void mark_extent_used_locked(psync_cache_extent_t *ext, time_t tm){
+  uint8_t seg;
+  if (tm>ext->lastuse+5){
+    ext->lastuse=tm;
+    ext->usecnt++;
+    seg=extent_seg(ext);
+    if (seg>ext->seg)
+      seg=ext->seg;
+    seg_del_locked(ext);
+    seg_add_locked(ext, seg);
+    seg_balance_locked(&cache_tiers[cacheid_tier(ext->cacheid)]);
+    if (psync_list_isempty(&ext->dirtylist)){
+      psync_list_add_tail(&dirty_extents, &ext->dirtylist);
+      dirty_extents_cnt++;
+    }
+  }
+}
+
+static int free_run_cmp(const psync_tree *t1, const psync_tree *t2){
+  const psync_cache_free_run_t *r1, *r2;
+  r1=psync_tree_element(t1, psync_cache_free_run_t, tree);
+  r2=psync_tree_element(t2, psync_cache_free_run_t, tree);
+  if (r1->to-r1->from!=r2->to-r2->from)
+    return r1->to-r1->from<r2->to-r2->from?-1:1;
+  else if (r1->from!=r2->from)
+    return r1->from<r2->from?-1:1;
+  else
+    return 0;
+}
+
+static psync_cache_free_run_t *free_run_find(psync_tree *tr, uint64_t from, uint64_t to){
+  psync_cache_free_run_t *r;
+  while (tr){
+    r=psync_tree_element(tr, psync_cache_free_run_t, tree);
+    if (to-from<r->to-r->from || (to-from==r->to-r->from && from<r->from))
+      tr=tr->left;
+    else if (to-from>r->to-r->from || from>r->from)
+      tr=tr->right;
+    else
+      return r;
+  }
+  return NULL;
+}
+
+/* adds (index!=0) or removes the free runs of the tier that overlap or touch from-to to or from its free_runs */
+static void free_runs_update_locked(psync_cache_tier_t *t, uint64_t from, uint64_t to, int index){
+  psync_interval_tree_t *it;
+  psync_cache_free_run_t *r;
+  it=psync_interval_tree_first_interval_containing_or_after(t->free_slots, from?from-1:0);
+  while (it && it->from<=to){
+    if (index){
+      r=psync_new(psync_cache_free_run_t);
+      r->from=it->from;
+      r->to=it->to;
+      psync_tree_add(&t->free_runs, &r->tree, free_run_cmp);
+    }
+    else if ((r=free_run_find(t->free_runs, it->from, it->to))){
+      psync_tree_del(&t->free_runs, &r->tree);
+      psync_free(r);
+    }
+    it=psync_interval_tree_get_next(it);
+  }
+}
+
+static void slots_add_locked(psync_cache_tier_t *t, uint64_t from, uint64_t to){
+  free_runs_update_locked(t, from, to, 0);
+  psync_interval_tree_add(&t->free_slots, from, to);
+  free_runs_update_locked(t, from, to, 1);
+}
+
+static void slots_remove_locked(psync_cache_tier_t *t, uint64_t from, uint64_t to){
+  free_runs_update_locked(t, from, to, 0);
+  psync_interval_tree_remove(&t->free_slots, from, to);
+  free_runs_update_locked(t, from, to, 1);
+}
+
+static void slots_cut_end_locked(psync_cache_tier_t *t, uint64_t end){
+  free_runs_update_locked(t, end, UINT64_MAX, 0);
+  psync_interval_tree_cut_end(&t->free_slots, end);
+  free_runs_update_locked(t, end, UINT64_MAX, 1);
+}
+
+static void slots_free_locked(psync_cache_tier_t *t){
+  psync_tree_for_each_element_call_safe(t->free_runs, psync_cache_free_run_t, tree, psync_free);
+  t->free_runs=PSYNC_TREE_EMPTY;
+  psync_interval_tree_free(t->free_slots);
+  t->free_slots=NULL;
+}
+
+static void free_db_slots_locked(uint64_t cacheid, uint64_t cnt){
+  psync_cache_tier_t *t;
+  uint64_t slot;
+  t=&cache_tiers[cacheid_tier(cacheid)];
+  slot=cacheid_slot(cacheid);
+  if (slot>=t->max_page)
+    return;
+  if (slot+cnt>t->max_page)
+    cnt=t->max_page-slot;
+  slots_add_locked(t, slot, slot+cnt);
+  t->free_pages+=cnt;
+  free_db_pages+=cnt;
+}
+
+/* allocates up to cnt consecutive slots in the file of the tier, preferring the shortest free run that is long enough (the first
+ * one of these in the file) and falling back to the longest one, returns the number of allocated slots
+ */
+static uint32_t alloc_tier_slots_locked(uint32_t tier, uint32_t cnt, uint32_t *cacheid){
+  psync_cache_tier_t *t;
+  psync_cache_free_run_t *r, *best;
+  psync_tree *tr;
+  uint64_t from;
+  t=&cache_tiers[tier];
+  best=NULL;
+  tr=t->free_runs;
+  while (tr){
+    r=psync_tree_element(tr, psync_cache_free_run_t, tree);
+    if (r->to-r->from>=cnt){
+      best=r;
+      tr=tr->left;
+    }
+    else
+      tr=tr->right;
+  }
+  if (!best){
+    if (!t->free_runs)
+      return 0;
+    best=psync_tree_element(psync_tree_get_last(t->free_runs), psync_cache_free_run_t, tree);
+  }
+  if (best->to-best->from<cnt)
+    cnt=best->to-best->from;
+  from=best->from;
+  *cacheid=tier_cacheid(tier, from);
+  slots_remove_locked(t, from, from+cnt);
+  t->free_pages-=cnt;
+  free_db_pages-=cnt;
+  return cnt;
+}
+
+static uint32_t alloc_db_slots_locked(uint32_t cnt, uint32_t *cacheid){
+  uint32_t i;
+  for (i=0; i<cache_tier_cnt; i++)
+    if (cache_tiers[i].free_pages)
+      return alloc_tier_slots_locked(i, cnt, cacheid);
+  return 0;
+}
+
+static uint32_t count_free_db_slots_locked(psync_cache_tier_t *t){
+  psync_interval_tree_t *it;
+  uint32_t cnt;
+  cnt=0;
+  psync_interval_tree_for_each(it, t->free_slots)
+    cnt+=it->to-it->from;
+  return cnt;
+}
+
+static void delete_extents_from_db(psync_cache_extent_t **exts, psync_uint_t cnt){
   psync_sql_res *res;
-  psync_uint_row row;
+  psync_uint_t i;
+  psync_sql_start_transaction();
+  res=psync_sql_prep_statement("DELETE FROM pagecacheextent WHERE id=?");
+  for (i=0; i<cnt; i++){
+    psync_sql_bind_uint(res, 1, exts[i]->dbid);
+    psync_sql_run(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+}
+
+/* drops extents of the tier that occupy slots at or above maxpage and sets max_page of the tier to maxpage, flush_cache_mutex
+ * should be held */
+static void shrink_db_cache(uint32_t tier, uint64_t maxpage){
+  psync_cache_extent_t **exts, *ext;
+  psync_cache_tier_t *t;
+  psync_tree *tr, *ntr;
+  psync_uint_t cnt, alloc, i;
+  t=&cache_tiers[tier];
+  exts=NULL;
+  cnt=alloc=0;
+  pthread_mutex_lock(&extent_mutex);
+  tr=psync_tree_get_first(cache_extents);
+  while (tr){
+    ntr=psync_tree_get_next(tr);
+    ext=psync_tree_element(tr, psync_cache_extent_t, tree);
+    if (cacheid_tier(ext->cacheid)==tier && cacheid_slot(ext->cacheid)+ext->pagecnt>maxpage){
+      if (cnt==alloc){
+        alloc=alloc*2+16;
+        exts=(psync_cache_extent_t **)psync_realloc(exts, sizeof(psync_cache_extent_t *)*alloc);
+      }
+      del_extent_locked(ext);
+      exts[cnt++]=ext;
+    }
+    tr=ntr;
+  }
+  slots_cut_end_locked(t, maxpage);
+  t->max_page=maxpage;
+  for (i=0; i<cnt; i++)
+    free_db_slots_locked(exts[i]->cacheid, exts[i]->pagecnt);
+  free_db_pages-=t->free_pages;
+  t->free_pages=count_free_db_slots_locked(t);
+  free_db_pages+=t->free_pages;
+  pthread_mutex_unlock(&extent_mutex);
+  if (cnt){
+    delete_extents_from_db(exts, cnt);
+    for (i=0; i<cnt; i++)
+      psync_free(exts[i]);
+    debug(D_NOTICE, "dropped %u extents above page %lu of cache tier %u", (unsigned)cnt, (unsigned long)maxpage, (unsigned)tier);
+  }
+  psync_free(exts);
+}
+
+static unsigned char *has_pages_in_db(uint64_t hash, uint64_t pageid, uint32_t pagecnt, int readahead){
+  psync_cache_extent_t *ext;
   unsigned char *ret;
-  uint64_t fromid;
-  uint32_t fcnt;
+  uint64_t from, to;
   if (unlikely(!pagecnt))
     return NULL;
   ret=psync_new_cnt(unsigned char, pagecnt);
   memset(ret, 0, pagecnt);
-  fromid=0;
-  fcnt=0;
-  res=psync_sql_query_rdlock("SELECT pageid, id FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid>=? AND pageid<? ORDER BY pageid");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, pageid);
-  psync_sql_bind_uint(res, 3, pageid+pagecnt);
-  while ((row=psync_sql_fetch_rowint(res))){
-    ret[row[0]-pageid]=1;
-    if (row[1]==fromid+fcnt)
-      fcnt++;
-    else{
-      if (fcnt && readahead)
-        psync_file_readahead(readcache, fromid*PSYNC_FS_PAGE_SIZE, fcnt*PSYNC_FS_PAGE_SIZE);
-      fromid=row[1];
-      fcnt=1;
-    }
+  pthread_mutex_lock(&extent_mutex);
+  ext=get_extent_containing_or_after(hash, pageid);
+  while (ext && ext->pageid<pageid+pagecnt){
+    from=ext->pageid>pageid?ext->pageid:pageid;
+    to=ext->pageid+ext->pagecnt;
+    if (to>pageid+pagecnt)
+      to=pageid+pagecnt;
+    memset(ret+from-pageid, 1, to-from);
+    if (readahead)
+      psync_file_readahead(cacheid_fd(ext->cacheid), cacheid_offset(ext->cacheid+from-ext->pageid), (to-from)*PSYNC_FS_PAGE_SIZE);
+    ext=get_next_extent(ext);
   }
-  psync_sql_free_result(res);
-  if (fcnt && readahead)
-    psync_file_readahead(readcache, fromid*PSYNC_FS_PAGE_SIZE, fcnt*PSYNC_FS_PAGE_SIZE);
+  pthread_mutex_unlock(&extent_mutex);
   return ret;
 }
 
 static int has_page_in_db(uint64_t hash, uint64_t pageid){
-  psync_sql_res *res;
-  psync_uint_row row;
-  res=psync_sql_query_rdlock("SELECT pageid FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, pageid);
-  row=psync_sql_fetch_rowint(res);
-  psync_sql_free_result(res);
-  return row!=NULL;
+  int ret;
+  pthread_mutex_lock(&extent_mutex);
+  ret=get_extent(hash, pageid)!=NULL;
+  pthread_mutex_unlock(&extent_mutex);
+  return ret;
 }
 
 static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
-  psync_cache_page_t *page;
+  psync_cache_page_t *page, *badpage;
   psync_uint_t h;
   psync_int_t ret;
   uint32_t crc;
   time_t tm;
   ret=-1;
-  h=pagehash_by_hash_and_pageid(hash, pageid);
-  pthread_mutex_lock(&cache_mutex);
+  badpage=NULL;
+  h=lock_bucket(hash, pageid);
   psync_list_for_each_element(page, &cache_hash[h], psync_cache_page_t, list)
     if (page->hash==hash && page->pageid==pageid){
       psync_prefetch(page->page);
@@ -786,8 +1334,8 @@ static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid,
         debug(D_WARNING, "memory page CRC does not match %u!=%u, this is most likely memory fault or corruption, pageid %u",
                          (unsigned)crc, (unsigned)page->crc, (unsigned)page->pageid);
         psync_list_del(&page->list);
-        psync_pagecache_return_free_page_locked(page);
-        cache_pages_in_hash--;
+        stripe_pages(h)--;
+        badpage=page;
         break;
       }
       if (size+off>page->size){
@@ -799,621 +1347,666 @@ static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid,
       memcpy(buff, page->page+off, size);
       ret=size;
     }
-  pthread_mutex_unlock(&cache_mutex);
+  unlock_stripe(h);
+  if (unlikely(badpage))
+    psync_pagecache_return_free_page(badpage);
   return ret;
 }
 
 static int switch_memory_page_to_hash(uint64_t oldhash, uint64_t newhash, uint64_t pageid){
   psync_cache_page_t *page;
   psync_uint_t ho, hn;
+  int ret;
+  ho=stripe_by_hash_and_pageid(oldhash, pageid);
+  hn=stripe_by_hash_and_pageid(newhash, pageid);
+  ret=0;
+  if (ho<=hn){
+    lock_stripe(ho);
+    if (ho!=hn)
+      lock_stripe(hn);
+  }
+  else{
+    lock_stripe(hn);
+    lock_stripe(ho);
+  }
   ho=pagehash_by_hash_and_pageid(oldhash, pageid);
   hn=pagehash_by_hash_and_pageid(newhash, pageid);
-  pthread_mutex_lock(&cache_mutex);
   psync_list_for_each_element(page, &cache_hash[ho], psync_cache_page_t, list)
     if (page->hash==oldhash && page->pageid==pageid && page->type==PAGE_TYPE_READ){
       psync_list_del(&page->list);
+      stripe_pages(ho)--;
       page->hash=newhash;
       psync_list_add_tail(&cache_hash[hn], &page->list);
-      pthread_mutex_unlock(&cache_mutex);
-      return 1;
+      stripe_pages(hn)++;
+      ret=1;
+      break;
     }
-  pthread_mutex_unlock(&cache_mutex);
-  return 0;
+  unlock_stripe(ho);
+  if (ho%CACHE_LOCK_STRIPES!=hn%CACHE_LOCK_STRIPES)
+    unlock_stripe(hn);
+  return ret;
 }
 
-typedef struct {
-  uint32_t lastuse;
-  uint32_t id;
-  uint16_t usecnt;
-  int8_t isfirst;
-  int8_t isxfirst;
-} pagecache_entry;
-
-static int pagecache_entry_cmp_lastuse(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
-}
-
-static int pagecache_entry_cmp_usecnt_lastuse2(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=2 && e2->usecnt<2)
+static int cmp_flush_pages(const psync_list *p1, const psync_list *p2){
+  const psync_cache_page_t *page1, *page2;
+  page1=psync_list_element(p1, const psync_cache_page_t, flushlist);
+  page2=psync_list_element(p2, const psync_cache_page_t, flushlist);
+  if (page1->hash<page2->hash)
     return -1;
-  else if (e2->usecnt>=2 && e1->usecnt<2)
+  else if (page1->hash>page2->hash)
     return 1;
-  else
-    return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
-}
-
-static int pagecache_entry_cmp_usecnt_lastuse4(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=4 && e2->usecnt<4)
+  else if (page1->pageid<page2->pageid)
     return -1;
-  else if (e2->usecnt>=4 && e1->usecnt<4)
+  else if (page1->pageid>page2->pageid)
     return 1;
   else
-    return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
+    return 0;
 }
 
-static int pagecache_entry_cmp_usecnt_lastuse8(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=8 && e2->usecnt<8)
+static int cmp_discard_pages(const psync_list *p1, const psync_list *p2){
+  const psync_cache_page_t *page1, *page2;
+  page1=psync_list_element(p1, const psync_cache_page_t, flushlist);
+  page2=psync_list_element(p2, const psync_cache_page_t, flushlist);
+  if (page1->lastuse<page2->lastuse)
     return -1;
-  else if (e2->usecnt>=8 && e1->usecnt<8)
+  else if (page1->lastuse>page2->lastuse)
     return 1;
   else
-    return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
+    return 0;
 }
 
-static int pagecache_entry_cmp_usecnt_lastuse16(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=16 && e2->usecnt<16)
-    return -1;
-  else if (e2->usecnt>=16 && e1->usecnt<16)
-    return 1;
-  else
-    return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
+/* adds all READ pages in the hash to pages (linked by flushlist) and frees CACHE pages, returns the number of READ pages */
+static psync_uint_t collect_read_pages(psync_list *pages){
+  psync_list freed, *l1, *l2;
+  psync_cache_page_t *page;
+  psync_uint_t s, i, cnt;
+  psync_list_init(&freed);
+  cnt=0;
+  for (s=0; s<CACHE_LOCK_STRIPES; s++){
+    lock_stripe(s);
+    for (i=s; i<cache_hash_size; i+=CACHE_LOCK_STRIPES)
+      psync_list_for_each_safe(l1, l2, &cache_hash[i]){
+        page=psync_list_element(l1, psync_cache_page_t, list);
+        if (page->type==PAGE_TYPE_READ){
+          psync_list_add_tail(pages, &page->flushlist);
+          cnt++;
+        }
+        else if (page->type==PAGE_TYPE_CACHE){
+          psync_list_del(&page->list);
+          psync_list_add_tail(&freed, &page->list);
+          stripe_pages(s)--;
+        }
+      }
+    unlock_stripe(s);
+  }
+  psync_pagecache_return_free_pages(&freed);
+  return cnt;
 }
 
-static int pagecache_entry_cmp_id(const void *p1, const void *p2){
-  return (int)((const pagecache_entry *)p1)->id-(int)((const pagecache_entry *)p2)->id;
+static void remove_page_from_hash(psync_cache_page_t *page, psync_list *freed){
+  psync_uint_t h;
+  h=lock_page_stripe(page);
+  psync_list_del(&page->list);
+  stripe_pages(h)--;
+  unlock_stripe(h);
+  psync_list_add_tail(freed, &page->list);
 }
 
-static int pagecache_entry_cmp_first_pages(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  int d;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  d=(int)e2->isfirst-(int)e1->isfirst;
-  if (d)
-    return d;
-  else if (e1->isfirst)
-    return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
-  else{
-    d=(int)e2->isxfirst-(int)e1->isxfirst;
-    if (d)
-      return d;
+/* sets the full flag of every tier and shrinks the ones on disks that went below minlocalfreespace, only the disk of the first tier
+ * is reported as the local disk, returns 1 if none of the tiers can grow */
+static int check_disk_full(){
+  psync_cache_tier_t *t;
+  int64_t filesize, freespace;
+  uint64_t minlocal, maxpage, addspc;
+  uint32_t i;
+  int full;
+  minlocal=psync_setting_get_uint(_PS(minlocalfreespace));
+  full=1;
+  for (i=0; i<cache_tier_cnt; i++){
+    t=&cache_tiers[i];
+    t->full=0;
+    if (tier_is_dead(t) && i){
+      t->full=1;
+      continue;
+    }
+    filesize=psync_file_size(t->fd);
+    if (unlikely_log(filesize==-1)){
+      full=0;
+      continue;
+    }
+    freespace=psync_get_free_space_by_path(t->dir);
+    if (unlikely_log(freespace==-1)){
+      full=0;
+      continue;
+    }
+    if (t->max_page*PSYNC_FS_PAGE_SIZE>filesize)
+      addspc=get_cache_pages_in_hash()*PSYNC_FS_PAGE_SIZE;
     else
-      return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
+      addspc=0;
+    if (minlocal+addspc<=freespace){
+      if (i==0)
+        psync_set_local_full(0);
+      full=0;
+      continue;
+    }
+    debug(D_NOTICE, "disk of cache tier %u is full, freespace=%lu, minfreespace=%lu", (unsigned)i, (unsigned long)freespace, (unsigned long)minlocal);
+    if (i==0)
+      psync_set_local_full(1);
+    t->full=1;
+    if (minlocal>=freespace)
+      maxpage=filesize/PSYNC_FS_PAGE_SIZE;
+    else
+      maxpage=(filesize+freespace-minlocal)/PSYNC_FS_PAGE_SIZE;
+    if (maxpage<t->max_page)
+      shrink_db_cache(i, maxpage);
+    debug(D_NOTICE, "free_db_pages=%u, max_page=%lu", (unsigned)free_db_pages, (unsigned long)t->max_page);
   }
+  return full;
 }
 
-static int pagecache_entry_cmp_xfirst_pages(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  int d;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  d=(int)e2->isxfirst-(int)e1->isxfirst;
-  if (d)
-    return d;
-  else
-    return (int)((int64_t)e2->lastuse-(int64_t)e1->lastuse);
+/* extends the files of tiers that are under their size, fastest first, until there are at least pagecnt free slots */
+static void grow_cache_tiers_locked(uint64_t pagecnt){
+  psync_cache_tier_t *t;
+  uint64_t cnt;
+  uint32_t i;
+  for (i=0; i<cache_tier_cnt && free_db_pages<pagecnt; i++){
+    t=&cache_tiers[i];
+    if (t->max_page>=t->in_pages || t->full)
+      continue;
+    cnt=t->in_pages-t->max_page;
+    if (cnt>cache_pages)
+      cnt=cache_pages;
+    t->max_page+=cnt;
+    free_db_slots_locked(tier_cacheid(i, t->max_page-cnt), cnt);
+    debug(D_NOTICE, "added %lu new free pages to cache tier %u, in_pages=%lu, max_page=%lu",
+                    (unsigned long)cnt, (unsigned)i, (unsigned long)t->in_pages, (unsigned long)t->max_page);
+  }
 }
 
+static int sync_cache_tiers(){
+  uint32_t i;
+  int ret;
+  ret=0;
+  for (i=0; i<cache_tier_cnt; i++)
+    if (!tier_is_dead(&cache_tiers[i]) && psync_file_sync(cache_tiers[i].fd))
+      ret=-1;
+  return ret;
+}
 
-/* sum should be around 90-95 percent, so after a run cache get smaller */
-#define PSYNC_FS_CACHE_LRU_PERCENT  40
-#define PSYNC_FS_CACHE_LRU2_PERCENT 20
-#define PSYNC_FS_CACHE_LRU4_PERCENT 15
-#define PSYNC_FS_CACHE_LRU8_PERCENT 10
-#define PSYNC_FS_CACHE_LRU16_PERCENT 5
+/* extents used often and recently belong in a faster tier, everything else can be moved down, the two never overlap so an extent
+ * does not go back and forth */
+static int tier_promotable(const psync_cache_extent_t *ext, time_t tm){
+  return ext->usecnt>=PSYNC_FS_CACHE_TIER_PROMOTE_USECNT && ext->lastuse+PSYNC_FS_CACHE_TIER_IDLE_SEC>=tm;
+}
 
-/* first pages percent pages are first reserved for the least recently used first pages and the above percents are
- * only applied to the remainder, so it is OK if first pages percent plus all the above go above 100%
- */
-#define PSYNC_FS_CACHE_LRU_FIRST_PAGES_PERCENT 15
-#define PSYNC_FS_CACHE_LRU_XFIRST_PAGES_PERCENT 5
-#define PSYNC_FS_FIRST_PAGES_UNDER_ID (PSYNC_FS_MIN_READAHEAD_START/PSYNC_FS_PAGE_SIZE)
-#define PSYNC_FS_XFIRST_PAGES_UNDER_ID (1024*1024/PSYNC_FS_PAGE_SIZE)
+/* reserves slots in tier for ext and adds it to moves, the slots are only given up by the extent when the move completes */
+static int plan_tier_move_locked(psync_cache_extent_t *ext, uint32_t tier, psync_cache_move_t *moves, uint32_t *cnt){
+  psync_cache_move_t *m;
+  uint32_t to, got;
+  got=alloc_tier_slots_locked(tier, ext->pagecnt, &to);
+  if (got!=ext->pagecnt){
+    if (got)
+      free_db_slots_locked(to, got);
+    return -1;
+  }
+  m=&moves[(*cnt)++];
+  m->ext=ext;
+  m->hash=ext->hash;
+  m->pageid=ext->pageid;
+  m->dbid=ext->dbid;
+  m->from=ext->cacheid;
+  m->to=to;
+  m->pagecnt=ext->pagecnt;
+  m->lastsize=ext->lastsize;
+  m->crcs=psync_new_cnt(uint32_t, ext->pagecnt);
+  memcpy(m->crcs, ext->crcs, sizeof(uint32_t)*ext->pagecnt);
+  m->buff=NULL;
+  m->ok=0;
+  return 0;
+}
 
-static void clean_cache(){
+/* moves extents between tiers, flush_cache_mutex should be held. Every tier but the last is kept PSYNC_FS_CACHE_TIER_FREE_PERCENT
+ * free by moving its least valuable extents one tier down (making room in the last tier by eviction) and extents of slower tiers
+ * that are used often are moved one tier up while it has free slots. The data of all moves is read in one batch and written in
+ * another, extents switch to their new slots only after these are synced, so readers see either copy.
+ */
+static void balance_cache_tiers(){
+  psync_cache_move_t *moves;
+  psync_cache_extent_t *ext, *vext, **dexts;
+  psync_cache_tier_t *t;
+  psync_file_io_t *ios;
+  psync_list *l;
   psync_sql_res *res;
-  uint64_t ocnt, cnt, rcnt, i, e;
-  psync_uint_row row;
-  pagecache_entry *entries, *oentries;
-  debug(D_NOTICE, "cleaning cache, free cache pages %u", (unsigned)free_db_pages);
-  if (pthread_mutex_trylock(&clean_cache_mutex)){
-    debug(D_NOTICE, "cache clean already in progress, skipping");
+  time_t tm;
+  uint64_t want;
+  uint32_t i, j, cnt, iocnt, dcnt, budget, scan, written, moved;
+  int seg, last;
+  tm=psync_timer_time();
+  moves=psync_new_cnt(psync_cache_move_t, PSYNC_FS_CACHE_TIER_MOVE_PAGES);
+  dexts=NULL;
+  cnt=dcnt=0;
+  budget=scan=PSYNC_FS_CACHE_TIER_MOVE_PAGES;
+  last=cache_tier_cnt-1;
+  pthread_mutex_lock(&evict_mutex);
+  if (evict_stoppers){
+    pthread_mutex_unlock(&evict_mutex);
+    psync_free(moves);
     return;
   }
-  while (clean_cache_stoppers){
-    clean_cache_waiters++;
-    pthread_cond_wait(&clean_cache_cond, &clean_cache_mutex);
-    if (--clean_cache_waiters){
-      // leave the last waiter to do the job
-      pthread_mutex_unlock(&clean_cache_mutex);
-      return;
+  pthread_mutex_lock(&extent_mutex);
+  /* slower tiers first, so the extents they move down do not compete with the ones coming from above */
+  for (i=last; i>0 && budget && scan; i--){
+    if (tier_is_dead(&cache_tiers[i]))
+      continue;
+    t=&cache_tiers[i-1];
+    want=t->in_pages*PSYNC_FS_CACHE_TIER_FREE_PERCENT/100;
+    for (seg=CACHE_SEG_PROBATION; seg>=0 && t->free_pages<want && budget && scan; seg--){
+      l=t->segs[seg].prev;
+      while (l!=&t->segs[seg] && want>t->free_pages && budget && scan){
+        ext=psync_list_element(l, psync_cache_extent_t, seglist);
+        l=l->prev;
+        scan--;
+        if (tier_promotable(ext, tm) || ext->pagecnt>budget)
+          continue;
+        if (i==(uint32_t)last){
+          if (!dexts)
+            dexts=psync_new_cnt(psync_cache_extent_t *, PSYNC_FS_CACHE_TIER_MOVE_PAGES);
+          while (cache_tiers[i].free_pages<ext->pagecnt && dcnt<PSYNC_FS_CACHE_TIER_MOVE_PAGES &&
+                 (vext=seg_get_victim_locked(&cache_tiers[i]))){
+            del_extent_locked(vext);
+            free_db_slots_locked(vext->cacheid, vext->pagecnt);
+            dexts[dcnt++]=vext;
+          }
+        }
+        if (plan_tier_move_locked(ext, i, moves, &cnt))
+          break;
+        budget-=ext->pagecnt;
+        want-=ext->pagecnt<want?ext->pagecnt:want;
+      }
+    }
+  }
+  for (i=1; i<cache_tier_cnt && budget && scan; i++){
+    t=&cache_tiers[i];
+    for (seg=0; seg<CACHE_SEG_PROBATION && cache_tiers[i-1].free_pages && budget && scan; seg++){
+      l=t->segs[seg].next;
+      while (l!=&t->segs[seg] && cache_tiers[i-1].free_pages && budget && scan){
+        ext=psync_list_element(l, psync_cache_extent_t, seglist);
+        l=l->next;
+        scan--;
+        if (!tier_promotable(ext, tm) || ext->pagecnt>budget)
+          continue;
+        if (plan_tier_move_locked(ext, i-1, moves, &cnt))
+          break;
+        budget-=ext->pagecnt;
+      }
     }
   }
-  cnt=psync_sql_cellint("SELECT MAX(id) FROM pagecache", 0);
+  pthread_mutex_unlock(&extent_mutex);
+  pthread_mutex_unlock(&evict_mutex);
+  if (dcnt){
+    delete_extents_from_db(dexts, dcnt);
+    for (i=0; i<dcnt; i++)
+      psync_free(dexts[i]);
+    debug(D_NOTICE, "evicted %u extents from the last cache tier", (unsigned)dcnt);
+  }
+  psync_free(dexts);
   if (!cnt){
-    pthread_mutex_unlock(&clean_cache_mutex);
-    debug(D_NOTICE, "no entries in pagecache, cancelling cache clean");
+    psync_free(moves);
     return;
   }
-  clean_cache_in_progress=1;
-  psync_sql_sync();
-  entries=(pagecache_entry *)psync_malloc(cnt*sizeof(pagecache_entry));
-  i=0;
-  e=0;
-  while (i<cnt){
-    res=psync_sql_query_rdlock("SELECT id, pageid, lastuse, usecnt, type FROM pagecache WHERE id>? ORDER BY id LIMIT 50000");
-    psync_sql_bind_uint(res, 1, e);
-    row=psync_sql_fetch_rowint(res);
-    if (unlikely(!row)){
-      psync_sql_free_result(res);
-      break;
-    }
-    do{
-      if (unlikely(i>=cnt))
+  ios=psync_new_cnt(psync_file_io_t, cnt);
+  for (i=0; i<cnt; i++){
+    moves[i].buff=psync_malloc((size_t)moves[i].pagecnt*PSYNC_FS_PAGE_SIZE);
+    ios[i].buf=moves[i].buff;
+    ios[i].count=(size_t)moves[i].pagecnt*PSYNC_FS_PAGE_SIZE;
+    ios[i].offset=cacheid_offset(moves[i].from);
+    ios[i].fd=cacheid_fd(moves[i].from);
+  }
+  psync_file_pread_batch(ios, cnt);
+  iocnt=0;
+  for (i=0; i<cnt; i++){
+    if (ios[i].ret!=(ssize_t)ios[i].count)
+      continue;
+    for (j=0; j<moves[i].pagecnt; j++)
+      if (psync_crc32c(PSYNC_CRC_INITIAL, moves[i].buff+(size_t)j*PSYNC_FS_PAGE_SIZE,
+                       j==moves[i].pagecnt-1?moves[i].lastsize:PSYNC_FS_PAGE_SIZE)!=moves[i].crcs[j])
         break;
-      e=row[0];
-      if (likely(row[4]==PAGE_TYPE_READ)){
-        entries[i].lastuse=row[2];
-        entries[i].id=row[0];
-        if (row[3]>UINT16_MAX)
-          entries[i].usecnt=UINT16_MAX;
-        else
-          entries[i].usecnt=row[3];
-        entries[i].isfirst=row[2]<PSYNC_FS_FIRST_PAGES_UNDER_ID;
-        entries[i].isxfirst=row[2]<PSYNC_FS_XFIRST_PAGES_UNDER_ID;
-        i++;
-        if ((i&0x3ff)==0x3ff && psync_sql_has_waiters())
-          break;
-      }
-      row=psync_sql_fetch_rowint(res);
-    } while (row);
-    psync_sql_free_result(res);
-    if (free_db_pages)
-      psync_milisleep(1);
-  }
-  ocnt=cnt=i;
-  oentries=entries;
-  debug(D_NOTICE, "read %lu entries", (unsigned long)cnt);
-
-  rcnt=PSYNC_FS_CACHE_LRU_FIRST_PAGES_PERCENT*ocnt/100;
-  psync_qpartition(entries, cnt, rcnt, sizeof(pagecache_entry), pagecache_entry_cmp_first_pages);
-  cnt-=rcnt;
-  entries+=rcnt;
-  debug(D_NOTICE, "sorted first pages, reserved %lu pages, continuing with %lu entries", (unsigned long)rcnt, (unsigned long)cnt);
-
-  rcnt=PSYNC_FS_CACHE_LRU_XFIRST_PAGES_PERCENT*ocnt/100;
-  psync_qpartition(entries, cnt, rcnt, sizeof(pagecache_entry), pagecache_entry_cmp_xfirst_pages);
-  cnt-=rcnt;
-  entries+=rcnt;
-  debug(D_NOTICE, "sorted extended first pages, reserved %lu pages, continuing with %lu entries", (unsigned long)rcnt, (unsigned long)cnt);
-
-  ocnt=cnt;
-  rcnt=PSYNC_FS_CACHE_LRU_PERCENT*ocnt/100;
-  psync_qpartition(entries, cnt, rcnt, sizeof(pagecache_entry), pagecache_entry_cmp_lastuse);
-  cnt-=rcnt;
-  entries+=rcnt;
-  debug(D_NOTICE, "sorted entries by lastuse, reserved %lu pages, continuing with %lu oldest entries", (unsigned long)rcnt, (unsigned long)cnt);
-
-  rcnt=PSYNC_FS_CACHE_LRU2_PERCENT*ocnt/100;
-  psync_qpartition(entries, cnt, rcnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse2);
-  cnt-=rcnt;
-  entries+=rcnt;
-  debug(D_NOTICE, "sorted entries by more than 2 uses and lastuse, reserved %lu pages, continuing with %lu entries", (unsigned long)rcnt, (unsigned long)cnt);
-
-  rcnt=PSYNC_FS_CACHE_LRU4_PERCENT*ocnt/100;
-  psync_qpartition(entries, cnt, rcnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse4);
-  cnt-=rcnt;
-  entries+=rcnt;
-  debug(D_NOTICE, "sorted entries by more than 4 uses and lastuse, reserved %lu pages, continuing with %lu entries", (unsigned long)rcnt, (unsigned long)cnt);
-
-  rcnt=PSYNC_FS_CACHE_LRU8_PERCENT*ocnt/100;
-  psync_qpartition(entries, cnt, rcnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse8);
-  cnt-=rcnt;
-  entries+=rcnt;
-  debug(D_NOTICE, "sorted entries by more than 8 uses and lastuse, reserved %lu pages, continuing with %lu entries", (unsigned long)rcnt, (unsigned long)cnt);
-
-  rcnt=PSYNC_FS_CACHE_LRU16_PERCENT*ocnt/100;
-  psync_qpartition(entries, cnt, rcnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse16);
-  cnt-=rcnt;
-  entries+=rcnt;
-  debug(D_NOTICE, "sorted entries by more than 16 uses and lastuse, reserved %lu pages, deleting %lu entries", (unsigned long)rcnt, (unsigned long)cnt);
-
-  psync_pqsort(entries, cnt, cnt, sizeof(pagecache_entry), pagecache_entry_cmp_id);
-  debug(D_NOTICE, "sorted entries to delete by id to help the SQL");
-
-  psync_sql_start_transaction();
-  res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)", hash=NULL, pageid=NULL, crc=NULL WHERE id=?");
+    if (j!=moves[i].pagecnt)
+      continue;
+    moves[i].ok=1;
+    ios[iocnt].buf=moves[i].buff;
+    ios[iocnt].count=(size_t)moves[i].pagecnt*PSYNC_FS_PAGE_SIZE;
+    ios[iocnt].offset=cacheid_offset(moves[i].to);
+    ios[iocnt].fd=cacheid_fd(moves[i].to);
+    iocnt++;
+  }
+  written=0;
+  if (psync_file_pwrite_batch(ios, iocnt))
+    for (i=0; i<cnt; i++)
+      moves[i].ok=0;
+  else
+    for (i=0; i<cnt; i++)
+      if (moves[i].ok)
+        written|=1<<cacheid_tier(moves[i].to);
+  for (i=0; i<cache_tier_cnt; i++)
+    if ((written&(1<<i)) && psync_file_sync(cache_tiers[i].fd))
+      for (j=0; j<cnt; j++)
+        if (cacheid_tier(moves[j].to)==i)
+          moves[j].ok=0;
+  psync_free(ios);
+  moved=0;
+  /* pages locked in the cache in the meantime are to stay where they are */
+  pthread_mutex_lock(&evict_mutex);
+  if (evict_stoppers)
+    for (i=0; i<cnt; i++)
+      moves[i].ok=0;
+  pthread_mutex_lock(&extent_mutex);
   for (i=0; i<cnt; i++){
-    psync_sql_bind_uint(res, 1, entries[i].id);
-    psync_sql_run(res);
-    free_db_pages++;
-    if ((i&0x1f)==0x1f && psync_sql_has_waiters()){
-      psync_sql_free_result(res);
-      psync_sql_commit_transaction();
-      debug(D_NOTICE, "got waiters for sql lock, pausing for a while");
-      psync_milisleep(5);
-      psync_sql_start_transaction();
-      res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)", hash=NULL, pageid=NULL, crc=NULL WHERE id=?");
+    ext=get_extent(moves[i].hash, moves[i].pageid);
+    if (moves[i].ok && ext==moves[i].ext && ext->cacheid==moves[i].from && ext->pagecnt==moves[i].pagecnt){
+      seg_del_locked(ext);
+      ext->cacheid=moves[i].to;
+      seg_add_locked(ext, ext->seg);
+      free_db_slots_locked(moves[i].from, moves[i].pagecnt);
+      moved++;
     }
-    else if ((i&0xfff)==0xfff){
-      psync_sql_free_result(res);
-      psync_sql_commit_transaction();
-      psync_sql_start_transaction();
-      res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)", hash=NULL, pageid=NULL, crc=NULL WHERE id=?");
+    else{
+      free_db_slots_locked(moves[i].to, moves[i].pagecnt);
+      moves[i].ok=0;
     }
   }
-  psync_sql_free_result(res);
-  psync_sql_commit_transaction();
-/*  ocnt=(cnt+63)/64;
-  for (j=0; j<ocnt; j++){
-    i=j*64;
-    e=i+64;
-    if (e>cnt)
-      e=cnt;
+  for (i=0; i<cache_tier_cnt; i++)
+    seg_balance_locked(&cache_tiers[i]);
+  pthread_mutex_unlock(&extent_mutex);
+  pthread_mutex_unlock(&evict_mutex);
+  if (moved){
     psync_sql_start_transaction();
-    res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)", hash=NULL, pageid=NULL, crc=NULL WHERE id=?");
-    for (; i<e; i++){
-      psync_sql_bind_uint(res, 1, entries[i].id);
-      psync_sql_run(res);
-      free_db_pages++;
-    }
+    res=psync_sql_prep_statement("UPDATE pagecacheextent SET cacheid=? WHERE id=?");
+    for (i=0; i<cnt; i++)
+      if (moves[i].ok){
+        psync_sql_bind_uint(res, 1, moves[i].to);
+        psync_sql_bind_uint(res, 2, moves[i].dbid);
+        psync_sql_run(res);
+      }
     psync_sql_free_result(res);
     psync_sql_commit_transaction();
-    psync_milisleep(5);
-    // 64 pages per 5 millisec is around 50Mb/sec, more than enough
-  }*/
-  clean_cache_in_progress=0;
-  pthread_mutex_unlock(&clean_cache_mutex);
-  psync_free(oentries);
-  debug(D_NOTICE, "syncing database");
-  psync_sql_sync();
-  debug(D_NOTICE, "finished cleaning cache, free cache pages %u", (unsigned)free_db_pages);
-}
-
-static int cmp_flush_pages(const psync_list *p1, const psync_list *p2){
-  const psync_cache_page_t *page1, *page2;
-  page1=psync_list_element(p1, const psync_cache_page_t, flushlist);
-  page2=psync_list_element(p2, const psync_cache_page_t, flushlist);
-  if (page1->hash<page2->hash)
-    return -1;
-  else if (page1->hash>page2->hash)
-    return 1;
-  else if (page1->pageid<page2->pageid)
-    return -1;
-  else if (page1->pageid>page2->pageid)
-    return 1;
-  else
-    return 0;
-}
-
-static int cmp_discard_pages(const psync_list *p1, const psync_list *p2){
-  const psync_cache_page_t *page1, *page2;
-  page1=psync_list_element(p1, const psync_cache_page_t, flushlist);
-  page2=psync_list_element(p2, const psync_cache_page_t, flushlist);
-  if (page1->lastuse<page2->lastuse)
-    return -1;
-  else if (page1->lastuse>page2->lastuse)
-    return 1;
-  else
-    return 0;
-}
-
-static int check_disk_full(){
-  int64_t filesize, freespace;
-  uint64_t minlocal, maxpage, addspc;
-  psync_sql_res *res;
-  db_cache_max_page=psync_sql_cellint("SELECT MAX(id) FROM pagecache", 0);
-  filesize=psync_file_size(readcache);
-  if (unlikely_log(filesize==-1))
-    return 0;
-  freespace=psync_get_free_space_by_path(psync_setting_get_string(_PS(fscachepath)));
-  minlocal=psync_setting_get_uint(_PS(minlocalfreespace));
-  if (unlikely_log(freespace==-1))
-    return 0;
-  if (db_cache_max_page*PSYNC_FS_PAGE_SIZE>filesize)
-    addspc=cache_pages_in_hash*PSYNC_FS_PAGE_SIZE;
-  else
-    addspc=0;
-  if (minlocal+addspc<=freespace){
-    psync_set_local_full(0);
-    return 0;
   }
-  debug(D_NOTICE, "local disk is full, freespace=%lu, minfreespace=%lu", (unsigned long)freespace, (unsigned long)minlocal);
-  psync_set_local_full(1);
-  if (minlocal>=freespace)
-    maxpage=filesize/PSYNC_FS_PAGE_SIZE;
-  else
-    maxpage=(filesize+freespace-minlocal)/PSYNC_FS_PAGE_SIZE;
-  res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
-  psync_sql_bind_uint(res, 1, maxpage);
-  psync_sql_run_free(res);
-  free_db_pages=psync_sql_cellint("SELECT COUNT(*) FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE), 0);
-  db_cache_max_page=maxpage;
-  debug(D_NOTICE, "free_db_pages=%u, db_cache_max_page=%lu", (unsigned)free_db_pages, (unsigned long)db_cache_max_page);
-  return 1;
+  debug(D_NOTICE, "moved %u of %u extents between cache tiers", (unsigned)moved, (unsigned)cnt);
+  for (i=0; i<cnt; i++){
+    psync_free(moves[i].buff);
+    psync_free(moves[i].crcs);
+  }
+  psync_free(moves);
 }
 
 static int flush_pages(int nosleep){
   static time_t lastflush=0;
   psync_list *l1, *l2;
   psync_sql_res *res;
-  psync_uint_row row;
-  psync_cache_page_t *page;
-  psync_list pages_to_flush;
-  psync_uint_t i, updates, pagecnt;
+  psync_cache_page_t *page, *pg;
+  psync_cache_extent_t **exts, **dexts, *ext, *vext;
+  psync_list pages_to_flush, freed;
+  psync_file_io_t *ios;
+  psync_uint_t i, j, updates, pagecnt, extcnt, runlen, dcnt, dalloc;
   time_t ctime;
-  uint32_t cpih;
+  uint32_t cacheid;
   int ret, diskfull;
-  pthread_mutex_lock(&cache_mutex);
+  pthread_mutex_lock(&free_pages_mutex);
   flush_page_running++;
   flushcacherun=1;
-  pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_unlock(&free_pages_mutex);
   flushedbetweentimers=1;
   pthread_mutex_lock(&flush_cache_mutex);
   diskfull=check_disk_full();
   updates=0;
   pagecnt=0;
+  exts=NULL;
+  dexts=NULL;
+  extcnt=dcnt=dalloc=0;
   ctime=psync_timer_time();
   psync_list_init(&pages_to_flush);
-  pthread_mutex_lock(&cache_mutex);
+  psync_list_init(&freed);
   if (unlikely(diskfull && free_db_pages==0)){
     debug(D_NOTICE, "disk is full, discarding some pages");
-    for (i=0; i<CACHE_HASH; i++)
-      psync_list_for_each_safe(l1, l2, &cache_hash[i]){
-        page=psync_list_element(l1, psync_cache_page_t, list);
-        if (page->type==PAGE_TYPE_READ)
-          psync_list_add_tail(&pages_to_flush, &page->flushlist);
-        else if (page->type==PAGE_TYPE_CACHE){
-          psync_list_del(&page->list);
-          psync_list_add_head(&free_pages, &page->list);
-          cache_pages_in_hash--;
-          cache_pages_free++;
-        }
-      }
-    pthread_mutex_unlock(&cache_mutex);
+    collect_read_pages(&pages_to_flush);
     psync_list_sort(&pages_to_flush, cmp_discard_pages);
-    pthread_mutex_lock(&cache_mutex);
     i=0;
     psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-      psync_list_del(&page->list);
-      psync_list_add_head(&free_pages, &page->list);
-      cache_pages_in_hash--;
-      cache_pages_free++;
-      if (++i>=CACHE_PAGES/2)
+      remove_page_from_hash(page, &freed);
+      if (++i>=cache_pages/2)
         break;
     }
     debug(D_NOTICE, "discarded %u pages", (unsigned)i);
     psync_list_init(&pages_to_flush);
-    if (free_page_waiters)
-      pthread_cond_broadcast(&free_page_cond);
+    psync_pagecache_return_free_pages(&freed);
   }
-  if (cache_pages_in_hash){
+  if (get_cache_pages_in_hash()){
     debug(D_NOTICE, "flushing cache free_db_pages=%u", (unsigned)free_db_pages);
+    pthread_mutex_lock(&free_pages_mutex);
     cache_pages_reset=0;
-    for (i=0; i<CACHE_HASH; i++)
-      psync_list_for_each_safe(l1, l2, &cache_hash[i]){
-        page=psync_list_element(l1, psync_cache_page_t, list);
-        if (page->type==PAGE_TYPE_READ){
-          psync_list_add_tail(&pages_to_flush, &page->flushlist);
-          pagecnt++;
-        }
-        else if (page->type==PAGE_TYPE_CACHE){
-          psync_list_del(&page->list);
-          psync_list_add_head(&free_pages, &page->list);
-          cache_pages_free++;
-        }
-      }
-    cache_pages_in_hash=pagecnt;
+    pthread_mutex_unlock(&free_pages_mutex);
+    pagecnt=collect_read_pages(&pages_to_flush);
     if (pagecnt){
-      pthread_mutex_unlock(&cache_mutex);
       debug(D_NOTICE, "cache_pages_in_hash=%u", (unsigned)pagecnt);
       psync_list_sort(&pages_to_flush, cmp_flush_pages);
-      res=psync_sql_query_rdlock("SELECT id FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE)" ORDER BY id LIMIT ?");
-      psync_sql_bind_uint(res, 1, pagecnt);
-      psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-        if (unlikely(!(row=psync_sql_fetch_rowint(res)))){
-          psync_list *l1, *l2;
-          l1=&page->flushlist;
-          do{
+      exts=psync_new_cnt(psync_cache_extent_t *, pagecnt);
+      ext=NULL;
+      /* psync_pagecache_lock_pages_in_cache() prevents eviction of extents while it is in effect */
+      pthread_mutex_lock(&evict_mutex);
+      pthread_mutex_lock(&extent_mutex);
+      if (free_db_pages<pagecnt && !diskfull)
+        grow_cache_tiers_locked(pagecnt);
+      /* group consecutive pages of the same hash into extents, pages that are already in the cache file are only released */
+      l1=pages_to_flush.next;
+      while (l1!=&pages_to_flush){
+        page=psync_list_element(l1, psync_cache_page_t, flushlist);
+        if ((ext && ext->hash==page->hash && ext->pageid+ext->pagecnt>page->pageid) || get_extent(page->hash, page->pageid)){
+          page->flushpageid=UINT32_MAX;
+          l1=l1->next;
+          continue;
+        }
+        runlen=1;
+        pg=page;
+        l2=l1->next;
+        while (runlen<CACHE_EXTENT_MAX_PAGES && l2!=&pages_to_flush && pg->size==PSYNC_FS_PAGE_SIZE){
+          pg=psync_list_element(l2, psync_cache_page_t, flushlist);
+          if (pg->hash!=page->hash || pg->pageid!=page->pageid+runlen || get_extent(pg->hash, pg->pageid))
+            break;
+          runlen++;
+          l2=l2->next;
+        }
+        while (free_db_pages<runlen && !evict_stoppers && (vext=get_victim_locked())){
+          del_extent_locked(vext);
+          free_db_slots_locked(vext->cacheid, vext->pagecnt);
+          if (dcnt==dalloc){
+            dalloc=dalloc*2+16;
+            dexts=(psync_cache_extent_t **)psync_realloc(dexts, sizeof(psync_cache_extent_t *)*dalloc);
+          }
+          dexts[dcnt++]=vext;
+        }
+        runlen=alloc_db_slots_locked(runlen, &cacheid);
+        if (unlikely(!runlen)){
+          debug(D_NOTICE, "no free pages in cache file, keeping the rest of the pages in memory");
+          do {
             l2=l1->next;
             psync_list_del(l1);
             l1=l2;
           } while (l1!=&pages_to_flush);
           break;
         }
-        page->flushpageid=row[0];
+        ext=new_extent(page->hash, page->pageid, cacheid, runlen);
+        for (i=0; i<runlen; i++){
+          page=psync_list_element(l1, psync_cache_page_t, flushlist);
+          page->flushpageid=cacheid+i;
+          ext->crcs[i]=page->crc;
+          ext->lastsize=page->size;
+          if (page->lastuse>ext->lastuse)
+            ext->lastuse=page->lastuse;
+          if (page->usecnt>ext->usecnt)
+            ext->usecnt=page->usecnt;
+          l1=l1->next;
+        }
+        exts[extcnt++]=ext;
       }
-      psync_sql_free_result(res);
-  /*    res=psync_sql_query("SELECT id FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE)" ORDER BY id");
-      for (i=0; i<CACHE_HASH; i++)
-        psync_list_for_each_element(page, &cache_hash[i], psync_cache_page_t, list)
-          if (page->type==PAGE_TYPE_READ){
-            if (!(row=psync_sql_fetch_rowint(res)))
-              goto break2;
-            page->flushpageid=row[0];
-            psync_list_add_tail(&pages_to_flush, &page->flushlist);
-          }
-  break2:
-      psync_sql_free_result(res);
-      pthread_mutex_unlock(&cache_mutex);*/
+      pthread_mutex_unlock(&extent_mutex);
+      pthread_mutex_unlock(&evict_mutex);
+      /* the records of the evicted extents have to be gone before their slots are overwritten, otherwise a crash in between would
+       * leave them pointing to data of other files */
+      if (dcnt){
+        delete_extents_from_db(dexts, dcnt);
+        for (i=0; i<dcnt; i++)
+          psync_free(dexts[i]);
+        debug(D_NOTICE, "evicted %u extents from cache", (unsigned)dcnt);
+        dcnt=0;
+      }
+      /* all pages go to the kernel in as few system calls as the I/O backend allows */
+      ios=psync_new_cnt(psync_file_io_t, pagecnt);
       i=0;
       psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-        if (psync_file_pwrite(readcache, page->page, PSYNC_FS_PAGE_SIZE, (uint64_t)page->flushpageid*PSYNC_FS_PAGE_SIZE)!=PSYNC_FS_PAGE_SIZE){
-          debug(D_ERROR, "write to cache file failed");
-          pthread_mutex_unlock(&flush_cache_mutex);
-          return -1;
-        }
+        if (page->flushpageid==UINT32_MAX)
+          continue;
+        ios[i].buf=page->page;
+        ios[i].count=PSYNC_FS_PAGE_SIZE;
+        ios[i].offset=cacheid_offset(page->flushpageid);
+        ios[i].fd=cacheid_fd(page->flushpageid);
         i++;
       }
-      debug(D_NOTICE, "cache data of %u pages written", (unsigned)i);
-      psync_file_schedulesync(readcache);
+      if (psync_file_pwrite_batch(ios, i)){
+        debug(D_ERROR, "write to cache file failed");
+        psync_free(ios);
+        goto err0;
+      }
+      psync_free(ios);
+      debug(D_NOTICE, "cache data of %u pages written in %u extents", (unsigned)i, (unsigned)extcnt);
+      for (i=0; i<cache_tier_cnt; i++)
+        if (!tier_is_dead(&cache_tiers[i]))
+          psync_file_schedulesync(cache_tiers[i].fd);
       /* if we can afford it, wait a while before calling fsync() as at least on Linux this blocks reads from the same file until it returns */
       if (nosleep!=1){
         if (nosleep==2)
           i=180;
         else
           i=0;
-        pthread_mutex_lock(&cache_mutex);
-        while (cache_pages_free>=CACHE_PAGES*5/100 && i++<200){
-          pthread_mutex_unlock(&cache_mutex);
+        pthread_mutex_lock(&free_pages_mutex);
+        while (cache_pages_free>=cache_pages*5/100 && i++<200){
+          pthread_mutex_unlock(&free_pages_mutex);
           psync_milisleep(10);
-          pthread_mutex_lock(&cache_mutex);
+          pthread_mutex_lock(&free_pages_mutex);
         }
-        pthread_mutex_unlock(&cache_mutex);
+        pthread_mutex_unlock(&free_pages_mutex);
       }
       debug(D_NOTICE, "syncing cache data");
-      if (psync_file_sync(readcache)){
+      if (sync_cache_tiers()){
         debug(D_ERROR, "flush of cache file failed");
-        pthread_mutex_unlock(&flush_cache_mutex);
-        return -1;
+        goto err0;
       }
       debug(D_NOTICE, "cache data synced");
-      pthread_mutex_lock(&cache_mutex);
     }
   }
-  pthread_mutex_unlock(&cache_mutex);
+  psync_free(dexts);
   psync_sql_start_transaction();
-  pthread_mutex_lock(&cache_mutex);
-  if (db_cache_max_page<db_cache_in_pages && cache_pages_in_hash && !diskfull){
-    i=0;
-    res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES && i<cache_pages_in_hash){
+  if (extcnt){
+    res=psync_sql_prep_statement("INSERT INTO pagecacheextent (hash, pageid, pagecnt, cacheid, lastsize, lastuse, usecnt, crcs) VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
+    for (i=0; i<extcnt; i++){
+      ext=exts[i];
+      psync_sql_bind_uint(res, 1, ext->hash);
+      psync_sql_bind_uint(res, 2, ext->pageid);
+      psync_sql_bind_uint(res, 3, ext->pagecnt);
+      psync_sql_bind_uint(res, 4, ext->cacheid);
+      psync_sql_bind_uint(res, 5, ext->lastsize);
+      psync_sql_bind_uint(res, 6, ext->lastuse);
+      psync_sql_bind_uint(res, 7, ext->usecnt);
+      psync_sql_bind_blob(res, 8, (const char *)ext->crcs, sizeof(uint32_t)*ext->pagecnt);
       psync_sql_run(res);
-      i++;
-      if (i%64==0){
-        pthread_mutex_unlock(&cache_mutex);
-        psync_sql_free_result(res);
-        psync_sql_commit_transaction();
-        if (!nosleep && !free_page_waiters)
-          psync_milisleep(1);
-        psync_sql_start_transaction();
-        pthread_mutex_lock(&cache_mutex);
-        res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-      }
+      ext->dbid=psync_sql_insertid();
     }
     psync_sql_free_result(res);
-    free_db_pages+=i;
-    db_cache_max_page+=i;
-    debug(D_NOTICE, "inserted %lu new free pages to database, db_cache_in_pages=%lu, db_cache_max_page=%lu",
-                    (unsigned long)i, (unsigned long)db_cache_in_pages, (unsigned long)db_cache_max_page);
-    updates++;
+    j=0;
+    pthread_mutex_lock(&extent_mutex);
+    for (i=0; i<extcnt; i++)
+      if (unlikely(add_extent_locked(exts[i]))){
+        free_db_slots_locked(exts[i]->cacheid, exts[i]->pagecnt);
+        exts[j++]=exts[i];
+      }
+    pthread_mutex_unlock(&extent_mutex);
+    if (unlikely(j)){
+      debug(D_WARNING, "%u extents were added to the cache by somebody else while flushing, dropping them", (unsigned)j);
+      res=psync_sql_prep_statement("DELETE FROM pagecacheextent WHERE id=?");
+      for (i=0; i<j; i++){
+        psync_sql_bind_uint(res, 1, exts[i]->dbid);
+        psync_sql_run(res);
+        psync_free(exts[i]);
+      }
+      psync_sql_free_result(res);
+    }
+    updates+=extcnt;
   }
-  cpih=cache_pages_in_hash;
+  psync_free(exts);
   if (!psync_list_isempty(&pages_to_flush)){
     pagecnt=0;
-    res=psync_sql_prep_statement("UPDATE OR IGNORE pagecache SET hash=?, pageid=?, type="NTO_STR(PAGE_TYPE_READ)", lastuse=?, usecnt=?, size=?, crc=? WHERE id=?");
     psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-      psync_list_del(&page->list);
-      psync_sql_bind_uint(res, 1, page->hash);
-      psync_sql_bind_uint(res, 2, page->pageid);
-      psync_sql_bind_uint(res, 3, page->lastuse);
-      psync_sql_bind_uint(res, 4, page->usecnt);
-      psync_sql_bind_uint(res, 5, page->size);
-      psync_sql_bind_uint(res, 6, page->crc);
-      psync_sql_bind_uint(res, 7, page->flushpageid);
-      psync_sql_run(res);
-      if (likely(psync_sql_affected_rows())){
-        updates++;
-        pagecnt++;
-        free_db_pages--;
-      }
-      psync_list_add_head(&free_pages, &page->list);
-      cache_pages_free++;
-      if (nosleep!=1 && updates%64==0){
-        if (free_page_waiters)
-          pthread_cond_broadcast(&free_page_cond);
-        pthread_mutex_unlock(&cache_mutex);
-        psync_sql_free_result(res);
-        psync_sql_commit_transaction();
-        if (!free_page_waiters) // it is ok if we read a stale value, because we don't hold cache_mutex any more
-          psync_milisleep(1);
-        psync_sql_start_transaction();
-        pthread_mutex_lock(&cache_mutex);
-        res=psync_sql_prep_statement("UPDATE OR IGNORE pagecache SET hash=?, pageid=?, type="NTO_STR(PAGE_TYPE_READ)", lastuse=?, usecnt=?, size=?, crc=? WHERE id=?");
-      }
+      remove_page_from_hash(page, &freed);
+      pagecnt++;
     }
-    psync_sql_free_result(res);
+    psync_pagecache_return_free_pages(&freed);
     debug(D_NOTICE, "flushed %u pages to cache file, free db pages %u, cache_pages_in_hash=%u", (unsigned)pagecnt,
-          (unsigned)free_db_pages, (unsigned)cache_pages_in_hash);
-    cache_pages_in_hash-=pagecnt;
-  }
-  if (cachepages_to_update_cnt && (cpih || cachepages_to_update_cnt>=DB_CACHE_UPDATE_HASH/4 || lastflush+300<ctime)){
-    res=psync_sql_prep_statement("UPDATE pagecache SET lastuse=?, usecnt=usecnt+? WHERE id=?");
-    for (i=0; i<DB_CACHE_UPDATE_HASH; i++)
-      if (cachepages_to_update[i].pagecacheid){
-        psync_sql_bind_uint(res, 1, cachepages_to_update[i].lastuse);
-        psync_sql_bind_uint(res, 2, cachepages_to_update[i].usecnt);
-        psync_sql_bind_uint(res, 3, cachepages_to_update[i].pagecacheid);
-        psync_sql_run(res);
-        memset(&cachepages_to_update[i], 0, sizeof(psync_cachepage_to_update));
-        updates++;
-        if (!nosleep && updates%128==0){
-          pthread_mutex_unlock(&cache_mutex);
-          psync_sql_free_result(res);
-          psync_sql_commit_transaction();
-          if (!free_page_waiters)
-            psync_milisleep(1);
-          psync_sql_start_transaction();
-          pthread_mutex_lock(&cache_mutex);
-          res=psync_sql_prep_statement("UPDATE pagecache SET lastuse=?, usecnt=usecnt+? WHERE id=?");
-        }
-      }
+          (unsigned)free_db_pages, (unsigned)get_cache_pages_in_hash());
+  }
+  if (dirty_extents_cnt && (pagecnt || dirty_extents_cnt>=cache_extents_cnt/4 || lastflush+300<ctime)){
+    i=0;
+    res=psync_sql_prep_statement("UPDATE pagecacheextent SET lastuse=?, usecnt=? WHERE id=?");
+    pthread_mutex_lock(&extent_mutex);
+    while (!psync_list_isempty(&dirty_extents)){
+      ext=psync_list_remove_head_element(&dirty_extents, psync_cache_extent_t, dirtylist);
+      psync_list_init(&ext->dirtylist);
+      psync_sql_bind_uint(res, 1, ext->lastuse);
+      psync_sql_bind_uint(res, 2, ext->usecnt);
+      psync_sql_bind_uint(res, 3, ext->dbid);
+      psync_sql_run(res);
+      i++;
+    }
+    dirty_extents_cnt=0;
+    pthread_mutex_unlock(&extent_mutex);
     psync_sql_free_result(res);
-    debug(D_NOTICE, "flushed %u access records to database", (unsigned)cachepages_to_update_cnt);
-    cachepages_to_update_cnt=0;
-    if (!nosleep)
-      for (i=0; i<DB_CACHE_UPDATE_HASH; i++)
-        if (cachepages_to_update[i].pagecacheid)
-          cachepages_to_update_cnt++;
+    debug(D_NOTICE, "flushed %u access records to database", (unsigned)i);
+    updates+=i;
     lastflush=ctime;
   }
+  pthread_mutex_lock(&free_pages_mutex);
   flushcacherun=0;
   flush_page_running--;
   if (free_page_waiters){
     debug(D_NOTICE, "finished flushing cache, but there are still free page waiters, broadcasting");
     pthread_cond_broadcast(&free_page_cond);
   }
-  if (updates){
-    pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_unlock(&free_pages_mutex);
+  if (updates)
     ret=psync_sql_commit_transaction();
-    pthread_mutex_unlock(&flush_cache_mutex);
-    if (free_db_pages<=CACHE_PAGES*2)
-      psync_run_thread("clean cache", clean_cache);
-    return ret;
-  }
   else{
-    pthread_mutex_unlock(&cache_mutex);
     psync_sql_rollback_transaction();
-    pthread_mutex_unlock(&flush_cache_mutex);
-    if (free_db_pages==0)
-      psync_run_thread("clean cache", clean_cache);
-    return 0;
+    ret=0;
   }
+  if (cache_tier_cnt>1)
+    balance_cache_tiers();
+  pthread_mutex_unlock(&flush_cache_mutex);
+  return ret;
+err0:
+  pthread_mutex_lock(&extent_mutex);
+  for (i=0; i<extcnt; i++){
+    free_db_slots_locked(exts[i]->cacheid, exts[i]->pagecnt);
+    psync_free(exts[i]);
+  }
+  pthread_mutex_unlock(&extent_mutex);
+  psync_free(exts);
+  psync_free(dexts);
+  pthread_mutex_lock(&free_pages_mutex);
+  flushcacherun=0;
+  flush_page_running--;
+  if (free_page_waiters)
+    pthread_cond_broadcast(&free_page_cond);
+  pthread_mutex_unlock(&free_pages_mutex);
+  pthread_mutex_unlock(&flush_cache_mutex);
+  return -1;
 }
 
 int psync_pagecache_flush(){
@@ -1424,251 +2017,233 @@ int psync_pagecache_flush(){
 }
 
 static void psync_pagecache_flush_timer(psync_timer_t timer, void *ptr){
-  if (!flushedbetweentimers && (cache_pages_in_hash || cachepages_to_update_cnt))
+  psync_cache_arena_t *arena, *arenas;
+  psync_cache_page_t *page;
+  psync_list resetting;
+  if (!flushedbetweentimers && (get_cache_pages_in_hash() || dirty_extents_cnt))
     psync_run_thread("flush pages timer", flush_pages_noret);
   flushedbetweentimers=0;
-  pthread_mutex_lock(&cache_mutex);
-  if (cache_pages_free==CACHE_PAGES && !cache_pages_reset){
+  psync_list_init(&resetting);
+  arenas=NULL;
+  pthread_mutex_lock(&free_pages_mutex);
+  if (cache_pages_free==cache_pages && !cache_pages_reset){
     cache_pages_reset=1;
+    retired_pages_unreset=0;
     debug(D_NOTICE, "resetting free pages");
-    psync_anon_reset(pages_base, CACHE_PAGES*PSYNC_FS_PAGE_SIZE);
+    for (arena=cache_arenas; arena; arena=arena->next)
+      psync_anon_reset(arena->base, (size_t)arena->pagecnt*PSYNC_FS_PAGE_SIZE);
   }
-  pthread_mutex_unlock(&cache_mutex);
-}
-
-static void mark_pagecache_used(uint64_t pagecacheid){
-  uint64_t h;
-  time_t tm;
-  int tries, runthread;
-  h=pagecacheid%DB_CACHE_UPDATE_HASH;
-  tm=psync_timer_time();
-  tries=0;
-  runthread=0;
-  pthread_mutex_lock(&cache_mutex);
-  while (++tries<=10){
-    if (cachepages_to_update[h].pagecacheid==0){
-      cachepages_to_update[h].pagecacheid=pagecacheid;
-      cachepages_to_update[h].lastuse=tm;
-      cachepages_to_update[h].usecnt=1;
-      cachepages_to_update_cnt++;
-      break;
-    }
-    else if (cachepages_to_update[h].pagecacheid==pagecacheid){
-      if (tm>cachepages_to_update[h].lastuse+5){
-        cachepages_to_update[h].lastuse=tm;
-        cachepages_to_update[h].usecnt++;
-      }
-      break;
+  else if (retired_pages_unreset){
+    debug(D_NOTICE, "releasing memory of %u retired pages", (unsigned)retired_pages_unreset);
+    /* the pages are taken off retired_pages while their memory is released without the lock, so the cache can not grow into them */
+    while (retired_pages_unreset){
+      page=psync_list_remove_head_element(&retired_pages, psync_cache_page_t, list);
+      psync_list_add_tail(&resetting, &page->list);
+      retired_pages_unreset--;
     }
-    if (++h>=DB_CACHE_UPDATE_HASH)
-      h=0;
-  }
-  if (cachepages_to_update_cnt>DB_CACHE_UPDATE_HASH/2 && !flushcacherun){
-    flushcacherun=1;
-    runthread=1;
+    arenas=cache_arenas;
   }
-  pthread_mutex_unlock(&cache_mutex);
-  if (runthread)
-    psync_run_thread("flush pages mark_pagecache_used", flush_pages_noret);
+  pthread_mutex_unlock(&free_pages_mutex);
+  if (psync_list_isempty(&resetting))
+    return;
+  psync_list_for_each_element(page, &resetting, psync_cache_page_t, list)
+    for (arena=arenas; arena; arena=arena->next)
+      if (page->page>=arena->base && page->page<arena->base+(size_t)arena->pagecnt*PSYNC_FS_PAGE_SIZE){
+        if (!arena->hugetlb)
+          psync_anon_reset(page->page, PSYNC_FS_PAGE_SIZE);
+        break;
+      }
+  pthread_mutex_lock(&free_pages_mutex);
+  while (!psync_list_isempty(&resetting))
+    psync_list_add_tail(&retired_pages, psync_list_remove_head(&resetting));
+  pthread_mutex_unlock(&free_pages_mutex);
 }
 
-static void mark_pagescache_used(uint64_t first_page_id, psync_uint_t pagecnt, unsigned char *dbread){
-  time_t tm;
-  psync_uint_t i;
-  uint64_t h;
-  int tries, runthread;
-  runthread=0;
-  tm=psync_timer_time();
-  pthread_mutex_lock(&cache_mutex);
-  for (i=0; i<pagecnt; i++)
-    if (dbread[i/8]&(1<<(i%8))){
-      h=(first_page_id+i)%DB_CACHE_UPDATE_HASH;
-      tries=0;
-      while (++tries<=10){
-        if (cachepages_to_update[h].pagecacheid==0){
-          cachepages_to_update[h].pagecacheid=first_page_id+i;
-          cachepages_to_update[h].lastuse=tm;
-          cachepages_to_update[h].usecnt=1;
-          cachepages_to_update_cnt++;
-          break;
-        }
-        else if (cachepages_to_update[h].pagecacheid==first_page_id+i){
-          if (tm>cachepages_to_update[h].lastuse+5){
-            cachepages_to_update[h].lastuse=tm;
-            cachepages_to_update[h].usecnt++;
-          }
-          break;
-        }
-        if (++h>=DB_CACHE_UPDATE_HASH)
-          h=0;
-      }
-    }
-  if (cachepages_to_update_cnt>DB_CACHE_UPDATE_HASH/2 && !flushcacherun){
-    flushcacherun=1;
-    runthread=1;
+/* looks up pageid of hash in the cache file, on success marks the extent as used and returns its slot, size and crc */
+static int get_page_in_db(uint64_t hash, uint64_t pageid, uint64_t *cacheid, uint32_t *size, uint32_t *crc){
+  psync_cache_extent_t *ext;
+  pthread_mutex_lock(&extent_mutex);
+  ext=get_extent(hash, pageid);
+  if (ext){
+    *cacheid=ext->cacheid+pageid-ext->pageid;
+    *size=extent_page_size(ext, pageid);
+    *crc=ext->crcs[pageid-ext->pageid];
+    mark_extent_used_locked(ext, psync_timer_time());
   }
-  pthread_mutex_unlock(&cache_mutex);
-  if (runthread)
-    psync_run_thread("flush pages mark_pagescache_used", flush_pages_noret);
+  pthread_mutex_unlock(&extent_mutex);
+  return ext?0:-1;
 }
 
-PSYNC_NOINLINE static void mark_page_free(uint64_t pagecacheid){
-  psync_sql_res *res;
-  res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)", pageid=NULL, hash=NULL WHERE id=?");
-  psync_sql_bind_uint(res, 1, pagecacheid);
-  psync_sql_run_free(res);
+/* drops the extent holding pageid of hash if it is still stored at cacheid, used when the data in the cache file turns out to be bad */
+PSYNC_NOINLINE static void drop_bad_extent(uint64_t hash, uint64_t pageid, uint64_t cacheid){
+  psync_cache_extent_t *ext;
+  pthread_mutex_lock(&extent_mutex);
+  ext=get_extent(hash, pageid);
+  if (ext && ext->cacheid+pageid-ext->pageid==cacheid)
+    del_extent_locked(ext);
+  else
+    ext=NULL;
+  pthread_mutex_unlock(&extent_mutex);
+  if (!ext)
+    return;
+  debug(D_NOTICE, "dropping extent of %u pages at page %lu of cache file", (unsigned)ext->pagecnt, (unsigned long)ext->cacheid);
+  delete_extents_from_db(&ext, 1);
+  pthread_mutex_lock(&extent_mutex);
+  free_db_slots_locked(ext->cacheid, ext->pagecnt);
+  pthread_mutex_unlock(&extent_mutex);
+  psync_free(ext);
 }
 
+/* the whole page is always read so that its CRC can be checked, partial reads go through a buffer on the stack */
 static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
-  psync_sql_res *res;
-  psync_uint_row row;
+  char pbuff[PSYNC_FS_PAGE_SIZE];
+  char *rbuff;
   size_t dsize;
   ssize_t readret;
-  psync_int_t ret;
-  uint64_t pagecacheid;
-  uint32_t crc;
-  ret=-1;
-  res=psync_sql_query_rdlock("SELECT id, size, crc FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, pageid);
-  if ((row=psync_sql_fetch_rowint(res))){
-    pagecacheid=row[0];
-    dsize=row[1];
-    crc=row[2];
-    if (size+off>dsize){
-      if (off>dsize)
-        size=0;
-      else
-        size=dsize-off;
-    }
-    ret=size;
+  uint64_t cacheid;
+  uint32_t crc, psize;
+  if (get_page_in_db(hash, pageid, &cacheid, &psize, &crc))
+    return -1;
+  dsize=psize;
+  if (size+off>dsize){
+    if (off>dsize)
+      size=0;
+    else
+      size=dsize-off;
   }
-  psync_sql_free_result(res);
-  if (ret!=-1){
-    readret=psync_file_pread(readcache, buff, size, pagecacheid*PSYNC_FS_PAGE_SIZE+off);
-    if (unlikely(readret!=size)){
-      debug(D_ERROR, "failed to read %lu bytes from cache file at offset %lu, read returned %ld, errno=%ld",
-            (unsigned long)size, (unsigned long)(pagecacheid*PSYNC_FS_PAGE_SIZE+off), (long)readret, (long)psync_fs_err());
-      mark_page_free(pagecacheid);
-      ret=-1;
-    }
-    else{
-      if (unlikely(size==dsize && off==0 && psync_crc32c(PSYNC_CRC_INITIAL, buff, size)!=crc)){
-        debug(D_WARNING, "got bad CRC when reading data from cache at offset %lu", (unsigned long)(pagecacheid*PSYNC_FS_PAGE_SIZE+off));
-        mark_page_free(pagecacheid);
-        ret=-1;
-      }
-      else
-        mark_pagecache_used(pagecacheid);
-    }
+  if (size==dsize && off==0)
+    rbuff=buff;
+  else
+    rbuff=pbuff;
+  readret=psync_file_pread(cacheid_fd(cacheid), rbuff, dsize, cacheid_offset(cacheid));
+  if (unlikely(readret!=dsize)){
+    debug(D_ERROR, "failed to read %lu bytes from cache tier %u at offset %lu, read returned %ld, errno=%ld", (unsigned long)dsize,
+          (unsigned)cacheid_tier(cacheid), (unsigned long)cacheid_offset(cacheid), (long)readret, (long)psync_fs_err());
+    drop_bad_extent(hash, pageid, cacheid);
+    return -1;
   }
-  return ret;
+  if (unlikely(psync_crc32c(PSYNC_CRC_INITIAL, rbuff, dsize)!=crc)){
+    debug(D_WARNING, "got bad CRC when reading data from cache tier %u at offset %lu", (unsigned)cacheid_tier(cacheid),
+          (unsigned long)cacheid_offset(cacheid));
+    drop_bad_extent(hash, pageid, cacheid);
+    return -1;
+  }
+  if (rbuff!=buff)
+    memcpy(buff, rbuff+off, size);
+  return size;
 }
 
 static void check_pages_in_database_by_hash(uint64_t hash, uint64_t first_page_id, psync_uint_t pagecnt, char *buff, unsigned char *dbread){
-  psync_sql_res *res;
-  psync_full_result_int *fres;
-  uint64_t cid, cpid;
-  ssize_t readret;
-  uint32_t i, j, cnt;
-  res=psync_sql_query_rdlock("SELECT id, pageid, size, crc FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)
-                             " AND hash=? AND pageid>=? AND pageid<? ORDER BY pageid");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, first_page_id);
-  psync_sql_bind_uint(res, 3, first_page_id+pagecnt);
-  fres=psync_sql_fetchall_int(res);
-  cnt=1;
-  for (i=0; i<fres->rows; i+=cnt){
-    if (psync_get_result_cell(fres, i, 2)!=PSYNC_FS_PAGE_SIZE)
+  psync_cache_extent_t *ext;
+  psync_file_io_t *ios;
+  uint64_t *cids;
+  uint32_t *crcs;
+  uint64_t from, to, pid;
+  time_t tm;
+  uint32_t i, j, cnt, iocnt;
+  cids=psync_new_cnt(uint64_t, pagecnt);
+  crcs=psync_new_cnt(uint32_t, pagecnt);
+  for (i=0; i<pagecnt; i++)
+    cids[i]=UINT64_MAX;
+  tm=psync_timer_time();
+  pthread_mutex_lock(&extent_mutex);
+  ext=get_extent_containing_or_after(hash, first_page_id);
+  while (ext && ext->pageid<first_page_id+pagecnt){
+    from=ext->pageid>first_page_id?ext->pageid:first_page_id;
+    to=ext->pageid+ext->pagecnt;
+    /* only full pages are read here, the partial last page of a file is left to the single page path */
+    if (ext->lastsize!=PSYNC_FS_PAGE_SIZE)
+      to--;
+    if (to>first_page_id+pagecnt)
+      to=first_page_id+pagecnt;
+    for (pid=from; pid<to; pid++){
+      cids[pid-first_page_id]=ext->cacheid+pid-ext->pageid;
+      crcs[pid-first_page_id]=ext->crcs[pid-ext->pageid];
+    }
+    if (from<to)
+      mark_extent_used_locked(ext, tm);
+    ext=get_next_extent(ext);
+  }
+  pthread_mutex_unlock(&extent_mutex);
+  /* runs of consecutive cache pages are read together, all runs are submitted as one batch, so runs in different tiers are read
+   * from their disks in parallel */
+  ios=psync_new_cnt(psync_file_io_t, pagecnt);
+  iocnt=0;
+  for (i=0; i<pagecnt; i+=cnt){
+    cnt=1;
+    if (cids[i]==UINT64_MAX)
       continue;
-    cid=psync_get_result_cell(fres, i, 0);
-    cpid=psync_get_result_cell(fres, i, 1);
-    cnt=0;
-    while (i+cnt+1<fres->rows && psync_get_result_cell(fres, i+cnt+1, 0)==cid+cnt+1 && psync_get_result_cell(fres, i+cnt+1, 1)==cpid+cnt+1 &&
-           psync_get_result_cell(fres, i+cnt+1, 2)==PSYNC_FS_PAGE_SIZE)
+    while (i+cnt<pagecnt && cids[i+cnt]==cids[i]+cnt)
       cnt++;
-    cnt++;
-//    debug(D_NOTICE, "reading %u consecutive pages from cache file id %lu, firstpageid %lu", (unsigned)cnt, (unsigned long)cid, (unsigned long)cpid);
-    readret=psync_file_pread(readcache, buff+(cpid-first_page_id)*PSYNC_FS_PAGE_SIZE, PSYNC_FS_PAGE_SIZE*cnt, cid*PSYNC_FS_PAGE_SIZE);
-    if (readret!=PSYNC_FS_PAGE_SIZE*cnt){
-      debug(D_ERROR, "failed to read %lu bytes from cache file at offset %lu, read returned %ld, errno=%ld",
-            (unsigned long)(PSYNC_FS_PAGE_SIZE*cnt), (unsigned long)(cid*PSYNC_FS_PAGE_SIZE), (long)readret, (long)psync_fs_err());
+    ios[iocnt].buf=buff+i*PSYNC_FS_PAGE_SIZE;
+    ios[iocnt].count=PSYNC_FS_PAGE_SIZE*cnt;
+    ios[iocnt].offset=cacheid_offset(cids[i]);
+    ios[iocnt].fd=cacheid_fd(cids[i]);
+    iocnt++;
+  }
+  psync_file_pread_batch(ios, iocnt);
+  for (i=0; i<iocnt; i++){
+    if (ios[i].ret!=(ssize_t)ios[i].count){
+      debug(D_ERROR, "failed to read %lu bytes from cache tier %u at offset %lu, read returned %ld, errno=%ld", (unsigned long)ios[i].count,
+            (unsigned)cacheid_tier(cids[((char *)ios[i].buf-buff)/PSYNC_FS_PAGE_SIZE]), (unsigned long)ios[i].offset, (long)ios[i].ret,
+            (long)psync_fs_err());
       continue;
     }
-    for (j=0; j<cnt; j++)
-      if (psync_crc32c(PSYNC_CRC_INITIAL, buff+(cpid-first_page_id+j)*PSYNC_FS_PAGE_SIZE, PSYNC_FS_PAGE_SIZE)==psync_get_result_cell(fres, i+j, 3))
-        dbread[(cpid-first_page_id+j)/8]|=1<<((cpid-first_page_id+j)%8);
+    cnt=ios[i].count/PSYNC_FS_PAGE_SIZE;
+    for (j=((char *)ios[i].buf-buff)/PSYNC_FS_PAGE_SIZE; cnt; j++, cnt--)
+      if (psync_crc32c(PSYNC_CRC_INITIAL, buff+j*PSYNC_FS_PAGE_SIZE, PSYNC_FS_PAGE_SIZE)==crcs[j])
+        dbread[j/8]|=1<<(j%8);
       else
-        debug(D_WARNING, "got bad CRC when reading data from cache at offset %lu", (unsigned long)((cid+j)*PSYNC_FS_PAGE_SIZE));
+        debug(D_WARNING, "got bad CRC when reading data from cache tier %u at offset %lu", (unsigned)cacheid_tier(cids[j]),
+              (unsigned long)cacheid_offset(cids[j]));
   }
-  if (fres->rows)
-    mark_pagescache_used(first_page_id, pagecnt, dbread);
-  psync_free(fres);
+  psync_free(ios);
+  psync_free(crcs);
+  psync_free(cids);
 }
 
 static psync_int_t check_page_in_database_by_hash_and_cache(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
-  psync_sql_res *res;
-  psync_uint_row row;
   psync_cache_page_t *page;
   size_t dsize;
   ssize_t readret;
-  psync_int_t ret;
-  uint64_t pagecacheid;
-  uint32_t crc, ccrc;
-  ret=-1;
-  res=psync_sql_query_rdlock("SELECT id, size, crc FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, pageid);
-  if ((row=psync_sql_fetch_rowint(res))){
-    pagecacheid=row[0];
-    dsize=row[1];
-    crc=row[2];
-    if (size+off>dsize){
-      if (off>dsize)
-        size=0;
-      else
-        size=dsize-off;
-    }
-    ret=size;
+  uint64_t cacheid;
+  uint32_t crc, ccrc, psize;
+  if (get_page_in_db(hash, pageid, &cacheid, &psize, &crc))
+    return -1;
+  dsize=psize;
+  if (size+off>dsize){
+    if (off>dsize)
+      size=0;
+    else
+      size=dsize-off;
   }
-  psync_sql_free_result(res);
-  if (ret!=-1){
-    page=psync_pagecache_get_free_page(0);
-    readret=psync_file_pread(readcache, page->page, dsize, pagecacheid*PSYNC_FS_PAGE_SIZE);
-    if (unlikely(readret!=dsize)){
-      debug(D_ERROR, "failed to read %lu bytes from cache file at offset %lu, read returned %ld, errno=%ld",
-            (unsigned long)dsize, (unsigned long)(pagecacheid*PSYNC_FS_PAGE_SIZE), (long)readret, (long)psync_fs_err());
-      mark_page_free(pagecacheid);
-      psync_pagecache_return_free_page(page);
-      ret=-1;
-    }
-    else{
-      ccrc=psync_crc32c(PSYNC_CRC_INITIAL, page->page, dsize);
-      if (unlikely(ccrc!=crc)){
-        debug(D_WARNING, "got bad CRC when reading data from cache at offset %lu, size %lu db CRC %u calculated CRC %u",
-              (unsigned long)(pagecacheid*PSYNC_FS_PAGE_SIZE), (unsigned long)dsize, (unsigned)crc, (unsigned)ccrc);
-        mark_page_free(pagecacheid);
-        psync_pagecache_return_free_page(page);
-        ret=-1;
-      }
-      else{
-        mark_pagecache_used(pagecacheid);
-        memcpy(buff, page->page+off, size);
-        page->hash=hash;
-        page->pageid=pageid;
-        page->lastuse=0;
-        page->size=dsize;
-        page->usecnt=0;
-        page->crc=ccrc;
-        page->type=PAGE_TYPE_CACHE;
-        pthread_mutex_lock(&cache_mutex);
-        psync_list_add_tail(&cache_hash[pagehash_by_hash_and_pageid(hash, pageid)], &page->list);
-        cache_pages_in_hash++;
-        pthread_mutex_unlock(&cache_mutex);
-      }
-    }
+  page=psync_pagecache_get_free_page(0);
+  readret=psync_file_pread(cacheid_fd(cacheid), page->page, dsize, cacheid_offset(cacheid));
+  if (unlikely(readret!=dsize)){
+    debug(D_ERROR, "failed to read %lu bytes from cache tier %u at offset %lu, read returned %ld, errno=%ld", (unsigned long)dsize,
+          (unsigned)cacheid_tier(cacheid), (unsigned long)cacheid_offset(cacheid), (long)readret, (long)psync_fs_err());
+    drop_bad_extent(hash, pageid, cacheid);
+    psync_pagecache_return_free_page(page);
+    return -1;
   }
-  return ret;
+  ccrc=psync_crc32c(PSYNC_CRC_INITIAL, page->page, dsize);
+  if (unlikely(ccrc!=crc)){
+    debug(D_WARNING, "got bad CRC when reading data from cache tier %u at offset %lu, size %lu db CRC %u calculated CRC %u",
+          (unsigned)cacheid_tier(cacheid), (unsigned long)cacheid_offset(cacheid), (unsigned long)dsize, (unsigned)crc, (unsigned)ccrc);
+    drop_bad_extent(hash, pageid, cacheid);
+    psync_pagecache_return_free_page(page);
+    return -1;
+  }
+  memcpy(buff, page->page+off, size);
+  page->hash=hash;
+  page->pageid=pageid;
+  page->lastuse=0;
+  page->size=dsize;
+  page->usecnt=0;
+  page->crc=ccrc;
+  page->type=PAGE_TYPE_CACHE;
+  add_page_to_hash(page);
+  return size;
 }
 
 int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset){
@@ -1764,7 +2339,7 @@ static void psync_pagecache_send_error(psync_request_t *request, int err){
   lock_wait(request->hash);
   psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list)
     psync_pagecache_send_range_error(range, request, err);
-  unlock_wait(request->ash);
+  unlock_wait(request->hash);
   if (request->needkey)
     psync_pagecache_set_bad_encoder(request->of);
   psync_fs_dec_of_refcnt_and_readers(request->of);
@@ -1794,6 +2369,8 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
       return -1;
     }
   }
+  if (!request->firstms)
+    request->firstms=psync_millitime();
   for (i=0; i<len; i++){
     page=psync_pagecache_get_free_page(0);
     rb=psync_http_request_readall(sock, page->page, PSYNC_FS_PAGE_SIZE);
@@ -1802,6 +2379,7 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
       psync_timer_notify_exception();
       return -1;
     }
+    request->bytes+=rb;
     page->hash=request->hash;
     page->pageid=first_page_id+i;
     page->lastuse=psync_timer_time();
@@ -1817,10 +2395,7 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
         break;
       }
     unlock_wait(page->hash);
-    pthread_mutex_lock(&cache_mutex);
-    psync_list_add_tail(&cache_hash[pagehash_by_hash_and_pageid(page->hash, page->pageid)], &page->list);
-    cache_pages_in_hash++;
-    pthread_mutex_unlock(&cache_mutex);
+    add_page_to_hash(page);
   }
   return 0;
 }
@@ -1863,6 +2438,48 @@ char *psync_http_construct_range_next_header(psync_request_t *request){
   return psync_strdup((char *)memcpy(buff+off-sizeof(PSYNC_CONSTRUCT_HEADER)+3, PSYNC_CONSTRUCT_HEADER, sizeof(PSYNC_CONSTRUCT_HEADER)-1));
 }
 
+static void readahead_request_start(psync_request_t *request){
+  request->sentms=psync_millitime();
+  request->firstms=0;
+  request->bytes=0;
+}
+
+static uint64_t ewma(uint64_t avg, uint64_t sample, uint32_t weight){
+  if (avg)
+    return (avg*(weight-1)+sample)/weight;
+  else
+    return sample;
+}
+
+/* Round trip is the time until the first response header, throughput is measured over the rest of the request. Requests
+ * smaller than the starting readahead mostly measure latency, so they only update the round trip.
+ */
+static void readahead_request_done(psync_request_t *request){
+  psync_openfile_t *of;
+  psync_file_stream_t *st;
+  uint64_t now, rtt, rate;
+  if (request->streamidx<0 || !request->firstms)
+    return;
+  now=psync_millitime();
+  rtt=request->firstms-request->sentms;
+  rate=0;
+  if (request->bytes>=PSYNC_FS_MIN_READAHEAD_START)
+    rate=request->bytes*1000/(now>request->firstms?now-request->firstms:1);
+  of=request->of;
+  psync_fs_lock_file(of);
+  of->rttms=ewma(of->rttms, rtt, 8);
+  if (rate)
+    of->netrate=ewma(of->netrate, rate, 4);
+  st=&of->streams[request->streamidx];
+  if (st->gen==request->streamgen){
+    st->rttms=ewma(st->rttms, rtt, 8);
+    if (rate)
+      st->netrate=ewma(st->netrate, rate, 4);
+    st->requests++;
+  }
+  pthread_mutex_unlock(&of->mutex);
+}
+
 static void psync_pagecache_read_unmodified_thread(void *ptr){
   psync_request_t *request;
   psync_http_socket *sock;
@@ -1917,6 +2534,7 @@ retry:
       if (likely_log(hosts->length && hosts->array[0]->type==PARAM_STR))
         psync_http_connect_and_cache_host(hosts->array[0]->str);
       psync_socket_set_write_buffered(api);
+      readahead_request_start(request);
       psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list){
         debug(D_NOTICE, "sending request for offset %lu, size %lu to API", (unsigned long)range->offset, (unsigned long)range->length);
         if (psync_api_send_read_request(api, request->fileid, request->hash, range->offset, range->length))
@@ -1946,6 +2564,7 @@ err_api1:
     }
     else if ((api=get_shared_api())){
       psync_socket_set_write_buffered_thread(api);
+      readahead_request_start(request);
       debug(D_NOTICE, "no cached server connections, no cached API servers, but got shared API connection sending request to shared API");
       psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list){
         debug(D_NOTICE, "sending request for offset %lu, size %lu to shared API", (unsigned long)range->offset, (unsigned long)range->length);
@@ -1985,6 +2604,7 @@ err_api0:
 //  debug(D_NOTICE, "connected to %s", host);
   path=psync_find_result(urls->urls, "path", PARAM_STR)->str;
   psync_socket_set_write_buffered(sock->sock);
+  readahead_request_start(request);
   psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list){
     debug(D_NOTICE, "sending request for offset %lu, size %lu", (unsigned long)range->offset, (unsigned long)range->length);
     if (psync_list_is_head(&request->ranges, &range->list) && !psync_list_is_tail(&request->ranges, &range->list)){
@@ -2018,6 +2638,7 @@ err_api0:
   psync_http_close(sock);
   debug(D_NOTICE, "request from %s finished", host);
 ok1:
+  readahead_request_done(request);
   psync_fs_dec_of_refcnt_and_readers(request->of);
   psync_pagecache_free_request(request);
   release_urls(urls);
@@ -2070,21 +2691,80 @@ static void check_or_request_page(uint64_t fileid, uint64_t hash, uint64_t pagei
   }
 }
 
-static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint64_t offset, uint64_t size, psync_list *ranges,
+static void readahead_account_read(psync_file_stream_t *st, uint64_t size, uint64_t now){
+  st->readbytes+=size;
+  if (now>=st->ratesince+PSYNC_FS_READAHEAD_RATE_MS){
+    st->readrate=ewma(st->readrate, st->readbytes*1000/(now-st->ratesince), 4);
+    st->readbytes=0;
+    st->ratesince=now;
+  }
+}
+
+/* pages read ahead wait in the memory cache, a window larger than it only evicts them before they are used */
+static uint64_t readahead_cache_cap(){
+  uint64_t c;
+  c=(uint64_t)cache_pages*PSYNC_FS_PAGE_SIZE/PSYNC_FS_READAHEAD_CACHE_DIV;
+  return c<PSYNC_FS_MIN_READAHEAD_START?PSYNC_FS_MIN_READAHEAD_START:c;
+}
+
+/* Data has to be requested a round trip plus the time to transfer it ahead of the reader, so for a reader consuming
+ * readrate the window w satisfies w=readrate*(rtt+w/netrate). It is doubled so that the next request goes out before the
+ * previous one is consumed. A reader at or above the network rate gets the largest window, but never more than
+ * PSYNC_FS_MAX_READAHEAD_SEC of its own consumption.
+ */
+static uint64_t readahead_bdp_window(const psync_file_stream_t *st){
+  uint64_t w;
+  if (!st->readrate || !st->netrate)
+    return 0;
+  if (st->readrate*4>=st->netrate*3)
+    w=PSYNC_FS_MAX_READAHEAD_BDP;
+  else{
+    w=2*st->readrate*st->rttms/1000;
+    if (w>PSYNC_FS_MAX_READAHEAD_BDP)
+      w=PSYNC_FS_MAX_READAHEAD_BDP;
+    w+=w*st->readrate/(st->netrate-st->readrate);
+  }
+  if (w>st->readrate*PSYNC_FS_MAX_READAHEAD_SEC)
+    w=st->readrate*PSYNC_FS_MAX_READAHEAD_SEC;
+  if (w>PSYNC_FS_MAX_READAHEAD_BDP)
+    w=PSYNC_FS_MAX_READAHEAD_BDP;
+  if (w>readahead_cache_cap())
+    w=readahead_cache_cap();
+  if (w<PSYNC_FS_MIN_READAHEAD_START)
+    w=PSYNC_FS_MIN_READAHEAD_START;
+  return size_round_up_to_page(w);
+}
+
+/* enough requests in flight to cover the bandwidth-delay product of the link, one per MB of it */
+static uint32_t readahead_max_running_reads(const psync_openfile_t *of){
+  uint64_t r;
+  if (!of->netrate || !of->rttms)
+    return PSYNC_FS_DEFAULT_RUNNING_READS;
+  r=2+of->netrate*of->rttms/1000/(1024*1024);
+  if (r>PSYNC_FS_MAX_RUNNING_READS)
+    r=PSYNC_FS_MAX_RUNNING_READS;
+  return r;
+}
+
+static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint64_t offset, uint64_t size, psync_request_t *rq,
                                                       psync_fileid_t fileid, uint64_t hash, uint64_t initialsize, psync_crypto_offsets_t *offsets){
-  uint64_t readahead, frompageoff, topageoff, first_page_id, rto;
+  uint64_t readahead, frompageoff, topageoff, first_page_id, rto, window, now;
   psync_int_t i, pagecnt, h, streamid;
+  psync_list *ranges;
   psync_page_wait_t *pw;
   psync_request_range_t *range;
   time_t ctime;
   unsigned char *pages_in_db;
   int found;
+  ranges=&rq->ranges;
+  rq->streamidx=-1;
   if (offset+size>=initialsize)
     return;
   readahead=0;
   frompageoff=offset/PSYNC_FS_PAGE_SIZE;
   topageoff=((offset+size+PSYNC_FS_PAGE_SIZE-1)/PSYNC_FS_PAGE_SIZE)-1;
   ctime=psync_timer_time();
+  now=psync_millitime();
   found=0;
   for (streamid=0; streamid<PSYNC_FS_FILESTREAMS_CNT; streamid++)
     if (of->streams[streamid].frompage<=frompageoff && of->streams[streamid].topage+2>=frompageoff){
@@ -2094,6 +2774,7 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
       of->streams[streamid].topage=topageoff;
       of->streams[streamid].length+=size;
       of->streams[streamid].lastuse=ctime;
+      readahead_account_read(&of->streams[streamid], size, now);
       break;
     }
     else if (of->streams[streamid].lastuse>=ctime-2)
@@ -2114,12 +2795,22 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
     of->streams[streamid].length=size;
     of->streams[streamid].requestedto=0;
     of->streams[streamid].lastuse=ctime;
+    of->streams[streamid].readrate=0;
+    of->streams[streamid].readbytes=size;
+    of->streams[streamid].ratesince=now;
+    of->streams[streamid].netrate=of->netrate;
+    of->streams[streamid].rttms=of->rttms;
+    of->streams[streamid].window=0;
+    of->streams[streamid].requests=0;
+    of->streams[streamid].gen++;
     if (found==1 && of->currentspeed*4>readahead && !psync_list_isempty(ranges)){
       debug(D_NOTICE, "found just one freshly used stream, increasing readahead to four times current speed %u", (unsigned int)of->currentspeed*4);
       readahead=size_round_up_to_page(of->currentspeed*4);
     }
   }
-  if (of->runningreads>=6 && psync_list_isempty(ranges))
+  rq->streamidx=streamid;
+  rq->streamgen=of->streams[streamid].gen;
+  if (of->runningreads>=readahead_max_running_reads(of) && psync_list_isempty(ranges))
     return;
   if (offset==0 && (size<PSYNC_FS_MIN_READAHEAD_START) && readahead<PSYNC_FS_MIN_READAHEAD_START-size)
     readahead=PSYNC_FS_MIN_READAHEAD_START-size;
@@ -2129,11 +2820,22 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
   }
   else if (offset!=0 && (size<PSYNC_FS_MIN_READAHEAD_RAND) && readahead<PSYNC_FS_MIN_READAHEAD_RAND-size)
     readahead=PSYNC_FS_MIN_READAHEAD_RAND-size;
-  if (of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC>PSYNC_FS_MIN_READAHEAD_START){
+  window=readahead_bdp_window(&of->streams[streamid]);
+  of->streams[streamid].window=window;
+  if (window){
+    /* once the stream is sequential jump to the window instead of growing it with the length read so far */
+    if (readahead>=PSYNC_FS_MIN_READAHEAD_START && readahead<window)
+      readahead=window;
+    else if (readahead>window)
+      readahead=window;
+  }
+  else if (of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC>PSYNC_FS_MIN_READAHEAD_START){
     if (readahead>of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC)
       readahead=size_round_up_to_page(of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC);
     if (readahead>PSYNC_FS_MAX_READAHEAD_IF_SEC)
       readahead=PSYNC_FS_MAX_READAHEAD_IF_SEC;
+    if (readahead>readahead_cache_cap())
+      readahead=size_round_up_to_page(readahead_cache_cap());
   }
   else if (readahead>PSYNC_FS_MAX_READAHEAD)
     readahead=PSYNC_FS_MAX_READAHEAD;
@@ -2223,8 +2925,9 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
   unlock_wait(hash);
   psync_free(pages_in_db);
   if (!psync_list_isempty(ranges))
-    debug(D_NOTICE, "readahead=%lu, rto=%lu, offset=%lu, size=%lu, currentspeed=%u",
-          (long unsigned)readahead, (unsigned long)rto, (unsigned long)offset, (unsigned long)size, (unsigned)of->currentspeed);
+    debug(D_NOTICE, "readahead=%lu, rto=%lu, offset=%lu, size=%lu, currentspeed=%u, window=%lu",
+          (long unsigned)readahead, (unsigned long)rto, (unsigned long)offset, (unsigned long)size, (unsigned)of->currentspeed,
+          (unsigned long)window);
 }
 
 static void psync_free_page_waiter(psync_page_waiter_t *pwt){
@@ -2280,7 +2983,7 @@ static void wait_waiter(psync_page_waiter_t *pwt, uint64_t hash, const char *pt)
   lock_wait(hash);
   while (!pwt->ready){
     debug(D_NOTICE, "waiting for %s page #%lu to be read", pt, (unsigned long)pwt->waiting_for->pageid);
-    pthread_cond_wait(&pwt->cond, &wait_page_mutex);
+    pthread_cond_wait(&pwt->cond, wait_mutex(hash));
     debug(D_NOTICE, "waited for %s page", pt); // not safe to use pwt->waiting_for here
   }
   unlock_wait(hash);
@@ -2363,14 +3066,15 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
     add_page_waiter(&waiting, &rq->ranges, hash, first_page_id+i, fileid, pbuff, i, copyoff, copysize);
   }
   unlock_wait(hash);
-  psync_pagecache_read_unmodified_readahead(of, poffset, psize, &rq->ranges, fileid, hash, initialsize, NULL);
+  psync_pagecache_read_unmodified_readahead(of, poffset, psize, rq, fileid, hash, initialsize, NULL);
   if (!psync_list_isempty(&rq->ranges)){
     rq->of=of;
     rq->fileid=fileid;
     rq->hash=hash;
     rq->needkey=0;
     psync_fs_inc_of_refcnt_and_readers(of);
-    psync_run_thread1("read unmodified", psync_pagecache_read_unmodified_thread, rq);
+    /* the request may only carry readahead if all the pages that were asked for are already cached */
+    psync_run_pool1(psync_list_isempty(&waiting)?PSYNC_POOL_IO:PSYNC_POOL_READ, "read unmodified", psync_pagecache_read_unmodified_thread, rq);
   }
   else
     psync_free(rq);
@@ -2592,14 +3296,15 @@ int psync_pagecache_read_unmodified_encrypted_locked(psync_openfile_t *of, char
       goto err0;
   }
   unlock_wait(hash);
-  psync_pagecache_read_unmodified_readahead(of, poffset, psize, &rq->ranges, fileid, hash, initialsize, &offsets);
+  psync_pagecache_read_unmodified_readahead(of, poffset, psize, rq, fileid, hash, initialsize, &offsets);
   if (!psync_list_isempty(&rq->ranges) || needkey){
     rq->of=of;
     rq->fileid=fileid;
     rq->hash=hash;
     rq->needkey=needkey;
     psync_fs_inc_of_refcnt_and_readers(of);
-    psync_run_thread1("crypto read unmodified", psync_pagecache_read_unmodified_thread, rq);
+    psync_run_pool1(psync_list_isempty(&waiting) && !needkey?PSYNC_POOL_IO:PSYNC_POOL_READ, "crypto read unmodified",
+                    psync_pagecache_read_unmodified_thread, rq);
   }
   else
     psync_free(rq);
@@ -2731,6 +3436,7 @@ int psync_pagecache_readv_locked(psync_openfile_t *of, psync_pagecache_read_rang
   pthread_mutex_unlock(&of->mutex);
   rq=psync_new(psync_request_t);
   psync_list_init(&rq->ranges);
+  rq->streamidx=-1;
   psync_list_init(&waiting);
   for (i=0; i<cnt; i++){
     assert(ranges[i].offset+ranges[i].size<=of->encrypted?psync_fs_crypto_crypto_size(initialsize):initialsize);
@@ -2789,7 +3495,7 @@ int psync_pagecache_readv_locked(psync_openfile_t *of, psync_pagecache_read_rang
     rq->hash=hash;
     rq->needkey=needkey;
     psync_fs_inc_of_refcnt_and_readers(of);
-    psync_run_thread1("readv unmodified", psync_pagecache_read_unmodified_thread, rq);
+    psync_run_pool1(PSYNC_POOL_READ, "readv unmodified", psync_pagecache_read_unmodified_thread, rq);
   }
   ret=0;
   if (needkey){
@@ -2808,7 +3514,7 @@ int psync_pagecache_readv_locked(psync_openfile_t *of, psync_pagecache_read_rang
   psync_list_for_each_element(pwt, &waiting, psync_page_waiter_t, listwaiter){
     while (!pwt->ready){
       debug(D_NOTICE, "waiting for page #%lu to be read", (unsigned long)pwt->waiting_for->pageid);
-      pthread_cond_wait(&pwt->cond, &wait_page_mutex);
+      pthread_cond_wait(&pwt->cond, wait_mutex(hash));
       debug(D_NOTICE, "waited for page"); // not safe to use pwt->waiting_for here
     }
     if (pwt->error || pwt->rsize<pwt->size)
@@ -2829,10 +3535,9 @@ static void psync_pagecache_add_page_if_not_exists(psync_cache_page_t *page, uin
     psync_pagecache_return_free_page(page);
     return;
   }
-  h1=pagehash_by_hash_and_pageid(hash, pageid);
   h2=waiterhash_by_hash_and_pageid(hash, pageid);
   lock_wait(hash);
-  pthread_mutex_lock(&cache_mutex);
+  h1=lock_bucket(hash, pageid);
   psync_list_for_each_element(pg, &cache_hash[h1], psync_cache_page_t, list)
     if (pg->type==PAGE_TYPE_READ && pg->hash==hash && pg->pageid==pageid){
       hasit=1;
@@ -2844,27 +3549,14 @@ static void psync_pagecache_add_page_if_not_exists(psync_cache_page_t *page, uin
         hasit=1;
         break;
       }
-  if (hasit)
-    psync_pagecache_return_free_page_locked(page);
-  else{
+  if (!hasit){
     psync_list_add_tail(&cache_hash[h1], &page->list);
-    cache_pages_in_hash++;
+    stripe_pages(h1)++;
   }
-  pthread_mutex_unlock(&cache_mutex);
+  unlock_stripe(h1);
   unlock_wait(hash);
-}
-
-static void psync_check_clean_running(){
-  if (unlikely(clean_cache_in_progress)){
-   if (pthread_mutex_trylock(&clean_cache_mutex)){
-     debug(D_NOTICE, "waiting for cache clean to exit");
-     pthread_mutex_lock(&clean_cache_mutex);
-     pthread_mutex_unlock(&clean_cache_mutex);
-     debug(D_NOTICE, "waited for cache clean to exit");
-   }
-   else
-     pthread_mutex_unlock(&clean_cache_mutex);
-  }
+  if (hasit)
+    psync_pagecache_return_free_page(page);
 }
 
 static void psync_pagecache_new_upload_to_cache(uint64_t taskid, uint64_t hash, int pause){
@@ -2907,10 +3599,8 @@ static void psync_pagecache_new_upload_to_cache(uint64_t taskid, uint64_t hash,
     if (rd<PSYNC_FS_PAGE_SIZE)
       break;
     pageid++;
-    if (pause && pageid%64==0){
-      psync_check_clean_running();
+    if (pause && pageid%64==0)
       psync_milisleep(10);
-    }
   }
   psync_file_close(fd);
   psync_file_delete(filename);
@@ -2918,39 +3608,95 @@ static void psync_pagecache_new_upload_to_cache(uint64_t taskid, uint64_t hash,
   psync_free(filename);
 }
 
-static void switch_pageids(uint64_t hash, uint64_t oldhash, uint64_t *pageids, psync_uint_t pageidcnt){
+/* moves the pages from..to-1 of oldhash in the cache file to hash, extents that are fully inside the range are just renamed, the
+ * (at most two) extents that are partially covered have the covered pages copied to memory under the new hash
+ */
+static void switch_db_pages_to_hash(uint64_t oldhash, uint64_t hash, uint64_t from, uint64_t to){
+  psync_cache_extent_t *ext, *next;
+  psync_cache_page_t *page;
   psync_sql_res *res;
-  psync_uint_t i;
-  res=psync_sql_prep_statement("UPDATE OR IGNORE pagecache SET hash=?, lastuse=? WHERE hash=? AND type=? AND pageid=?");
-  psync_sql_start_transaction();
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, psync_timer_time());
-  psync_sql_bind_uint(res, 3, oldhash);
-  psync_sql_bind_uint(res, 4, PAGE_TYPE_READ);
-  for (i=0; i<pageidcnt; i++){
-    psync_sql_bind_uint(res, 5, pageids[i]);
-    psync_sql_run(res);
+  uint64_t *dbids;
+  uint64_t partial[2][2], pageid;
+  psync_uint_t cnt, alloc, pcnt, i;
+  psync_int_t pdb;
+  time_t tm;
+  dbids=NULL;
+  cnt=alloc=pcnt=0;
+  tm=psync_timer_time();
+  pthread_mutex_lock(&extent_mutex);
+  ext=get_extent_containing_or_after(oldhash, from);
+  while (ext && ext->pageid<to){
+    next=get_next_extent(ext);
+    if (ext->pageid>=from && ext->pageid+ext->pagecnt<=to){
+      del_extent_locked(ext);
+      ext->hash=hash;
+      if (unlikely(add_extent_locked(ext))){
+        ext->hash=oldhash;
+        add_extent_locked(ext);
+      }
+      else{
+        ext->lastuse=tm;
+        if (cnt==alloc){
+          alloc=alloc*2+16;
+          dbids=(uint64_t *)psync_realloc(dbids, sizeof(uint64_t)*alloc);
+        }
+        dbids[cnt++]=ext->dbid;
+      }
+    }
+    else if (pcnt<ARRAY_SIZE(partial)){
+      partial[pcnt][0]=ext->pageid>from?ext->pageid:from;
+      partial[pcnt][1]=ext->pageid+ext->pagecnt<to?ext->pageid+ext->pagecnt:to;
+      pcnt++;
+    }
+    ext=next;
   }
-  psync_sql_commit_transaction();
-  psync_sql_free_result(res);
+  pthread_mutex_unlock(&extent_mutex);
+  if (cnt){
+    psync_sql_start_transaction();
+    res=psync_sql_prep_statement("UPDATE pagecacheextent SET hash=?, lastuse=? WHERE id=?");
+    psync_sql_bind_uint(res, 1, hash);
+    psync_sql_bind_uint(res, 2, tm);
+    for (i=0; i<cnt; i++){
+      psync_sql_bind_uint(res, 3, dbids[i]);
+      psync_sql_run(res);
+    }
+    psync_sql_free_result(res);
+    psync_sql_commit_transaction();
+  }
+  psync_free(dbids);
+  for (i=0; i<pcnt; i++)
+    for (pageid=partial[i][0]; pageid<partial[i][1]; pageid++){
+      page=psync_pagecache_get_free_page(1);
+      pdb=check_page_in_database_by_hash(oldhash, pageid, page->page, PSYNC_FS_PAGE_SIZE, 0);
+      if (pdb==-1){
+        psync_pagecache_return_free_page(page);
+        continue;
+      }
+      page->hash=hash;
+      page->pageid=pageid;
+      page->lastuse=tm;
+      page->size=pdb;
+      page->usecnt=1;
+      page->crc=psync_crc32c(PSYNC_CRC_INITIAL, page->page, pdb);
+      page->type=PAGE_TYPE_READ;
+      psync_pagecache_add_page_if_not_exists(page, hash, pageid);
+    }
 }
 
 static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint64_t oldhash){
-  uint64_t pageids[64];
   char *filename, *indexname;
   const char *cachepath;
   psync_cache_page_t *page;
   psync_interval_tree_t *tree, *interval;
-  uint64_t pageid, off, roff, rdoff, rdlen;
+  uint64_t pageid, off, roff, rdoff, rdlen, swfrom, swto;
   int64_t fs;
   ssize_t rd;
   psync_int_t pdb;
-  psync_uint_t pageidcnt;
   time_t tm;
   psync_file_t fd;
   char fileidhex[sizeof(psync_fsfileid_t)*2+2];
   int ret;
-  pageidcnt=0;
+  swfrom=swto=0;
   psync_binhex(fileidhex, &taskid, sizeof(psync_fsfileid_t));
   fileidhex[sizeof(psync_fsfileid_t)]='d';
   fileidhex[sizeof(psync_fsfileid_t)+1]=0;
@@ -3008,13 +3754,14 @@ static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint
         break;
       }
       if (!switch_memory_page_to_hash(oldhash, hash, pageid)){
-        pageids[pageidcnt]=pageid;
-        if (++pageidcnt==ARRAY_SIZE(pageids)){
-          pageidcnt=0;
-          switch_pageids(hash, oldhash, pageids, ARRAY_SIZE(pageids));
-          psync_milisleep(10);
-          psync_check_clean_running();
+        if (swto!=pageid){
+          if (swfrom!=swto){
+            switch_db_pages_to_hash(oldhash, hash, swfrom, swto);
+            psync_milisleep(10);
+          }
+          swfrom=pageid;
         }
+        swto=pageid+1;
       }
     }
     else if (interval->from<=off && (interval->to>=off+PSYNC_FS_PAGE_SIZE || interval->to>=fs)){ // full new page
@@ -3037,10 +3784,8 @@ static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint
       page->type=PAGE_TYPE_READ;
 //      debug(D_NOTICE, "new page %lu crc %lu size %lu", (unsigned long)pageid, (unsigned long)page->crc, (unsigned long)rd);
       psync_pagecache_add_page_if_not_exists(page, hash, pageid);
-      if (pageid%64==0){
-        psync_check_clean_running();
+      if (pageid%64==0)
         psync_milisleep(10);
-      }
     }
     else{ // page with both old and new fragments
       // we covered full new page and full old page cases, so this interval either ends or starts inside current page
@@ -3105,15 +3850,13 @@ static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint
       page->type=PAGE_TYPE_READ;
 //      debug(D_NOTICE, "combined page %lu crc %lu size %lu", (unsigned long)pageid, (unsigned long)page->crc, (unsigned long)pdb);
       psync_pagecache_add_page_if_not_exists(page, hash, pageid);
-      if (pageid%64==0){
-        psync_check_clean_running();
+      if (pageid%64==0)
         psync_milisleep(10);
-      }
     }
   }
 err2:
-  if (pageidcnt)
-    switch_pageids(hash, oldhash, pageids, pageidcnt);
+  if (swfrom!=swto)
+    switch_db_pages_to_hash(oldhash, hash, swfrom, swto);
   psync_file_close(fd);
 err1:
   psync_interval_tree_free(tree);
@@ -3246,190 +3989,454 @@ int psync_pagecache_copy_all_pages_from_cache_to_file_locked(psync_openfile_t *o
   }
 }
 
+/* Writes the content with the given hash to a new file if all of its pages are cached and verifies it against hexsum,
+ * the file is removed on any failure.
+ */
+int psync_pagecache_copy_to_local_file(uint64_t hash, uint64_t size, const char *filename, const unsigned char *hexsum){
+  char buff[PSYNC_FS_PAGE_SIZE];
+  psync_hash_ctx hctx;
+  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN], hashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  uint64_t i, pagecnt;
+  psync_int_t rb;
+  psync_file_t fd;
+  int ret;
+  if (!psync_pagecache_have_all_pages_in_cache(hash, size) || psync_pagecache_lock_pages_in_cache())
+    return -1;
+  fd=psync_file_open(filename, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (unlikely_log(fd==INVALID_HANDLE_VALUE)){
+    psync_pagecache_unlock_pages_from_cache();
+    return -1;
+  }
+  ret=-1;
+  psync_hash_init(&hctx);
+  pagecnt=(size+PSYNC_FS_PAGE_SIZE-1)/PSYNC_FS_PAGE_SIZE;
+  for (i=0; i<pagecnt; i++){
+    rb=check_page_in_memory_by_hash(hash, i, buff, PSYNC_FS_PAGE_SIZE, 0);
+    if (rb==-1){
+      rb=check_page_in_database_by_hash(hash, i, buff, PSYNC_FS_PAGE_SIZE, 0);
+      if (rb==-1)
+        goto err;
+    }
+    if (unlikely_log(psync_file_write(fd, buff, rb)!=rb))
+      goto err;
+    psync_hash_update(&hctx, buff, rb);
+  }
+  psync_hash_final(hashbin, &hctx);
+  psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
+  if (unlikely_log(memcmp(hashhex, hexsum, PSYNC_HASH_DIGEST_HEXLEN)) || unlikely_log(psync_file_sync(fd)))
+    goto err;
+  debug(D_NOTICE, "copied %lu bytes to %s from cache", (unsigned long)size, filename);
+  ret=0;
+err:
+  psync_file_close(fd);
+  psync_pagecache_unlock_pages_from_cache();
+  if (ret)
+    psync_file_delete(filename);
+  return ret;
+}
+
 int psync_pagecache_lock_pages_in_cache(){
-  if (pthread_mutex_trylock(&clean_cache_mutex))
+  if (pthread_mutex_trylock(&evict_mutex))
     return -1;
-  clean_cache_stoppers++;
-  pthread_mutex_unlock(&clean_cache_mutex);
+  evict_stoppers++;
+  pthread_mutex_unlock(&evict_mutex);
   return 0;
 }
 
 void psync_pagecache_unlock_pages_from_cache(){
-  pthread_mutex_lock(&clean_cache_mutex);
-  if (--clean_cache_stoppers==0 && clean_cache_waiters)
-    pthread_cond_broadcast(&clean_cache_cond);
-  pthread_mutex_unlock(&clean_cache_mutex);
+  pthread_mutex_lock(&evict_mutex);
+  evict_stoppers--;
+  pthread_mutex_unlock(&evict_mutex);
 }
 
-void psync_pagecache_resize_cache(){
-  pthread_mutex_lock(&flush_cache_mutex);
-  db_cache_in_pages=psync_setting_get_uint(_PS(fscachesize))/PSYNC_FS_PAGE_SIZE;
-  db_cache_max_page=psync_sql_cellint("SELECT MAX(id) FROM pagecache", 0);
-  if (db_cache_max_page>db_cache_in_pages){
-    psync_sql_res *res;
-    psync_stat_t st;
-    res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
-    psync_sql_bind_uint(res, 1, db_cache_in_pages);
-    psync_sql_run_free(res);
-    db_cache_max_page=db_cache_in_pages;
-    if (!psync_fstat(readcache, &st) && psync_stat_size(&st)>db_cache_in_pages*PSYNC_FS_PAGE_SIZE){
-      if (likely_log(psync_file_seek(readcache, db_cache_in_pages*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1)){
-        assertw(psync_file_truncate(readcache)==0);
-        debug(D_NOTICE, "shrunk cache to %lu pages (%lu bytes)", (unsigned long)db_cache_in_pages, (unsigned long)db_cache_in_pages*PSYNC_FS_PAGE_SIZE);
+/* drops what does not fit in the configured size of the tier and truncates its file, flush_cache_mutex should be held */
+static void trim_cache_tier(uint32_t tier){
+  psync_cache_tier_t *t;
+  psync_stat_t st;
+  t=&cache_tiers[tier];
+  if (t->max_page>t->in_pages){
+    shrink_db_cache(tier, t->in_pages);
+    if (!psync_fstat(t->fd, &st) && psync_stat_size(&st)>t->in_pages*PSYNC_FS_PAGE_SIZE){
+      if (likely_log(psync_file_seek(t->fd, t->in_pages*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1)){
+        assertw(psync_file_truncate(t->fd)==0);
+        debug(D_NOTICE, "shrunk cache tier %u to %lu pages (%lu bytes)", (unsigned)tier, (unsigned long)t->in_pages,
+              (unsigned long)t->in_pages*PSYNC_FS_PAGE_SIZE);
       }
     }
   }
+}
+
+void psync_pagecache_resize_cache(){
+  pthread_mutex_lock(&flush_cache_mutex);
+  /* the setting may be changed before the filesystem is started, psync_pagecache_init() reads it then */
+  if (cache_tier_cnt){
+    cache_tiers[0].in_pages=psync_setting_get_uint(_PS(fscachesize))/PSYNC_FS_PAGE_SIZE;
+    trim_cache_tier(0);
+  }
   pthread_mutex_unlock(&flush_cache_mutex);
 }
 
-static int psync_pagecache_free_page_from_read_cache(){
+/* frees space on the disk of the first tier, which is the one fscachepath is on */
+uint64_t psync_pagecache_free_from_read_cache(uint64_t size){
+  psync_cache_tier_t *t;
   psync_stat_t st;
-  uint64_t sizeinpages;
-  psync_sql_res *res;
-  psync_cache_page_t *page;
-  psync_uint_row row;
-  int ret;
-  ret=-1;
+  uint64_t pages, sizeinpages, newmax;
+  pages=size_round_up_to_page(size)/PSYNC_FS_PAGE_SIZE;
+  t=&cache_tiers[0];
   pthread_mutex_lock(&flush_cache_mutex);
-  do {
-    if (psync_fstat(readcache, &st)){
-      debug(D_NOTICE, "stat of read cache file failed");
-      break;
+  if (!cache_tier_cnt || psync_fstat(t->fd, &st)){
+    pthread_mutex_unlock(&flush_cache_mutex);
+    debug(D_NOTICE, "stat of read cache file failed");
+    return 0;
+  }
+  sizeinpages=psync_stat_size(&st)/PSYNC_FS_PAGE_SIZE;
+  if (sizeinpages>t->max_page)
+    sizeinpages=t->max_page;
+  if (pages>sizeinpages)
+    pages=sizeinpages;
+  newmax=sizeinpages-pages;
+  shrink_db_cache(0, newmax);
+  if (psync_file_seek(t->fd, newmax*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)==-1 || psync_file_truncate(t->fd)){
+    debug(D_WARNING, "failed to truncate down read cache");
+    pages=0;
+  }
+  pthread_mutex_unlock(&flush_cache_mutex);
+  debug(D_NOTICE, "freed %lu pages from read cache", (unsigned long)pages);
+  return pages*PSYNC_FS_PAGE_SIZE;
+}
+
+/* the directory of every tier is stored in the setting table as cachetier<n>, the extents of a tier are only kept if it is still in
+ * the same directory, that is if fscachepath or fscachetiers were not changed in a way that moves tiers to other positions. The
+ * first tier is taken as unchanged if nothing was stored yet, as cache ids stored before there were tiers point to it.
+ */
+static int cache_tier_unchanged(uint32_t tier){
+  char name[32];
+  char *dir;
+  int ret;
+  psync_slprintf(name, sizeof(name), "cachetier%u", (unsigned)tier);
+  dir=psync_get_string_value(name);
+  if (dir)
+    ret=!psync_filename_cmp(dir, cache_tiers[tier].dir);
+  else
+    ret=tier==0;
+  psync_free(dir);
+  return ret;
+}
+
+static void store_cache_tiers(){
+  char name[32];
+  uint32_t i;
+  for (i=0; i<cache_tier_cnt; i++){
+    psync_slprintf(name, sizeof(name), "cachetier%u", (unsigned)i);
+    psync_set_string_value(name, cache_tiers[i].dir);
+  }
+}
+
+/* loads the extents of the cache tiers from the database, rows that are inconsistent with the cache files or with each other or that
+ * belong to tiers that changed their directory are deleted, max_page of the tiers should be set to the sizes of their files */
+static void load_cache_extents(){
+  psync_sql_res *res, *dres;
+  psync_variant_row row;
+  psync_cache_extent_t *ext;
+  psync_cache_tier_t *t;
+  psync_interval_tree_t *fslot;
+  const char *crcs;
+  size_t crcslen;
+  uint64_t cacheid, pagecnt;
+  uint32_t loaded, dropped, i;
+  int unchanged[PSYNC_FS_CACHE_MAX_TIERS];
+  for (i=0; i<cache_tier_cnt; i++){
+    unchanged[i]=cache_tier_unchanged(i);
+    if (!unchanged[i])
+      debug(D_NOTICE, "cache tier %u is now in %s, dropping its extents", (unsigned)i, cache_tiers[i].dir);
+    if (cache_tiers[i].max_page)
+      slots_add_locked(&cache_tiers[i], 0, cache_tiers[i].max_page);
+  }
+  loaded=dropped=0;
+  psync_sql_start_transaction();
+  dres=psync_sql_prep_statement("DELETE FROM pagecacheextent WHERE id=?");
+  res=psync_sql_query("SELECT id, hash, pageid, pagecnt, cacheid, lastsize, lastuse, usecnt, crcs FROM pagecacheextent ORDER BY lastuse");
+  while ((row=psync_sql_fetch_row(res))){
+    pagecnt=psync_get_number(row[3]);
+    cacheid=psync_get_number(row[4]);
+    crcs=psync_get_lstring_or_null(row[8], &crcslen);
+    ext=NULL;
+    t=cacheid_tier(cacheid)<cache_tier_cnt && unchanged[cacheid_tier(cacheid)]?&cache_tiers[cacheid_tier(cacheid)]:NULL;
+    if (likely(pagecnt && pagecnt<=CACHE_EXTENT_MAX_PAGES && crcs && crcslen==pagecnt*sizeof(uint32_t) && t &&
+               cacheid_slot(cacheid)+pagecnt<=t->max_page)){
+      ext=new_extent(psync_get_number(row[1]), psync_get_number(row[2]), cacheid, pagecnt);
+      ext->dbid=psync_get_number(row[0]);
+      ext->lastsize=psync_get_number(row[5]);
+      ext->lastuse=psync_get_number(row[6]);
+      ext->usecnt=psync_get_number(row[7]);
+      memcpy(ext->crcs, crcs, crcslen);
+      fslot=psync_interval_tree_first_interval_containing_or_after(t->free_slots, cacheid_slot(cacheid));
+      if (ext->lastsize>PSYNC_FS_PAGE_SIZE || !fslot || fslot->from>cacheid_slot(cacheid) || fslot->to<cacheid_slot(cacheid)+pagecnt ||
+          add_extent_locked(ext)){
+        psync_free(ext);
+        ext=NULL;
+      }
     }
-    if (psync_stat_size(&st)<PSYNC_FS_PAGE_SIZE*2){
-      debug(D_NOTICE, "read cache is already zero");
-      break;
+    if (ext){
+      slots_remove_locked(t, cacheid_slot(cacheid), cacheid_slot(cacheid)+pagecnt);
+      loaded++;
     }
-    sizeinpages=psync_stat_size(&st)/PSYNC_FS_PAGE_SIZE-1;
-    if (unlikely(db_cache_max_page>sizeinpages)){
-      debug(D_NOTICE, "there are %lu unallocated pages in db, deleting", (unsigned long)(db_cache_max_page-sizeinpages));
-      res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
-      psync_sql_bind_uint(res, 1, sizeinpages);
-      psync_sql_run_free(res);
-      db_cache_max_page=sizeinpages;
-    }
-    else if (unlikely_log(db_cache_max_page<sizeinpages))
-      sizeinpages=db_cache_max_page;
-    page=psync_pagecache_get_free_page_if_available();
-    if (unlikely(!page)){
-      debug(D_NOTICE, "no free pages, skipping");
-      break;
+    else{
+      psync_sql_bind_uint(dres, 1, psync_get_number(row[0]));
+      psync_sql_run(dres);
+      dropped++;
     }
-    if (psync_file_pread(readcache, page->page, PSYNC_FS_PAGE_SIZE, sizeinpages*PSYNC_FS_PAGE_SIZE)!=PSYNC_FS_PAGE_SIZE){
-      psync_pagecache_return_free_page(page);
-      debug(D_NOTICE, "read from read cache failed");
+  }
+  psync_sql_free_result(res);
+  psync_sql_free_result(dres);
+  store_cache_tiers();
+  psync_sql_commit_transaction();
+  free_db_pages=0;
+  for (i=0; i<cache_tier_cnt; i++){
+    t=&cache_tiers[i];
+    t->free_pages=count_free_db_slots_locked(t);
+    free_db_pages+=t->free_pages;
+    debug(D_NOTICE, "%u free pages in cache tier %u of %lu pages in %s", (unsigned)t->free_pages, (unsigned)i,
+          (unsigned long)t->max_page, t->dir);
+  }
+  debug(D_NOTICE, "loaded %u cache extents, dropped %u invalid ones", (unsigned)loaded, (unsigned)dropped);
+}
+
+/* opens the cache file of a tier in dir, a tier is added for every entry so that cacheids keep their tier, the ones that are
+ * duplicates or whose file can not be opened are added as dead tiers that hold no pages */
+static void add_cache_tier(const char *dir, uint64_t size){
+  psync_cache_tier_t *t;
+  psync_stat_t st;
+  char *cache_file;
+  uint32_t i;
+  t=&cache_tiers[cache_tier_cnt];
+  t->fd=INVALID_HANDLE_VALUE;
+  for (i=0; i<cache_tier_cnt; i++)
+    if (!psync_filename_cmp(cache_tiers[i].dir, dir)){
+      debug(D_WARNING, "cache directory %s is used by tier %u, ignoring it", dir, (unsigned)i);
       break;
     }
-    res=psync_sql_query_rdlock("SELECT type, hash, pageid, lastuse, usecnt, size, crc FROM pagecache WHERE id=?");
-    psync_sql_bind_uint(res, 1, sizeinpages);
-    row=psync_sql_fetch_rowint(res);
-    if (!row || row[0]==PAGE_TYPE_FREE){
-      psync_sql_free_result(res);
-      psync_pagecache_return_free_page(page);
+  if (i==cache_tier_cnt && dir[0]){
+    if (psync_stat(dir, &st))
+      psync_mkdir(dir);
+    cache_file=psync_strcat(dir, PSYNC_DIRECTORY_SEPARATOR, PSYNC_DEFAULT_READ_CACHE_FILE, NULL);
+    t->fd=psync_file_open(cache_file, P_O_RDWR, P_O_CREAT);
+    psync_free(cache_file);
+    if (t->fd==INVALID_HANDLE_VALUE)
+      debug(D_WARNING, "could not open cache file in %s, ignoring it", dir);
+  }
+  if (t->fd==INVALID_HANDLE_VALUE || psync_fstat(t->fd, &st))
+    t->max_page=0;
+  else
+    t->max_page=psync_stat_size(&st)/PSYNC_FS_PAGE_SIZE;
+  t->dir=psync_strdup(dir);
+  t->in_pages=tier_is_dead(t)?0:size/PSYNC_FS_PAGE_SIZE;
+  t->free_slots=NULL;
+  t->free_runs=PSYNC_TREE_EMPTY;
+  t->free_pages=0;
+  t->full=0;
+  for (i=0; i<CACHE_SEG_CNT; i++){
+    psync_list_init(&t->segs[i]);
+    t->seg_pages[i]=0;
+  }
+  cache_tier_cnt++;
+}
+
+/* tiers after the first come from fscachetiers as size:dir entries separated by ; */
+static void add_cache_tiers(const char *tiers){
+  const char *e;
+  char *dir, *end;
+  uint64_t size;
+  while (*tiers && cache_tier_cnt<PSYNC_FS_CACHE_MAX_TIERS){
+    e=strchr(tiers, ';');
+    if (!e)
+      e=tiers+strlen(tiers);
+    size=strtoull(tiers, &end, 10);
+    if (end<e && *end==':' && end+1<e && size>=PSYNC_FS_PAGE_SIZE){
+      dir=psync_strndup(end+1, e-end-1);
+      add_cache_tier(dir, size);
+      psync_free(dir);
     }
-    else{
-      page->hash=row[1];
-      page->pageid=row[2];
-      page->lastuse=row[3];
-      page->size=row[5];
-      page->usecnt=row[4];
-      page->crc=row[6];
-      psync_sql_free_result(res);
-      if (unlikely(psync_crc32c(PSYNC_CRC_INITIAL, page->page, page->size)!=page->crc)){
-        debug(D_WARNING, "page CRC check failed, dropping page, db CRC %u calculated CRC %u",
-              (unsigned)page->crc, (unsigned)psync_crc32c(PSYNC_CRC_INITIAL, page->page, page->size));
-        psync_pagecache_return_free_page(page);
-      }
-      else{
-        page->type=PAGE_TYPE_READ;
-        psync_pagecache_add_page_if_not_exists(page, page->hash, page->pageid);
-      }
+    else if (e>tiers){
+      debug(D_WARNING, "ignoring bad entry in fscachetiers");
+      add_cache_tier("", 0);
     }
-    db_cache_max_page=sizeinpages-1;
-    res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
-    psync_sql_bind_uint(res, 1, db_cache_max_page);
-    psync_sql_run_free(res);
-    if (psync_file_seek(readcache, sizeinpages*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1 && psync_file_truncate(readcache)==0)
-      ret=0;
-    else
-      debug(D_NOTICE, "failed to truncate down read cache");
-  } while (0);
-  pthread_mutex_unlock(&flush_cache_mutex);
-  return ret;
+    tiers=*e?e+1:e;
+  }
 }
 
-uint64_t psync_pagecache_free_from_read_cache(uint64_t size){
-  uint64_t i;
-  size=size_round_up_to_page(size)/PSYNC_FS_PAGE_SIZE;
+static uint32_t memory_cache_pages(){
+  uint64_t size;
+  size=psync_setting_get_uint(_PS(fsmemcachesize));
+  if (!size){
+    size=psync_get_physical_memory()/PSYNC_FS_MEMORY_CACHE_AUTO_DIV;
+    if (size>PSYNC_FS_MEMORY_CACHE_AUTO_MAX)
+      size=PSYNC_FS_MEMORY_CACHE_AUTO_MAX;
+  }
+  if (size<PSYNC_FS_MEMORY_CACHE_MIN)
+    size=PSYNC_FS_MEMORY_CACHE_MIN;
+  else if (size/PSYNC_FS_PAGE_SIZE>UINT32_MAX/2)
+    size=(uint64_t)(UINT32_MAX/2)*PSYNC_FS_PAGE_SIZE;
+  return size/PSYNC_FS_PAGE_SIZE;
+}
+
+/* rebuilds cache_hash with size buckets, size has to be a multiple of CACHE_LOCK_STRIPES */
+static void resize_cache_hash(psync_uint_t size){
+  psync_list *nhash, *ohash, *l1, *l2;
+  psync_cache_page_t *page;
+  psync_uint_t i;
+  nhash=psync_new_cnt(psync_list, size);
   for (i=0; i<size; i++)
-    if (psync_pagecache_free_page_from_read_cache()){
-      debug(D_WARNING, "failed to free page from read cache");
-      break;
+    psync_list_init(&nhash[i]);
+  for (i=0; i<CACHE_LOCK_STRIPES; i++)
+    lock_stripe(i);
+  for (i=0; i<cache_hash_size; i++)
+    psync_list_for_each_safe(l1, l2, &cache_hash[i]){
+      page=psync_list_element(l1, psync_cache_page_t, list);
+      psync_list_add_tail(&nhash[(page->hash+page->pageid)%size], &page->list);
     }
-  debug(D_NOTICE, "freed %lu pages from read cache", (unsigned long)i);
-  return i*PSYNC_FS_PAGE_SIZE;
+  ohash=cache_hash;
+  cache_hash=nhash;
+  cache_hash_size=size;
+  for (i=CACHE_LOCK_STRIPES; i>0; i--)
+    unlock_stripe(i-1);
+  psync_free(ohash);
 }
 
-void psync_pagecache_init(){
-  uint64_t i;
-  char *page_data, *cache_file;
-  const char *cache_dir;
-  psync_sql_res *res;
+static psync_uint_t cache_hash_size_for_pages(uint32_t pages){
+  return (pages/2/CACHE_LOCK_STRIPES+1)*CACHE_LOCK_STRIPES;
+}
+
+/* allocates a new arena of at least pagecnt pages rounded up to whole huge pages and adds its pages to the free list */
+static void add_cache_arena(uint32_t pagecnt){
+  psync_cache_arena_t *arena;
   psync_cache_page_t *page;
-  psync_stat_t st;
-  for (i=0; i<CACHE_HASH; i++)
-    psync_list_init(&cache_hash[i]);
-  for (i=0; i<PAGE_WAITER_HASH; i++)
-    psync_list_init(&wait_page_hash[i]);
-  pthread_mutex_init(&wait_page_mutex, NULL);
-  psync_list_init(&free_pages);
-  memset(cachepages_to_update, 0, sizeof(cachepages_to_update));
-  pages_base=(char *)psync_mmap_anon_safe(CACHE_PAGES*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
-  page_data=pages_base;
-  page=(psync_cache_page_t *)(page_data+CACHE_PAGES*PSYNC_FS_PAGE_SIZE);
-  cache_pages_free=CACHE_PAGES;
-  for (i=0; i<CACHE_PAGES; i++){
+  char *page_data;
+  psync_list pages;
+  size_t size;
+  uint32_t i;
+  size=(size_t)pagecnt*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t));
+  size=((size-1)/PSYNC_HUGE_PAGE_SIZE+1)*PSYNC_HUGE_PAGE_SIZE;
+  pagecnt=size/(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t));
+  arena=psync_new(psync_cache_arena_t);
+  arena->base=(char *)psync_mmap_anon_huge(size, &arena->hugetlb);
+  arena->pagecnt=pagecnt;
+  page_data=arena->base;
+  page=(psync_cache_page_t *)(page_data+(size_t)pagecnt*PSYNC_FS_PAGE_SIZE);
+  psync_list_init(&pages);
+  for (i=0; i<pagecnt; i++){
     page->page=page_data;
-    psync_list_add_tail(&free_pages, &page->list);
+    psync_list_add_tail(&pages, &page->list);
     page_data+=PSYNC_FS_PAGE_SIZE;
     page++;
   }
-  cache_dir=psync_setting_get_string(_PS(fscachepath));
-  if (psync_stat(cache_dir, &st))
-    psync_mkdir(cache_dir);
-  cache_file=psync_strcat(cache_dir, PSYNC_DIRECTORY_SEPARATOR, PSYNC_DEFAULT_READ_CACHE_FILE, NULL);
-  if (psync_stat(cache_file, &st))
-    psync_sql_statement("DELETE FROM pagecache");
-  else{
-    res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>?");
-    psync_sql_bind_uint(res, 1, psync_stat_size(&st)/PSYNC_FS_PAGE_SIZE);
-    psync_sql_run_free(res);
+  pthread_mutex_lock(&free_pages_mutex);
+  arena->next=cache_arenas;
+  cache_arenas=arena;
+  cache_pages+=pagecnt;
+  cache_pages_reset=0;
+  pthread_mutex_unlock(&free_pages_mutex);
+  psync_pagecache_return_free_pages(&pages);
+  debug(D_NOTICE, "allocated %u new pages for memory cache", (unsigned)pagecnt);
+}
+
+static void set_memory_cache_pages(uint32_t target){
+  psync_cache_page_t *page;
+  uint32_t cnt;
+  pthread_mutex_lock(&free_pages_mutex);
+  cnt=cache_pages-cache_pages_to_retire;
+  if (target>cnt){
+    cnt=target-cnt;
+    if (cache_pages_to_retire>=cnt){
+      cache_pages_to_retire-=cnt;
+      cnt=0;
+    }
+    else{
+      cnt-=cache_pages_to_retire;
+      cache_pages_to_retire=0;
+    }
+    while (cnt && !psync_list_isempty(&retired_pages)){
+      page=psync_list_remove_head_element(&retired_pages, psync_cache_page_t, list);
+      if (retired_pages_unreset)
+        retired_pages_unreset--;
+      psync_list_add_head(&free_pages, &page->list);
+      cache_pages_free++;
+      cache_pages++;
+      cnt--;
+    }
+    if (free_page_waiters)
+      pthread_cond_broadcast(&free_page_cond);
+    pthread_mutex_unlock(&free_pages_mutex);
+    if (cnt)
+      add_cache_arena(cnt);
   }
-  db_cache_in_pages=psync_setting_get_uint(_PS(fscachesize))/PSYNC_FS_PAGE_SIZE;
-  db_cache_max_page=psync_sql_cellint("SELECT MAX(id) FROM pagecache", 0);
-  free_db_pages=psync_sql_cellint("SELECT COUNT(*) FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE), 0);
-  if (db_cache_max_page<db_cache_in_pages && free_db_pages<CACHE_PAGES*2){
-    i=0;
-    psync_sql_start_transaction();
-    res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES*2){
-      psync_sql_run(res);
-      i++;
+  else if (target<cnt){
+    cache_pages_to_retire+=cnt-target;
+    while (cache_pages_to_retire && !psync_list_isempty(&free_pages)){
+      cache_pages_free--;
+      psync_pagecache_return_free_page_locked(psync_list_remove_head_element(&free_pages, psync_cache_page_t, list));
     }
-    psync_sql_free_result(res);
-    psync_sql_commit_transaction();
-    free_db_pages+=i;
-    db_cache_max_page+=i;
-    debug(D_NOTICE, "inserted %lu new free pages to database, db_cache_in_pages=%lu, db_cache_max_page=%lu",
-                    (unsigned long)i, (unsigned long)db_cache_in_pages, (unsigned long)db_cache_max_page);
-  }
-  readcache=psync_file_open(cache_file, P_O_RDWR, P_O_CREAT);
-  psync_free(cache_file);
-  if (likely_log(psync_file_seek(readcache, db_cache_max_page*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1))
-    assertw(psync_file_truncate(readcache)==0);
-  if (db_cache_max_page>db_cache_in_pages)
-    psync_pagecache_resize_cache();
+    cnt=cache_pages_to_retire;
+    pthread_mutex_unlock(&free_pages_mutex);
+    /* the rest of the pages will be retired as they are freed by flushes */
+    if (cnt){
+      debug(D_NOTICE, "%u pages of memory cache are in use, they will be released after flush", (unsigned)cnt);
+      psync_run_thread("flush pages resize", flush_pages_noret);
+    }
+  }
+  else
+    pthread_mutex_unlock(&free_pages_mutex);
+}
+
+void psync_pagecache_resize_memory_cache(){
+  uint32_t target;
+  pthread_mutex_lock(&resize_mutex);
+  /* the setting may be changed before the filesystem is started, the new size will then be used by psync_pagecache_init() */
+  if (cache_arenas){
+    target=memory_cache_pages();
+    debug(D_NOTICE, "resizing memory cache to %u pages", (unsigned)target);
+    set_memory_cache_pages(target);
+    if (cache_hash_size_for_pages(target)!=cache_hash_size)
+      resize_cache_hash(cache_hash_size_for_pages(target));
+  }
+  pthread_mutex_unlock(&resize_mutex);
+}
+
+void psync_pagecache_init(){
+  uint64_t i;
+  for (i=0; i<PAGE_WAITER_HASH; i++)
+    psync_list_init(&wait_page_hash[i]);
+  for (i=0; i<PAGE_WAITER_STRIPES; i++)
+    pthread_mutex_init(&wait_page_mutex[i], NULL);
+  for (i=0; i<CACHE_LOCK_STRIPES; i++){
+    pthread_mutex_init(&cache_stripes[i].mutex, NULL);
+    cache_stripes[i].pages=0;
+  }
+  psync_list_init(&free_pages);
+  psync_list_init(&retired_pages);
+  pthread_mutex_lock(&resize_mutex);
+  i=memory_cache_pages();
+  debug(D_NOTICE, "using %lu pages for memory cache", (unsigned long)i);
+  resize_cache_hash(cache_hash_size_for_pages(i));
+  cache_pages_free=0;
+  add_cache_arena(i);
+  cache_pages_reset=1;
+  pthread_mutex_unlock(&resize_mutex);
   pthread_mutex_lock(&flush_cache_mutex);
+  add_cache_tier(psync_setting_get_string(_PS(fscachepath)), psync_setting_get_uint(_PS(fscachesize)));
+  add_cache_tiers(psync_setting_get_string(_PS(fscachetiers)));
+  pthread_mutex_lock(&extent_mutex);
+  load_cache_extents();
+  pthread_mutex_unlock(&extent_mutex);
+  psync_fileio_init();
+  for (i=0; i<cache_tier_cnt; i++){
+    if (tier_is_dead(&cache_tiers[i]))
+      continue;
+    psync_fileio_register_file(cache_tiers[i].fd);
+    if (likely_log(psync_file_seek(cache_tiers[i].fd, cache_tiers[i].max_page*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1))
+      assertw(psync_file_truncate(cache_tiers[i].fd)==0);
+    trim_cache_tier(i);
+  }
   check_disk_full();
   pthread_mutex_unlock(&flush_cache_mutex);
   psync_sql_lock();
@@ -3450,11 +4457,36 @@ void clean_cache_del(void *delcache, psync_pstat *st){
 }
 
 void psync_pagecache_clean_cache(){
+  psync_cache_tier_t *t;
+  psync_uint_t i, j;
   const char *cache_dir;
   cache_dir=psync_setting_get_string(_PS(fscachepath));
-  if (readcache!=INVALID_HANDLE_VALUE){
-    psync_file_seek(readcache, 0, P_SEEK_SET);
-    psync_file_truncate(readcache);
+  if (cache_tier_cnt){
+    pthread_mutex_lock(&flush_cache_mutex);
+    pthread_mutex_lock(&extent_mutex);
+    psync_tree_for_each_element_call_safe(cache_extents, psync_cache_extent_t, tree, psync_free);
+    cache_extents=PSYNC_TREE_EMPTY;
+    psync_list_init(&dirty_extents);
+    for (i=0; i<cache_tier_cnt; i++){
+      t=&cache_tiers[i];
+      for (j=0; j<CACHE_SEG_CNT; j++){
+        psync_list_init(&t->segs[j]);
+        t->seg_pages[j]=0;
+      }
+      slots_free_locked(t);
+      t->free_pages=0;
+      t->max_page=0;
+    }
+    cache_extents_cnt=0;
+    dirty_extents_cnt=0;
+    free_db_pages=0;
+    pthread_mutex_unlock(&extent_mutex);
+    for (i=0; i<cache_tier_cnt; i++)
+      if (!tier_is_dead(&cache_tiers[i])){
+        psync_file_seek(cache_tiers[i].fd, 0, P_SEEK_SET);
+        psync_file_truncate(cache_tiers[i].fd);
+      }
+    pthread_mutex_unlock(&flush_cache_mutex);
     psync_list_dir(cache_dir, clean_cache_del, NULL);
   }
   else
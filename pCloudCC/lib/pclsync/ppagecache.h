@@ -46,9 +46,11 @@ void psync_pagecache_creat_to_pagecache(uint64_t taskid, uint64_t hash, int onth
 void psync_pagecache_modify_to_pagecache(uint64_t taskid, uint64_t hash, uint64_t oldhash);
 int psync_pagecache_have_all_pages_in_cache(uint64_t hash, uint64_t size);
 int psync_pagecache_copy_all_pages_from_cache_to_file_locked(psync_openfile_t *of, uint64_t hash, uint64_t size);
+int psync_pagecache_copy_to_local_file(uint64_t hash, uint64_t size, const char *filename, const unsigned char *hexsum);
 int psync_pagecache_lock_pages_in_cache();
 void psync_pagecache_unlock_pages_from_cache();
 void psync_pagecache_resize_cache();
+void psync_pagecache_resize_memory_cache();
 uint64_t psync_pagecache_free_from_read_cache(uint64_t size);
 void psync_pagecache_clean_cache();
 
@@ -60,7 +60,7 @@ static void psync_run_ratelimited_timer(psync_timer_t timer, void *ptr){
   pthread_mutex_unlock(&task_mutex);
   if (run){
     debug(D_NOTICE, "running %s in a thread", name);
-    psync_run_thread(name, call);
+    psync_run_pool(PSYNC_POOL_CPU, name, call);
   }
   else{
     psync_timer_stop(timer);
@@ -122,7 +122,7 @@ void psync_run_ratelimited(const char *name, psync_run_ratelimit_callback0 call,
   if (!found){
     if (runinthread){
       debug(D_NOTICE, "running %s in a thread", name);
-      psync_run_thread(name, call);
+      psync_run_pool(PSYNC_POOL_CPU, name, call);
     }
     else{
       debug(D_NOTICE, "running %s on this thread", name);
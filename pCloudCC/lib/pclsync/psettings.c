@@ -68,7 +68,14 @@ static psync_setting_t settings[]={
   {"autostartfs", NULL, NULL, {PSYNC_AUTOSTARTFS_DEFAULT}, PSYNC_TBOOL},
   {"fscachesize", psync_pagecache_resize_cache, NULL, {PSYNC_FS_DEFAULT_CACHE_SIZE}, PSYNC_TNUMBER},
   {"fscachepath", NULL, NULL, {0}, PSYNC_TSTRING},
-  {"sleepstopcrypto", NULL, NULL, {PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP}, PSYNC_TBOOL}
+  {"sleepstopcrypto", NULL, NULL, {PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP}, PSYNC_TBOOL},
+  {"fsmemcachesize", psync_pagecache_resize_memory_cache, NULL, {PSYNC_FS_MEMORY_CACHE}, PSYNC_TNUMBER},
+  {"fsuploadthreads", NULL, NULL, {PSYNC_FSUPLOAD_LARGE_THREADS}, PSYNC_TNUMBER},
+  {"fullspeedchecksums", NULL, NULL, {PSYNC_IO_BUDGET_DEFAULT_FULL_SPEED}, PSYNC_TBOOL},
+  {"fswritebuffersize", NULL, NULL, {PSYNC_FS_WRITE_BUFFER_SIZE}, PSYNC_TNUMBER},
+  {"fswritebuffertotal", NULL, NULL, {PSYNC_FS_WRITE_BUFFER_TOTAL}, PSYNC_TNUMBER},
+  {"fsiouring", NULL, NULL, {PSYNC_FS_IO_URING_DEFAULT}, PSYNC_TBOOL},
+  {"fscachetiers", NULL, NULL, {0}, PSYNC_TSTRING}
 };
 
 void psync_settings_reset(){
@@ -94,6 +101,13 @@ void psync_settings_reset(){
   settings[_PS(fscachesize)].num=PSYNC_FS_DEFAULT_CACHE_SIZE;
   settings[_PS(fscachepath)].str=defaultcache;
   settings[_PS(sleepstopcrypto)].num=PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP;
+  settings[_PS(fsmemcachesize)].num=PSYNC_FS_MEMORY_CACHE;
+  settings[_PS(fsuploadthreads)].num=PSYNC_FSUPLOAD_LARGE_THREADS;
+  settings[_PS(fullspeedchecksums)].boolean=PSYNC_IO_BUDGET_DEFAULT_FULL_SPEED;
+  settings[_PS(fswritebuffersize)].num=PSYNC_FS_WRITE_BUFFER_SIZE;
+  settings[_PS(fswritebuffertotal)].num=PSYNC_FS_WRITE_BUFFER_TOTAL;
+  settings[_PS(fsiouring)].boolean=PSYNC_FS_IO_URING_DEFAULT;
+  settings[_PS(fscachetiers)].str="";
   for (i=0; i<ARRAY_SIZE(settings); i++){
     if (settings[i].type==PSYNC_TSTRING){
       settings[i].str=psync_strdup(settings[i].str);
@@ -126,6 +140,7 @@ void psync_settings_init(){
   settings[_PS(ignorepatterns)].str=PSYNC_IGNORE_PATTERNS_DEFAULT;
   settings[_PS(fsroot)].str=defaultfs;
   settings[_PS(fscachepath)].str=defaultcache;
+  settings[_PS(fscachetiers)].str="";
   for (i=0; i<ARRAY_SIZE(settings); i++){
     if (settings[i].type==PSYNC_TSTRING){
       settings[i].str=psync_strdup(settings[i].str);
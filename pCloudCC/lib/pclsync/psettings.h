@@ -76,26 +76,59 @@
 
 #define PSYNC_STACK_SIZE (64*1024)
 
+#define PSYNC_POOL_CPU_THREADS 4
+#define PSYNC_POOL_IO_THREADS 32
+#define PSYNC_POOL_READ_THREADS 16
+#define PSYNC_POOL_IDLE_SEC 30
+
 #define PSYNC_DEBUG_LOG_ALLOC_OVER (8*1024*1024)
 #define PSYNC_DEBUG_LOCK_TIMEOUT 45
 
 #define PSYNC_QUERY_CACHE_SEC 600
 #define PSYNC_QUERY_MAX_CNT 8
+#define PSYNC_QUERY_THREAD_SLOTS 256
 
 #define PSYNC_DIFF_CHECK_ADAPTER_CHANGE_SEC 5
 
 #define PSYNC_MAX_PARALLEL_DOWNLOADS 1024
 #define PSYNC_MAX_PARALLEL_UPLOADS 32
 #define PSYNC_FSUPLOAD_NUM_TASKS_PER_RUN 128
+#define PSYNC_TASK_QUEUE_BATCH 512
+#define PSYNC_TASK_QUEUE_FLUSH_CNT 64
+#define PSYNC_MAX_LOCAL_COPY_CANDIDATES 8
+#define PSYNC_FSUPLOAD_LARGE_THREADS 3
+#define PSYNC_FSUPLOAD_STREAM_MIN_SIZE (64*1024*1024)
 #define PSYNC_START_NEW_DOWNLOADS_TRESHOLD (4*1024*1024)
 #define PSYNC_START_NEW_UPLOADS_TRESHOLD (512*1024)
 #define PSYNC_MIN_SIZE_FOR_CHECKSUMS (64*1024)
 #define PSYNC_MIN_SIZE_FOR_EXISTS_CHECK (8*1024)
 #define PSYNC_MIN_SIZE_FOR_P2P (32*1024)
 #define PSYNC_MAX_SIZE_FOR_ASYNC_DOWNLOAD (256*1024)
+#define PSYNC_MAX_SIZE_FOR_ASYNC_CHUNKED_DOWNLOAD (16*1024*1024)
+#define PSYNC_MAX_SIZE_FOR_ASYNC_UPLOAD (256*1024)
 #define PSYNC_MAX_CHECKSUMS_SIZE (64*1024*1024)
+#define PSYNC_MIN_SIZE_FOR_PARALLEL_DOWNLOAD (64*1024*1024)
+#define PSYNC_PARALLEL_DOWNLOAD_SEGMENT (8*1024*1024)
+#define PSYNC_PARALLEL_DOWNLOAD_MAX_CONNS 8
+#define PSYNC_PARALLEL_DOWNLOAD_PROBE_SEC 2
+
+#define PSYNC_CDC_MIN_CHUNK (16*1024)
+#define PSYNC_CDC_AVG_CHUNK (64*1024)
+#define PSYNC_CDC_MAX_CHUNK (256*1024)
+#define PSYNC_CDC_MIN_FILE_SIZE (4*1024*1024)
+#define PSYNC_CDC_MAX_SIGNATURES 2048
 
 #define PSYNC_COPY_BUFFER_SIZE (256*1024)
+
+#define PSYNC_IO_BUDGET_CHECK_BYTES (16*PSYNC_COPY_BUFFER_SIZE)
+#define PSYNC_IO_BUDGET_PRESSURE_HIGH 10
+#define PSYNC_IO_BUDGET_PRESSURE_LOW 2
+#define PSYNC_IO_BUDGET_MIN_SLEEP 5
+#define PSYNC_IO_BUDGET_MAX_SLEEP 500
+#define PSYNC_IO_BUDGET_SLOWDOWN 4
+#define PSYNC_IO_BUDGET_PROBE_INTERVAL 5000
+#define PSYNC_IO_BUDGET_PROBE_SLEEP 100
+#define PSYNC_IO_BUDGET_DEFAULT_FULL_SPEED 0
 #define PSYNC_RECV_BUFFER_SHAPED (128*1024)
 #define PSYNC_MAX_SPEED_RECV_BUFFER (1024*1024)
 
@@ -115,6 +148,7 @@
 #define PSYNC_LOCALSCAN_SLEEPSEC_PER_SCAN       10
 #define PSYNC_LOCALSCAN_RESCAN_INTERVAL         10
 #define PSYNC_LOCALSCAN_RESCAN_NOTIFY_SUPPORTED 3600
+#define PSYNC_LOCALSCAN_MAX_DIRTY_FOLDERS       1024
 #define PSYNC_MIN_INTERVAL_RECALC_DOWNLOAD      2
 #define PSYNC_MIN_INTERVAL_RECALC_UPLOAD        5
 #define PSYNC_UPLOAD_NOWRITE_TIMER              30
@@ -139,6 +173,9 @@
 #define PSYNC_DEFAULT_NTF_THUMB_DIR "ntfthumbs"
 
 #define PSYNC_DB_CHECKPOINT_AT_PAGES 2000
+#define PSYNC_DB_READ_CONNECTIONS 4
+#define PSYNC_DB_READ_STMT_CNT 16
+#define PSYNC_DB_READ_BUSY_TIMEOUT 5000
 
 #define PSYNC_DEFAULT_CACHE_FOLDER "Cache"
 #define PSYNC_DEFAULT_READ_CACHE_FILE "cached"
@@ -169,6 +206,9 @@
 #define PSYNC_ASYNC_GROUP_REQUESTS_FOR 60
 
 #define PSYNC_ASYNC_MAX_GROUPED_REQUESTS 128
+#define PSYNC_ASYNC_DOWNLOAD_CHUNK (1024*1024)
+#define PSYNC_ASYNC_MAX_UNCONFIRMED_FAILS 3
+#define PSYNC_ASYNC_MAX_API_RESULT (4*1024*1024)
 
 #define PSYNC_CRYPTO_DEFAULT_STOP_ON_SLEEP 0
 
@@ -222,15 +262,49 @@
 #define PSYNC_DEFAULT_SEND_BUFF (4*1024*1024)
 
 #define PSYNC_FS_PAGE_SIZE 4096
-#define PSYNC_FS_MEMORY_CACHE (64*1024*1024)
+/* size of the in-memory page cache, 0 sizes it automatically to 1/PSYNC_FS_MEMORY_CACHE_AUTO_DIV of the physical memory */
+#define PSYNC_FS_MEMORY_CACHE 0
+#define PSYNC_FS_MEMORY_CACHE_AUTO_DIV 64
+#define PSYNC_FS_MEMORY_CACHE_MIN (16*1024*1024)
+#define PSYNC_FS_MEMORY_CACHE_AUTO_MAX ((uint64_t)2*1024*1024*1024)
+
+/* writes to open files are collected in a per-file buffer of up to PSYNC_FS_WRITE_BUFFER_SIZE bytes, all buffers together
+ * take at most PSYNC_FS_WRITE_BUFFER_TOTAL, buffered data is written out at the latest PSYNC_FS_WRITE_BUFFER_MAX_MS after
+ * the buffer was started, on the next write to the file */
+#define PSYNC_FS_WRITE_BUFFER_SIZE (1024*1024)
+#define PSYNC_FS_WRITE_BUFFER_TOTAL (64*1024*1024)
+#define PSYNC_FS_WRITE_BUFFER_MAX_MS 2000
 #define PSYNC_FS_DISK_FLUSH_SEC 20
 #define PSYNC_FS_FILESTREAMS_CNT 12
+#define PSYNC_FS_DENTRY_CACHE_CNT (64*1024)
+/* how long the kernel may cache names and attributes, remote changes are invalidated explicitly */
+#define PSYNC_FS_ENTRY_TIMEOUT 30
+#define PSYNC_FS_ATTR_TIMEOUT 30
+/* listings are kept that long after readdir to answer the lookups that usually follow it */
+#define PSYNC_FS_DIRLIST_HINT_SEC 5
+#define PSYNC_FS_NODE_HASH_SIZE 16384
 #define PSYNC_FS_MIN_READAHEAD_START (128*1024)
 #define PSYNC_FS_MIN_READAHEAD_RAND (16*1024)
 #define PSYNC_FS_MAX_READAHEAD (16*1024*1024)
 #define PSYNC_FS_MAX_READAHEAD_IF_SEC (64*1024*1024)
 #define PSYNC_FS_MAX_READAHEAD_SEC 16
+#define PSYNC_FS_MAX_READAHEAD_BDP (256*1024*1024)
+/* a single stream does not read ahead more than that part of the memory cache */
+#define PSYNC_FS_READAHEAD_CACHE_DIV 4
+#define PSYNC_FS_DEFAULT_RUNNING_READS 6
+#define PSYNC_FS_MAX_RUNNING_READS 24
+#define PSYNC_FS_READAHEAD_RATE_MS 250
 #define PSYNC_FS_DEFAULT_CACHE_SIZE ((uint64_t)5*1024*1024*1024)
+/* the disk cache can be spread over tiers on different disks, fscachepath first and then the ones from fscachetiers. Extents
+ * used at least PSYNC_FS_CACHE_TIER_PROMOTE_USECNT times are moved up while the tier above has free space, every tier but the
+ * last keeps PSYNC_FS_CACHE_TIER_FREE_PERCENT of its size free by moving its least valuable extents down. Extents used that
+ * often are only moved down after PSYNC_FS_CACHE_TIER_IDLE_SEC without use. A flush moves at most PSYNC_FS_CACHE_TIER_MOVE_PAGES.
+ */
+#define PSYNC_FS_CACHE_MAX_TIERS 4
+#define PSYNC_FS_CACHE_TIER_PROMOTE_USECNT 4
+#define PSYNC_FS_CACHE_TIER_FREE_PERCENT 5
+#define PSYNC_FS_CACHE_TIER_IDLE_SEC (7*86400)
+#define PSYNC_FS_CACHE_TIER_MOVE_PAGES 8192
 #define PSYNC_FS_DIRECT_UPLOAD_LIMIT (256*1024)
 #define PSYNC_FS_FILESIZE_FOR_2CONN (4*1024*1024)
 #define PSYNC_FS_FILE_LOC_HIST_SEC 30
@@ -238,6 +312,12 @@
 #define PSYNC_FS_MIN_INITIAL_WRITE_SHAPER (200*1024)
 #define PSYNC_FS_MAX_SHAPER_SLEEP_SEC 8
 
+/* batched file I/O goes to one of PSYNC_FILEIO_RINGS io_uring instances, a batch that finds all of them busy is done with
+ * blocking calls */
+#define PSYNC_FILEIO_RINGS 4
+#define PSYNC_FILEIO_RING_ENTRIES 256
+#define PSYNC_FILEIO_MAX_FILES 8
+
 /* defaults for database settings */
 #define PSYNC_USE_SSL_DEFAULT 1
 #define PSYNC_DWL_SHAPER_DEFAULT -1
@@ -245,6 +325,7 @@
 #define PSYNC_MIN_LOCAL_FREE_SPACE ((uint64_t)2048*1024*1024)
 #define PSYNC_P2P_SYNC_DEFAULT 1
 #define PSYNC_AUTOSTARTFS_DEFAULT 1
+#define PSYNC_FS_IO_URING_DEFAULT 1
 #define PSYNC_IGNORE_PATTERNS_DEFAULT ".DS_Store;\
 .DS_Store?;\
 .AppleDouble;\
@@ -277,6 +358,13 @@ $RECYCLE.BIN;\
 #define PSYNC_SETTING_fscachesize       9
 #define PSYNC_SETTING_fscachepath      10
 #define PSYNC_SETTING_sleepstopcrypto  11
+#define PSYNC_SETTING_fsmemcachesize   12
+#define PSYNC_SETTING_fsuploadthreads  13
+#define PSYNC_SETTING_fullspeedchecksums 14
+#define PSYNC_SETTING_fswritebuffersize 15
+#define PSYNC_SETTING_fswritebuffertotal 16
+#define PSYNC_SETTING_fsiouring        17
+#define PSYNC_SETTING_fscachetiers     18
 
 typedef int psync_settingid_t;
 
@@ -137,7 +137,7 @@ void psync_status_init(){
 void psync_status_recalc_to_download(){
   psync_sql_res *res;
   psync_uint_row row;
-  res=psync_sql_query_rdlock("SELECT COUNT(*), SUM(f.size) FROM task t, file f WHERE t.type=? AND t.itemid=f.id");
+  res=psync_sql_query_readonly("SELECT COUNT(*), SUM(f.size) FROM task t, file f WHERE t.type=? AND t.itemid=f.id");
   psync_sql_bind_uint(res, 1, PSYNC_DOWNLOAD_FILE);
   if ((row=psync_sql_fetch_rowint(res))){
     psync_status.filestodownload=row[0];
@@ -163,7 +163,7 @@ void psync_status_recalc_to_upload(){
   psync_stat_t st;
   uint64_t bytestou;
   uint32_t filestou;
-  res=psync_sql_query_rdlock("SELECT COUNT(*), SUM(f.size) FROM task t, localfile f WHERE t.type=? AND t.localitemid=f.id");
+  res=psync_sql_query_readonly("SELECT COUNT(*), SUM(f.size) FROM task t, localfile f WHERE t.type=? AND t.localitemid=f.id");
   psync_sql_bind_uint(res, 1, PSYNC_UPLOAD_FILE);
   if ((row=psync_sql_fetch_rowint(res))){
     filestou=row[0];
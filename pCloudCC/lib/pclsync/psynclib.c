@@ -1131,7 +1131,7 @@ psync_sharerequest_list_t *psync_list_sharerequests(int incoming){
   psync_sql_res *res;
   builder=psync_list_builder_create(sizeof(psync_sharerequest_t), offsetof(psync_sharerequest_list_t, sharerequests));
   incoming=!!incoming;
-  res=psync_sql_query_rdlock("SELECT id, folderid, ctime, permissions, userid, mail, name, message, ifnull(isba, 0) FROM sharerequest WHERE isincoming=? ORDER BY name");
+  res=psync_sql_query_readonly("SELECT id, folderid, ctime, permissions, userid, mail, name, message, ifnull(isba, 0) FROM sharerequest WHERE isincoming=? ORDER BY name");
   psync_sql_bind_uint(res, 1, incoming);
   psync_list_bulder_add_sql(builder, res, create_request);
   return (psync_sharerequest_list_t *)psync_list_builder_finalize(builder);
@@ -1186,7 +1186,7 @@ psync_share_list_t *psync_list_shares(int incoming){
   builder=psync_list_builder_create(sizeof(psync_share_t), offsetof(psync_share_list_t, shares));
   incoming=!!incoming;
   if (incoming) {
-    res=psync_sql_query_rdlock("SELECT id, folderid, ctime, permissions, userid, ifnull(mail, ''), ifnull(mail, '') as frommail,name, ifnull(bsharedfolderid, 0), 0 FROM sharedfolder WHERE isincoming=1 AND id >= 0 "
+    res=psync_sql_query_readonly("SELECT id, folderid, ctime, permissions, userid, ifnull(mail, ''), ifnull(mail, '') as frommail,name, ifnull(bsharedfolderid, 0), 0 FROM sharedfolder WHERE isincoming=1 AND id >= 0 "
                                 " UNION ALL "
                                 " select id, folderid, ctime, permissions, fromuserid as userid , "
                                 " case when isteam = 1 then (select name from baccountteam where id = toteamid) "
@@ -1197,7 +1197,7 @@ psync_share_list_t *psync_list_shares(int incoming){
   psync_list_bulder_add_sql(builder, res, create_share);
 
   } else {
-    res=psync_sql_query_rdlock("SELECT sf.id, sf.folderid, sf.ctime, sf.permissions, sf.userid, ifnull(sf.mail, ''), ifnull(sf.mail, '') as frommail, f.name as fname, ifnull(sf.bsharedfolderid, 0), 0 "
+    res=psync_sql_query_readonly("SELECT sf.id, sf.folderid, sf.ctime, sf.permissions, sf.userid, ifnull(sf.mail, ''), ifnull(sf.mail, '') as frommail, f.name as fname, ifnull(sf.bsharedfolderid, 0), 0 "
                                 " FROM sharedfolder sf, folder f WHERE sf.isincoming=0 AND sf.id >= 0 and sf.folderid = f.id "
                                 " UNION ALL "
                                 " select bsf.id, bsf.folderid, bsf.ctime,  bsf.permissions, "
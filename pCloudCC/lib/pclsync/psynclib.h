@@ -748,6 +748,19 @@ const char *psync_get_auth_string();
  * p2psync (bool) - use or not peer to peer downloads
  *
  * fscachesize (uint) - size of filesystem cache, in bytes, sane minimum of few tens of Mb or even hundreds is advised
+ * fsmemcachesize (uint) - size of in-memory filesystem cache, in bytes, 0 sizes it automatically based on physical memory, can be
+ *                 changed while the filesystem is running
+ * fsuploadthreads (uint) - maximum number of large files uploaded from the filesystem in parallel, changes apply to newly
+ *                 queued uploads
+ * fullspeedchecksums (bool) - if set local files are checksummed as fast as the disk allows, otherwise checksumming backs off
+ *                 while the system is waiting on disk I/O
+ * fswritebuffersize (uint) - size of the buffer in which small writes to an open file are merged before they are written to the
+ *                 cache, in bytes, 0 disables buffering, changes apply to newly started buffers
+ * fswritebuffertotal (uint) - maximum memory used by the write buffers of all open files, in bytes
+ * fsiouring (bool) - use io_uring for cache file I/O where the kernel supports it, applies on next start of the filesystem
+ * fscachetiers (string) - additional, slower disk cache tiers as size:directory entries (size in bytes) separated by ";",
+ *                 fscachepath is the fastest tier, applies on next start of the filesystem, changing the order drops the cached data
+ *                 of the moved tiers
  * fsroot (string) - where to mount the filesystem
  * autostartfs (bool) - if set starts the fs on app startup
  * sleepstopcrypto (bool) - if set, stops crypto when computer wakes up from sleep
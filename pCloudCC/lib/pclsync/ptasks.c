@@ -32,6 +32,19 @@
 #include "pstatus.h"
 #include "pcallbacks.h"
 #include "ppathstatus.h"
+#include "psettings.h"
+
+typedef struct {
+  psync_list tasks;
+  psync_list done;
+  psync_task_completed_callback completed;
+  uint32_t donecnt;
+  uint32_t loadedgen;
+} task_queue_t;
+
+static task_queue_t task_queues[2];
+static pthread_mutex_t task_queue_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint32_t task_queue_gen[2]={0, 0};
 
 static void create_task1(psync_uint_t type, psync_syncid_t syncid, uint64_t entryid, uint64_t localentryid){
   psync_sql_res *res;
@@ -199,3 +212,117 @@ void psync_task_delete_remote_file(psync_syncid_t syncid, psync_fileid_t fileid)
 void psync_task_delete_remote_folder(psync_syncid_t syncid, psync_folderid_t folderid){
   create_task5(PSYNC_DELREC_REMOTE_FOLDER, syncid, folderid);
 }
+
+void psync_task_queue_init(uint32_t direction, psync_task_completed_callback completed){
+  task_queue_t *q;
+  q=&task_queues[direction];
+  psync_list_init(&q->tasks);
+  psync_list_init(&q->done);
+  q->completed=completed;
+  q->donecnt=0;
+  q->loadedgen=0;
+}
+
+static void task_queue_drop(task_queue_t *q){
+  psync_list_for_each_element_call(&q->tasks, psync_task_t, list, psync_free);
+  psync_list_init(&q->tasks);
+}
+
+static void task_queue_load(uint32_t direction, task_queue_t *q){
+  psync_sql_res *res;
+  psync_variant_row row;
+  psync_task_t *task;
+  const char *name;
+  size_t len;
+  pthread_mutex_lock(&task_queue_mutex);
+  q->loadedgen=task_queue_gen[direction];
+  pthread_mutex_unlock(&task_queue_mutex);
+  res=psync_sql_query_rdlock("SELECT id, type, syncid, itemid, localitemid, newitemid, name, newsyncid FROM task WHERE "
+                             "inprogress=0 AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"=? ORDER BY id LIMIT "NTO_STR(PSYNC_TASK_QUEUE_BATCH));
+  psync_sql_bind_uint(res, 1, direction);
+  while ((row=psync_sql_fetch_row(res))){
+    name=psync_get_lstring_or_null(row[6], &len);
+    if (name)
+      len++;
+    else
+      len=0;
+    task=(psync_task_t *)psync_malloc(sizeof(psync_task_t)+len);
+    task->id=psync_get_number(row[0]);
+    task->type=psync_get_number(row[1]);
+    task->syncid=psync_get_number_or_null(row[2]);
+    task->itemid=psync_get_number(row[3]);
+    task->localitemid=psync_get_number(row[4]);
+    task->newitemid=psync_get_number_or_null(row[5]);
+    if (name){
+      task->name=(char *)(task+1);
+      memcpy(task+1, name, len);
+    }
+    else
+      task->name=NULL;
+    task->newsyncid=psync_get_number_or_null(row[7]);
+    psync_list_add_tail(&q->tasks, &task->list);
+  }
+  psync_sql_free_result(res);
+}
+
+psync_task_t *psync_task_queue_get(uint32_t direction){
+  task_queue_t *q;
+  psync_task_t *task;
+  uint32_t gen;
+  q=&task_queues[direction];
+  pthread_mutex_lock(&task_queue_mutex);
+  gen=task_queue_gen[direction];
+  pthread_mutex_unlock(&task_queue_mutex);
+  if (gen!=q->loadedgen)
+    task_queue_drop(q);
+  if (psync_list_isempty(&q->tasks)){
+    /* done tasks have to be deleted before reloading, otherwise they would be returned again */
+    psync_task_queue_flush(direction);
+    task_queue_load(direction, q);
+    if (psync_list_isempty(&q->tasks))
+      return NULL;
+  }
+  task=psync_list_remove_head_element(&q->tasks, psync_task_t, list);
+  return task;
+}
+
+void psync_task_queue_done(uint32_t direction, psync_task_t *task){
+  task_queue_t *q;
+  q=&task_queues[direction];
+  psync_list_add_tail(&q->done, &task->list);
+  if (++q->donecnt>=PSYNC_TASK_QUEUE_FLUSH_CNT)
+    psync_task_queue_flush(direction);
+}
+
+void psync_task_queue_flush(uint32_t direction){
+  task_queue_t *q;
+  psync_sql_res *res;
+  psync_task_t *task;
+  q=&task_queues[direction];
+  if (!q->donecnt)
+    return;
+  psync_sql_start_transaction();
+  res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
+  psync_list_for_each_element(task, &q->done, psync_task_t, list){
+    psync_sql_bind_uint(res, 1, task->id);
+    psync_sql_run(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+  if (q->completed)
+    psync_list_for_each_element(task, &q->done, psync_task_t, list)
+      q->completed(task);
+  psync_list_for_each_element_call(&q->done, psync_task_t, list, psync_free);
+  psync_list_init(&q->done);
+  q->donecnt=0;
+}
+
+void psync_task_queue_retry(uint32_t direction){
+  task_queue_drop(&task_queues[direction]);
+}
+
+void psync_task_queue_invalidate(uint32_t direction){
+  pthread_mutex_lock(&task_queue_mutex);
+  task_queue_gen[direction]++;
+  pthread_mutex_unlock(&task_queue_mutex);
+}
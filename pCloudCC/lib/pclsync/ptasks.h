@@ -30,6 +30,7 @@
 
 #include "pcompiler.h"
 #include "psynclib.h"
+#include "plist.h"
 
 #define PSYNC_TASK_DOWNLOAD 0
 #define PSYNC_TASK_UPLOAD   1
@@ -62,6 +63,20 @@
 #define PSYNC_DELETE_REMOTE_FILE   ((PSYNC_TASK_TYPE_DELETE<<PSYNC_TASK_TYPE_OFF)+PSYNC_TASK_FILE+PSYNC_TASK_UPLOAD)
 #define PSYNC_DELREC_REMOTE_FOLDER ((PSYNC_TASK_TYPE_DELREC<<PSYNC_TASK_TYPE_OFF)+PSYNC_TASK_FOLDER+PSYNC_TASK_UPLOAD)
 
+typedef struct {
+  psync_list list;
+  uint64_t id;
+  uint64_t itemid;
+  uint64_t localitemid;
+  uint64_t newitemid;
+  const char *name;
+  psync_syncid_t syncid;
+  psync_syncid_t newsyncid;
+  uint32_t type;
+} psync_task_t;
+
+typedef void (*psync_task_completed_callback)(psync_task_t *);
+
 
 void psync_task_create_local_folder(psync_syncid_t syncid, psync_folderid_t folderid, psync_folderid_t localfolderid);
 void psync_task_delete_local_folder(psync_syncid_t syncid, psync_folderid_t folderid, psync_folderid_t localfolderid, const char *remotepath);
@@ -90,4 +105,22 @@ void psync_task_rename_remote_folder(psync_syncid_t oldsyncid, psync_syncid_t ne
 void psync_task_delete_remote_file(psync_syncid_t syncid, psync_fileid_t fileid);
 void psync_task_delete_remote_folder(psync_syncid_t syncid, psync_folderid_t folderid);
 
+/* In-memory queues of the download and upload tasks (direction is PSYNC_TASK_DOWNLOAD or PSYNC_TASK_UPLOAD), each
+ * having a single consumer thread. Tasks are loaded in batches, ordered by id, so tasks inserted later always come
+ * after the cached ones and inserting code only has to wake the consumer. Code deleting or changing pending tasks from
+ * other threads has to call psync_task_queue_invalidate.
+ *
+ * psync_task_queue_get returns NULL if there are no tasks, the returned task is to be freed with psync_free unless it
+ * is passed to psync_task_queue_done. Deletion of done tasks is deferred and done in groups, the completed callback is
+ * called for each of them after that, outside of the transaction. The consumer calls psync_task_queue_flush before it
+ * blocks and before it exits, so done tasks are not left in the database. psync_task_queue_retry drops the cached tasks so the
+ * failed task that was just returned is the next one again.
+ */
+void psync_task_queue_init(uint32_t direction, psync_task_completed_callback completed);
+psync_task_t *psync_task_queue_get(uint32_t direction);
+void psync_task_queue_done(uint32_t direction, psync_task_t *task);
+void psync_task_queue_flush(uint32_t direction);
+void psync_task_queue_retry(uint32_t direction);
+void psync_task_queue_invalidate(uint32_t direction);
+
 #endif
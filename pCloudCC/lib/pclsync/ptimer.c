@@ -31,18 +31,21 @@
 #include "plibs.h"
 #include "pcache.h"
 
-/* Maximum timeout possible is TIMER_ARRAY_SIZE^TIMER_LEVELS seconds, in the worst case
- * TIMER_LEVELS operations will be preformed for each timer to service it
- * (it is log TIMER_ARRAY_SIZE(timer_seconds_after_now)). So servicing a timer is
- * generally constant time task with a maximum constant of TIMER_LEVELS and increasing
- * TIMER_ARRAY_SIZE will trade memory for less processing for each timer.
+/* Timers are kept in a hierarchical wheel with millisecond ticks. Maximum timeout possible is
+ * TIMER_ARRAY_SIZE^TIMER_LEVELS milliseconds, in the worst case TIMER_LEVELS operations will be preformed for each
+ * timer to service it (it is log TIMER_ARRAY_SIZE(timer_ms_after_now)). So servicing a timer is generally constant
+ * time task with a maximum constant of TIMER_LEVELS and increasing TIMER_ARRAY_SIZE will trade memory for less
+ * processing for each timer.
+ *
+ * The timer thread sleeps until the next tick that has work to do (a timer to run or a list to move to a lower
+ * level), but wakes up at least once a second to update psync_current_time.
  *
  * TIMER_ARRAY_SIZE should be a power of two.
  */
 
 #define TIMER_ARRAY_SIZE_SHIFT 6 /* 64 */
 #define TIMER_ARRAY_SIZE (1<<TIMER_ARRAY_SIZE_SHIFT)
-#define TIMER_LEVELS 3
+#define TIMER_LEVELS 5
 
 #define PTIMER_IS_RUNNING     1
 #define PTIMER_STOP_AFTER_RUN 2
@@ -61,6 +64,9 @@ static struct exception_list *sleeplist=NULL;
 static pthread_mutex_t timer_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t timer_ex_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t timer_cond=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t timer_thread_cond=PTHREAD_COND_INITIALIZER;
+static uint64_t timer_current_ms;
+static uint64_t timer_wake_at;
 static uint32_t nextsecwaiters=0;
 static int timer_running=0;
 
@@ -78,22 +84,68 @@ PSYNC_NOINLINE static void timer_sleep_detected(time_t lt){
   psync_timer_notify_exception();
 }
 
-static void timer_check_upper_levels(time_t tmdiv, psync_uint_t level, psync_uint_t sh){
+static void timer_insert(psync_timer_t timer){
+  uint64_t diff, n;
+  uint32_t i;
+  if (unlikely(timer->runat<=timer_current_ms))
+    timer->runat=timer_current_ms+1;
+  diff=timer->runat-timer_current_ms;
+  n=TIMER_ARRAY_SIZE;
+  for (i=0; i<TIMER_LEVELS-1; i++){
+    if (diff<=n)
+      break;
+    else
+      n*=TIMER_ARRAY_SIZE;
+  }
+  timer->level=i;
+  psync_list_add_tail(&timerlists[i][(timer->runat>>(i*TIMER_ARRAY_SIZE_SHIFT))%TIMER_ARRAY_SIZE], &timer->list);
+  if (timer->runat<timer_wake_at){
+    timer_wake_at=timer->runat;
+    pthread_cond_signal(&timer_thread_cond);
+  }
+}
+
+static void timer_check_upper_levels(uint64_t tmdiv, psync_uint_t level, psync_uint_t sh){
   psync_list *l1, *l2, *l;
-  time_t m;
+  uint64_t m;
   m=tmdiv%TIMER_ARRAY_SIZE;
   if (m==0 && level<TIMER_LEVELS-2)
     timer_check_upper_levels(tmdiv/TIMER_ARRAY_SIZE, level+1, sh+TIMER_ARRAY_SIZE_SHIFT);
   l=&timerlists[level+1][m];
-  psync_list_for_each_safe(l1, l2, l)
+  psync_list_for_each_safe(l1, l2, l){
+    psync_list_element(l1, psync_timer_structure_t, list)->level=level;
     psync_list_add_tail(&timerlists[level][(psync_list_element(l1, psync_timer_structure_t, list)->runat>>sh)%TIMER_ARRAY_SIZE], l1);
+  }
   psync_list_init(&timerlists[level+1][m]);
 }
 
-static void timer_prepare_timers(time_t from, time_t to, psync_list *list){
-  time_t i, m;
+/* returns the first tick after from that has timers to run or to move down, but not later than limit */
+static uint64_t timer_next_tick(uint64_t from, uint64_t limit){
+  uint64_t t, step;
+  psync_uint_t level, i, sh;
+  for (t=from+1; t<=from+TIMER_ARRAY_SIZE && t<limit; t++)
+    if (!psync_list_isempty(&timerlists[0][t%TIMER_ARRAY_SIZE]))
+      return t;
+  for (level=1; level<TIMER_LEVELS; level++){
+    sh=level*TIMER_ARRAY_SIZE_SHIFT;
+    step=(uint64_t)1<<sh;
+    t=((from>>sh)+1)<<sh;
+    for (i=0; i<TIMER_ARRAY_SIZE && t<limit; i++, t+=step)
+      if (!psync_list_isempty(&timerlists[level][(t>>sh)%TIMER_ARRAY_SIZE])){
+        limit=t;
+        break;
+      }
+  }
+  return limit;
+}
+
+/* only the ticks that have something to do are visited, so catching up after a long sleep does not walk every
+ * millisecond in between */
+static void timer_prepare_timers(uint64_t from, uint64_t to, psync_list *list){
+  uint64_t i, m;
   psync_list *l1, *l2;
-  for (i=from+1; i<=to; i++){
+  i=from;
+  while ((i=timer_next_tick(i, to+1))<=to){
     m=i%TIMER_ARRAY_SIZE;
     if (m==0)
       timer_check_upper_levels(i/TIMER_ARRAY_SIZE, 0, 0);
@@ -116,8 +168,8 @@ PSYNC_NOINLINE static void timer_process_timers(psync_list *timers){
     if (!(timer->opts&PTIMER_STOP_AFTER_RUN)){
       timer->opts=0;
       psync_list_del(l1);
-      timer->runat=psync_current_time+timer->numsec;
-      psync_list_add_tail(&timerlists[timer->level][(timer->runat>>(timer->level*TIMER_ARRAY_SIZE_SHIFT))%TIMER_ARRAY_SIZE], &timer->list);
+      timer->runat=timer_current_ms+timer->numms;
+      timer_insert(timer);
     }
   }
   pthread_mutex_unlock(&timer_mutex);
@@ -126,28 +178,43 @@ PSYNC_NOINLINE static void timer_process_timers(psync_list *timers){
 
 static void timer_thread(){
   psync_list timers;
+  struct timespec tm;
+  uint64_t now, wakeat;
   time_t lt;
   lt=psync_current_time;
+  pthread_mutex_lock(&timer_mutex);
   while (psync_do_run){
+    now=psync_millitime();
     psync_list_init(&timers);
-    psync_milisleep(1000);
-    psync_current_time=psync_time();
-    pthread_mutex_lock(&timer_mutex);
-    timer_prepare_timers(lt, psync_current_time, &timers);
-    if (nextsecwaiters)
+    if (likely(now>timer_current_ms)){
+      timer_prepare_timers(timer_current_ms, now, &timers);
+      timer_current_ms=now;
+    }
+    psync_current_time=now/1000;
+    if (psync_current_time!=lt && nextsecwaiters)
       pthread_cond_broadcast(&timer_cond);
-    pthread_mutex_unlock(&timer_mutex);
-    if (unlikely(!psync_list_isempty(&timers)))
+    if (unlikely(!psync_list_isempty(&timers))){
+      pthread_mutex_unlock(&timer_mutex);
       timer_process_timers(&timers);
-    if (unlikely(psync_current_time-lt>=25))
+      pthread_mutex_lock(&timer_mutex);
+    }
+    if (unlikely(psync_current_time-lt>=25)){
+      pthread_mutex_unlock(&timer_mutex);
       timer_sleep_detected(lt);
-    else if (unlikely_log(psync_current_time==lt)){
-      if (!psync_do_run)
-        break;
-      psync_milisleep(1000);
+      pthread_mutex_lock(&timer_mutex);
     }
     lt=psync_current_time;
+    timer_wake_at=timer_next_tick(timer_current_ms, (timer_current_ms/1000+1)*1000);
+    /* if the clock went backwards timer_current_ms is in the future, so sleep at most a second of real time */
+    now=psync_millitime();
+    wakeat=timer_wake_at<now+1000?timer_wake_at:now+1000;
+    if (wakeat>now){
+      tm.tv_sec=wakeat/1000;
+      tm.tv_nsec=(wakeat%1000)*1000000;
+      pthread_cond_timedwait(&timer_thread_cond, &timer_mutex, &tm);
+    }
   }
+  pthread_mutex_unlock(&timer_mutex);
 }
 
 void psync_timer_init(){
@@ -155,7 +222,9 @@ void psync_timer_init(){
   for (i=0; i<TIMER_LEVELS; i++)
     for (j=0; j<TIMER_ARRAY_SIZE; j++)
       psync_list_init(&timerlists[i][j]);
-  psync_current_time=psync_time();
+  timer_current_ms=psync_millitime();
+  timer_wake_at=timer_current_ms;
+  psync_current_time=timer_current_ms/1000;
   psync_run_thread("timer", timer_thread);
   timer_running=1;
 }
@@ -171,36 +240,41 @@ void psync_timer_wake(){
   pthread_cond_signal(&timer_cond);
 }
 
-psync_timer_t psync_timer_register(psync_timer_callback func, time_t numsec, void *param){
+static psync_timer_t timer_register(psync_timer_callback func, uint64_t numms, void *param, uint32_t opts){
   psync_timer_t timer;
+  uint64_t maxms;
   uint32_t i;
-  time_t n;
+  maxms=1;
+  for (i=0; i<TIMER_LEVELS; i++)
+    maxms*=TIMER_ARRAY_SIZE;
+  if (unlikely(numms>maxms)){
+    debug(D_ERROR, "requested timeout %lums is larger than the maximum of %lums", (unsigned long)numms, (unsigned long)maxms);
+    numms=maxms;
+  }
   timer=psync_new(psync_timer_structure_t);
   timer->call=func;
   timer->param=param;
-  n=TIMER_ARRAY_SIZE;
-  for (i=0; i<TIMER_LEVELS; i++){
-    if (numsec<=n)
-      break;
-    else
-      n*=TIMER_ARRAY_SIZE;
-  }
-  if (unlikely(i==TIMER_LEVELS)){
-    n/=TIMER_ARRAY_SIZE;
-    debug(D_ERROR, "requested timeout %lu is larger than the maximum of %lu", (unsigned long)numsec, (unsigned long)n);
-    numsec=n;
-    i--;
-  }
-  timer->numsec=numsec;
-  timer->level=i;
-  timer->opts=0;
+  timer->numms=numms;
+  timer->opts=opts;
   pthread_mutex_lock(&timer_mutex);
-  timer->runat=psync_current_time+numsec;
-  psync_list_add_tail(&timerlists[i][(timer->runat>>(i*TIMER_ARRAY_SIZE_SHIFT))%TIMER_ARRAY_SIZE], &timer->list);
+  timer->runat=psync_millitime()+numms;
+  timer_insert(timer);
   pthread_mutex_unlock(&timer_mutex);
   return timer;
 }
 
+psync_timer_t psync_timer_register(psync_timer_callback func, time_t numsec, void *param){
+  return timer_register(func, (uint64_t)numsec*1000, param, 0);
+}
+
+psync_timer_t psync_timer_register_ms(psync_timer_callback func, uint64_t numms, void *param){
+  return timer_register(func, numms, param, 0);
+}
+
+psync_timer_t psync_timer_oneshot_ms(psync_timer_callback func, uint64_t numms, void *param){
+  return timer_register(func, numms, param, PTIMER_STOP_AFTER_RUN);
+}
+
 int psync_timer_stop(psync_timer_t timer){
   int needfree=0;
   pthread_mutex_lock(&timer_mutex);
@@ -46,8 +46,8 @@ typedef struct _psync_timer_t {
   psync_list list;
   psync_timer_callback call;
   void *param;
-  time_t numsec;
-  time_t runat;
+  uint64_t numms;
+  uint64_t runat;
   uint32_t level;
   uint32_t opts;
 } psync_timer_structure_t, *psync_timer_t;
@@ -56,6 +56,9 @@ void psync_timer_init();
 time_t psync_timer_time();
 void psync_timer_wake();
 psync_timer_t psync_timer_register(psync_timer_callback func, time_t numsec, void *param);
+psync_timer_t psync_timer_register_ms(psync_timer_callback func, uint64_t numms, void *param);
+/* the timer is freed after func returns, it can be stopped only before that */
+psync_timer_t psync_timer_oneshot_ms(psync_timer_callback func, uint64_t numms, void *param);
 int psync_timer_stop(psync_timer_t timer);
 void psync_timer_exception_handler(psync_exception_callback func);
 void psync_timer_sleep_handler(psync_exception_callback func);
@@ -665,7 +665,7 @@ plink_info_list_t * do_psync_list_links(char **err /*OUT*/) {
 
   builder=psync_list_builder_create(sizeof(link_info_t), offsetof(plink_info_list_t, entries));
 
-  res=psync_sql_query_rdlock("SELECT id, code, comment, traffic, maxspace, downloads, created,"
+  res=psync_sql_query_readonly("SELECT id, code, comment, traffic, maxspace, downloads, created,"
                         " modified, name,  isfolder, folderid, fileid, isincomming, icon FROM links");
 
   psync_list_bulder_add_sql(builder, res, create_link);
@@ -41,6 +41,7 @@
 #include "plocalscan.h"
 #include "pfileops.h"
 #include "ppathstatus.h"
+#include "pcdc.h"
 
 typedef struct {
   psync_list list;
@@ -117,6 +118,7 @@ static int task_wait_no_uploads(uint64_t taskid){
   psync_sql_res *res;
   psync_uint_row row;
   uint64_t cnt;
+  psync_task_queue_flush(PSYNC_TASK_UPLOAD);
   pthread_mutex_lock(&current_uploads_mutex);
   while (psync_status.filesuploading){
     current_uploads_waiters++;
@@ -659,7 +661,8 @@ static int upload_get_checksum(psync_socket *api, psync_uploadid_t uploadid, uin
 }
 
 static int upload_save(psync_socket *api, psync_fileid_t localfileid, const char *localpath, const unsigned char *hashhex, uint64_t size,
-                       psync_uploadid_t uploadid, psync_folderid_t folderid, const char *name, uint64_t taskid, psync_stat_t *st, binparam pr){
+                       psync_uploadid_t uploadid, psync_folderid_t folderid, const char *name, uint64_t taskid, psync_stat_t *st, binparam pr,
+                       const psync_cdc_chunks_t *chunks){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("folderid", folderid), P_STR("name", name), P_NUM("uploadid", uploadid), P_STR("timeformat", "timestamp"),
 #if defined(PSYNC_HAS_BIRTHTIME)
                      P_NUM("ctime", psync_stat_birthtime(st)),
@@ -690,6 +693,8 @@ static int upload_save(psync_socket *api, psync_fileid_t localfileid, const char
       psync_sql_bind_uint(sres, 2, size);
       psync_sql_bind_lstring(sres, 3, (const char *)hashhex, PSYNC_HASH_DIGEST_HEXLEN);
       psync_sql_run_free(sres);
+      if (chunks)
+        psync_cdc_save_chunks(hash, chunks);
       if (psync_check_result(meta, "conflicted", PARAM_BOOL)){
         psync_sql_commit_transaction();
         set_local_file_conflicted(localfileid, fileid, hash, localpath, psync_find_result(meta, "name", PARAM_STR)->str, taskid);
@@ -709,6 +714,27 @@ static int upload_save(psync_socket *api, psync_fileid_t localfileid, const char
   return ret;
 }
 
+/* the chunk signatures are only kept if the file still has the content that was uploaded */
+static psync_cdc_chunks_t *upload_chunk_file(psync_file_t fd, const unsigned char *hashhex, uint64_t fsize){
+  psync_cdc_chunks_t *chunks;
+  psync_hash_ctx hctx;
+  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN], hexbin[PSYNC_HASH_DIGEST_HEXLEN];
+  if (fsize<PSYNC_CDC_MIN_FILE_SIZE)
+    return NULL;
+  psync_hash_init(&hctx);
+  chunks=psync_cdc_chunk_file(fd, 0, fsize, &hctx);
+  psync_hash_final(hashbin, &hctx);
+  if (chunks){
+    psync_binhex(hexbin, hashbin, PSYNC_HASH_DIGEST_LEN);
+    if (memcmp(hexbin, hashhex, PSYNC_HASH_DIGEST_HEXLEN)){
+      debug(D_NOTICE, "file changed after it was uploaded, not keeping its chunk signatures");
+      psync_free(chunks);
+      chunks=NULL;
+    }
+  }
+  return chunks;
+}
+
 static int upload_big_file(const char *localpath, const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name,
                            psync_fileid_t localfileid, psync_syncid_t syncid, upload_list_t *upload, psync_uploadid_t uploadid, uint64_t uploadoffset,
                            psync_stat_t *st, binparam pr){
@@ -718,6 +744,7 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
   psync_uint_row row;
   psync_full_result_int *fr;
   psync_upload_range_list_t *le, *le2;
+  psync_cdc_chunks_t *chunks;
   psync_list rlist;
   uint64_t result;
   uint32_t rid, respwait, id;
@@ -790,7 +817,8 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
       fileid=row[0];
       hash=row[1];
       psync_sql_free_result(sql);
-      if (fileid && psync_net_scan_file_for_blocks(api, &rlist, fileid, hash, fd)==PSYNC_NET_TEMPFAIL)
+      if (fileid && (psync_net_scan_file_for_chunks(&rlist, fileid, hash, fd)==PSYNC_NET_TEMPFAIL ||
+                     psync_net_scan_file_for_blocks(api, &rlist, fileid, hash, fd)==PSYNC_NET_TEMPFAIL))
         goto err1;
     }
     else
@@ -909,15 +937,19 @@ restart:
     uploadoffset+=le->len;
   }
   psync_list_for_each_element_call(&rlist, psync_upload_range_list_t, list, psync_free);
+  chunks=NULL;
   if (psync_file_size(fd)!=fsize){
     debug(D_NOTICE, "file %s changed filesize while uploading, restarting task", localpath);
     ret=PSYNC_NET_TEMPFAIL;
   }
-  else
+  else{
     ret=PSYNC_NET_OK;
+    chunks=upload_chunk_file(fd, hashhex, fsize);
+  }
   psync_file_close(fd);
   if (ret==PSYNC_NET_OK)
-    ret=upload_save(api, localfileid, localpath, hashhex, fsize, uploadid, folderid, name, upload->taskid, st, pr);
+    ret=upload_save(api, localfileid, localpath, hashhex, fsize, uploadid, folderid, name, upload->taskid, st, pr, chunks);
+  psync_free(chunks);
   if (ret==PSYNC_NET_TEMPFAIL){
     psync_apipool_release_bad(api);
     return -1;
@@ -1327,48 +1359,50 @@ static int upload_task(uint64_t taskid, uint32_t type, psync_syncid_t syncid, ui
   return res;
 }
 
-static void upload_thread(){
+static void upload_task_completed(psync_task_t *task){
   psync_sql_res *res;
-  psync_variant *row;
-  uint64_t taskid;
-  uint32_t type;
+  psync_uint_row row;
+  if (task->type!=PSYNC_UPLOAD_FILE)
+    return;
+  res=psync_sql_query_rdlock("SELECT syncid, localparentfolderid FROM localfile WHERE id=?");
+  psync_sql_bind_uint(res, 1, task->localitemid);
+  if ((row=psync_sql_fetch_rowint(res)))
+    psync_path_status_sync_folder_task_completed(row[0], row[1]);
+  psync_sql_free_result(res);
+  psync_status_recalc_to_upload_async();
+}
+
+static void upload_thread(){
+  psync_task_t *task;
   while (psync_do_run){
+    /* finished tasks are deleted in batches, they must not stay in the task table (and counted as pending) while we block */
+    if (!psync_statuses_ok_array(requiredstatuses, ARRAY_SIZE(requiredstatuses)))
+      psync_task_queue_flush(PSYNC_TASK_UPLOAD);
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
 
-    row=psync_sql_row("SELECT id, type, syncid, itemid, localitemid, newitemid, name, newsyncid FROM task WHERE type&"
-                       NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_UPLOAD)" AND inprogress=0 ORDER BY id LIMIT 1");
-    if (row){
-      taskid=psync_get_number(row[0]);
-      type=psync_get_number(row[1]);
-      if (!upload_task(taskid, type,
-                         psync_get_number(row[2]),
-                         psync_get_number(row[3]),
-                         psync_get_number(row[4]),
-                         psync_get_number_or_null(row[5]),
-                         psync_get_string_or_null(row[6]),
-                         psync_get_number_or_null(row[7]))){
-        if (type==PSYNC_UPLOAD_FILE){
-          delete_upload_task(taskid, psync_get_number(row[3]));
-          psync_status_recalc_to_upload_async();
-        }
-        else{
-          res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
-          psync_sql_bind_uint(res, 1, taskid);
-          psync_sql_run_free(res);
-        }
+    task=psync_task_queue_get(PSYNC_TASK_UPLOAD);
+    if (task){
+      if (!upload_task(task->id, task->type, task->syncid, task->itemid, task->localitemid, task->newitemid, task->name, task->newsyncid)){
+        psync_task_queue_done(PSYNC_TASK_UPLOAD, task);
+        continue;
       }
-      else if (type!=PSYNC_UPLOAD_FILE)
+      else if (task->type!=PSYNC_UPLOAD_FILE){
         psync_milisleep(PSYNC_SLEEP_ON_FAILED_UPLOAD);
-      psync_free(row);
+        psync_task_queue_retry(PSYNC_TASK_UPLOAD);
+      }
+      psync_free(task);
       continue;
     }
 
+    psync_task_queue_flush(PSYNC_TASK_UPLOAD);
     pthread_mutex_lock(&upload_mutex);
     if (!upload_wakes)
       pthread_cond_wait(&upload_cond, &upload_mutex);
     upload_wakes=0;
     pthread_mutex_unlock(&upload_mutex);
   }
+  /* otherwise the tasks done since the last flush are run again on the next start */
+  psync_task_queue_flush(PSYNC_TASK_UPLOAD);
 }
 
 void psync_wake_upload(){
@@ -1379,6 +1413,7 @@ void psync_wake_upload(){
 }
 
 void psync_upload_init(){
+  psync_task_queue_init(PSYNC_TASK_UPLOAD, upload_task_completed);
   psync_timer_exception_handler(psync_wake_upload);
   psync_run_thread("upload main", upload_thread);
 }
@@ -1390,8 +1425,10 @@ void psync_delete_upload_tasks_for_file(psync_fileid_t localfileid){
   psync_sql_bind_uint(res, 1, PSYNC_UPLOAD_FILE);
   psync_sql_bind_uint(res, 2, localfileid);
   psync_sql_run(res);
-  if (psync_sql_affected_rows())
+  if (psync_sql_affected_rows()){
+    psync_task_queue_invalidate(PSYNC_TASK_UPLOAD);
     psync_status_recalc_to_upload_async();
+  }
   psync_sql_free_result(res);
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_for_each_element(upl, &uploads, upload_list_t, list)
@@ -1406,6 +1443,7 @@ void psync_stop_sync_upload(psync_syncid_t syncid){
   res=psync_sql_prep_statement("DELETE FROM task WHERE syncid=? AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_UPLOAD));
   psync_sql_bind_uint(res, 1, syncid);
   psync_sql_run_free(res);
+  psync_task_queue_invalidate(PSYNC_TASK_UPLOAD);
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_for_each_element(upl, &uploads, upload_list_t, list)
     if (upl->syncid==syncid)
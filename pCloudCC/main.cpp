@@ -31,6 +31,7 @@ int main(int argc, char **argv) {
         ("daemonize,d", po::bool_switch(&daemon), "Daemonize the process.")
         ("commands ,o", po::bool_switch(&commands), "Parent stays alive and processes commands. ")
         ("mountpoint,m", po::value<std::string>(), "Mount point where drive to be mounted.")
+        ("memcache,r", po::value<int>(), "Size of the in-memory file cache in MB, 0 to size it automatically.")
         ("commands_only,k", po::bool_switch(&commands_only),"Daemon already started pass only commands")
         ("newuser,n", po::bool_switch(&newuser), "Switch if this is a new user to be registered.")
         ("savepassword,s", po::bool_switch(&save_pass), "Save password in database.")
@@ -82,6 +83,9 @@ int main(int argc, char **argv) {
     if (vm.count("mountpoint"))
         console_client::clibrary::pclsync_lib::get_lib().set_mount( vm["mountpoint"].as<std::string>());
     
+    if (vm.count("memcache"))
+        console_client::clibrary::pclsync_lib::get_lib().set_memcache( vm["memcache"].as<int>());
+    
     console_client::clibrary::pclsync_lib::get_lib().newuser_ = newuser;
     console_client::clibrary::pclsync_lib::get_lib().set_savepass(save_pass);
     console_client::clibrary::pclsync_lib::get_lib().set_daemon(daemon);
@@ -247,6 +247,8 @@ int clib::pclsync_lib::init()//std::string& username, std::string& password, std
    was_init_ = true;
    if (!get_mount().empty())
     psync_set_string_setting("fsroot",get_mount().c_str());
+   if (get_memcache() >= 0)
+    psync_set_uint_setting("fsmemcachesize",(uint64_t)get_memcache()*1024*1024);
   
 // _tunnel  = psync_ssl_tunnel_start("127.0.0.1", 9443, "62.210.116.50", 443);
    
@@ -295,7 +297,7 @@ int clib::pclsync_lib::unlink () {
   return 0;
 }
 
-clib::pclsync_lib::pclsync_lib() : status_(new pstatus_struct_() ), was_init_(false), setup_crypto_(false)
+clib::pclsync_lib::pclsync_lib() : status_(new pstatus_struct_() ), was_init_(false), setup_crypto_(false), memcache_(-1)
 {}
 
 clib::pclsync_lib::~pclsync_lib()
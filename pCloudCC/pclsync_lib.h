@@ -48,11 +48,13 @@ namespace console_client {
       const std::string& get_password() {return password_;}
       const std::string& get_crypto_pass() {return crypto_pass_;};
       const std::string& get_mount() {return mount_;}
+      int get_memcache() {return memcache_;}
       //Setters
       void set_username(const std::string& arg) { username_ = arg;}
       void set_password(const std::string& arg) { password_ = arg;}
       void set_crypto_pass(const std::string& arg) { crypto_pass_ = arg;};
       void set_mount(const std::string& arg) { mount_ = arg;}
+      void set_memcache(int arg) { memcache_ = arg;}
       void set_savepass(bool s) {save_pass_ = s;}
       void setupsetup_crypto(bool p) {setup_crypto_ = p;}
       void set_newuser(bool p) {newuser_ = p;}
@@ -87,6 +89,7 @@ namespace console_client {
       std::string password_;
       std::string crypto_pass_;
       std::string mount_;
+      int memcache_;
        
       bool to_set_mount_;
       bool daemon_;